@@ -0,0 +1,274 @@
+/*
+ * archive.c - Create and Extract Compressed Archives of Lanyard Filesystem Images.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Archives
+ *
+ * An archive holds an image compressed in independent frames and can be
+ * handed to every lanyfs utility in place of a device, for reading only.
+ * Blocks on the free blocks chain are dropped while archiving, they read
+ * as zeros from the archive and are left as holes when extracting.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "archive.lanyfs";
+const char *progdate = "December 2012";
+#define EXTRACT_CHUNK		(1 << 20)
+
+/* global variables */
+int v = 0;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * intlog2() - Simple logarithm check.
+ * @n:				value to check
+ */
+static int intlog2 (unsigned int n)
+{
+	int b = 0;
+	while (n) {
+		if (n & 1) {
+			if (n > 1)
+				return -1;
+			return b;
+		}
+		n >>= 1;
+		b++;
+	}
+	return -1;
+}
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-c codec] [-f frame size] [-j threads] "
+		  "image archive\n"
+		  "       %s [-v] -x archive image\n"),
+		progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/**
+ * extract() - Writes the image held by an archive.
+ * @src:			archive
+ * @dst:			path of image to create
+ *
+ * Zero blocks are skipped, so free blocks become holes in the image.
+ */
+static void extract (const char *src, const char *dst)
+{
+	struct lanyfs_dev *dev;
+	unsigned char *buf;
+	uint64_t pos, holes = 0;
+	size_t len, i, n;
+	int fd;
+
+	dev = lanyfs_dev_open(src, 1);
+	if (!dev)
+		show_error(_("error opening archive %s: %s"), src,
+			   strerror(errno));
+	if (strcmp(dev->ops->name, "archive"))
+		show_error(_("%s is not an archive"), src);
+	fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		show_error(_("error creating %s: %s"), dst, strerror(errno));
+	buf = malloc(EXTRACT_CHUNK);
+	if (!buf)
+		show_error(_("out of memory"));
+	for (pos = 0; pos < dev->size; pos += len) {
+		len = dev->size - pos < EXTRACT_CHUNK ?
+		      dev->size - pos : EXTRACT_CHUNK;
+		if (lanyfs_dev_pread(dev, buf, len, pos))
+			show_error(_("error reading %s: %s"), src,
+				   strerror(errno));
+		for (i = 0; i < len; i += n) {
+			n = len - i < (1 << LANYFS_MIN_BLOCKSIZE) ?
+			    len - i : (1 << LANYFS_MIN_BLOCKSIZE);
+			if (lanyfs_is_zero(buf + i, n)) {
+				holes += n;
+				continue;
+			}
+			if (lanyfs_fd_pwrite(fd, buf + i, n, pos + i))
+				show_error(_("error writing %s: %s"), dst,
+					   strerror(errno));
+		}
+	}
+	if (ftruncate(fd, dev->size) || fsync(fd) || close(fd))
+		show_error(_("error writing %s: %s"), dst, strerror(errno));
+	verbose("left %"PRIu64" bytes as holes", holes);
+	printf(_("extracted %"PRIu64" bytes to %s\n"), dev->size, dst);
+	free(buf);
+	lanyfs_dev_close(dev);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	char *src, *dst;
+	uint64_t stored;
+	int codec = LANYFS_CODEC_LZ4;
+	int shift = LANYFS_ARCHIVE_SHIFT;
+	int threads = lanyfs_default_threads();
+	int unpack = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "c:f:j:vx")) != -1) {
+		switch (c) {
+		case 'c':
+			codec = lanyfs_codec_parse(optarg);
+			if (codec < 0)
+				show_error(_("codec %s not available"), optarg);
+			break;
+		case 'f':
+			shift = intlog2(atoi(optarg));
+			if (shift < LANYFS_MIN_BLOCKSIZE || shift > 30)
+				show_error(_("invalid frame size"));
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			break;
+		case 'v':
+			v = 1;
+			break;
+		case 'x':
+			unpack = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 != argc)
+		show_usage();
+	src = argv[optind];
+	dst = argv[optind + 1];
+
+	if (unpack) {
+		extract(src, dst);
+		return EXIT_SUCCESS;
+	}
+
+	/* open image */
+	vol = lanyfs_vol_open(src, 1);
+	if (!vol)
+		show_error(_("error opening image %s: %s"), src,
+			   strerror(errno));
+	if (shift < vol->blocksize)
+		show_error(_("frame size smaller than blocksize"));
+	verbose("codec=%s, frame size=%u, threads=%d",
+		lanyfs_codec_name(codec), 1U << shift, threads);
+	if (lanyfs_archive_create(vol, dst, codec, shift, threads, &stored))
+		show_error(_("error creating archive %s: %s"), dst,
+			   strerror(errno));
+	printf(_("archived %"PRIu64" bytes into %"PRIu64" bytes\n"),
+	       vol->dev->size, stored);
+	lanyfs_vol_close(vol);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,470 @@
+/*
+ * bench.c - Measure Concurrent Read Throughput of Lanyard Filesystems.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Benchmark
+ *
+ * All files of a volume are read by 1, 2, 4 and so on up to the requested
+ * number of threads sharing one volume handle. Each round runs for a fixed
+ * time on a thread pool of that size. Files are submitted round robin in
+ * batches, each batch is a task. Files are opened by path and read
+ * completely. Throughput and its ratio to the single-threaded round show
+ * how well concurrent readers scale. Run it on an image in tmpfs to take
+ * the storage device out of the picture.
+ *
+ * Optionally the file blocks of the volume are converted between on-disk
+ * and host byte order over and over, which shows what the byte order costs
+ * a build with LANYFS_SWAP, e.g. one made with -DLANYFS_FORCE_SWAP.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+#include <time.h>
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "bench.lanyfs";
+const char *progdate = "December 2012";
+#define SECONDS_DEFAULT		2	/* duration of a round */
+#define CACHE_DEFAULT		4096	/* blocks cached */
+#define CANON_MAX		65536	/* file blocks converted */
+#define BATCH_FILES		64	/* files read per task */
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct bench_files - Paths of all files on the volume.
+ * @path:			paths
+ * @n:				number of paths
+ * @cap:			number of paths allocated
+ */
+struct bench_files {
+	char			**path;
+	size_t			n;
+	size_t			cap;
+};
+
+/**
+ * struct bench_worker - Counters of a reading thread.
+ * @bytes:			bytes read
+ * @files:			files read
+ * @__padding:			keeps counters of threads on own cache lines
+ */
+struct bench_worker {
+	uint64_t		bytes;
+	uint64_t		files;
+	unsigned char		__padding[48];
+};
+
+/**
+ * struct bench_round - State shared by the threads of a round.
+ * @vol:			volume
+ * @files:			files to read
+ * @chunk:			read size in bytes
+ * @deadline:			end of round, seconds on monotonic clock
+ * @workers:			counters, one per thread
+ * @bufs:			read buffers, one per thread
+ */
+struct bench_round {
+	struct lanyfs_vol	*vol;
+	struct bench_files	*files;
+	size_t			chunk;
+	double			deadline;
+	struct bench_worker	*workers;
+	unsigned char		**bufs;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-e] [-j threads] [-t seconds] "
+		  "[-b chunk size] [-c cache blocks] device\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/**
+ * now() - Returns seconds on the monotonic clock.
+ */
+static double now (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * collect() - Collects the paths of all files below a directory.
+ * @vol:			volume
+ * @dir:			path of directory
+ * @files:			paths collected
+ */
+static void collect (struct lanyfs_vol *vol, const char *dir,
+		     struct bench_files *files)
+{
+	struct lanyfs_fh *fh;
+	struct lanyfs_dirent ent;
+	uint64_t pos = 0;
+	char *path;
+	int ret;
+
+	fh = lanyfs_open(vol, dir);
+	if (!fh)
+		show_error(_("error opening %s: %s"), dir, strerror(errno));
+	while ((ret = lanyfs_readdir(fh, &pos, &ent)) == 1) {
+		path = malloc(strlen(dir) + strlen(ent.name) + 2);
+		if (!path)
+			show_error(_("out of memory"));
+		sprintf(path, "%s/%s", dir, ent.name);
+		if (ent.type == LANYFS_TYPE_DIR) {
+			collect(vol, path, files);
+			free(path);
+			continue;
+		}
+		if (files->n == files->cap) {
+			files->cap = files->cap ? files->cap * 2 : 256;
+			files->path = realloc(files->path,
+					      files->cap * sizeof(char *));
+			if (!files->path)
+				show_error(_("out of memory"));
+		}
+		files->path[files->n++] = path;
+	}
+	if (ret < 0)
+		show_error(_("error reading %s: %s"), dir, strerror(errno));
+	lanyfs_close(fh);
+}
+
+/**
+ * read_files() - Pool task reading a batch of files completely.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			round
+ * @batch:			number of batch, files wrap around
+ *
+ * Files left when the round ends are skipped.
+ */
+static int read_files (struct lanyfs_pool *pool, int worker, void *arg,
+		       uint64_t batch)
+{
+	struct bench_round *round = arg;
+	struct bench_worker *w = &round->workers[worker];
+	struct lanyfs_fh *fh;
+	const char *path;
+	uint64_t i, off;
+	ssize_t n;
+
+	for (i = batch * BATCH_FILES; i < (batch + 1) * BATCH_FILES; i++) {
+		if (now() >= round->deadline)
+			break;
+		path = round->files->path[i % round->files->n];
+		fh = lanyfs_open(round->vol, path);
+		if (!fh)
+			show_error(_("error opening %s: %s"), path,
+				   strerror(errno));
+		for (off = 0; (n = lanyfs_pread(fh, round->bufs[worker],
+						round->chunk, off));
+		     off += n) {
+			if (n < 0)
+				show_error(_("error reading %s: %s"), path,
+					   strerror(errno));
+			w->bytes += n;
+		}
+		lanyfs_close(fh);
+		w->files++;
+	}
+	return 0;
+}
+
+/**
+ * run_round() - Runs one round of reading.
+ * @round:			round
+ * @threads:			number of threads
+ * @seconds:			duration
+ * @rate:			throughput in bytes per second
+ * @files:			files read per second
+ */
+static void run_round (struct bench_round *round, int threads, int seconds,
+		       double *rate, double *files)
+{
+	struct lanyfs_pool *pool;
+	struct lanyfs_pool_stats st;
+	uint64_t bytes = 0, nfiles = 0, next;
+	double start, elapsed;
+	int i;
+
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		show_error(_("error starting threads: %s"), strerror(errno));
+	threads = lanyfs_pool_threads(pool);
+	memset(round->workers, 0, threads * sizeof(*round->workers));
+	start = now();
+	round->deadline = start + seconds;
+	for (next = 0; now() < round->deadline; next++)
+		lanyfs_pool_submit(pool, read_files, round, next);
+	lanyfs_pool_wait(pool);
+	elapsed = now() - start;
+	for (i = 0; i < threads; i++) {
+		bytes += round->workers[i].bytes;
+		nfiles += round->workers[i].files;
+		lanyfs_pool_stats(pool, i, &st);
+		verbose("worker %d: %"PRIu64" tasks, %"PRIu64" stolen, "
+			"%.0f%% busy", i, st.tasks, st.steals,
+			st.busy + st.idle ?
+			100.0 * st.busy / (st.busy + st.idle) : 0.0);
+	}
+	*rate = bytes / elapsed;
+	*files = nfiles / elapsed;
+	lanyfs_pool_free(pool);
+}
+
+/**
+ * run_canon() - Measures converting file blocks to host byte order.
+ * @vol:			volume
+ * @files:			files on the volume
+ * @seconds:			duration
+ * @rate:			returns blocks converted per second
+ */
+static void run_canon (struct lanyfs_vol *vol, struct bench_files *files,
+		       int seconds, double *rate)
+{
+	struct lanyfs_stat st;
+	unsigned char *buf;
+	size_t n, i;
+	uint64_t done = 0;
+	double start, deadline;
+
+	n = files->n < CANON_MAX ? files->n : CANON_MAX;
+	buf = malloc(n * vol->bsize);
+	if (!buf)
+		show_error(_("out of memory"));
+	for (i = 0; i < n; i++) {
+		if (lanyfs_stat(vol, files->path[i], &st) ||
+		    lanyfs_read_block(vol, st.addr, buf + i * vol->bsize))
+			show_error(_("error reading %s: %s"), files->path[i],
+				   strerror(errno));
+	}
+	start = now();
+	deadline = start + seconds;
+	do {
+		/* every pass converts back and forth */
+		lanyfs_canon_blocks(LANYFS_TYPE_FILE, buf, n, vol->bsize);
+		lanyfs_canon_blocks(LANYFS_TYPE_FILE, buf, n, vol->bsize);
+		done += 2 * n;
+	} while (now() < deadline);
+	*rate = done / (now() - start);
+	free(buf);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	struct bench_files files;
+	struct bench_round round;
+	char *dev_name;
+	double rate, nfiles, base = 0;
+	uint64_t hits, misses;
+	size_t cache = CACHE_DEFAULT, i;
+	int threads = lanyfs_default_threads(), seconds = SECONDS_DEFAULT, t;
+	int canon = 0, jset = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&files, 0, sizeof(files));
+	memset(&round, 0, sizeof(round));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "b:c:ej:t:v")) != -1) {
+		switch (c) {
+		case 'b':
+			round.chunk = (size_t) atol(optarg) << 10;
+			if (!round.chunk)
+				show_error(_("invalid chunk size"));
+			break;
+		case 'c':
+			cache = atol(optarg);
+			break;
+		case 'e':
+			canon = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			jset = 1;
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			if (seconds < 1)
+				show_error(_("invalid duration"));
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 1 != argc)
+		show_usage();
+	dev_name = argv[optind];
+
+	vol = lanyfs_open_volume(dev_name, cache);
+	if (!vol)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+	/* the device's profile decides what was not asked for */
+	if (!round.chunk)
+		round.chunk = lanyfs_dev_batch(vol->dev);
+	if (!jset)
+		threads = lanyfs_dev_threads(vol->dev, threads);
+	collect(vol, "", &files);
+	if (!files.n)
+		show_error(_("no files on %s"), dev_name);
+	verbose("%zu files, %zu blocks cached, %zu KiB per read", files.n,
+		cache, round.chunk >> 10);
+	round.vol = vol;
+	round.files = &files;
+	round.workers = calloc(threads, sizeof(*round.workers));
+	round.bufs = calloc(threads, sizeof(*round.bufs));
+	if (!round.workers || !round.bufs)
+		show_error(_("out of memory"));
+	for (t = 0; t < threads; t++) {
+		if (posix_memalign((void **) &round.bufs[t], 4096,
+				   round.chunk))
+			round.bufs[t] = NULL;
+		if (!round.bufs[t])
+			show_error(_("out of memory"));
+	}
+
+	printf(_("threads      MiB/s    files/s  speedup\n"));
+	for (t = 1; t <= threads; t = t < threads && t * 2 > threads ?
+					threads : t * 2) {
+		run_round(&round, t, seconds, &rate, &nfiles);
+		if (t == 1)
+			base = rate;
+		printf("%7d %10.1f %10.1f %8.2f\n", t, rate / (1 << 20),
+		       nfiles, base > 0 ? rate / base : 0);
+		if (t == threads)
+			break;
+	}
+	if (canon) {
+		run_canon(vol, &files, seconds, &rate);
+		printf(_("byte order (%s): %.1f million blocks/s\n"),
+		       lanyfs_canon_impl(), rate / 1e6);
+	}
+	if (vol->cache) {
+		lanyfs_cache_stats(vol->cache, &hits, &misses);
+		verbose("cache: %"PRIu64" hits, %"PRIu64" misses", hits,
+			misses);
+	}
+	for (i = 0; i < files.n; i++)
+		free(files.path[i]);
+	free(files.path);
+	for (t = 0; t < threads; t++)
+		free(round.bufs[t]);
+	free(round.bufs);
+	free(round.workers);
+	lanyfs_close_volume(vol);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,325 @@
+/*
+ * cluster.c - Cluster Metadata of Lanyard Filesystems.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Clustering
+ *
+ * Walking a tree reads every directory and file block and, for the sizes
+ * of files, their extenders. Scattered among the data, each of them costs
+ * a seek. All of them are moved into one region here, in the order a walk
+ * reads them: every directory's entries in the order a listing reads its
+ * binary tree, root first and left before right, followed by the
+ * extenders of its files, followed by its subdirectories' contents in the
+ * same order, depth first. The root directory goes first.
+ *
+ * The blocks are moved by lanyfs_move_region(), which updates every pointer
+ * to them and the free blocks chain. Data blocks stay where they are,
+ * unless they are in the way. On volumes formatted with a metadata zone,
+ * the region is placed inside the zone if it fits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "cluster.lanyfs";
+const char *progdate = "December 2012";
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct cluster_order - Metadata blocks in the order of a walk.
+ * @blocks:			directory, file and extender blocks
+ * @dirs:			number of directories
+ * @files:			number of files
+ * @exts:			number of extenders
+ */
+struct cluster_order {
+	struct lanyfs_addrvec	blocks;
+	uint64_t		dirs;
+	uint64_t		files;
+	uint64_t		exts;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr, _("usage: %s [-v] [-j threads] device\n"), progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * order_ext() - Appends an extender to the order.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			order
+ */
+static int order_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+		      uint64_t iblock, void *arg)
+{
+	struct cluster_order *order = arg;
+
+	if (type != LANYFS_TYPE_EXT)
+		return 0;
+	order->exts++;
+	return lanyfs_addrvec_push(&order->blocks, addr);
+}
+
+/**
+ * order_dir() - Appends the contents of a directory to the order.
+ * @vol:			volume
+ * @order:			order
+ * @subtree:			binary tree root of directory's contents
+ * @subdirs:			subdirectories found, appended in order
+ * @b:				block buffer
+ *
+ * Entries go in the order a listing reads them, then the extenders of the
+ * files among them.
+ */
+static void order_dir (struct lanyfs_vol *vol, struct cluster_order *order,
+		       uint64_t subtree, struct lanyfs_addrvec *subdirs,
+		       union lanyfs_b *b)
+{
+	struct lanyfs_addrvec stack = {NULL, 0, 0}, files = {NULL, 0, 0};
+	uint64_t addr, hops = 0;
+	size_t i;
+
+	if (subtree && lanyfs_addrvec_push(&stack, subtree))
+		show_error(_("out of memory"));
+	while (stack.n) {
+		addr = stack.a[--stack.n];
+		if (!lanyfs_valid_addr(vol, addr) || ++hops > vol->blocks ||
+		    lanyfs_read_block(vol, addr, b) ||
+		    (b->raw.type != LANYFS_TYPE_DIR &&
+		     b->raw.type != LANYFS_TYPE_FILE))
+			show_error(_("damaged binary tree at block %"PRIu64
+				     ", filesystem needs checking"), addr);
+		if (lanyfs_addrvec_push(&order->blocks, addr) ||
+		    lanyfs_addrvec_push(b->raw.type == LANYFS_TYPE_DIR ?
+					subdirs : &files, addr))
+			show_error(_("out of memory"));
+		if (b->raw.type == LANYFS_TYPE_DIR)
+			order->dirs++;
+		else
+			order->files++;
+		/* left before right */
+		if ((b->vi_btree.right &&
+		     lanyfs_addrvec_push(&stack,
+					 fromle64(b->vi_btree.right))) ||
+		    (b->vi_btree.left &&
+		     lanyfs_addrvec_push(&stack, fromle64(b->vi_btree.left))))
+			show_error(_("out of memory"));
+	}
+	for (i = 0; i < files.n; i++) {
+		if (lanyfs_read_block(vol, files.a[i], b) ||
+		    lanyfs_ext_walk(vol, fromle64(b->file.data), order_ext,
+				    order))
+			show_error(_("error walking file at block %"PRIu64
+				     ": %s"), files.a[i], strerror(errno));
+	}
+	lanyfs_addrvec_free(&stack);
+	lanyfs_addrvec_free(&files);
+}
+
+/**
+ * order_tree() - Lists all metadata blocks in the order of a walk.
+ * @vol:			volume
+ * @order:			order
+ *
+ * Subdirectories go on a stack in reverse, so they come off it in order.
+ */
+static void order_tree (struct lanyfs_vol *vol, struct cluster_order *order)
+{
+	struct lanyfs_addrvec todo = {NULL, 0, 0}, subdirs = {NULL, 0, 0};
+	union lanyfs_b *b;
+	uint64_t root = fromle64(vol->sb->sb.rootdir);
+
+	b = lanyfs_alloc_block(vol);
+	if (!b || lanyfs_addrvec_push(&order->blocks, root) ||
+	    lanyfs_addrvec_push(&todo, root))
+		show_error(_("out of memory"));
+	order->dirs++;
+	while (todo.n) {
+		if (lanyfs_read_block(vol, todo.a[--todo.n], b) ||
+		    b->raw.type != LANYFS_TYPE_DIR)
+			show_error(_("read error at block %"PRIu64),
+				   todo.a[todo.n]);
+		subdirs.n = 0;
+		order_dir(vol, order, fromle64(b->dir.subtree), &subdirs, b);
+		while (subdirs.n) {
+			if (lanyfs_addrvec_push(&todo, subdirs.a[--subdirs.n]))
+				show_error(_("out of memory"));
+		}
+	}
+	lanyfs_addrvec_free(&todo);
+	lanyfs_addrvec_free(&subdirs);
+	free(b);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	struct cluster_order order;
+	char *dev_name;
+	uint64_t start;
+	int threads = lanyfs_default_threads(), jset = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "j:v")) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			jset = 1;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 1 != argc)
+		show_usage();
+	dev_name = argv[optind];
+
+	/* open device */
+	vol = lanyfs_vol_open(dev_name, 0);
+	if (!vol)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+	if (!jset)
+		threads = lanyfs_dev_threads(vol->dev, threads);
+
+	/* order */
+	printf(_("walking %s\n"), dev_name);
+	memset(&order, 0, sizeof(order));
+	order_tree(vol, &order);
+	verbose("%"PRIu64" directories, %"PRIu64" files, %"PRIu64
+		" extenders", order.dirs, order.files, order.exts);
+
+	/* move */
+	printf(_("moving %zu blocks with %d threads\n"), order.blocks.n,
+	       threads);
+	if (lanyfs_move_region(vol, order.blocks.a, order.blocks.n, 1,
+			       threads, &start))
+		show_error(_("error moving blocks: %s"), strerror(errno));
+	printf(_("metadata in blocks %"PRIu64" to %"PRIu64"\n"), start,
+	       start + order.blocks.n - 1);
+	lanyfs_addrvec_free(&order.blocks);
+
+	/* close device */
+	if (lanyfs_vol_close(vol))
+		show_error(_("error closing device %s"), dev_name);
+
+	printf(_("all done\n"));
+	return EXIT_SUCCESS;
+}
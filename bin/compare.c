@@ -0,0 +1,734 @@
+/*
+ * compare.c - Compare Benchmark Results of Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Comparing results
+ *
+ * Both sides are sets of repeated samples per metric as written by
+ * perf.lanyfs; a file may hold several result documents one after the
+ * other, their samples are pooled. Only medians are compared, a single
+ * slow run must not decide anything.
+ *
+ * Whether the samples of the two sides differ at all is decided by a
+ * two-sided Mann-Whitney U test, which makes no assumption about the
+ * distribution of timings. How large the change is, is estimated by the
+ * relative change of the median together with a bootstrap confidence
+ * interval: both sides are resampled with replacement many times and the
+ * change of the medians is recorded every time. The random sequence has a
+ * fixed seed so the same input always gives the same report.
+ *
+ * A metric regressed if the test is significant and it got worse by more
+ * than the threshold.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "compare.lanyfs";
+const char *progdate = "December 2012";
+#define THRESHOLD_DEFAULT	5.0	/* percent worse that is a regression */
+#define ALPHA_DEFAULT		0.05	/* significance level */
+#define RESAMPLES_DEFAULT	2000	/* bootstrap resamples */
+#define MIN_SAMPLES		3	/* samples per side for a verdict */
+#define CMP_OK			0
+#define CMP_REGRESSED		1
+#define CMP_FAILED		2
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct cmp_side - Samples of a metric on one side.
+ * @s:				samples
+ * @n:				number of samples
+ * @cap:			number of samples allocated
+ */
+struct cmp_side {
+	double			*s;
+	size_t			n;
+	size_t			cap;
+};
+
+/**
+ * struct cmp_metric - A metric found in the results.
+ * @name:			name
+ * @unit:			unit of samples
+ * @lower:			lower values are better
+ * @side:			samples, old and new
+ */
+struct cmp_metric {
+	char			*name;
+	char			*unit;
+	int			lower;
+	struct cmp_side		side[2];
+};
+
+/**
+ * struct cmp_set - All metrics found in the results.
+ * @m:				metrics
+ * @n:				number of metrics
+ * @cap:			number of metrics allocated
+ */
+struct cmp_set {
+	struct cmp_metric	*m;
+	size_t			n;
+	size_t			cap;
+};
+
+/**
+ * struct json_in - Position in a JSON document being parsed.
+ * @name:			name of file
+ * @buf:			contents of file
+ * @p:				current position
+ * @end:			end of contents
+ */
+struct json_in {
+	const char		*name;
+	char			*buf;
+	const char		*p;
+	const char		*end;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-t threshold] [-a alpha] [-b resamples] "
+		  "old new\n"),
+		progname);
+	exit(CMP_FAILED);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(CMP_FAILED);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * json_error() - Reports malformed input and exits program.
+ * @in:				input
+ * @what:			what was expected
+ */
+static void json_error (struct json_in *in, const char *what)
+{
+	show_error(_("%s: expected %s at offset %td"), in->name, what,
+		   in->p - in->buf);
+}
+
+/**
+ * json_ws() - Skips white space, returns the next character or 0 at end.
+ * @in:				input
+ */
+static int json_ws (struct json_in *in)
+{
+	while (in->p < in->end && strchr(" \t\r\n", *in->p))
+		in->p++;
+	return in->p < in->end ? *in->p : 0;
+}
+
+/**
+ * json_expect() - Consumes a character that must come next.
+ * @in:				input
+ * @c:				character
+ */
+static void json_expect (struct json_in *in, int c)
+{
+	char what[4] = { '\'', c, '\'', '\0' };
+
+	if (json_ws(in) != c)
+		json_error(in, what);
+	in->p++;
+}
+
+/**
+ * json_string() - Parses a string.
+ * @in:				input
+ *
+ * Returns a newly allocated copy. Escaped characters outside ASCII are
+ * replaced by '?', names and units of metrics do not need them.
+ */
+static char *json_string (struct json_in *in)
+{
+	char *s, *d;
+
+	json_expect(in, '"');
+	s = d = malloc(in->end - in->p + 1);
+	if (!s)
+		show_error(_("out of memory"));
+	while (in->p < in->end && *in->p != '"') {
+		if (*in->p != '\\') {
+			*d++ = *in->p++;
+			continue;
+		}
+		if (++in->p >= in->end)
+			break;
+		switch (*in->p++) {
+		case 'b':
+			*d++ = '\b';
+			break;
+		case 'f':
+			*d++ = '\f';
+			break;
+		case 'n':
+			*d++ = '\n';
+			break;
+		case 'r':
+			*d++ = '\r';
+			break;
+		case 't':
+			*d++ = '\t';
+			break;
+		case 'u':
+			in->p += in->end - in->p < 4 ? in->end - in->p : 4;
+			*d++ = '?';
+			break;
+		default:
+			*d++ = in->p[-1];
+			break;
+		}
+	}
+	if (in->p >= in->end)
+		json_error(in, "'\"'");
+	in->p++;
+	*d = '\0';
+	return s;
+}
+
+/**
+ * json_number() - Parses a number.
+ * @in:				input
+ */
+static double json_number (struct json_in *in)
+{
+	char *end;
+	double n;
+
+	json_ws(in);
+	n = strtod(in->p, &end);
+	if (end == in->p || end > in->end)
+		json_error(in, _("number"));
+	in->p = end;
+	return n;
+}
+
+/**
+ * json_more() - Steps to the next member of an object or array.
+ * @in:				input
+ * @close:			closing character, '}' or ']'
+ * @first:			no member seen yet
+ *
+ * Returns 1 if another member follows, 0 once the closing character was
+ * consumed.
+ */
+static int json_more (struct json_in *in, int close, int first)
+{
+	int c = json_ws(in);
+
+	if (c == close) {
+		in->p++;
+		return 0;
+	}
+	if (!first)
+		json_expect(in, ',');
+	return 1;
+}
+
+/**
+ * json_skip() - Skips a value of any type.
+ * @in:				input
+ */
+static void json_skip (struct json_in *in)
+{
+	int c = json_ws(in), first = 1;
+
+	switch (c) {
+	case '{':
+		in->p++;
+		while (json_more(in, '}', first)) {
+			free(json_string(in));
+			json_expect(in, ':');
+			json_skip(in);
+			first = 0;
+		}
+		break;
+	case '[':
+		in->p++;
+		while (json_more(in, ']', first)) {
+			json_skip(in);
+			first = 0;
+		}
+		break;
+	case '"':
+		free(json_string(in));
+		break;
+	case 't':
+	case 'f':
+	case 'n':
+		while (in->p < in->end && *in->p >= 'a' && *in->p <= 'z')
+			in->p++;
+		break;
+	default:
+		json_number(in);
+		break;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * find_metric() - Returns a metric by name, adds it if not yet known.
+ * @set:			metrics
+ * @name:			name of metric, taken over
+ */
+static struct cmp_metric *find_metric (struct cmp_set *set, char *name)
+{
+	struct cmp_metric *m;
+	size_t i;
+
+	for (i = 0; i < set->n; i++) {
+		if (!strcmp(set->m[i].name, name)) {
+			free(name);
+			return &set->m[i];
+		}
+	}
+	if (set->n == set->cap) {
+		set->cap = set->cap ? set->cap * 2 : 16;
+		m = realloc(set->m, set->cap * sizeof(*m));
+		if (!m)
+			show_error(_("out of memory"));
+		set->m = m;
+	}
+	m = &set->m[set->n++];
+	memset(m, 0, sizeof(*m));
+	m->name = name;
+	m->lower = 1;
+	return m;
+}
+
+/**
+ * add_sample() - Adds a sample to one side of a metric.
+ * @side:			side
+ * @s:				sample
+ */
+static void add_sample (struct cmp_side *side, double s)
+{
+	double *p;
+
+	if (side->n == side->cap) {
+		side->cap = side->cap ? side->cap * 2 : 16;
+		p = realloc(side->s, side->cap * sizeof(*p));
+		if (!p)
+			show_error(_("out of memory"));
+		side->s = p;
+	}
+	side->s[side->n++] = s;
+}
+
+/**
+ * parse_metric() - Parses the description and samples of a metric.
+ * @in:				input
+ * @m:				metric
+ * @side:			side the samples belong to
+ */
+static void parse_metric (struct json_in *in, struct cmp_metric *m, int side)
+{
+	char *key, *s;
+	int first = 1, sfirst;
+
+	json_expect(in, '{');
+	while (json_more(in, '}', first)) {
+		first = 0;
+		key = json_string(in);
+		json_expect(in, ':');
+		if (!strcmp(key, "unit")) {
+			s = json_string(in);
+			if (m->unit && strcmp(m->unit, s))
+				show_error(_("%s: unit of %s changed from %s "
+					     "to %s"), in->name, m->name,
+					   m->unit, s);
+			free(m->unit);
+			m->unit = s;
+		} else if (!strcmp(key, "better")) {
+			s = json_string(in);
+			if (strcmp(s, "lower") && strcmp(s, "higher"))
+				show_error(_("%s: %s is better %s, expected "
+					     "lower or higher"), in->name,
+					   m->name, s);
+			m->lower = !strcmp(s, "lower");
+			free(s);
+		} else if (!strcmp(key, "samples")) {
+			json_expect(in, '[');
+			sfirst = 1;
+			while (json_more(in, ']', sfirst)) {
+				add_sample(&m->side[side], json_number(in));
+				sfirst = 0;
+			}
+		} else {
+			json_skip(in);
+		}
+		free(key);
+	}
+}
+
+/**
+ * read_results() - Reads all result documents of a file.
+ * @name:			name of file
+ * @set:			metrics
+ * @side:			side the samples belong to
+ */
+static void read_results (const char *name, struct cmp_set *set, int side)
+{
+	struct json_in in;
+	FILE *fp;
+	char *key;
+	size_t len = 0, cap = 1 << 16, got;
+	int first, mfirst;
+
+	in.name = name;
+	in.buf = malloc(cap);
+	fp = fopen(name, "r");
+	if (!fp)
+		show_error(_("error opening %s: %s"), name, strerror(errno));
+	while (in.buf && (got = fread(in.buf + len, 1, cap - len, fp))) {
+		len += got;
+		if (len == cap)
+			in.buf = realloc(in.buf, cap *= 2);
+	}
+	if (!in.buf)
+		show_error(_("out of memory"));
+	if (ferror(fp))
+		show_error(_("error reading %s: %s"), name, strerror(errno));
+	fclose(fp);
+	in.p = in.buf;
+	in.end = in.buf + len;
+
+	if (!json_ws(&in))
+		show_error(_("%s: no results"), name);
+	while (json_ws(&in)) {
+		json_expect(&in, '{');
+		first = 1;
+		while (json_more(&in, '}', first)) {
+			first = 0;
+			key = json_string(&in);
+			json_expect(&in, ':');
+			if (strcmp(key, "metrics")) {
+				json_skip(&in);
+				free(key);
+				continue;
+			}
+			free(key);
+			json_expect(&in, '{');
+			mfirst = 1;
+			while (json_more(&in, '}', mfirst)) {
+				mfirst = 0;
+				key = json_string(&in);
+				json_expect(&in, ':');
+				parse_metric(&in, find_metric(set, key),
+					     side);
+			}
+		}
+	}
+	free(in.buf);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * cmp_double() - Orders doubles ascending, for qsort().
+ * @a:				first double
+ * @b:				second double
+ */
+static int cmp_double (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * median() - Returns the median of samples.
+ * @s:				samples, reordered
+ * @n:				number of samples
+ */
+static double median (double *s, size_t n)
+{
+	qsort(s, n, sizeof(*s), cmp_double);
+	return n % 2 ? s[n / 2] : (s[n / 2 - 1] + s[n / 2]) / 2;
+}
+
+/**
+ * mann_whitney() - Returns the p-value of a two-sided Mann-Whitney U test.
+ * @a:				first side
+ * @b:				second side
+ *
+ * Uses the normal approximation with correction for ties and continuity,
+ * good enough from about five samples per side.
+ */
+static double mann_whitney (const struct cmp_side *a, const struct cmp_side *b)
+{
+	double *x, *xa, rank_a = 0, ties = 0, u, mean, var, z, t;
+	size_t n = a->n + b->n, i, j, k = 0;
+
+	x = malloc(n * sizeof(*x));
+	xa = malloc(a->n * sizeof(*xa));
+	if (!x || !xa)
+		show_error(_("out of memory"));
+	memcpy(x, a->s, a->n * sizeof(*x));
+	memcpy(x + a->n, b->s, b->n * sizeof(*x));
+	memcpy(xa, a->s, a->n * sizeof(*xa));
+	qsort(x, n, sizeof(*x), cmp_double);
+	qsort(xa, a->n, sizeof(*xa), cmp_double);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && x[j] == x[i]; j++)
+			;
+		/* tied samples share the mean of their ranks */
+		t = j - i;
+		ties += t * t * t - t;
+		for (; k < a->n && xa[k] == x[i]; k++)
+			rank_a += (i + 1 + j) / 2.0;
+	}
+	free(xa);
+	free(x);
+	u = rank_a - a->n * (a->n + 1) / 2.0;
+	mean = a->n * b->n / 2.0;
+	var = a->n * b->n / 12.0 * ((n + 1) - ties / (n * (n - 1.0)));
+	if (var <= 0)
+		return 1;
+	z = fabs(u - mean) - 0.5;
+	if (z < 0)
+		z = 0;
+	z /= sqrt(var);
+	return erfc(z / sqrt(2));
+}
+
+/**
+ * bootstrap() - Estimates a confidence interval of the change of medians.
+ * @a:				old side
+ * @b:				new side
+ * @resamples:			number of resamples
+ * @alpha:			1 - confidence level
+ * @seed:			state of random sequence
+ * @lo:				lower bound, change in percent
+ * @hi:				upper bound, change in percent
+ */
+static void bootstrap (const struct cmp_side *a, const struct cmp_side *b,
+		       int resamples, double alpha, uint64_t *seed,
+		       double *lo, double *hi)
+{
+	double *delta, *ra, *rb, ma, mb;
+	size_t i;
+	int k;
+
+	delta = malloc(resamples * sizeof(*delta));
+	ra = malloc(a->n * sizeof(*ra));
+	rb = malloc(b->n * sizeof(*rb));
+	if (!delta || !ra || !rb)
+		show_error(_("out of memory"));
+	for (k = 0; k < resamples; k++) {
+		for (i = 0; i < a->n; i++)
+			ra[i] = a->s[lanyfs_rand(seed) % a->n];
+		for (i = 0; i < b->n; i++)
+			rb[i] = b->s[lanyfs_rand(seed) % b->n];
+		ma = median(ra, a->n);
+		mb = median(rb, b->n);
+		delta[k] = ma ? (mb - ma) / fabs(ma) * 100 : 0;
+	}
+	qsort(delta, resamples, sizeof(*delta), cmp_double);
+	*lo = delta[(int) floor(alpha / 2 * (resamples - 1))];
+	*hi = delta[(int) ceil((1 - alpha / 2) * (resamples - 1))];
+	free(rb);
+	free(ra);
+	free(delta);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct cmp_set set;
+	struct cmp_metric *m;
+	struct cmp_side *a, *b;
+	const char *verdict;
+	double threshold = THRESHOLD_DEFAULT, alpha = ALPHA_DEFAULT;
+	double ma, mb, delta, lo, hi, p, worse;
+	uint64_t seed = 0x4c414e5946534350ULL;
+	int resamples = RESAMPLES_DEFAULT, ret = CMP_OK;
+	size_t i;
+	char *end;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&set, 0, sizeof(set));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "a:b:t:v")) != -1) {
+		switch (c) {
+		case 'a':
+			alpha = strtod(optarg, &end);
+			if (*end || alpha <= 0 || alpha >= 1)
+				show_error(_("invalid significance level"));
+			break;
+		case 'b':
+			resamples = atoi(optarg);
+			if (resamples < 100)
+				show_error(_("invalid number of resamples"));
+			break;
+		case 't':
+			threshold = strtod(optarg, &end);
+			if (*end || threshold < 0)
+				show_error(_("invalid threshold"));
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 != argc)
+		show_usage();
+	read_results(argv[optind], &set, 0);
+	read_results(argv[optind + 1], &set, 1);
+	verbose("%zu metrics, threshold %.1f%%, alpha %g, %d resamples",
+		set.n, threshold, alpha, resamples);
+
+	printf(_("metric           unit           old         new    change"
+		 "         %2.0f%% CI        p  verdict\n"),
+	       (1 - alpha) * 100);
+	for (i = 0; i < set.n; i++) {
+		m = &set.m[i];
+		a = &m->side[0];
+		b = &m->side[1];
+		if (!a->n || !b->n) {
+			verbose("%s only in %s", m->name,
+				a->n ? argv[optind] : argv[optind + 1]);
+			continue;
+		}
+		bootstrap(a, b, resamples, alpha, &seed, &lo, &hi);
+		p = mann_whitney(a, b);
+		ma = median(a->s, a->n);
+		mb = median(b->s, b->n);
+		delta = ma ? (mb - ma) / fabs(ma) * 100 : 0;
+		worse = m->lower ? delta : -delta;
+		if (a->n < MIN_SAMPLES || b->n < MIN_SAMPLES)
+			verdict = _("too few samples");
+		else if (p >= alpha)
+			verdict = _("same");
+		else if (worse <= threshold)
+			verdict = worse > 0 ? _("worse") : _("better");
+		else {
+			verdict = _("REGRESSION");
+			ret = CMP_REGRESSED;
+		}
+		printf("%-16s %-8s %11.4g %11.4g %+8.1f%% [%+6.1f%%,%+6.1f%%] "
+		       "%8.4f  %s\n", m->name, m->unit ? m->unit : "-", ma,
+		       mb, delta, lo, hi, p, verdict);
+		verbose("%s: %zu old, %zu new samples, %s is better",
+			m->name, a->n, b->n, m->lower ? "lower" : "higher");
+	}
+
+	for (i = 0; i < set.n; i++) {
+		free(set.m[i].name);
+		free(set.m[i].unit);
+		free(set.m[i].side[0].s);
+		free(set.m[i].side[1].s);
+	}
+	free(set.m);
+	return ret;
+}
@@ -39,40 +39,18 @@
 /* -------------------------------------------------------------------------- */
 
 /**
- * DOC: Caution
+ * DOC: Byte order
  *
- * This programm works well on big and little endian architectures.
- * I have not tried with any other byte sex. However, functions
- * are already there. Just fill in the correct code for mixed endian
- * or whatever you like (have) to use.
- *
- * The functions are named tole16(), fromle16(), tole64() and fromle64().
- * See their documenation for further details.
+ * The superblock is converted to host byte order as a whole right after
+ * reading it, see lanyfs_canon_sb().
  */
 
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>		/* va_*(), vprintf() */
-#ifdef __FreeBSD__
-#include <sys/endian.h>
-#define bswap_16(x) __bswap16(x)
-#define bswap_64(x) __bswap64(x)
-#define off64_t off_t
-#define fseeko64 fseeko
-#define ftello64 ftello
-#elif defined __APPLE__
-#include <libkern/OSByteOrder.h>
-#define bswap_16(x) OSSwapInt16(x)
-#define bswap_64(x) OSSwapInt64(x)
-#define off64_t off_t
-#define fseeko64 fseeko
-#define ftello64 ftello
-#else
-#include <byteswap.h>
-#endif
 
-#include "lanyfs.h"
+#include "liblanyfs.h"
 
  /* gettext support, e.g. for i18n */
 #ifdef	HAVE_GETTEXT
@@ -99,55 +77,6 @@ const char *progdate = "December 2012";
 		p = NULL;	\
 	} while (0)
 
-/**
- * tole16() - Convert from CPU endianess to little endian.
- * @n:				unsigned integer to convert
- */
-static inline uint16_t tole16 (uint16_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_16(n);
-	return n;
-}
-
-/**
- * fromle16() - Convert from little endian to CPU endianess.
- * @n:				unsigned integer to convert
- */
-static inline uint16_t fromle16 (uint16_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_16(n);
-	return n;
-}
-
-/**
- * tole64() - Convert from CPU endianess to little endian.
- * @n:				unsigned integer to convert
- */
-
-static inline uint64_t tole64 (uint64_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_64(n);
-	return n;
-}
-
-/**
- * fromle64() - Convert from little endian to CPU endianess.
- * @n:				unsigned integer to convert
- */
-static inline uint64_t fromle64 (uint64_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_64(n);
-	return n;
-}
-
 /**
  * show_version() - Prints the program's name and version.
  */
@@ -189,27 +118,31 @@ static void show_error (const char *fmt, ...)
 int main (int argc, char *argv[])
 {
 	/* variables */
-	FILE *fp;
-	int i;
+	struct lanyfs_dev *dev;
 	struct lanyfs_sb *sb;
 
 	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
 	/* parse command line options */
 	if (argc < 2)
 		show_usage();
 
 	/* open device */
-	fp = fopen(argv[1], "rb");
-	if (!fp)
-		show_error(_("error opening device %s"), argv);
+	dev = lanyfs_dev_open(argv[1], 1);
+	if (!dev)
+		show_error(_("error opening device %s"), argv[1]);
 
 	/* read superblock */
 	sb = malloc(DETECTFS_SB_SIZE);
-	for (i = 0; i < DETECTFS_SB_SIZE; i++)
-		((unsigned char *) sb)[i] = fgetc(fp);
+	if (!sb)
+		show_error(_("out of memory"));
+	if (lanyfs_dev_pread(dev, sb, DETECTFS_SB_SIZE, 0))
+		show_error(_("error reading superblock"));
 
 	/* close device */
-	fclose(fp);
+	lanyfs_dev_close(dev);
+	lanyfs_canon_sb(sb);
 
 	/* show configuration */
 	printf(_("blocktype: 0x%x\n"), sb->type);
@@ -227,6 +160,12 @@ int main (int argc, char *argv[])
 	printf(_("free head: %"PRIu64"\n"), sb->freehead);
 	printf(_("free tail: %"PRIu64"\n"), sb->freetail);
 	printf(_("free blocks: %"PRIu64"\n"), sb->freeblocks);
+	if (sb->zoneend) {
+		printf(_("zone end: %"PRIu64"\n"), sb->zoneend);
+		printf(_("zone head: %"PRIu64"\n"), sb->zonehead);
+		printf(_("zone tail: %"PRIu64"\n"), sb->zonetail);
+		printf(_("zone free blocks: %"PRIu64"\n"), sb->zoneblocks);
+	}
 	printf(_("created: %04u-%02u-%02uT%02u:%02u:%02u.%u%+03d:%02d\n"),
 		sb->created.year, sb->created.mon, sb->created.day,
 		sb->created.hour, sb->created.min, sb->created.sec,
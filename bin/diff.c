@@ -0,0 +1,565 @@
+/*
+ * diff.c - Compare the Trees of two Lanyard Filesystems.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Comparing trees
+ *
+ * Both trees are walked together. The entries of a directory come out of
+ * its binary tree in name order on both sides, so one merge pass pairs
+ * them up and finds what was added or deleted. Each pair of directories
+ * is a task on a thread pool.
+ *
+ * Entries with the same block address, write counter and modification
+ * time on both sides are taken to be the same and not looked into, a
+ * directory like that is skipped with everything below it. File contents
+ * are only read if the metadata differs but the size does not. The work
+ * done thus grows with the size of the change, not of the trees.
+ *
+ * Changes are collected per worker and printed sorted by path.
+ */
+
+#define _GNU_SOURCE		/* asprintf() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "diff.lanyfs";
+const char *progdate = "December 2012";
+#define CACHE_DEFAULT		4096	/* blocks cached per volume */
+#define CHUNK_SIZE		(64 << 10)	/* bytes compared at once */
+#define DIFF_SAME		0
+#define DIFF_FOUND		1
+#define DIFF_FAILED		2
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct diff_change - A change found.
+ * @kind:			A added, D deleted, M contents changed, m only
+ * 				metadata changed, T type changed
+ * @path:			path, directories end in a slash
+ */
+struct diff_change {
+	char			kind;
+	char			*path;
+};
+
+/**
+ * struct diff_worker - Findings and buffers of a worker.
+ * @changes:			changes found
+ * @n:				number of changes
+ * @cap:			number of changes allocated
+ * @buf:			file contents, one chunk per side
+ * @dirs:			directory pairs merged
+ * @skipped:			pairs taken to be the same by metadata
+ * @files:			file pairs whose contents were compared
+ * @bytes:			bytes of file contents read per side
+ */
+struct diff_worker {
+	struct diff_change	*changes;
+	size_t			n;
+	size_t			cap;
+	unsigned char		*buf[2];
+	uint64_t		dirs;
+	uint64_t		skipped;
+	uint64_t		files;
+	uint64_t		bytes;
+};
+
+/**
+ * struct diff_ctx - State shared by all tasks.
+ * @vol:			volumes, old and new
+ * @full:			do not trust metadata, look at everything
+ * @workers:			one per worker
+ */
+struct diff_ctx {
+	struct lanyfs_vol	*vol[2];
+	int			full;
+	struct diff_worker	*workers;
+};
+
+/**
+ * struct diff_job - Pair of directories to merge.
+ * @ctx:			shared state
+ * @path:			path of directories, empty or ending in a slash
+ * @addr:			addresses of directory blocks, old and new
+ */
+struct diff_job {
+	struct diff_ctx		*ctx;
+	char			*path;
+	uint64_t		addr[2];
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr, _("usage: %s [-v] [-f] [-j threads] old new\n"),
+		progname);
+	exit(DIFF_FAILED);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(DIFF_FAILED);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * add_change() - Records a change.
+ * @w:				worker
+ * @kind:			kind of change
+ * @dir:			path of directory
+ * @ent:			entry changed
+ */
+static int add_change (struct diff_worker *w, char kind, const char *dir,
+		       const struct lanyfs_dirent *ent)
+{
+	struct diff_change *c;
+
+	if (w->n == w->cap) {
+		c = realloc(w->changes, (w->cap ? w->cap * 2 : 64) *
+			    sizeof(*c));
+		if (!c)
+			return -1;
+		w->changes = c;
+		w->cap = w->cap ? w->cap * 2 : 64;
+	}
+	c = &w->changes[w->n];
+	c->kind = kind;
+	if (asprintf(&c->path, "%s%s%s", dir, ent->name,
+		     ent->type == LANYFS_TYPE_DIR ? "/" : "") < 0)
+		return -1;
+	w->n++;
+	return 0;
+}
+
+/**
+ * same_meta() - Tells whether two entries are the same by their metadata.
+ * @a:				old entry
+ * @b:				new entry
+ */
+static int same_meta (const struct lanyfs_dirent *a,
+		      const struct lanyfs_dirent *b)
+{
+	return a->addr == b->addr && a->wrcnt == b->wrcnt &&
+	       a->size == b->size &&
+	       !memcmp(&a->modified, &b->modified, sizeof(a->modified));
+}
+
+/**
+ * same_contents() - Compares the contents of two files of equal size.
+ * @ctx:			shared state
+ * @w:				worker
+ * @a:				old entry
+ * @b:				new entry
+ *
+ * Returns 1 if they are the same, 0 if not and -1 on error.
+ */
+static int same_contents (struct diff_ctx *ctx, struct diff_worker *w,
+			  const struct lanyfs_dirent *a,
+			  const struct lanyfs_dirent *b)
+{
+	struct lanyfs_fh *fa, *fb;
+	ssize_t na, nb;
+	uint64_t off = 0;
+	int ret = -1;
+
+	fa = lanyfs_open_addr(ctx->vol[0], a->addr);
+	fb = lanyfs_open_addr(ctx->vol[1], b->addr);
+	if (!fa || !fb)
+		goto out;
+	w->files++;
+	for (;;) {
+		na = lanyfs_pread(fa, w->buf[0], CHUNK_SIZE, off);
+		nb = lanyfs_pread(fb, w->buf[1], CHUNK_SIZE, off);
+		if (na < 0 || nb < 0)
+			goto out;
+		w->bytes += na;
+		if (na != nb || memcmp(w->buf[0], w->buf[1], na)) {
+			ret = 0;
+			break;
+		}
+		if (!na) {
+			ret = 1;
+			break;
+		}
+		off += na;
+	}
+
+out:
+	lanyfs_close(fa);
+	lanyfs_close(fb);
+	return ret;
+}
+
+/**
+ * cmp_dirent() - Orders directory entries by name, for qsort().
+ * @a:				first entry
+ * @b:				second entry
+ */
+static int cmp_dirent (const void *a, const void *b)
+{
+	return strcmp(((const struct lanyfs_dirent *) a)->name,
+		      ((const struct lanyfs_dirent *) b)->name);
+}
+
+/**
+ * list_dir() - Lists a directory in name order.
+ * @vol:			volume
+ * @addr:			address of directory block
+ * @n:				number of entries
+ *
+ * Binary trees are ordered by name already, those that are not get their
+ * entries sorted so the merge still pairs them up.
+ */
+static struct lanyfs_dirent *list_dir (struct lanyfs_vol *vol, uint64_t addr,
+				       size_t *n)
+{
+	struct lanyfs_dirent *ents = NULL, *e;
+	struct lanyfs_fh *fh;
+	struct lanyfs_stat st;
+	uint64_t pos = 0;
+	size_t i = 0;
+	int ret;
+
+	fh = lanyfs_open_addr(vol, addr);
+	if (!fh)
+		return NULL;
+	if (lanyfs_fstat(fh, &st) || st.type != LANYFS_TYPE_DIR) {
+		lanyfs_close(fh);
+		errno = ENOTDIR;
+		return NULL;
+	}
+	*n = 0;
+	for (;;) {
+		if (i == *n) {
+			e = realloc(ents, (*n ? *n * 2 : 64) * sizeof(*e));
+			if (!e) {
+				ret = -1;
+				break;
+			}
+			ents = e;
+			*n = *n ? *n * 2 : 64;
+		}
+		ret = lanyfs_readdir(fh, &pos, &ents[i]);
+		if (ret != 1)
+			break;
+		i++;
+	}
+	lanyfs_close(fh);
+	if (ret) {
+		free(ents);
+		return NULL;
+	}
+	*n = i;
+	for (i = 1; i < *n; i++) {
+		if (strcmp(ents[i - 1].name, ents[i].name) > 0) {
+			qsort(ents, *n, sizeof(*ents), cmp_dirent);
+			break;
+		}
+	}
+	return ents;
+}
+
+/**
+ * diff_dir() - Merges a pair of directories.
+ * @pool:			pool running the comparison
+ * @worker:			index of worker
+ * @arg:			job, freed
+ * @n:				unused
+ *
+ * Pairs of subdirectories that may differ become tasks of their own.
+ */
+static int diff_dir (struct lanyfs_pool *pool, int worker, void *arg,
+		     uint64_t n)
+{
+	struct diff_job *job = arg, *sub;
+	struct diff_ctx *ctx = job->ctx;
+	struct diff_worker *w = &ctx->workers[worker];
+	struct lanyfs_dirent *ea, *eb, *a, *b;
+	size_t na = 0, nb = 0, i = 0, j = 0;
+	int ret = -1, c, same;
+
+	(void) n;
+	w->dirs++;
+	ea = list_dir(ctx->vol[0], job->addr[0], &na);
+	eb = list_dir(ctx->vol[1], job->addr[1], &nb);
+	if (!ea || !eb)
+		goto out;
+	while (i < na || j < nb) {
+		a = i < na ? &ea[i] : NULL;
+		b = j < nb ? &eb[j] : NULL;
+		c = !a ? 1 : !b ? -1 : strcmp(a->name, b->name);
+		if (c < 0) {
+			if (add_change(w, 'D', job->path, a))
+				goto out;
+			i++;
+			continue;
+		}
+		if (c > 0) {
+			if (add_change(w, 'A', job->path, b))
+				goto out;
+			j++;
+			continue;
+		}
+		i++;
+		j++;
+		if (a->type != b->type) {
+			if (add_change(w, 'T', job->path, b))
+				goto out;
+			continue;
+		}
+		if (!ctx->full && same_meta(a, b)) {
+			w->skipped++;
+			continue;
+		}
+		if (a->type == LANYFS_TYPE_DIR) {
+			sub = malloc(sizeof(*sub));
+			if (!sub)
+				goto out;
+			sub->ctx = ctx;
+			sub->addr[0] = a->addr;
+			sub->addr[1] = b->addr;
+			if (asprintf(&sub->path, "%s%s/", job->path,
+				     a->name) < 0) {
+				free(sub);
+				goto out;
+			}
+			if (lanyfs_pool_submit(pool, diff_dir, sub, 0)) {
+				free(sub->path);
+				free(sub);
+				goto out;
+			}
+			continue;
+		}
+		same = a->size == b->size ? same_contents(ctx, w, a, b) : 0;
+		if (same < 0)
+			goto out;
+		if (!same && add_change(w, 'M', job->path, b))
+			goto out;
+		if (same && memcmp(&a->modified, &b->modified,
+				   sizeof(a->modified)) &&
+		    add_change(w, 'm', job->path, b))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	free(ea);
+	free(eb);
+	free(job->path);
+	free(job);
+	return ret;
+}
+
+/**
+ * cmp_change() - Orders changes by path, for qsort().
+ * @a:				first change
+ * @b:				second change
+ */
+static int cmp_change (const void *a, const void *b)
+{
+	return strcmp(((const struct diff_change *) a)->path,
+		      ((const struct diff_change *) b)->path);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct diff_ctx ctx;
+	struct diff_job *job;
+	struct diff_change *all;
+	struct lanyfs_pool *pool;
+	struct diff_worker sum;
+	int threads = lanyfs_default_threads(), n, i, s;
+	size_t total = 0, k;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&ctx, 0, sizeof(ctx));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "fj:v")) != -1) {
+		switch (c) {
+		case 'f':
+			ctx.full = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 != argc)
+		show_usage();
+	for (s = 0; s < 2; s++) {
+		ctx.vol[s] = lanyfs_open_volume(argv[optind + s],
+						CACHE_DEFAULT);
+		if (!ctx.vol[s])
+			show_error(_("error opening device %s: %s"),
+				   argv[optind + s], strerror(errno));
+	}
+
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		show_error(_("error starting threads: %s"), strerror(errno));
+	n = lanyfs_pool_threads(pool);
+	ctx.workers = calloc(n, sizeof(*ctx.workers));
+	job = calloc(1, sizeof(*job));
+	if (!ctx.workers || !job)
+		show_error(_("out of memory"));
+	for (i = 0; i < n; i++) {
+		for (s = 0; s < 2; s++) {
+			ctx.workers[i].buf[s] = malloc(CHUNK_SIZE);
+			if (!ctx.workers[i].buf[s])
+				show_error(_("out of memory"));
+		}
+	}
+	job->ctx = &ctx;
+	job->path = strdup("");
+	if (!job->path)
+		show_error(_("out of memory"));
+	for (s = 0; s < 2; s++)
+		job->addr[s] = fromle64(ctx.vol[s]->sb->sb.rootdir);
+	if (lanyfs_pool_submit(pool, diff_dir, job, 0) ||
+	    lanyfs_pool_wait(pool))
+		show_error(_("error comparing: %s"), strerror(errno));
+	lanyfs_pool_free(pool);
+
+	memset(&sum, 0, sizeof(sum));
+	for (i = 0; i < n; i++) {
+		total += ctx.workers[i].n;
+		sum.dirs += ctx.workers[i].dirs;
+		sum.skipped += ctx.workers[i].skipped;
+		sum.files += ctx.workers[i].files;
+		sum.bytes += ctx.workers[i].bytes;
+	}
+	all = malloc((total ? total : 1) * sizeof(*all));
+	if (!all)
+		show_error(_("out of memory"));
+	for (i = 0, k = 0; i < n; i++) {
+		memcpy(all + k, ctx.workers[i].changes,
+		       ctx.workers[i].n * sizeof(*all));
+		k += ctx.workers[i].n;
+	}
+	qsort(all, total, sizeof(*all), cmp_change);
+	for (k = 0; k < total; k++) {
+		printf("%c\t%s\n", all[k].kind, all[k].path);
+		free(all[k].path);
+	}
+	verbose("%"PRIu64" directories merged, %"PRIu64" entries skipped, "
+		"%"PRIu64" files compared, %"PRIu64" bytes read", sum.dirs,
+		sum.skipped, sum.files, sum.bytes);
+
+	free(all);
+	for (i = 0; i < n; i++) {
+		free(ctx.workers[i].changes);
+		free(ctx.workers[i].buf[0]);
+		free(ctx.workers[i].buf[1]);
+	}
+	free(ctx.workers);
+	for (s = 0; s < 2; s++)
+		lanyfs_close_volume(ctx.vol[s]);
+	return total ? DIFF_FOUND : DIFF_SAME;
+}
@@ -0,0 +1,525 @@
+/*
+ * flash.c - Write Lanyard Filesystem Images to Many Devices at Once.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Flashing
+ *
+ * The image is read once, a run of blocks in use at a time, into buffers
+ * shared by all targets. Every target has a writer thread of its own and a
+ * queue of the buffers it still has to write. A buffer goes back to the
+ * reader once the last target has written it, so targets run ahead of each
+ * other by as many buffers as the budget holds, and only a target lagging
+ * behind by all of them holds up the others.
+ *
+ * Blocks on the free blocks chain are not read or written, optionally they
+ * are discarded on the targets. The superblock is written last, after all
+ * other blocks have been written and synced, so an interrupted target does
+ * not pass for a complete one.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>		/* getopt() */
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "flash.lanyfs";
+const char *progdate = "December 2012";
+#define BUDGET_DEFAULT		64	/* buffer budget in MiB */
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct flash_buf - Run of blocks shared by all targets.
+ * @pos:			byte offset
+ * @len:			number of bytes
+ * @data:			contents
+ * @refs:			number of targets still to write the run
+ * @next:			next free buffer
+ */
+struct flash_buf {
+	uint64_t		pos;
+	size_t			len;
+	unsigned char		*data;
+	int			refs;
+	struct flash_buf	*next;
+};
+
+struct flash;
+
+/**
+ * struct flash_target - Device being written.
+ * @fl:				flashing job
+ * @path:			path of device
+ * @dev:			device
+ * @thread:			writer thread
+ * @queue:			ring of buffers to write
+ * @head:			next buffer to write
+ * @tail:			next free slot of @queue
+ * @err:			errno of first failure, 0 while fine
+ * @written:			number of bytes written
+ * @discarded:			number of bytes discarded
+ * @ns:				nanoseconds from start to last write
+ */
+struct flash_target {
+	struct flash		*fl;
+	const char		*path;
+	struct lanyfs_dev	*dev;
+	pthread_t		thread;
+	struct flash_buf	**queue;
+	uint64_t		head;
+	uint64_t		tail;
+	int			err;
+	uint64_t		written;
+	uint64_t		discarded;
+	uint64_t		ns;
+};
+
+/**
+ * struct flash - Flashing job.
+ * @vol:			source volume
+ * @free:			bitmap of free blocks
+ * @discard:			discard free blocks on targets
+ * @targets:			targets
+ * @n:				number of targets
+ * @bufs:			all buffers
+ * @nbufs:			number of buffers, the budget
+ * @freebufs:			buffers not in use
+ * @done:			the reader has queued its last buffer
+ * @start:			nanoseconds at start
+ * @lock:			protects queues, buffer references and @freebufs
+ * @more:			signals queued buffers
+ * @less:			signals released buffers
+ */
+struct flash {
+	struct lanyfs_vol	*vol;
+	unsigned char		*free;
+	int			discard;
+	struct flash_target	*targets;
+	int			n;
+	struct flash_buf	*bufs;
+	size_t			nbufs;
+	struct flash_buf	*freebufs;
+	int			done;
+	uint64_t		start;
+	pthread_mutex_t		lock;
+	pthread_cond_t		more;
+	pthread_cond_t		less;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-d] [-m budget] image target...\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * open_target() - Opens a target, creating image files as needed.
+ * @path:			path of device or image file
+ * @size:			size of image in bytes
+ *
+ * Image files are created or grown to @size, devices must be large enough.
+ */
+static struct lanyfs_dev *open_target (const char *path, uint64_t size)
+{
+	struct lanyfs_dev *dev;
+	struct stat st;
+	int fd;
+
+	if (stat(path, &st) || S_ISREG(st.st_mode)) {
+		fd = open(path, O_WRONLY | O_CREAT, 0644);
+		if (fd < 0)
+			return NULL;
+		if ((fstat(fd, &st) || (uint64_t) st.st_size < size) &&
+		    ftruncate(fd, size)) {
+			close(fd);
+			return NULL;
+		}
+		if (close(fd))
+			return NULL;
+	}
+	dev = lanyfs_dev_open(path, 0);
+	if (dev && dev->size < size) {
+		lanyfs_dev_close(dev);
+		errno = ENOSPC;
+		return NULL;
+	}
+	return dev;
+}
+
+/**
+ * discard_free() - Discards all runs of free blocks on a target.
+ * @t:				target
+ *
+ * Targets unable to discard are left as they are.
+ */
+static int discard_free (struct flash_target *t)
+{
+	struct lanyfs_vol *vol = t->fl->vol;
+	uint64_t addr, end;
+
+	for (addr = 0; addr < vol->blocks; addr = end) {
+		for (end = addr + 1; end < vol->blocks &&
+		     !lanyfs_testbit(t->fl->free, end) ==
+		     !lanyfs_testbit(t->fl->free, addr); end++)
+			;
+		if (!lanyfs_testbit(t->fl->free, addr))
+			continue;
+		if (lanyfs_dev_discard(t->dev, (end - addr) << vol->blocksize,
+				       addr << vol->blocksize)) {
+			if (errno == EOPNOTSUPP)
+				return 0;
+			return -1;
+		}
+		t->discarded += (end - addr) << vol->blocksize;
+	}
+	return 0;
+}
+
+/**
+ * writer() - Writer thread of a target.
+ * @arg:			target
+ *
+ * A failed target keeps taking buffers off its queue without writing them,
+ * so it never holds up the others.
+ */
+static void *writer (void *arg)
+{
+	struct flash_target *t = arg;
+	struct flash *fl = t->fl;
+	struct flash_buf *b;
+
+	if (fl->discard && discard_free(t))
+		t->err = errno;
+	pthread_mutex_lock(&fl->lock);
+	for (;;) {
+		while (t->head == t->tail && !fl->done)
+			pthread_cond_wait(&fl->more, &fl->lock);
+		if (t->head == t->tail)
+			break;
+		b = t->queue[t->head++ % fl->nbufs];
+		pthread_mutex_unlock(&fl->lock);
+		if (!t->err) {
+			if (lanyfs_dev_pwrite(t->dev, b->data, b->len, b->pos))
+				t->err = errno;
+			else
+				t->written += b->len;
+		}
+		pthread_mutex_lock(&fl->lock);
+		if (!--b->refs) {
+			b->next = fl->freebufs;
+			fl->freebufs = b;
+			pthread_cond_signal(&fl->less);
+		}
+	}
+	pthread_mutex_unlock(&fl->lock);
+	if (!t->err && lanyfs_dev_sync(t->dev))
+		t->err = errno;
+	t->ns = lanyfs_lat_now() - fl->start;
+	return NULL;
+}
+
+/**
+ * read_image() - Reads all blocks in use but the superblock into buffers.
+ * @fl:				flashing job
+ * @run:			blocks per buffer
+ *
+ * Every buffer read is queued for all targets at once.
+ */
+static int read_image (struct flash *fl, uint64_t run)
+{
+	struct lanyfs_vol *vol = fl->vol;
+	struct flash_buf *b;
+	uint64_t addr, end;
+	int i;
+
+	for (addr = LANYFS_SUPERBLOCK + 1; addr < vol->blocks; addr = end) {
+		if (lanyfs_testbit(fl->free, addr)) {
+			end = addr + 1;
+			continue;
+		}
+		for (end = addr + 1; end < vol->blocks && end - addr < run &&
+		     !lanyfs_testbit(fl->free, end); end++)
+			;
+		pthread_mutex_lock(&fl->lock);
+		while (!fl->freebufs)
+			pthread_cond_wait(&fl->less, &fl->lock);
+		b = fl->freebufs;
+		fl->freebufs = b->next;
+		pthread_mutex_unlock(&fl->lock);
+		b->pos = addr << vol->blocksize;
+		b->len = (end - addr) << vol->blocksize;
+		if (lanyfs_dev_pread(vol->dev, b->data, b->len, b->pos))
+			return -1;
+		b->refs = fl->n;
+		pthread_mutex_lock(&fl->lock);
+		for (i = 0; i < fl->n; i++)
+			fl->targets[i].queue[fl->targets[i].tail++ %
+					     fl->nbufs] = b;
+		pthread_cond_broadcast(&fl->more);
+		pthread_mutex_unlock(&fl->lock);
+	}
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct flash fl;
+	struct flash_target *t;
+	size_t budget = BUDGET_DEFAULT, batch;
+	uint64_t run, nfree, size, inuse;
+	int i, ret, failed = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&fl, 0, sizeof(fl));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "dm:v")) != -1) {
+		switch (c) {
+		case 'd':
+			fl.discard = 1;
+			break;
+		case 'm':
+			budget = atol(optarg);
+			if (budget < 1)
+				show_error(_("invalid buffer budget"));
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 > argc)
+		show_usage();
+
+	fl.vol = lanyfs_vol_open(argv[optind], 1);
+	if (!fl.vol)
+		show_error(_("error opening image %s: %s"), argv[optind],
+			   strerror(errno));
+	fl.free = calloc(1, (fl.vol->blocks + 7) / 8);
+	if (!fl.free)
+		show_error(_("out of memory"));
+	if (lanyfs_free_map(fl.vol, fl.free, 0, &nfree))
+		show_error(_("error reading free blocks chain: %s"),
+			   strerror(errno));
+	size = fl.vol->blocks << fl.vol->blocksize;
+	inuse = fl.vol->blocks - nfree;
+	verbose("%"PRIu64" of %"PRIu64" blocks in use", inuse,
+		fl.vol->blocks);
+
+	/* the source may be verified, the targets are written */
+	unsetenv("LANYFS_VERITY");
+	fl.n = argc - optind - 1;
+	fl.targets = calloc(fl.n, sizeof(*fl.targets));
+	if (!fl.targets)
+		show_error(_("out of memory"));
+	batch = lanyfs_dev_batch(fl.vol->dev);
+	for (i = 0; i < fl.n; i++) {
+		t = &fl.targets[i];
+		t->fl = &fl;
+		t->path = argv[optind + 1 + i];
+		t->dev = open_target(t->path, size);
+		if (!t->dev)
+			show_error(_("error opening target %s: %s"), t->path,
+				   strerror(errno));
+		if (lanyfs_dev_batch(t->dev) > batch)
+			batch = lanyfs_dev_batch(t->dev);
+	}
+
+	/* runs suit the device taking the largest requests */
+	run = batch >> fl.vol->blocksize;
+	if (!run)
+		run = 1;
+	fl.nbufs = (budget << 20) / (run << fl.vol->blocksize);
+	if (fl.nbufs < 2)
+		fl.nbufs = 2;
+	fl.bufs = calloc(fl.nbufs, sizeof(*fl.bufs));
+	if (!fl.bufs)
+		show_error(_("out of memory"));
+	for (i = 0; (size_t) i < fl.nbufs; i++) {
+		/* aligned, runs may go out bypassing the page cache */
+		if (posix_memalign((void **) &fl.bufs[i].data, 4096,
+				   run << fl.vol->blocksize))
+			show_error(_("out of memory"));
+		fl.bufs[i].next = fl.freebufs;
+		fl.freebufs = &fl.bufs[i];
+	}
+	for (i = 0; i < fl.n; i++) {
+		fl.targets[i].queue = calloc(fl.nbufs,
+					     sizeof(*fl.targets[i].queue));
+		if (!fl.targets[i].queue)
+			show_error(_("out of memory"));
+	}
+	pthread_mutex_init(&fl.lock, NULL);
+	pthread_cond_init(&fl.more, NULL);
+	pthread_cond_init(&fl.less, NULL);
+	verbose("%zu buffers of %"PRIu64" KiB", fl.nbufs,
+		(run << fl.vol->blocksize) >> 10);
+
+	printf(_("writing %"PRIu64" blocks to %d targets\n"), inuse, fl.n);
+	fl.start = lanyfs_lat_now();
+	for (i = 0; i < fl.n; i++) {
+		if (pthread_create(&fl.targets[i].thread, NULL, writer,
+				   &fl.targets[i]))
+			show_error(_("error starting threads: %s"),
+				   strerror(errno));
+	}
+	ret = read_image(&fl, run);
+	if (ret)
+		fprintf(stderr, _("%s: error reading image: %s\n"), progname,
+			strerror(errno));
+	pthread_mutex_lock(&fl.lock);
+	fl.done = 1;
+	pthread_cond_broadcast(&fl.more);
+	pthread_mutex_unlock(&fl.lock);
+	for (i = 0; i < fl.n; i++)
+		pthread_join(fl.targets[i].thread, NULL);
+	if (ret)
+		exit(EXIT_FAILURE);
+
+	for (i = 0; i < fl.n; i++) {
+		t = &fl.targets[i];
+		if (!t->err && (lanyfs_dev_pwrite(t->dev, fl.vol->sb,
+						  fl.vol->bsize, 0) ||
+				lanyfs_dev_sync(t->dev)))
+			t->err = errno;
+		if (lanyfs_dev_close(t->dev) && !t->err)
+			t->err = errno;
+		if (t->err) {
+			fprintf(stderr, _("%s: error writing %s: %s\n"),
+				progname, t->path, strerror(t->err));
+			failed++;
+			continue;
+		}
+		if (t->discarded)
+			verbose("%s: discarded %"PRIu64" MiB", t->path,
+				t->discarded >> 20);
+		printf(_("%s: %"PRIu64" MiB in %.1f s, %.1f MiB/s\n"), t->path,
+		       (t->written + fl.vol->bsize) >> 20, t->ns / 1e9,
+		       t->ns ? (t->written + fl.vol->bsize) / 1048576.0 /
+		       (t->ns / 1e9) : 0.0);
+	}
+	pthread_mutex_destroy(&fl.lock);
+	pthread_cond_destroy(&fl.more);
+	pthread_cond_destroy(&fl.less);
+	for (i = 0; (size_t) i < fl.nbufs; i++)
+		free(fl.bufs[i].data);
+	for (i = 0; i < fl.n; i++)
+		free(fl.targets[i].queue);
+	free(fl.bufs);
+	free(fl.targets);
+	free(fl.free);
+	lanyfs_vol_close(fl.vol);
+	if (failed)
+		show_error(_("%d of %d targets failed"), failed, fl.n);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,814 @@
+/*
+ * fsck.c - Check Lanyard Filesystem Volumes.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Checking
+ *
+ * Every block but the superblock must be claimed exactly once, either by
+ * the directory tree or by the free blocks chain. The checker walks both
+ * and emits one edge (block, owner) per claim instead of keeping per-block
+ * state. Edges are sorted externally within the memory cap and validated
+ * in a single merge: a block seen twice is claimed twice, a gap in the
+ * sequence of blocks is a lost block.
+ *
+ * The directory tree is walked by several threads, each buffering its edges
+ * before handing them to the sort. A bitmap of visited directory and file
+ * blocks keeps pointer cycles from trapping the walk.
+ *
+ * Nothing is written to the device unless asked to repair.
+ */
+
+/**
+ * DOC: Repairing
+ *
+ * The free blocks chain carries no information of its own, it is merely
+ * the complement of the blocks reachable from the root directory and the
+ * bad blocks chain. When repairing, every claim made by the walk of the
+ * directory tree and the bad blocks chain is also recorded in a compressed
+ * bitmap. If the walk reached everything, the old chain is dropped and a
+ * fresh one is encoded for all blocks not in the bitmap, which fixes lost
+ * blocks, blocks both used and free, and wrong free counts in one go. A
+ * damaged directory tree leaves the chain as it is, since blocks beyond
+ * the damage would be handed out as free.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "fsck.lanyfs";
+const char *progdate = "December 2012";
+#define EDGE_BATCH		4096	/* edges buffered per worker */
+#define MEMCAP_DEFAULT		256	/* memory cap in MiB */
+#define REPORT_LIMIT		20	/* problems reported one by one */
+
+/* exit codes, as for fsck(8) */
+#define FSCK_OK			0
+#define FSCK_CORRECTED		1
+#define FSCK_ERRORS		4
+#define FSCK_FAILED		8
+
+/* global variables */
+int v = 0;
+
+/**
+ * enum fsck_kind - How a block is claimed.
+ * @KIND_NODE:			directory or file block in a binary tree
+ * @KIND_EXT:			extender of a file
+ * @KIND_DATA:			data block of a file
+ * @KIND_CHAIN:			chain block of the free blocks chain
+ * @KIND_FREE:			free block listed in a chain block
+ * @KIND_BADCHAIN:		chain block of the bad blocks chain
+ * @KIND_BAD:			bad block listed in a chain block
+ */
+enum fsck_kind {
+	KIND_NODE,
+	KIND_EXT,
+	KIND_DATA,
+	KIND_CHAIN,
+	KIND_FREE,
+	KIND_BADCHAIN,
+	KIND_BAD,
+};
+
+/**
+ * struct fsck_edge - Claim of a block.
+ * @block:			claimed block
+ * @owner:			claiming block, 0 for the superblock
+ * @kind:			enum fsck_kind
+ * @__reserved:			padding
+ */
+struct fsck_edge {
+	uint64_t		block;
+	uint64_t		owner;
+	uint32_t		kind;
+	uint32_t		__reserved;
+};
+
+/**
+ * struct fsck_buf - Edges buffered by a worker.
+ * @e:				edges
+ * @n:				number of edges
+ * @ctx:			check context
+ * @owner:			owner of extender tree being walked
+ */
+struct fsck_buf {
+	struct fsck_edge	e[EDGE_BATCH];
+	size_t			n;
+	struct fsck_ctx		*ctx;
+	uint64_t		owner;
+};
+
+/**
+ * struct fsck_ctx - State of a check.
+ * @sort:			external sort of edges
+ * @bufs:			one edge buffer per worker
+ * @visited:			directory and file blocks walked
+ * @reach:			blocks in use, only when repairing
+ * @errors:			number of errors found
+ * @unfixed:			errors a new free blocks chain does not fix
+ * @incomplete:			directory tree not walked completely
+ * @nodes:			number of directory and file blocks
+ */
+struct fsck_ctx {
+	struct lanyfs_sort	*sort;
+	struct fsck_buf		*bufs;
+	unsigned char		*visited;
+	struct lanyfs_cmap	*reach;
+	uint64_t		errors;
+	uint64_t		unfixed;
+	int			incomplete;
+	uint64_t		nodes;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-r] [-j threads] [-m memory] [-T tmpdir] "
+		  "device\n"),
+		progname);
+	exit(FSCK_FAILED);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(FSCK_FAILED);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/**
+ * problem() - Counts and prints a problem found on the volume.
+ * @ctx:			check context
+ * @fmt:			message format string
+ * @...:			format string arguments
+ *
+ * Only the first few problems are printed unless verbose.
+ */
+static void problem (struct fsck_ctx *ctx, const char *fmt, ...)
+{
+	va_list arg;
+	if (__atomic_fetch_add(&ctx->errors, 1, __ATOMIC_RELAXED) >=
+	    REPORT_LIMIT && !v)
+		return;
+	printf(_("error: "));
+	va_start(arg, fmt);
+	vprintf(fmt, arg);
+	va_end(arg);
+	printf("\n");
+}
+
+/**
+ * kind_name() - Returns a printable name of a claim.
+ * @kind:			enum fsck_kind
+ */
+static const char *kind_name (uint32_t kind)
+{
+	switch (kind) {
+	case KIND_NODE:
+		return _("node");
+	case KIND_EXT:
+		return _("extender");
+	case KIND_DATA:
+		return _("data");
+	case KIND_CHAIN:
+		return _("chain");
+	case KIND_BADCHAIN:
+		return _("bad blocks chain");
+	case KIND_BAD:
+		return _("bad");
+	default:
+		return _("free");
+	}
+}
+
+/**
+ * edge_cmp() - Orders edges by block, kind and owner.
+ * @a:				edge
+ * @b:				edge
+ */
+static int edge_cmp (const void *a, const void *b)
+{
+	const struct fsck_edge *x = a, *y = b;
+	if (x->block != y->block)
+		return x->block < y->block ? -1 : 1;
+	if (x->kind != y->kind)
+		return x->kind < y->kind ? -1 : 1;
+	if (x->owner != y->owner)
+		return x->owner < y->owner ? -1 : 1;
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * emit() - Buffers an edge.
+ * @ctx:			check context
+ * @buf:			edge buffer of calling worker
+ * @block:			claimed block
+ * @owner:			claiming block
+ * @kind:			enum fsck_kind
+ */
+static void emit (struct fsck_ctx *ctx, struct fsck_buf *buf, uint64_t block,
+		  uint64_t owner, uint32_t kind)
+{
+	struct fsck_edge *e;
+	if (buf->n == EDGE_BATCH) {
+		if (lanyfs_sort_add(ctx->sort, buf->e, buf->n))
+			show_error(_("error sorting edges: %s"),
+				   strerror(errno));
+		buf->n = 0;
+	}
+	if (ctx->reach && kind != KIND_CHAIN && kind != KIND_FREE &&
+	    lanyfs_cmap_set(ctx->reach, block) < 0)
+		show_error(_("out of memory"));
+	e = &buf->e[buf->n++];
+	e->block = block;
+	e->owner = owner;
+	e->kind = kind;
+	e->__reserved = 0;
+}
+
+/**
+ * check_ext() - Claims the extender and data blocks of a file.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			edge buffer of calling worker
+ */
+static int check_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+		      uint64_t iblock, void *arg)
+{
+	struct fsck_buf *buf = arg;
+	emit(buf->ctx, buf, addr, buf->owner,
+	     type == LANYFS_TYPE_EXT ? KIND_EXT : KIND_DATA);
+	return 0;
+}
+
+/**
+ * check_node() - Checks a directory or file block and claims its children.
+ * @vol:			volume
+ * @worker:			index of calling worker
+ * @addr:			address of block
+ * @b:				the block
+ * @arg:			check context
+ */
+static int check_node (struct lanyfs_vol *vol, int worker, uint64_t addr,
+		       union lanyfs_b *b, void *arg)
+{
+	struct fsck_ctx *ctx = arg;
+	struct fsck_buf *buf = &ctx->bufs[worker];
+	uint64_t child[3];
+	int i, bad = 0;
+
+	/* a second visit means a pointer cycle, the merge reports it */
+	if (__atomic_fetch_or(&ctx->visited[addr >> 3], 1 << (addr & 7),
+			      __ATOMIC_RELAXED) & (1 << (addr & 7)))
+		return LANYFS_WALK_PRUNE;
+	__atomic_fetch_add(&ctx->nodes, 1, __ATOMIC_RELAXED);
+
+	if (!memchr(b->vi_meta.name, 0, LANYFS_NAME_LENGTH) ||
+	    (!b->vi_meta.name[0] && b->raw.type == LANYFS_TYPE_FILE))
+		problem(ctx, _("block %"PRIu64": invalid name"), addr);
+	child[0] = fromle64(b->vi_btree.left);
+	child[1] = fromle64(b->vi_btree.right);
+	child[2] = b->raw.type == LANYFS_TYPE_DIR ?
+		   fromle64(b->dir.subtree) : 0;
+	for (i = 0; i < 3; i++) {
+		if (child[i] && !lanyfs_valid_addr(vol, child[i])) {
+			problem(ctx, _("block %"PRIu64": pointer to invalid "
+				"block %"PRIu64), addr, child[i]);
+			__atomic_store_n(&ctx->incomplete, 1,
+					 __ATOMIC_RELAXED);
+			bad = 1;
+		}
+	}
+	if (b->raw.type == LANYFS_TYPE_FILE && b->file.data) {
+		buf->owner = addr;
+		if (lanyfs_ext_walk(vol, fromle64(b->file.data), check_ext,
+				    buf)) {
+			problem(ctx, _("block %"PRIu64": damaged extender "
+				"tree"), addr);
+			__atomic_store_n(&ctx->incomplete, 1,
+					 __ATOMIC_RELAXED);
+		}
+	}
+	/* children of a damaged block are not walked, they turn up lost */
+	if (bad)
+		return LANYFS_WALK_PRUNE;
+	for (i = 0; i < 3; i++) {
+		if (child[i])
+			emit(ctx, buf, child[i], addr, KIND_NODE);
+	}
+	return 0;
+}
+
+/**
+ * check_tree() - Walks the directory tree.
+ * @vol:			volume
+ * @ctx:			check context
+ * @threads:			number of worker threads
+ */
+static void check_tree (struct lanyfs_vol *vol, struct fsck_ctx *ctx,
+			int threads)
+{
+	uint64_t root = fromle64(vol->sb->sb.rootdir);
+	union lanyfs_b *b;
+
+	if (!lanyfs_valid_addr(vol, root)) {
+		problem(ctx, _("superblock: invalid root directory"));
+		ctx->incomplete = 1;
+		return;
+	}
+	emit(ctx, &ctx->bufs[0], root, 0, KIND_NODE);
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		show_error(_("out of memory"));
+	if (lanyfs_read_block(vol, root, b))
+		show_error(_("read error at block %"PRIu64), root);
+	if (b->raw.type != LANYFS_TYPE_DIR) {
+		problem(ctx, _("root directory is no directory"));
+		ctx->incomplete = 1;
+	} else if (check_node(vol, 0, root, b, ctx) == 0 &&
+		   lanyfs_walk(vol, fromle64(b->dir.subtree), threads,
+			       check_node, ctx)) {
+		problem(ctx, _("directory tree damaged: %s"), strerror(errno));
+		ctx->incomplete = 1;
+	}
+	free(b);
+}
+
+/**
+ * check_chain() - Walks a chain of blocks.
+ * @vol:			volume
+ * @ctx:			check context
+ * @head:			first chain block
+ * @bad:			bad blocks chain rather than free blocks chain
+ * @name:			name of chain in messages
+ * @last:			last chain block, 0 if the chain is empty
+ *
+ * Returns the number of blocks in the chain, chain blocks included.
+ */
+static uint64_t check_chain (struct lanyfs_vol *vol, struct fsck_ctx *ctx,
+			     uint64_t head, int bad, const char *name,
+			     uint64_t *last)
+{
+	struct fsck_buf *buf = &ctx->bufs[0];
+	union lanyfs_b *b;
+	uint64_t addr, prev = 0, target, n = 0, hops = 0;
+	int slots = lanyfs_chain_slots(vol), slot;
+
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		show_error(_("out of memory"));
+	for (addr = head; addr; addr = fromle64(b->chain.next)) {
+		if (!lanyfs_valid_addr(vol, addr)) {
+			problem(ctx, _("%s: invalid block %"PRIu64), name,
+				addr);
+			break;
+		}
+		if (++hops > vol->blocks) {
+			problem(ctx, _("%s: loop"), name);
+			break;
+		}
+		if (lanyfs_read_block(vol, addr, b))
+			show_error(_("read error at block %"PRIu64), addr);
+		/* chain blocks used to be typed as extenders */
+		if (b->raw.type != LANYFS_TYPE_CHAIN &&
+		    b->raw.type != LANYFS_TYPE_EXT) {
+			problem(ctx, _("block %"PRIu64": not a chain block"),
+				addr);
+			break;
+		}
+		emit(ctx, buf, addr, prev, bad ? KIND_BADCHAIN : KIND_CHAIN);
+		n++;
+		for (slot = 0; slot < slots; slot++) {
+			target = lanyfs_slot_get(vol, &b->chain.stream, slot);
+			if (!target)
+				continue;
+			if (!lanyfs_valid_addr(vol, target)) {
+				problem(ctx, _("block %"PRIu64": invalid chain "
+					"entry %"PRIu64), addr, target);
+				continue;
+			}
+			emit(ctx, buf, target, addr, bad ? KIND_BAD : KIND_FREE);
+			n++;
+		}
+		prev = addr;
+	}
+	*last = prev;
+	free(b);
+	return n;
+}
+
+/**
+ * check_bad() - Walks the bad blocks chain.
+ * @vol:			volume
+ * @ctx:			check context
+ *
+ * Bad blocks stay in use for good, a damaged chain cannot be repaired.
+ */
+static void check_bad (struct lanyfs_vol *vol, struct fsck_ctx *ctx)
+{
+	uint64_t errors = ctx->errors, last;
+	check_chain(vol, ctx, fromle64(vol->sb->sb.badblocks), 1,
+		    _("bad blocks chain"), &last);
+	if (ctx->errors != errors)
+		ctx->incomplete = 1;
+}
+
+/**
+ * check_free() - Walks the free blocks chains.
+ * @vol:			volume
+ * @ctx:			check context
+ *
+ * Covers the main chain and the metadata zone's chain, which is empty on
+ * volumes without a zone. Returns the number of free blocks found.
+ */
+static uint64_t check_free (struct lanyfs_vol *vol, struct fsck_ctx *ctx)
+{
+	struct lanyfs_sb *sb = &vol->sb->sb;
+	uint64_t n, z, last;
+
+	n = check_chain(vol, ctx, fromle64(sb->freehead), 0,
+			_("free blocks chain"), &last);
+	if (last != fromle64(sb->freetail))
+		problem(ctx, _("superblock: free blocks chain ends at %"PRIu64
+			", not at %"PRIu64), last, fromle64(sb->freetail));
+	if (n != fromle64(sb->freeblocks))
+		problem(ctx, _("superblock: %"PRIu64" free blocks counted, "
+			"%"PRIu64" recorded"), n, fromle64(sb->freeblocks));
+	z = check_chain(vol, ctx, fromle64(sb->zonehead), 0,
+			_("metadata zone chain"), &last);
+	if (last != fromle64(sb->zonetail))
+		problem(ctx, _("superblock: metadata zone chain ends at "
+			"%"PRIu64", not at %"PRIu64), last,
+			fromle64(sb->zonetail));
+	if (z != fromle64(sb->zoneblocks))
+		problem(ctx, _("superblock: %"PRIu64" free blocks in metadata "
+			"zone counted, %"PRIu64" recorded"), z,
+			fromle64(sb->zoneblocks));
+	return n + z;
+}
+
+/**
+ * check_claims() - Validates the sorted edges.
+ * @vol:			volume
+ * @ctx:			check context
+ *
+ * Returns the number of lost blocks.
+ */
+static uint64_t check_claims (struct lanyfs_vol *vol, struct fsck_ctx *ctx)
+{
+	struct fsck_edge e, last;
+	uint64_t next = 1, lost = 0;
+	int ret;
+
+	memset(&last, 0, sizeof(last));
+	while ((ret = lanyfs_sort_next(ctx->sort, &e)) == 1) {
+		if (e.block == last.block) {
+			problem(ctx, _("block %"PRIu64" claimed as %s by "
+				"%"PRIu64" and as %s by %"PRIu64), e.block,
+				kind_name(last.kind), last.owner,
+				kind_name(e.kind), e.owner);
+			/* claims by the free blocks chain go away with it */
+			if (e.kind != KIND_CHAIN && e.kind != KIND_FREE &&
+			    last.kind != KIND_CHAIN && last.kind != KIND_FREE)
+				ctx->unfixed++;
+			continue;
+		}
+		if (e.block > next) {
+			verbose("blocks %"PRIu64" to %"PRIu64" lost", next,
+				e.block - 1);
+			lost += e.block - next;
+		}
+		next = e.block + 1;
+		last = e;
+	}
+	if (ret < 0)
+		show_error(_("error sorting edges: %s"), strerror(errno));
+	if (vol->blocks > next) {
+		verbose("blocks %"PRIu64" to %"PRIu64" lost", next,
+			vol->blocks - 1);
+		lost += vol->blocks - next;
+	}
+	if (lost)
+		problem(ctx, _("%"PRIu64" blocks lost"), lost);
+	return lost;
+}
+
+/**
+ * check_sb() - Checks superblock fields.
+ * @vol:			volume
+ * @ctx:			check context
+ */
+static void check_sb (struct lanyfs_vol *vol, struct fsck_ctx *ctx)
+{
+	struct lanyfs_sb *sb = &vol->sb->sb;
+	if (sb->major != LANYFS_MAJOR_VERSION)
+		problem(ctx, _("superblock: unknown version %u.%u"),
+			sb->major, sb->minor);
+	if (vol->blocks < 2 || vol->blocks > vol->dev->size >> vol->blocksize)
+		problem(ctx, _("superblock: %"PRIu64" blocks exceed device"),
+			vol->blocks);
+	if (fromle64(sb->freeblocks) + fromle64(sb->zoneblocks) >= vol->blocks)
+		problem(ctx, _("superblock: too many free blocks"));
+	if (fromle64(sb->zoneend) > vol->blocks)
+		problem(ctx, _("superblock: metadata zone ends at %"PRIu64
+			", behind last block"), fromle64(sb->zoneend));
+}
+
+/**
+ * rebuild_chain() - Replaces one free blocks chain.
+ * @vol:			volume, writable
+ * @ctx:			check context, with all blocks in use recorded
+ * @start:			first block covered by the chain
+ * @end:			first block after those covered
+ * @zone:			metadata zone's chain rather than main chain
+ *
+ * The lowest free blocks become chain blocks, on a freshly formatted or
+ * lightly used volume they form a single run written in large batches.
+ * Returns the number of free blocks.
+ */
+static uint64_t rebuild_chain (struct lanyfs_vol *vol, struct fsck_ctx *ctx,
+			       uint64_t start, uint64_t end, int zone)
+{
+	struct lanyfs_chainenc *enc;
+	uint64_t *chains, nfree = 0, nchains, addr, i;
+
+	addr = start - 1;
+	while ((addr = lanyfs_cmap_next_clear(ctx->reach, addr + 1)) < end)
+		nfree++;
+	nchains = lanyfs_chain_blocks(vol, nfree);
+	verbose("encoding %"PRIu64" free blocks into %"PRIu64" chain blocks",
+		nfree, nchains);
+	if (!nchains && zone) {
+		vol->sb->sb.zonehead = 0;
+		vol->sb->sb.zonetail = 0;
+		vol->sb->sb.zoneblocks = 0;
+		return 0;
+	}
+	if (!nchains) {
+		vol->sb->sb.freehead = 0;
+		vol->sb->sb.freetail = 0;
+		vol->sb->sb.freeblocks = 0;
+		return 0;
+	}
+	chains = malloc(nchains * sizeof(*chains));
+	if (!chains)
+		show_error(_("out of memory"));
+	addr = start - 1;
+	for (i = 0; i < nchains; i++)
+		chains[i] = addr = lanyfs_cmap_next_clear(ctx->reach, addr + 1);
+	enc = zone ? lanyfs_zone_begin(vol, chains, nchains) :
+		     lanyfs_chain_begin(vol, chains, nchains);
+	if (!enc)
+		show_error(_("error writing free blocks chain: %s"),
+			   strerror(errno));
+	while ((addr = lanyfs_cmap_next_clear(ctx->reach, addr + 1)) < end) {
+		if (lanyfs_chain_add(enc, addr))
+			show_error(_("error writing free blocks chain: %s"),
+				   strerror(errno));
+	}
+	if (lanyfs_chain_end(enc))
+		show_error(_("error writing free blocks chain: %s"),
+			   strerror(errno));
+	free(chains);
+	return nfree;
+}
+
+/**
+ * rebuild_free() - Replaces the free blocks chains.
+ * @vol:			volume, writable
+ * @ctx:			check context, with all blocks in use recorded
+ *
+ * Free blocks inside the metadata zone go to the zone's chain, the others
+ * to the main chain. Returns the number of free blocks.
+ */
+static uint64_t rebuild_free (struct lanyfs_vol *vol, struct fsck_ctx *ctx)
+{
+	uint64_t zoneend = fromle64(vol->sb->sb.zoneend), nfree = 0;
+
+	if (zoneend)
+		nfree = rebuild_chain(vol, ctx, LANYFS_SUPERBLOCK + 1, zoneend,
+				      1);
+	nfree += rebuild_chain(vol, ctx, zoneend ? zoneend :
+			       LANYFS_SUPERBLOCK + 1, vol->blocks, 0);
+	if (lanyfs_write_sb(vol) || lanyfs_dev_sync(vol->dev))
+		show_error(_("error writing superblock: %s"), strerror(errno));
+	return nfree;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	struct fsck_ctx ctx;
+	char *dev_name, *tmpdir = NULL;
+	uint64_t nfree, lost, reach = 0;
+	size_t memcap = MEMCAP_DEFAULT;
+	int threads = lanyfs_default_threads(), passes, i, repair = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&ctx, 0, sizeof(ctx));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "j:m:rT:v")) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			break;
+		case 'm':
+			memcap = atol(optarg);
+			if (memcap < 1)
+				show_error(_("invalid memory cap"));
+			break;
+		case 'r':
+			repair = 1;
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 1 != argc)
+		show_usage();
+	dev_name = argv[optind];
+
+	/* open device */
+	vol = lanyfs_vol_open(dev_name, !repair);
+	if (!vol)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+	/* the reachable blocks of a repair count against the cap */
+	if (repair)
+		reach = lanyfs_cmap_bound(vol->blocks);
+	if (reach >= (uint64_t) memcap << 20)
+		show_error(_("memory cap too small to repair, need more than "
+			     "%"PRIu64" MiB"), reach >> 20);
+	ctx.sort = lanyfs_sort_open(tmpdir, sizeof(struct fsck_edge),
+				    edge_cmp, (memcap << 20) - reach);
+	ctx.bufs = calloc(threads, sizeof(*ctx.bufs));
+	ctx.visited = lanyfs_bitmap_open(tmpdir, vol->blocks);
+	if (repair)
+		ctx.reach = lanyfs_cmap_new(vol->blocks);
+	if (!ctx.sort || !ctx.bufs || !ctx.visited || (repair && !ctx.reach))
+		show_error(_("out of memory"));
+	for (i = 0; i < threads; i++)
+		ctx.bufs[i].ctx = &ctx;
+
+	printf(_("checking superblock\n"));
+	check_sb(vol, &ctx);
+	if (ctx.errors)
+		show_error(_("superblock damaged, try recover.lanyfs"));
+	printf(_("checking directory tree\n"));
+	check_tree(vol, &ctx, threads);
+	check_bad(vol, &ctx);
+	ctx.unfixed = ctx.errors;
+	printf(_("checking free blocks chain\n"));
+	nfree = check_free(vol, &ctx);
+	for (i = 0; i < threads; i++) {
+		if (lanyfs_sort_add(ctx.sort, ctx.bufs[i].e, ctx.bufs[i].n))
+			show_error(_("error sorting edges: %s"),
+				   strerror(errno));
+	}
+	free(ctx.bufs);
+	lanyfs_bitmap_close(ctx.visited, vol->blocks);
+
+	printf(_("checking block claims\n"));
+	if (lanyfs_sort_finish(ctx.sort, &passes))
+		show_error(_("error sorting edges: %s"), strerror(errno));
+	verbose("sorted %"PRIu64" edges in %d merge passes",
+		lanyfs_sort_count(ctx.sort), passes);
+	lost = check_claims(vol, &ctx);
+	lanyfs_sort_close(ctx.sort);
+
+	printf(_("%"PRIu64" directories and files, %"PRIu64" free blocks, "
+		 "%"PRIu64" lost blocks\n"), ctx.nodes, nfree, lost);
+	if (repair && ctx.errors && ctx.incomplete) {
+		printf(_("directory tree damaged, free blocks chain left as "
+			 "is\n"));
+		repair = 0;
+	}
+	if (repair && ctx.errors) {
+		/* the superblock is the only block in use not claimed */
+		if (lanyfs_cmap_set(ctx.reach, 0) < 0)
+			show_error(_("out of memory"));
+		printf(_("rebuilding free blocks chain\n"));
+		nfree = rebuild_free(vol, &ctx);
+		printf(_("%"PRIu64" free blocks\n"), nfree);
+	}
+	lanyfs_cmap_free(ctx.reach);
+	lanyfs_vol_close(vol);
+	if (repair && ctx.errors && !ctx.unfixed) {
+		printf(_("%"PRIu64" errors corrected\n"), ctx.errors);
+		return FSCK_CORRECTED;
+	}
+	if (ctx.errors) {
+		printf(_("%"PRIu64" errors found\n"), ctx.errors);
+		return FSCK_ERRORS;
+	}
+	printf(_("no errors found\n"));
+	return FSCK_OK;
+}
@@ -0,0 +1,1014 @@
+/*
+ * gen.c - Generate Synthetic Lanyard Filesystem Images.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Generating
+ *
+ * A shape spec describes the image: number of files, depth and fan-out of
+ * the directory tree, distribution of file sizes, fragmentation, shape of
+ * the binary trees and a seed. Specs are read from a file of "key = value"
+ * lines and from the command line.
+ *
+ * The directory tree is a complete tree of the given depth and fan-out,
+ * files are spread over all directories by a hash of their number. Every
+ * random choice is drawn from a sequence seeded by the spec's seed and the
+ * number of the file or directory it belongs to, so the same spec yields
+ * the same image, bit for bit, no matter how many threads write it.
+ *
+ * Generating takes two steps. Planning walks the directory tree once and
+ * assigns addresses to all blocks, leaving random gaps between data blocks
+ * of fragmented files. Writing then fills every block exactly once, the
+ * directories and files being handed out to all threads. The gaps and the
+ * space left at the end become the free blocks chain.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+#include <time.h>
+#include <math.h>
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "gen.lanyfs";
+const char *progdate = "December 2012";
+#define GEN_ROOTDIR		"LANYFSROOT"
+#define GEN_BATCH		64	/* nodes handed out at once */
+
+/* global variables */
+int v = 0;
+
+/**
+ * enum gen_dist - Distribution of file sizes.
+ * @DIST_FIXED:			all files of size min
+ * @DIST_UNIFORM:		uniform between min and max
+ * @DIST_EXP:			exponential of mean min, capped at max
+ * @DIST_PARETO:		pareto of scale min and shape alpha, capped at
+ * 				max
+ */
+enum gen_dist {
+	DIST_FIXED,
+	DIST_UNIFORM,
+	DIST_EXP,
+	DIST_PARETO,
+};
+
+/**
+ * struct gen_spec - Shape of the image.
+ * @blocksize:			blocksize (exponent to base 2)
+ * @addrlen:			length of block addresses in bytes
+ * @files:			number of files
+ * @depth:			depth of directory tree
+ * @fanout:			subdirectories per directory
+ * @dist:			enum gen_dist
+ * @min:			first parameter of size distribution
+ * @max:			largest file size
+ * @alpha:			shape of pareto distribution
+ * @frag:			chance of a gap after each data block
+ * @gap:			largest gap in blocks
+ * @btree:			LANYFS_BTREE_*
+ * @seed:			seed of all random choices
+ * @spare:			free blocks at the end of the image
+ * @time:			date of all directories and files, seconds since
+ * 				the epoch
+ * @label:			volume label
+ */
+struct gen_spec {
+	int			blocksize;
+	int			addrlen;
+	uint64_t		files;
+	int			depth;
+	int			fanout;
+	int			dist;
+	uint64_t		min;
+	uint64_t		max;
+	double			alpha;
+	double			frag;
+	uint64_t		gap;
+	int			btree;
+	uint64_t		seed;
+	uint64_t		spare;
+	time_t			time;
+	char			label[LANYFS_NAME_LENGTH];
+};
+
+/**
+ * struct gen_gap - Range of blocks left free.
+ * @start:			first block
+ * @n:				number of blocks
+ */
+struct gen_gap {
+	uint64_t		start;
+	uint64_t		n;
+};
+
+/**
+ * struct gen_plan - Addresses of all blocks.
+ * @spec:			shape
+ * @ndirs:			number of directories, root included
+ * @daddr:			address of each directory
+ * @dleft:			left pointer of each directory
+ * @dright:			right pointer of each directory
+ * @dsub:			subtree of each directory
+ * @fstart:			first entry of each directory in flist, ndirs + 1
+ * 				entries
+ * @flist:			files ordered by directory and number
+ * @fsize:			size of each file
+ * @faddr:			address of each file, its extenders follow
+ * @fleft:			left pointer of each file
+ * @fright:			right pointer of each file
+ * @gaps:			ranges left free, ascending
+ * @ngaps:			number of ranges
+ * @used:			first block after the last block in use
+ * @width:			digits of names
+ * @ts:				date of all directories and files
+ * @run:			data blocks written at once, the batch size of
+ * 				the device
+ */
+struct gen_plan {
+	struct gen_spec		*spec;
+	uint64_t		ndirs;
+	uint64_t		*daddr;
+	uint64_t		*dleft;
+	uint64_t		*dright;
+	uint64_t		*dsub;
+	uint64_t		*fstart;
+	uint64_t		*flist;
+	uint64_t		*fsize;
+	uint64_t		*faddr;
+	uint64_t		*fleft;
+	uint64_t		*fright;
+	struct gen_gap		*gaps;
+	size_t			ngaps;
+	uint64_t		used;
+	int			width;
+	struct lanyfs_ts	ts;
+	uint64_t		run;
+};
+
+/**
+ * struct gen_worker - Buffers of a pool worker writing the image.
+ * @plan:			plan
+ * @vol:			volume
+ * @b:				block buffer
+ * @run:			buffer of a run of data blocks
+ * @data:			data block addresses of current file
+ * @cap:			number of addresses allocated
+ */
+struct gen_worker {
+	struct gen_plan		*plan;
+	struct lanyfs_vol	*vol;
+	union lanyfs_b		*b;
+	unsigned char		*run;
+	uint64_t		*data;
+	uint64_t		cap;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * intlog2() - Simple logarithm check.
+ * @n:				value to check
+ */
+static int intlog2 (unsigned int n)
+{
+	int b = 0;
+	while (n) {
+		if (n & 1) {
+			if (n > 1)
+				return -1;
+			return b;
+		}
+		n >>= 1;
+		b++;
+	}
+	return -1;
+}
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-j threads] [-f spec file] "
+		  "[-s key=value]... image\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * spec_set() - Sets one key of a spec.
+ * @spec:			spec
+ * @key:			key
+ * @val:			value
+ */
+static void spec_set (struct gen_spec *spec, const char *key, const char *val)
+{
+	char dist[16];
+	int n;
+
+	if (!strcmp(key, "blocksize")) {
+		spec->blocksize = intlog2(atoi(val));
+		if (spec->blocksize < LANYFS_MIN_BLOCKSIZE ||
+		    spec->blocksize > LANYFS_MAX_BLOCKSIZE)
+			show_error(_("invalid blocksize"));
+	} else if (!strcmp(key, "addrlen")) {
+		spec->addrlen = atoi(val);
+		if (spec->addrlen < LANYFS_MIN_ADDRLEN ||
+		    spec->addrlen > LANYFS_MAX_ADDRLEN)
+			show_error(_("invalid address length"));
+	} else if (!strcmp(key, "files")) {
+		spec->files = strtoull(val, NULL, 0);
+	} else if (!strcmp(key, "depth")) {
+		spec->depth = atoi(val);
+	} else if (!strcmp(key, "fanout")) {
+		spec->fanout = atoi(val);
+	} else if (!strcmp(key, "size")) {
+		n = sscanf(val, "%15s %"SCNu64, dist, &spec->min);
+		if (n == 2 && !strcmp(dist, "fixed")) {
+			spec->dist = DIST_FIXED;
+			spec->max = spec->min;
+		} else if (n == 2 && !strcmp(dist, "uniform") &&
+			   sscanf(val, "%*s %*u %"SCNu64, &spec->max) == 1) {
+			spec->dist = DIST_UNIFORM;
+		} else if (n == 2 && !strcmp(dist, "exp")) {
+			spec->dist = DIST_EXP;
+			if (sscanf(val, "%*s %*u %"SCNu64, &spec->max) != 1)
+				spec->max = spec->min * 64;
+		} else if (n == 2 && !strcmp(dist, "pareto") &&
+			   sscanf(val, "%*s %*u %lf", &spec->alpha) == 1) {
+			spec->dist = DIST_PARETO;
+			if (sscanf(val, "%*s %*u %*f %"SCNu64,
+				   &spec->max) != 1)
+				spec->max = spec->min * 1024;
+		} else {
+			show_error(_("invalid size distribution: %s"), val);
+		}
+		if (spec->max < spec->min || spec->alpha < 0)
+			show_error(_("invalid size distribution: %s"), val);
+	} else if (!strcmp(key, "frag")) {
+		spec->frag = atof(val);
+		if (spec->frag < 0 || spec->frag > 1)
+			show_error(_("invalid fragmentation"));
+	} else if (!strcmp(key, "gap")) {
+		spec->gap = strtoull(val, NULL, 0);
+		if (!spec->gap)
+			show_error(_("invalid gap"));
+	} else if (!strcmp(key, "btree")) {
+		if (!strcmp(val, "balanced"))
+			spec->btree = LANYFS_BTREE_BALANCED;
+		else if (!strcmp(val, "linear"))
+			spec->btree = LANYFS_BTREE_LINEAR;
+		else if (!strcmp(val, "random"))
+			spec->btree = LANYFS_BTREE_RANDOM;
+		else
+			show_error(_("invalid binary tree shape: %s"), val);
+	} else if (!strcmp(key, "seed")) {
+		spec->seed = strtoull(val, NULL, 0);
+	} else if (!strcmp(key, "spare")) {
+		spec->spare = strtoull(val, NULL, 0);
+	} else if (!strcmp(key, "time")) {
+		spec->time = (time_t) strtoll(val, NULL, 0);
+	} else if (!strcmp(key, "label")) {
+		strncpy(spec->label, val, LANYFS_NAME_LENGTH - 1);
+	} else {
+		show_error(_("unknown key: %s"), key);
+	}
+}
+
+/**
+ * spec_line() - Parses a "key = value" line of a spec.
+ * @spec:			spec
+ * @line:			line, modified
+ *
+ * Empty lines and comments starting with '#' are skipped.
+ */
+static void spec_line (struct gen_spec *spec, char *line)
+{
+	char *key, *val, *end;
+
+	end = strchr(line, '#');
+	if (end)
+		*end = '\0';
+	key = line + strspn(line, " \t\r\n");
+	if (!*key)
+		return;
+	val = strchr(key, '=');
+	if (!val)
+		show_error(_("invalid spec line: %s"), key);
+	*val++ = '\0';
+	for (end = val - 2; end >= key && strchr(" \t", *end); end--)
+		*end = '\0';
+	val += strspn(val, " \t");
+	for (end = val + strlen(val) - 1; end >= val && strchr(" \t\r\n", *end);
+	     end--)
+		*end = '\0';
+	spec_set(spec, key, val);
+}
+
+/**
+ * spec_file() - Reads a spec file.
+ * @spec:			spec
+ * @path:			path of spec file
+ */
+static void spec_file (struct gen_spec *spec, const char *path)
+{
+	char line[1024];
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		show_error(_("error opening spec %s: %s"), path,
+			   strerror(errno));
+	while (fgets(line, sizeof(line), fp))
+		spec_line(spec, line);
+	fclose(fp);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * node_rand() - Starts the random sequence of a file or directory.
+ * @spec:			spec
+ * @n:				number of file or directory
+ * @stream:			which of its sequences
+ */
+static uint64_t node_rand (struct gen_spec *spec, uint64_t n, int stream)
+{
+	uint64_t state = spec->seed ^ ((n << 2 | stream) *
+				       0xd1b54a32d192ed03ULL);
+	lanyfs_rand(&state);
+	return state;
+}
+
+/**
+ * unit() - Draws a number from [0, 1).
+ * @state:			random sequence
+ */
+static double unit (uint64_t *state)
+{
+	return (lanyfs_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * file_size() - Draws the size of a file.
+ * @spec:			spec
+ * @n:				number of file
+ */
+static uint64_t file_size (struct gen_spec *spec, uint64_t n)
+{
+	uint64_t state = node_rand(spec, n, 0);
+	double size;
+
+	switch (spec->dist) {
+	case DIST_UNIFORM:
+		return spec->min + lanyfs_rand(&state) %
+				   (spec->max - spec->min + 1);
+	case DIST_EXP:
+		size = -log(1.0 - unit(&state)) * spec->min;
+		break;
+	case DIST_PARETO:
+		size = spec->min / pow(1.0 - unit(&state), 1.0 / spec->alpha);
+		break;
+	default:
+		return spec->min;
+	}
+	return size < spec->max ? (uint64_t) size : spec->max;
+}
+
+/**
+ * place_data() - Places the data blocks of a file.
+ * @plan:			plan
+ * @n:				number of file
+ * @cur:			first block to place at
+ * @nblocks:			number of data blocks
+ * @data:			addresses placed, may be NULL
+ * @gaps:			gaps left are recorded if true
+ *
+ * Planning and writing call this alike, the gaps drawn are the same.
+ * Returns the first block after the last data block.
+ */
+static uint64_t place_data (struct gen_plan *plan, uint64_t n, uint64_t cur,
+			    uint64_t nblocks, uint64_t *data, int gaps)
+{
+	struct gen_spec *spec = plan->spec;
+	struct gen_gap *g;
+	uint64_t state = node_rand(spec, n, 1), len, i;
+
+	for (i = 0; i < nblocks; i++) {
+		if (i && spec->frag > 0 && unit(&state) < spec->frag) {
+			len = 1 + lanyfs_rand(&state) % spec->gap;
+			if (gaps) {
+				if (!(plan->ngaps & (plan->ngaps + 1))) {
+					g = realloc(plan->gaps,
+						    (plan->ngaps + 1) * 2 *
+						    sizeof(*g));
+					if (!g)
+						show_error(_("out of memory"));
+					plan->gaps = g;
+				}
+				plan->gaps[plan->ngaps].start = cur;
+				plan->gaps[plan->ngaps++].n = len;
+			}
+			cur += len;
+		}
+		if (data)
+			data[i] = cur;
+		cur++;
+	}
+	return cur;
+}
+
+/**
+ * plan_alloc() - Allocates zeroed plan arrays.
+ * @n:				number of entries
+ */
+static uint64_t *plan_alloc (uint64_t n)
+{
+	uint64_t *a = calloc(n ? n : 1, sizeof(*a));
+	if (!a)
+		show_error(_("out of memory"));
+	return a;
+}
+
+/**
+ * plan_btrees() - Links the contents of every directory.
+ * @plan:			plan with addresses assigned
+ */
+static void plan_btrees (struct gen_plan *plan)
+{
+	struct gen_spec *spec = plan->spec;
+	uint64_t *addrs, *left, *right, d, c, i, n, sub, max = 0;
+
+	for (d = 0; d < plan->ndirs; d++) {
+		n = plan->fstart[d + 1] - plan->fstart[d] + spec->fanout;
+		max = n > max ? n : max;
+	}
+	addrs = plan_alloc(max);
+	left = plan_alloc(max);
+	right = plan_alloc(max);
+	for (d = 0; d < plan->ndirs; d++) {
+		/* subdirectories are named d..., files f..., so both sorted */
+		n = 0;
+		for (c = d * spec->fanout + 1; c <= d * spec->fanout +
+		     spec->fanout && c < plan->ndirs; c++)
+			addrs[n++] = plan->daddr[c];
+		sub = n;
+		for (i = plan->fstart[d]; i < plan->fstart[d + 1]; i++)
+			addrs[n++] = plan->faddr[plan->flist[i]];
+		if (lanyfs_btree_build(addrs, n, spec->btree,
+				       node_rand(spec, d, 2), left, right,
+				       &plan->dsub[d]))
+			show_error(_("out of memory"));
+		for (i = 0; i < n; i++) {
+			if (i < sub) {
+				c = d * spec->fanout + 1 + i;
+				plan->dleft[c] = left[i];
+				plan->dright[c] = right[i];
+			} else {
+				c = plan->flist[plan->fstart[d] + i - sub];
+				plan->fleft[c] = left[i];
+				plan->fright[c] = right[i];
+			}
+		}
+	}
+	free(addrs);
+	free(left);
+	free(right);
+}
+
+/**
+ * plan_image() - Assigns addresses to all blocks.
+ * @plan:			plan, spec set
+ * @vol:			volume of the image's geometry, for slot counts
+ */
+static void plan_image (struct gen_plan *plan, struct lanyfs_vol *vol)
+{
+	struct gen_spec *spec = plan->spec;
+	struct lanyfs_addrvec stack = {NULL, 0, 0};
+	uint64_t level, f, d, i, nblocks, cur, max, *fdir;
+
+	/* complete tree: children of directory d are d * fanout + 1... */
+	plan->ndirs = 1;
+	for (level = 1, i = 1; spec->fanout && level <= spec->depth;
+	     level++) {
+		i *= spec->fanout;
+		plan->ndirs += i;
+		if (plan->ndirs > (1ULL << 32))
+			show_error(_("too many directories"));
+	}
+	plan->daddr = plan_alloc(plan->ndirs);
+	plan->dleft = plan_alloc(plan->ndirs);
+	plan->dright = plan_alloc(plan->ndirs);
+	plan->dsub = plan_alloc(plan->ndirs);
+	plan->fstart = plan_alloc(plan->ndirs + 1);
+	plan->flist = plan_alloc(spec->files);
+	plan->fsize = plan_alloc(spec->files);
+	plan->faddr = plan_alloc(spec->files);
+	plan->fleft = plan_alloc(spec->files);
+	plan->fright = plan_alloc(spec->files);
+
+	/* spread files over directories, counting sort keeps them ordered */
+	fdir = plan->fleft;
+	for (f = 0; f < spec->files; f++) {
+		i = node_rand(spec, f, 3);
+		fdir[f] = lanyfs_rand(&i) % plan->ndirs;
+		plan->fstart[fdir[f] + 1]++;
+		plan->fsize[f] = file_size(spec, f);
+	}
+	for (d = 0; d < plan->ndirs; d++)
+		plan->fstart[d + 1] += plan->fstart[d];
+	memcpy(plan->dsub, plan->fstart, plan->ndirs * sizeof(uint64_t));
+	for (f = 0; f < spec->files; f++)
+		plan->flist[plan->dsub[fdir[f]]++] = f;
+
+	/* depth-first, every directory followed by its files */
+	cur = LANYFS_SUPERBLOCK + 1;
+	if (lanyfs_addrvec_push(&stack, 0))
+		show_error(_("out of memory"));
+	while (stack.n) {
+		d = stack.a[--stack.n];
+		plan->daddr[d] = cur++;
+		for (i = plan->fstart[d]; i < plan->fstart[d + 1]; i++) {
+			f = plan->flist[i];
+			nblocks = (plan->fsize[f] + vol->bsize - 1) >>
+				  vol->blocksize;
+			plan->faddr[f] = cur++;
+			cur += lanyfs_ext_count(vol, nblocks);
+			cur = place_data(plan, f, cur, nblocks, NULL, 1);
+		}
+		max = d * spec->fanout + spec->fanout;
+		for (i = max; spec->fanout && i > d * spec->fanout; i--) {
+			if (i < plan->ndirs && lanyfs_addrvec_push(&stack, i))
+				show_error(_("out of memory"));
+		}
+	}
+	lanyfs_addrvec_free(&stack);
+	plan->used = cur;
+	plan_btrees(plan);
+
+	for (i = plan->ndirs > spec->files ? plan->ndirs : spec->files,
+	     plan->width = 1; i >= 10; i /= 10)
+		plan->width++;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * fill_data() - Fills a data block with its generated content.
+ * @plan:			plan
+ * @buf:			block buffer
+ * @bsize:			blocksize in bytes
+ * @f:				number of file
+ * @iblock:			index of block within file
+ *
+ * Bytes beyond the end of the file are zero.
+ */
+static void fill_data (struct gen_plan *plan, unsigned char *buf, size_t bsize,
+		       uint64_t f, uint64_t iblock)
+{
+	uint64_t state = node_rand(plan->spec, f, 3) ^ (iblock *
+			 0x9e3779b97f4a7c15ULL), r, end;
+	size_t i;
+
+	for (i = 0; i < bsize; i += 8) {
+		r = tole64(lanyfs_rand(&state));
+		memcpy(buf + i, &r, 8);
+	}
+	end = plan->fsize[f] - iblock * bsize;
+	if (end < bsize)
+		memset(buf + end, 0, bsize - end);
+}
+
+/**
+ * write_block() - Writes a block planned at an address.
+ * @vol:			volume
+ * @addr:			address
+ * @b:				block
+ */
+static int write_block (struct lanyfs_vol *vol, uint64_t addr, const void *b)
+{
+	return lanyfs_dev_pwrite(vol->dev, b, vol->bsize,
+				 addr << vol->blocksize);
+}
+
+/**
+ * write_file() - Writes a file, its extenders and its data.
+ * @plan:			plan
+ * @vol:			volume
+ * @f:				number of file
+ * @b:				block buffer
+ * @run:			buffer of plan->run blocks
+ * @data:			address buffer, grown as needed
+ * @cap:			capacity of address buffer
+ */
+static int write_file (struct gen_plan *plan, struct lanyfs_vol *vol,
+		       uint64_t f, union lanyfs_b *b, unsigned char *run,
+		       uint64_t **data, uint64_t *cap)
+{
+	uint64_t nblocks, next, *ext, *grown, root, i, j, n;
+	char name[LANYFS_NAME_LENGTH];
+
+	nblocks = (plan->fsize[f] + vol->bsize - 1) >> vol->blocksize;
+	n = lanyfs_ext_count(vol, nblocks);
+	if (nblocks + n > *cap) {
+		grown = realloc(*data, (nblocks + n) * sizeof(**data));
+		if (!grown)
+			return -1;
+		*data = grown;
+		*cap = nblocks + n;
+	}
+	ext = *data + nblocks;
+	for (i = 0; i < n; i++)
+		ext[i] = plan->faddr[f] + 1 + i;
+	place_data(plan, f, plan->faddr[f] + 1 + n, nblocks, *data, 0);
+	if (lanyfs_ext_build(vol, *data, nblocks, ext, &root))
+		return -1;
+
+	snprintf(name, sizeof(name), "f%0*"PRIu64, plan->width, f);
+	lanyfs_node_init(vol, b, LANYFS_TYPE_FILE, name, plan->ts);
+	b->file.btree.left = tole64(plan->fleft[f]);
+	b->file.btree.right = tole64(plan->fright[f]);
+	b->file.data = tole64(root);
+	b->file.size = tole64(plan->fsize[f]);
+	if (write_block(vol, plan->faddr[f], b))
+		return -1;
+
+	/* consecutive data blocks go out together */
+	for (i = 0; i < nblocks; i = next) {
+		for (next = i; next < nblocks && next - i < plan->run &&
+		     (*data)[next] == (*data)[i] + (next - i); next++)
+			fill_data(plan, run + (next - i) * vol->bsize,
+				  vol->bsize, f, next);
+		j = next - i;
+		if (lanyfs_dev_pwrite(vol->dev, run, j * vol->bsize,
+				      (*data)[i] << vol->blocksize))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * write_dir() - Writes a directory block.
+ * @plan:			plan
+ * @vol:			volume
+ * @d:				number of directory
+ * @b:				block buffer
+ */
+static int write_dir (struct gen_plan *plan, struct lanyfs_vol *vol,
+		      uint64_t d, union lanyfs_b *b)
+{
+	char name[LANYFS_NAME_LENGTH];
+
+	if (d)
+		snprintf(name, sizeof(name), "d%0*"PRIu64, plan->width, d);
+	else
+		strcpy(name, GEN_ROOTDIR);
+	lanyfs_node_init(vol, b, LANYFS_TYPE_DIR, name, plan->ts);
+	b->dir.btree.left = tole64(plan->dleft[d]);
+	b->dir.btree.right = tole64(plan->dright[d]);
+	b->dir.subtree = tole64(plan->dsub[d]);
+	return write_block(vol, plan->daddr[d], b);
+}
+
+/**
+ * write_batch() - Pool task writing a batch of directories and files.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			array of struct gen_worker, one per worker
+ * @first:			first node of batch, directories come first
+ */
+static int write_batch (struct lanyfs_pool *pool, int worker, void *arg,
+			uint64_t first)
+{
+	struct gen_worker *w = (struct gen_worker *) arg + worker;
+	struct gen_plan *plan = w->plan;
+	uint64_t total = plan->ndirs + plan->spec->files, n;
+
+	for (n = first; n < first + GEN_BATCH && n < total; n++) {
+		if (n < plan->ndirs ?
+		    write_dir(plan, w->vol, n, w->b) :
+		    write_file(plan, w->vol, n - plan->ndirs, w->b, w->run,
+			       &w->data, &w->cap))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * next_free() - Returns the next block left free.
+ * @plan:			plan
+ * @vol:			volume
+ * @g:				gap being walked, 0 to start
+ * @i:				offset within gap, 0 to start
+ *
+ * Gaps come first, then the blocks after the last block in use. Returns 0
+ * if there are no more free blocks.
+ */
+static uint64_t next_free (struct gen_plan *plan, struct lanyfs_vol *vol,
+			   size_t *g, uint64_t *i)
+{
+	uint64_t addr;
+
+	if (*g < plan->ngaps) {
+		addr = plan->gaps[*g].start + (*i)++;
+		if (*i == plan->gaps[*g].n) {
+			(*g)++;
+			*i = 0;
+		}
+		return addr;
+	}
+	addr = plan->used + (*i)++;
+	return addr < vol->blocks ? addr : 0;
+}
+
+/**
+ * write_free() - Writes the free blocks chain.
+ * @plan:			plan
+ * @vol:			volume
+ *
+ * The lowest free blocks hold the chain, the rest fill its slots. Returns
+ * the number of free blocks.
+ */
+static uint64_t write_free (struct gen_plan *plan, struct lanyfs_vol *vol)
+{
+	struct lanyfs_chainenc *enc;
+	uint64_t nfree = vol->blocks - plan->used, m, k, i = 0, addr;
+	uint64_t *chains;
+	size_t g = 0;
+
+	for (k = 0; k < plan->ngaps; k++)
+		nfree += plan->gaps[k].n;
+	m = lanyfs_chain_blocks(vol, nfree);
+	if (!m)
+		return 0;
+	chains = malloc(m * sizeof(*chains));
+	if (!chains)
+		show_error(_("out of memory"));
+	for (k = 0; k < m; k++)
+		chains[k] = next_free(plan, vol, &g, &i);
+	enc = lanyfs_chain_begin(vol, chains, m);
+	if (!enc)
+		show_error(_("error writing free blocks chain: %s"),
+			   strerror(errno));
+	while ((addr = next_free(plan, vol, &g, &i))) {
+		if (lanyfs_chain_add(enc, addr))
+			show_error(_("error writing free blocks chain: %s"),
+				   strerror(errno));
+	}
+	if (lanyfs_chain_end(enc))
+		show_error(_("error writing free blocks chain: %s"),
+			   strerror(errno));
+	free(chains);
+	return nfree;
+}
+
+/**
+ * make_ts() - Converts seconds since the epoch to a LanyFS timestamp.
+ * @t:				seconds since the epoch, in UTC
+ */
+static struct lanyfs_ts make_ts (time_t t)
+{
+	struct lanyfs_ts ts;
+	struct tm tm;
+
+	memset(&ts, 0, sizeof(ts));
+	gmtime_r(&t, &tm);
+	ts.year = tole16(tm.tm_year + 1900);
+	ts.mon = tm.tm_mon + 1;
+	ts.day = tm.tm_mday;
+	ts.hour = tm.tm_hour;
+	ts.min = tm.tm_min;
+	ts.sec = tm.tm_sec;
+	return ts;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct gen_spec spec;
+	struct gen_plan plan;
+	struct gen_worker *workers;
+	struct lanyfs_vol *vol, *geo;
+	struct lanyfs_pool *pool;
+	char *path, *val;
+	uint64_t nfree, total, first;
+	int threads = lanyfs_default_threads(), jset = 0, i, n;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&spec, 0, sizeof(spec));
+	memset(&plan, 0, sizeof(plan));
+	spec.blocksize = 12;
+	spec.addrlen = 4;
+	spec.files = 1000;
+	spec.depth = 2;
+	spec.fanout = 4;
+	spec.dist = DIST_UNIFORM;
+	spec.max = 65536;
+	spec.gap = 16;
+	spec.seed = 1;
+	spec.spare = 1024;
+	spec.time = 1354320000;		/* 2012-12-01 */
+	strcpy(spec.label, "LanyFS Synthetic");
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "f:j:s:v")) != -1) {
+		switch (c) {
+		case 'f':
+			spec_file(&spec, optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			jset = 1;
+			break;
+		case 's':
+			val = strchr(optarg, '=');
+			if (!val)
+				show_usage();
+			*val++ = '\0';
+			spec_set(&spec, optarg, val);
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 1 != argc)
+		show_usage();
+	path = argv[optind];
+
+	/* plan on a volume of the right geometry but no device */
+	geo = calloc(1, sizeof(*geo));
+	if (!geo)
+		show_error(_("out of memory"));
+	geo->blocksize = spec.blocksize;
+	geo->bsize = (size_t) 1 << spec.blocksize;
+	geo->addrlen = spec.addrlen;
+	plan.spec = &spec;
+	plan.ts = make_ts(spec.time);
+	printf(_("planning %"PRIu64" files\n"), spec.files);
+	plan_image(&plan, geo);
+	free(geo);
+	verbose("%"PRIu64" directories, %"PRIu64" blocks in use, %zu gaps",
+		plan.ndirs, plan.used, plan.ngaps);
+
+	vol = lanyfs_vol_create(path, spec.blocksize, spec.addrlen,
+				plan.used + spec.spare);
+	if (!vol)
+		show_error(_("error creating image %s: %s"), path,
+			   strerror(errno));
+	plan.run = lanyfs_dev_batch(vol->dev) >> vol->blocksize;
+	if (!plan.run)
+		plan.run = 1;
+	if (!jset)
+		threads = lanyfs_dev_threads(vol->dev, threads);
+	verbose("%"PRIu64" blocks per write", plan.run);
+	printf(_("writing %"PRIu64" blocks with %d threads\n"), vol->blocks,
+	       threads);
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		show_error(_("error starting threads: %s"), strerror(errno));
+	n = lanyfs_pool_threads(pool);
+	workers = calloc(n, sizeof(*workers));
+	if (!workers)
+		show_error(_("out of memory"));
+	for (i = 0; i < n; i++) {
+		workers[i].plan = &plan;
+		workers[i].vol = vol;
+		workers[i].b = lanyfs_alloc_block(vol);
+		/* aligned, runs may go out bypassing the page cache */
+		if (posix_memalign((void **) &workers[i].run, 4096,
+				   plan.run * vol->bsize))
+			workers[i].run = NULL;
+		if (!workers[i].b || !workers[i].run)
+			show_error(_("out of memory"));
+	}
+	total = plan.ndirs + spec.files;
+	for (first = 0; first < total; first += GEN_BATCH)
+		if (lanyfs_pool_submit(pool, write_batch, workers, first))
+			break;
+	if (first < total || lanyfs_pool_wait(pool))
+		show_error(_("error writing image: %s"), strerror(errno));
+	lanyfs_pool_free(pool);
+	for (i = 0; i < n; i++) {
+		free(workers[i].b);
+		free(workers[i].run);
+		free(workers[i].data);
+	}
+	nfree = write_free(&plan, vol);
+
+	/* dates come from the spec, not the clock, like everything else */
+	vol->sb->sb.rootdir = tole64(plan.daddr[0]);
+	vol->sb->sb.created = vol->sb->sb.updated = plan.ts;
+	vol->sb->sb.wrcnt = tole16(1);
+	strncpy(vol->sb->sb.label, spec.label, LANYFS_NAME_LENGTH);
+	if (lanyfs_dev_pwrite(vol->dev, vol->sb, vol->bsize, 0) ||
+	    lanyfs_dev_sync(vol->dev))
+		show_error(_("error writing superblock: %s"), strerror(errno));
+	printf(_("%"PRIu64" directories, %"PRIu64" files, %"PRIu64" free "
+		 "blocks\n"), plan.ndirs, spec.files, nfree);
+	if (lanyfs_vol_close(vol))
+		show_error(_("error closing image: %s"), strerror(errno));
+	free(workers);
+	return EXIT_SUCCESS;
+}
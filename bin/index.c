@@ -0,0 +1,238 @@
+/*
+ * index.c - Build and Query Reverse Pointer Indexes of Lanyard Filesystems.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "index.lanyfs";
+const char *progdate = "December 2012";
+#define MEMCAP_DEFAULT		256	/* memory cap in MiB */
+
+/* global variables */
+int v = 0;
+
+/* names of pointer fields, indexed by enum lanyfs_field */
+static const char *field_names[] = {
+	"subtree", "left", "right", "data", "next", "slot", "rootdir",
+	"freehead", "freetail", "badblocks", "zonehead", "zonetail",
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-j threads] [-m memory] [-T tmpdir] "
+		  "device index\n"
+		  "       %s -q block device index\n"),
+		progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/**
+ * query() - Prints all referrers of a block.
+ * @vol:			volume
+ * @path:			path of index file
+ * @target:			block to look up
+ *
+ * Records of a stale index are verified against the volume one by one.
+ */
+static void query (struct lanyfs_vol *vol, const char *path, uint64_t target)
+{
+	struct lanyfs_index *idx;
+	const struct lanyfs_ref *refs;
+	unsigned int field;
+	size_t n, i;
+	int ok = 1;
+
+	idx = lanyfs_index_open(vol, path, 0);
+	if (!idx)
+		show_error(_("error opening index %s: %s"), path,
+			   strerror(errno));
+	if (lanyfs_index_stale(idx))
+		printf(_("index is stale, verifying records\n"));
+	n = lanyfs_index_find(idx, target, &refs);
+	printf(_("block %"PRIu64": %zu referrers\n"), target, n);
+	for (i = 0; i < n; i++) {
+		if (lanyfs_index_stale(idx)) {
+			ok = lanyfs_index_verify(vol, &refs[i]);
+			if (ok < 0)
+				show_error(_("read error at block %"PRIu64),
+					   fromle64(refs[i].referrer));
+		}
+		field = fromle16(refs[i].field);
+		printf("  %"PRIu64" %s", fromle64(refs[i].referrer),
+		       field < sizeof(field_names) / sizeof(*field_names) ?
+		       field_names[field] : "?");
+		if (field == LANYFS_FIELD_SLOT)
+			printf("[%"PRIu32"]", fromle32(refs[i].slot));
+		printf("%s\n", ok ? "" : _(" (changed)"));
+	}
+	lanyfs_index_close(idx);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	char *dev_name, *path, *tmpdir = NULL, *end;
+	uint64_t target = 0, count;
+	size_t memcap = MEMCAP_DEFAULT;
+	int threads = lanyfs_default_threads();
+	int lookup = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "j:m:q:T:v")) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			break;
+		case 'm':
+			memcap = atol(optarg);
+			if (memcap < 1)
+				show_error(_("invalid memory cap"));
+			break;
+		case 'q':
+			target = strtoull(optarg, &end, 0);
+			if (*end || !target)
+				show_error(_("invalid block %s"), optarg);
+			lookup = 1;
+			break;
+		case 'T':
+			tmpdir = optarg;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 != argc)
+		show_usage();
+	dev_name = argv[optind];
+	path = argv[optind + 1];
+
+	/* open device */
+	vol = lanyfs_vol_open(dev_name, 1);
+	if (!vol)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+	if (lookup) {
+		query(vol, path, target);
+	} else {
+		printf(_("indexing %s\n"), dev_name);
+		if (lanyfs_index_build(vol, path, threads, tmpdir,
+				       memcap << 20, &count))
+			show_error(_("error building index %s: %s"), path,
+				   strerror(errno));
+		verbose("%"PRIu64" pointers to %"PRIu64" blocks", count,
+			vol->blocks);
+		printf(_("wrote %"PRIu64" records to %s\n"), count, path);
+	}
+	lanyfs_vol_close(vol);
+	return EXIT_SUCCESS;
+}
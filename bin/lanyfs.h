@@ -71,6 +71,7 @@
 #define LANYFS_ATTR_NOEXEC	(1<<1)
 #define LANYFS_ATTR_HIDDEN	(1<<2)
 #define LANYFS_ATTR_ARCHIVE	(1<<3)
+#define LANYFS_ATTR_COMPRESSED	(1<<4)	/* data stored in compressed chunks */
 
 
 /**
@@ -140,6 +141,16 @@ struct lanyfs_raw {
  * @badblocks:			start of bad blocks chain
  * @__reserved_5:		reserved
  * @label:			optional label for the filesystem
+ * @zonehead:			start of metadata zone's free blocks chain
+ * @zonetail:			end of metadata zone's free blocks chain
+ * @zoneblocks:			number of free blocks in metadata zone
+ * @zoneend:			first block after metadata zone, 0 if none
+ *
+ * The metadata zone spans the blocks from the superblock up to @zoneend and
+ * has a free blocks chain of its own, which directory, file, extender and
+ * chain blocks are taken from first. Its fields live in what used to be
+ * reserved space after @label, so volumes formatted without a zone read
+ * zeros there.
  */
 struct lanyfs_sb {
 	unsigned char		type;
@@ -165,6 +176,10 @@ struct lanyfs_sb {
 	uint64_t		badblocks;
 	unsigned char		__reserved_5[8];
 	char			label[LANYFS_NAME_LENGTH];
+	uint64_t		zonehead;
+	uint64_t		zonetail;
+	uint64_t		zoneblocks;
+	uint64_t		zoneend;
 };
 
 /**
@@ -260,6 +275,9 @@ struct lanyfs_dir {
  * @btree:			binary tree components
  * @data:			address of extender for data blocks
   * @size:			size of file in bytes
+ * @stored:			length of data stream in bytes if compressed
+ * @codec:			codec of chunks if compressed
+ * @chunk:			size of chunks if compressed (exponent to base 2)
  * @__reserved_2:		reserved
  * @meta:			file metadata
  */
@@ -271,7 +289,10 @@ struct lanyfs_file {
 	struct lanyfs_btree	btree;
 	uint64_t		data;
 	uint64_t		size;
-	unsigned char		__reserved_2[16];
+	uint64_t		stored;
+	uint8_t			codec;
+	uint8_t			chunk;
+	unsigned char		__reserved_2[6];
 	struct lanyfs_meta	meta;
 };
 
@@ -300,6 +321,11 @@ struct lanyfs_chain {
  * @wrcnt:			write counter
  * @level:			depth of indirection
  * @stream:			start of block address stream
+ *
+ * A zero address in the stream is a hole: every block of the file it would
+ * cover lies within the file's size but is not stored and reads as zeros.
+ * Holes may also be left at the end, so a file's extender tree may cover
+ * fewer blocks than its size.
  */
 struct lanyfs_ext {
 	unsigned char		type;
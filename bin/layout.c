@@ -0,0 +1,490 @@
+/*
+ * layout.c - Lay Out Files of Lanyard Filesystems in Access Order.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Access order layout
+ *
+ * Files read in the same order every time, e.g. at boot, are read fastest
+ * from one sequential stream. The trace lists the files in the order they
+ * are read, either by path or as block I/O trace records in the default
+ * format of blkparse:
+ *
+ *	8,16   1        7     0.001829163   312  Q   R 2048 + 8 [init]
+ *
+ * Sectors of 512 bytes count from the start of the volume. Reads of any
+ * block of a file, including its file block and extenders, count as reads
+ * of the file. Every file is placed in full when first read, data blocks in
+ * file order, holes left out. With -f the file block and extenders go in
+ * front of the data.
+ *
+ * The blocks are moved into one region by lanyfs_move_region(), which
+ * updates every pointer to them and the free blocks chain. A metadata zone
+ * is left to metadata, the region goes behind it. File blocks and
+ * extenders stay in the zone, so -f is ignored on such volumes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "layout.lanyfs";
+const char *progdate = "December 2012";
+#define LAYOUT_SECTOR		9	/* blkparse sectors (exponent to base 2) */
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct layout_owner - Block of a file and the file owning it.
+ * @addr:			address of file, extender or data block
+ * @file:			address of file block
+ */
+struct layout_owner {
+	uint64_t		addr;
+	uint64_t		file;
+};
+
+/**
+ * struct layout_map - Owners of all blocks of all files.
+ * @owners:			owners, sorted by block once complete
+ * @n:				number of owners
+ * @parts:			owners found by each worker, pairs of block and
+ * 				file
+ */
+struct layout_map {
+	struct layout_owner	*owners;
+	size_t			n;
+	struct lanyfs_addrvec	*parts;
+};
+
+/**
+ * struct layout_file - Blocks of a file in placement order.
+ * @meta:			place file block and extenders as well
+ * @blocks:			blocks to place
+ * @data:			data blocks, collected separately
+ */
+struct layout_file {
+	int			meta;
+	struct lanyfs_addrvec	*blocks;
+	struct lanyfs_addrvec	data;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-f] [-j threads] device trace\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * own_ext() - Notes the owner of an extender or data block.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			vector of worker, file block address last
+ */
+static int own_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+		    uint64_t iblock, void *arg)
+{
+	struct lanyfs_addrvec *vec = arg;
+	uint64_t file = vec->a[vec->n - 1];
+
+	return lanyfs_addrvec_push(vec, addr) ||
+	       lanyfs_addrvec_push(vec, file);
+}
+
+/**
+ * own_node() - Notes the owner of all blocks of a file.
+ * @vol:			volume
+ * @worker:			index of calling worker
+ * @addr:			address of block
+ * @b:				the block
+ * @arg:			block map
+ */
+static int own_node (struct lanyfs_vol *vol, int worker, uint64_t addr,
+		     union lanyfs_b *b, void *arg)
+{
+	struct layout_map *map = arg;
+	struct lanyfs_addrvec *vec = &map->parts[worker];
+
+	if (b->raw.type != LANYFS_TYPE_FILE)
+		return 0;
+	if (lanyfs_addrvec_push(vec, addr) || lanyfs_addrvec_push(vec, addr))
+		return -1;
+	return lanyfs_ext_walk(vol, fromle64(b->file.data), own_ext, vec);
+}
+
+/**
+ * cmp_owner() - Orders owners by block, for qsort() and bsearch().
+ * @a:				first owner
+ * @b:				second owner
+ */
+static int cmp_owner (const void *a, const void *b)
+{
+	uint64_t x = ((const struct layout_owner *) a)->addr;
+	uint64_t y = ((const struct layout_owner *) b)->addr;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * map_blocks() - Maps all blocks of all files to their files.
+ * @vol:			volume
+ * @map:			block map
+ * @threads:			number of worker threads
+ */
+static void map_blocks (struct lanyfs_vol *vol, struct layout_map *map,
+			int threads)
+{
+	struct lanyfs_addrvec *vec;
+	size_t k;
+	int i;
+
+	map->parts = calloc(threads, sizeof(*map->parts));
+	if (!map->parts)
+		show_error(_("out of memory"));
+	if (lanyfs_walk(vol, fromle64(vol->sb->sb.rootdir), threads,
+			own_node, map))
+		show_error(_("error walking filesystem: %s"), strerror(errno));
+	for (i = 0; i < threads; i++)
+		map->n += map->parts[i].n / 2;
+	map->owners = malloc((map->n + 1) * sizeof(*map->owners));
+	if (!map->owners)
+		show_error(_("out of memory"));
+	for (i = 0, map->n = 0; i < threads; i++) {
+		vec = &map->parts[i];
+		for (k = 0; k < vec->n; k += 2) {
+			map->owners[map->n].addr = vec->a[k];
+			map->owners[map->n++].file = vec->a[k + 1];
+		}
+		lanyfs_addrvec_free(vec);
+	}
+	free(map->parts);
+	qsort(map->owners, map->n, sizeof(*map->owners), cmp_owner);
+	verbose("mapped %zu blocks of files", map->n);
+}
+
+/**
+ * parse_record() - Parses a blkparse record of a read.
+ * @line:			line of trace
+ * @sector:			first sector read
+ * @count:			number of sectors read
+ *
+ * Returns 1 for a read, 0 for another record and -1 if the line is no
+ * record at all.
+ */
+static int parse_record (const char *line, uint64_t *sector, uint64_t *count)
+{
+	char action[8], rwbs[8];
+	unsigned int major, minor, cpu, seq, pid;
+	double t;
+
+	if (sscanf(line, "%u,%u %u %u %lf %u %7s %7s %"SCNu64" + %"SCNu64,
+		   &major, &minor, &cpu, &seq, &t, &pid, action, rwbs, sector,
+		   count) != 10)
+		return -1;
+	return strchr(rwbs, 'R') && *count ? 1 : 0;
+}
+
+/**
+ * add_file() - Appends a file to the layout unless already there.
+ * @vol:			volume
+ * @files:			files in order of first read
+ * @seen:			bitmap of files already appended
+ * @file:			address of file block
+ */
+static void add_file (struct lanyfs_vol *vol, struct lanyfs_addrvec *files,
+		      unsigned char *seen, uint64_t file)
+{
+	if (lanyfs_testbit(seen, file))
+		return;
+	lanyfs_setbit(seen, file);
+	if (lanyfs_addrvec_push(files, file))
+		show_error(_("out of memory"));
+}
+
+/**
+ * read_trace() - Reads the files of a trace in order of first read.
+ * @vol:			volume
+ * @path:			trace, - for standard input
+ * @files:			file block addresses
+ * @threads:			number of worker threads
+ */
+static void read_trace (struct lanyfs_vol *vol, const char *path,
+			struct lanyfs_addrvec *files, int threads)
+{
+	struct layout_map map = {NULL, 0, NULL};
+	struct layout_owner key, *own;
+	unsigned char *seen;
+	union lanyfs_b *b;
+	uint64_t sector, count, addr, last;
+	char *line = NULL;
+	size_t cap = 0, len;
+	FILE *fp;
+	int ret;
+
+	fp = strcmp(path, "-") ? fopen(path, "r") : stdin;
+	seen = calloc((vol->blocks + 7) / 8, 1);
+	b = lanyfs_alloc_block(vol);
+	if (!fp)
+		show_error(_("error reading %s: %s"), path, strerror(errno));
+	if (!seen || !b)
+		show_error(_("out of memory"));
+	while (getline(&line, &cap, fp) > 0) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (!len || line[0] == '#')
+			continue;
+		ret = parse_record(line, &sector, &count);
+		if (!ret)
+			continue;
+		if (ret < 0) {
+			if (lanyfs_lookup(vol, line, &addr, NULL) ||
+			    lanyfs_read_block(vol, addr, b)) {
+				fprintf(stderr, _("%s: skipping %s: %s\n"),
+					progname, line, strerror(errno));
+				continue;
+			}
+			if (b->raw.type != LANYFS_TYPE_FILE) {
+				fprintf(stderr, _("%s: skipping %s: %s\n"),
+					progname, line, strerror(EISDIR));
+				continue;
+			}
+			add_file(vol, files, seen, addr);
+			continue;
+		}
+		if (!map.owners)
+			map_blocks(vol, &map, threads);
+		addr = (sector << LAYOUT_SECTOR) >> vol->blocksize;
+		last = ((sector + count) << LAYOUT_SECTOR) - 1;
+		for (last >>= vol->blocksize; addr <= last; addr++) {
+			key.addr = addr;
+			own = bsearch(&key, map.owners, map.n, sizeof(*own),
+				      cmp_owner);
+			if (own)
+				add_file(vol, files, seen, own->file);
+		}
+	}
+	if (ferror(fp))
+		show_error(_("error reading %s: %s"), path, strerror(errno));
+	if (fp != stdin)
+		fclose(fp);
+	free(line);
+	free(map.owners);
+	free(seen);
+	free(b);
+}
+
+/**
+ * place_ext() - Appends an extender or data block to a file's blocks.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			file
+ */
+static int place_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+		      uint64_t iblock, void *arg)
+{
+	struct layout_file *f = arg;
+
+	if (type == LANYFS_TYPE_DATA)
+		return lanyfs_addrvec_push(&f->data, addr);
+	if (f->meta)
+		return lanyfs_addrvec_push(f->blocks, addr);
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	struct lanyfs_addrvec files = {NULL, 0, 0}, blocks = {NULL, 0, 0};
+	struct layout_file f;
+	union lanyfs_b *b;
+	char *dev_name;
+	uint64_t start;
+	size_t i;
+	int threads = lanyfs_default_threads(), jset = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* parse command line options */
+	int c;
+	memset(&f, 0, sizeof(f));
+	while ((c = getopt(argc, argv, "fj:v")) != -1) {
+		switch (c) {
+		case 'f':
+			f.meta = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			jset = 1;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 != argc)
+		show_usage();
+	dev_name = argv[optind];
+
+	/* open device */
+	vol = lanyfs_vol_open(dev_name, 0);
+	if (!vol)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+	if (!jset)
+		threads = lanyfs_dev_threads(vol->dev, threads);
+	if (f.meta && vol->sb->sb.zoneend) {
+		fprintf(stderr, _("%s: metadata zone present, ignoring -f\n"),
+			progname);
+		f.meta = 0;
+	}
+
+	/* files in order of first read */
+	printf(_("reading trace %s\n"), argv[optind + 1]);
+	read_trace(vol, argv[optind + 1], &files, threads);
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		show_error(_("out of memory"));
+	f.blocks = &blocks;
+	for (i = 0; i < files.n; i++) {
+		if (lanyfs_read_block(vol, files.a[i], b))
+			show_error(_("read error at block %"PRIu64), files.a[i]);
+		if (f.meta && lanyfs_addrvec_push(&blocks, files.a[i]))
+			show_error(_("out of memory"));
+		if (lanyfs_ext_walk(vol, fromle64(b->file.data), place_ext,
+				    &f))
+			show_error(_("error walking file at block %"PRIu64
+				     ": %s"), files.a[i], strerror(errno));
+		if (lanyfs_addrvec_merge(&blocks, &f.data))
+			show_error(_("out of memory"));
+	}
+	free(b);
+	verbose("%zu files, %zu blocks to place", files.n, blocks.n);
+
+	/* move */
+	printf(_("moving %zu blocks with %d threads\n"), blocks.n, threads);
+	if (lanyfs_move_region(vol, blocks.a, blocks.n, 0, threads, &start))
+		show_error(_("error moving blocks: %s"), strerror(errno));
+	if (blocks.n)
+		printf(_("%zu files in blocks %"PRIu64" to %"PRIu64"\n"),
+		       files.n, start, start + blocks.n - 1);
+	lanyfs_addrvec_free(&files);
+	lanyfs_addrvec_free(&blocks);
+
+	/* close device */
+	if (lanyfs_vol_close(vol))
+		show_error(_("error closing device %s"), dev_name);
+
+	printf(_("all done\n"));
+	return EXIT_SUCCESS;
+}
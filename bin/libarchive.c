@@ -0,0 +1,705 @@
+/*
+ * libarchive.c - Seekable Compressed Archives of Lanyard Filesystem Images.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Archive files
+ *
+ * An archive splits an image into frames of fixed size, each compressed on
+ * its own, so any byte of the image is reached by decompressing one frame.
+ * The frame index at the end of the archive holds offset and stored length
+ * of every frame.
+ *
+ * Free blocks listed in the free blocks chain are not stored at all. A
+ * stored frame starts with a bitmap of the blocks it holds, followed by the
+ * held blocks back to back. Omitted blocks read as zeros. A frame holding
+ * no blocks has a stored length of 0 and costs nothing but its index entry.
+ * Chain blocks are kept, so the free blocks chain of an archived image is
+ * still intact.
+ *
+ * Reading goes through a small cache of decompressed frames, which makes
+ * the usual pattern of many small reads within one frame cheap.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+/* layout of archive files */
+#define ARCHIVE_VERSION		1
+#define ARCHIVE_HDR_SIZE	4096
+#define ARCHIVE_CACHE_FRAMES	16
+
+/* frame flags */
+#define FRAME_RAW		(1 << 0)	/* payload not compressed */
+#define FRAME_FULL		(1 << 1)	/* no bitmap, all blocks held */
+
+/**
+ * struct archive_hdr - On-disk header of archive files, little endian.
+ * @magic:			identifies archive files
+ * @version:			version of archive format
+ * @codec:			codec of frame payloads
+ * @frame_shift:		frame size (exponent to base 2)
+ * @block_shift:		blocksize of archived image (exponent to base 2)
+ * @size:			size of archived image in bytes
+ * @frames:			number of frames
+ * @index:			byte offset of frame index
+ */
+struct archive_hdr {
+	char			magic[LANYFS_DEV_MAGIC_LEN];
+	uint32_t		version;
+	uint32_t		codec;
+	uint32_t		frame_shift;
+	uint32_t		block_shift;
+	uint64_t		size;
+	uint64_t		frames;
+	uint64_t		index;
+};
+
+/**
+ * struct archive_frame - Frame index entry, little endian on disk.
+ * @offset:			byte offset of stored frame
+ * @length:			stored length, 0 if the frame holds no blocks
+ * @flags:			FRAME_* flags
+ */
+struct archive_frame {
+	uint64_t		offset;
+	uint32_t		length;
+	uint32_t		flags;
+};
+
+/**
+ * struct archive_slot - Cached decompressed frame.
+ * @frame:			frame number
+ * @stamp:			time of last use, 0 if slot is empty
+ * @data:			decompressed frame
+ */
+struct archive_slot {
+	uint64_t		frame;
+	uint64_t		stamp;
+	unsigned char		*data;
+};
+
+/**
+ * struct archive - Open archive.
+ * @hdr:			header in CPU byte order
+ * @index:			frame index in CPU byte order
+ * @fsize:			frame size in bytes
+ * @lock:			protects the cache
+ * @cache:			decompressed frames
+ * @clock:			source of cache time stamps
+ */
+struct archive {
+	struct archive_hdr	hdr;
+	struct archive_frame	*index;
+	size_t			fsize;
+	pthread_mutex_t		lock;
+	struct archive_slot	cache[ARCHIVE_CACHE_FRAMES];
+	uint64_t		clock;
+};
+
+/**
+ * frame_len() - Returns the number of image bytes covered by a frame.
+ * @hdr:			header
+ * @f:				frame
+ */
+static size_t frame_len (const struct archive_hdr *hdr, uint64_t f)
+{
+	uint64_t start = f << hdr->frame_shift;
+	uint64_t len = (uint64_t) 1 << hdr->frame_shift;
+	if (start + len > hdr->size)
+		len = hdr->size - start;
+	return len;
+}
+
+/**
+ * frame_blocks() - Returns the number of blocks covered by a frame.
+ * @hdr:			header
+ * @f:				frame
+ *
+ * The last block of an image may be partial.
+ */
+static size_t frame_blocks (const struct archive_hdr *hdr, uint64_t f)
+{
+	size_t bsize = (size_t) 1 << hdr->block_shift;
+	return (frame_len(hdr, f) + bsize - 1) / bsize;
+}
+
+/**
+ * frame_expand() - Decompresses a stored frame.
+ * @hdr:			header
+ * @entry:			index entry of frame
+ * @f:				frame number
+ * @stored:			stored frame
+ * @out:			decompressed frame, frame size bytes
+ */
+static int frame_expand (const struct archive_hdr *hdr,
+			 const struct archive_frame *entry, uint64_t f,
+			 const unsigned char *stored, unsigned char *out)
+{
+	size_t bsize = (size_t) 1 << hdr->block_shift;
+	size_t len = frame_len(hdr, f);
+	size_t nblocks = frame_blocks(hdr, f);
+	size_t maplen = 0, held = 0, raw, i, n;
+	const unsigned char *map = NULL;
+	unsigned char *payload, *p;
+	int codec = entry->flags & FRAME_RAW ? LANYFS_CODEC_NONE :
+		    (int) hdr->codec;
+
+	if (!entry->length) {
+		memset(out, 0, len);
+		return 0;
+	}
+	if (!(entry->flags & FRAME_FULL)) {
+		map = stored;
+		maplen = (nblocks + 7) / 8;
+		if (entry->length < maplen)
+			goto err;
+		for (i = 0; i < nblocks; i++)
+			held += !!lanyfs_testbit(map, i);
+	} else {
+		held = nblocks;
+	}
+
+	/* payload is held blocks back to back, the last one maybe partial */
+	raw = held * bsize;
+	if (held && (!map || lanyfs_testbit(map, nblocks - 1)) &&
+	    len % bsize)
+		raw -= bsize - len % bsize;
+	if (held == nblocks) {
+		return lanyfs_decompress(codec, stored + maplen,
+					 entry->length - maplen, out, raw);
+	}
+	payload = malloc(raw ? raw : 1);
+	if (!payload)
+		return -1;
+	if (lanyfs_decompress(codec, stored + maplen, entry->length - maplen,
+			      payload, raw)) {
+		free(payload);
+		return -1;
+	}
+	for (i = 0, p = payload; i < nblocks; i++) {
+		n = (i + 1) * bsize > len ? len - i * bsize : bsize;
+		if (lanyfs_testbit(map, i)) {
+			memcpy(out + i * bsize, p, n);
+			p += n;
+		} else {
+			memset(out + i * bsize, 0, n);
+		}
+	}
+	free(payload);
+	return 0;
+
+err:
+	errno = EIO;
+	return -1;
+}
+
+/**
+ * frame_load() - Reads and decompresses a frame.
+ * @dev:			device
+ * @f:				frame number
+ * @out:			decompressed frame, frame size bytes
+ */
+static int frame_load (struct lanyfs_dev *dev, uint64_t f, unsigned char *out)
+{
+	struct archive *arc = dev->priv;
+	struct archive_frame *entry = &arc->index[f];
+	unsigned char *stored;
+	int ret;
+
+	if (!entry->length)
+		return frame_expand(&arc->hdr, entry, f, NULL, out);
+	stored = malloc(entry->length);
+	if (!stored)
+		return -1;
+	ret = lanyfs_fd_pread(dev->fd, stored, entry->length, entry->offset);
+	if (!ret)
+		ret = frame_expand(&arc->hdr, entry, f, stored, out);
+	free(stored);
+	return ret;
+}
+
+/**
+ * cache_copy() - Copies from a cached frame.
+ * @arc:			archive
+ * @f:				frame number
+ * @buf:			target buffer
+ * @len:			number of bytes
+ * @off:			offset within frame
+ *
+ * Returns 1 on cache hit, 0 on miss. Must be called with the lock held.
+ */
+static int cache_copy (struct archive *arc, uint64_t f, void *buf, size_t len,
+		       size_t off)
+{
+	int i;
+	for (i = 0; i < ARCHIVE_CACHE_FRAMES; i++) {
+		if (arc->cache[i].stamp && arc->cache[i].frame == f) {
+			arc->cache[i].stamp = ++arc->clock;
+			memcpy(buf, arc->cache[i].data + off, len);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * cache_insert() - Inserts a frame into the cache.
+ * @arc:			archive
+ * @f:				frame number
+ * @data:			decompressed frame, owned by the cache afterwards
+ *
+ * The least recently used frame is evicted. Must be called with the lock
+ * held.
+ */
+static void cache_insert (struct archive *arc, uint64_t f, unsigned char *data)
+{
+	int i, victim = 0;
+	for (i = 0; i < ARCHIVE_CACHE_FRAMES; i++) {
+		if (arc->cache[i].stamp && arc->cache[i].frame == f) {
+			/* lost a race against another reader */
+			free(data);
+			return;
+		}
+		if (arc->cache[i].stamp < arc->cache[victim].stamp)
+			victim = i;
+	}
+	free(arc->cache[victim].data);
+	arc->cache[victim].frame = f;
+	arc->cache[victim].data = data;
+	arc->cache[victim].stamp = ++arc->clock;
+}
+
+/**
+ * arc_pread() - Reads from an archive.
+ * @dev:			device
+ * @buf:			target buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ *
+ * Frames are decompressed outside of the lock, so readers of different
+ * frames do not wait for each other.
+ */
+static int arc_pread (struct lanyfs_dev *dev, void *buf, size_t len,
+		      uint64_t pos)
+{
+	struct archive *arc = dev->priv;
+	unsigned char *data;
+	uint64_t f;
+	size_t off, n;
+	int hit;
+
+	if (pos + len > dev->size) {
+		errno = EIO;
+		return -1;
+	}
+	while (len) {
+		f = pos >> arc->hdr.frame_shift;
+		off = pos & (arc->fsize - 1);
+		n = arc->fsize - off < len ? arc->fsize - off : len;
+		if (!arc->index[f].length) {
+			memset(buf, 0, n);
+		} else {
+			pthread_mutex_lock(&arc->lock);
+			hit = cache_copy(arc, f, buf, n, off);
+			pthread_mutex_unlock(&arc->lock);
+			if (!hit) {
+				data = malloc(arc->fsize);
+				if (!data)
+					return -1;
+				if (frame_load(dev, f, data)) {
+					free(data);
+					return -1;
+				}
+				memcpy(buf, data + off, n);
+				pthread_mutex_lock(&arc->lock);
+				cache_insert(arc, f, data);
+				pthread_mutex_unlock(&arc->lock);
+			}
+		}
+		buf = (unsigned char *) buf + n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * arc_close() - Closes an archive.
+ * @dev:			device
+ */
+static int arc_close (struct lanyfs_dev *dev)
+{
+	struct archive *arc = dev->priv;
+	int i;
+	for (i = 0; i < ARCHIVE_CACHE_FRAMES; i++)
+		free(arc->cache[i].data);
+	pthread_mutex_destroy(&arc->lock);
+	free(arc->index);
+	free(arc);
+	return close(dev->fd);
+}
+
+static const struct lanyfs_dev_ops archive_ops = {
+	.name	= "archive",
+	.pread	= arc_pread,
+	.pwrite	= NULL,
+	.sync	= NULL,
+	.discard = NULL,
+	.close	= arc_close,
+};
+
+/**
+ * lanyfs_archive_open() - Opens an archive file as read-only device.
+ * @fd:				file descriptor of archive, taken over
+ * @rdonly:			must be set, archives cannot be written
+ *
+ * Called by lanyfs_dev_open() after having found the archive magic.
+ */
+struct lanyfs_dev *lanyfs_archive_open (int fd, int rdonly)
+{
+	struct lanyfs_dev *dev = NULL;
+	struct archive *arc = NULL;
+	struct archive_hdr *hdr;
+	uint64_t f;
+	int err;
+
+	if (!rdonly) {
+		errno = EROFS;
+		goto err;
+	}
+	dev = calloc(1, sizeof(*dev));
+	arc = calloc(1, sizeof(*arc));
+	if (!dev || !arc)
+		goto err;
+	hdr = &arc->hdr;
+	if (lanyfs_fd_pread(fd, hdr, sizeof(*hdr), 0))
+		goto err;
+	hdr->version = fromle32(hdr->version);
+	hdr->codec = fromle32(hdr->codec);
+	hdr->frame_shift = fromle32(hdr->frame_shift);
+	hdr->block_shift = fromle32(hdr->block_shift);
+	hdr->size = fromle64(hdr->size);
+	hdr->frames = fromle64(hdr->frames);
+	hdr->index = fromle64(hdr->index);
+	if (hdr->version != ARCHIVE_VERSION ||
+	    hdr->block_shift < LANYFS_MIN_BLOCKSIZE ||
+	    hdr->block_shift > LANYFS_MAX_BLOCKSIZE ||
+	    hdr->frame_shift < hdr->block_shift || hdr->frame_shift > 30 ||
+	    hdr->frames != (hdr->size + ((uint64_t) 1 << hdr->frame_shift) - 1)
+			   >> hdr->frame_shift) {
+		errno = EINVAL;
+		goto err;
+	}
+	arc->fsize = (size_t) 1 << hdr->frame_shift;
+	arc->index = calloc(hdr->frames + 1, sizeof(*arc->index));
+	if (!arc->index)
+		goto err;
+	if (hdr->frames && lanyfs_fd_pread(fd, arc->index,
+					   hdr->frames * sizeof(*arc->index),
+					   hdr->index))
+		goto err;
+	for (f = 0; f < hdr->frames; f++) {
+		arc->index[f].offset = fromle64(arc->index[f].offset);
+		arc->index[f].length = fromle32(arc->index[f].length);
+		arc->index[f].flags = fromle32(arc->index[f].flags);
+	}
+	pthread_mutex_init(&arc->lock, NULL);
+	dev->ops = &archive_ops;
+	dev->fd = fd;
+	dev->rdonly = 1;
+	dev->size = hdr->size;
+	dev->priv = arc;
+	return dev;
+
+err:
+	err = errno;
+	if (arc)
+		free(arc->index);
+	free(arc);
+	free(dev);
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * struct archive_job - Frames compressed in one batch.
+ * @vol:			source volume
+ * @free:			bitmap of blocks to omit
+ * @hdr:			header of archive being written
+ * @first:			first frame of batch
+ * @count:			number of frames in batch
+ * @held:			frame buffers, one per worker
+ * @out:			stored frames
+ * @entries:			index entries of stored frames
+ */
+struct archive_job {
+	struct lanyfs_vol	*vol;
+	const unsigned char	*free;
+	const struct archive_hdr *hdr;
+	uint64_t		first;
+	uint64_t		count;
+	unsigned char		**held;
+	unsigned char		**out;
+	struct archive_frame	*entries;
+};
+
+/**
+ * frame_store() - Builds the stored form of a frame.
+ * @job:			batch
+ * @f:				frame number
+ * @held:			buffer of frame size bytes
+ */
+static int frame_store (struct archive_job *job, uint64_t f,
+			unsigned char *held)
+{
+	const struct archive_hdr *hdr = job->hdr;
+	struct archive_frame *entry = &job->entries[f - job->first];
+	size_t bsize = (size_t) 1 << hdr->block_shift;
+	size_t len = frame_len(hdr, f);
+	size_t nblocks = frame_blocks(hdr, f);
+	size_t maplen = (nblocks + 7) / 8, raw = 0, clen, i, n;
+	uint64_t block = (f << hdr->frame_shift) >> hdr->block_shift;
+	unsigned char *out, *map;
+
+	out = malloc(maplen + lanyfs_compress_bound(hdr->codec, len));
+	if (!out)
+		return -1;
+	map = out;
+	memset(map, 0, maplen);
+	for (i = 0; i < nblocks; i++) {
+		if (block + i < job->vol->blocks &&
+		    lanyfs_testbit(job->free, block + i))
+			continue;
+		n = (i + 1) * bsize > len ? len - i * bsize : bsize;
+		if (lanyfs_dev_pread(job->vol->dev, held + raw, n,
+				     (f << hdr->frame_shift) + i * bsize))
+			goto err;
+		lanyfs_setbit(map, i);
+		raw += n;
+	}
+	entry->flags = 0;
+	if (!raw) {
+		entry->length = 0;
+		free(out);
+		job->out[f - job->first] = NULL;
+		return 0;
+	}
+	if (raw == len) {
+		/* nothing omitted, drop the bitmap */
+		entry->flags |= FRAME_FULL;
+		maplen = 0;
+	}
+	clen = lanyfs_compress(hdr->codec, held, raw, out + maplen, raw - 1);
+	if (!clen) {
+		entry->flags |= FRAME_RAW;
+		memcpy(out + maplen, held, raw);
+		clen = raw;
+	}
+	entry->length = maplen + clen;
+	job->out[f - job->first] = out;
+	return 0;
+
+err:
+	free(out);
+	return -1;
+}
+
+/**
+ * archive_task() - Pool task compressing a frame of a batch.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			batch
+ * @i:				index of frame within batch
+ */
+static int archive_task (struct lanyfs_pool *pool, int worker, void *arg,
+			 uint64_t i)
+{
+	struct archive_job *job = arg;
+	return frame_store(job, job->first + i, job->held[worker]);
+}
+
+/**
+ * job_release() - Frees buffers of batches and stops the pool.
+ * @job:			batch
+ * @pool:			pool compressing frames, may be NULL
+ */
+static void job_release (struct archive_job *job, struct lanyfs_pool *pool)
+{
+	int i;
+
+	for (i = 0; job->held && i < lanyfs_pool_threads(pool); i++)
+		free(job->held[i]);
+	free(job->held);
+	free(job->out);
+	lanyfs_pool_free(pool);
+}
+
+/**
+ * lanyfs_archive_create() - Converts an image into an archive.
+ * @vol:			source volume
+ * @path:			path of archive to create
+ * @codec:			codec of frame payloads
+ * @frame_shift:		frame size (exponent to base 2)
+ * @threads:			number of compressing threads
+ * @stored:			number of bytes written, may be NULL
+ *
+ * Frames are compressed in batches by all threads and written in order.
+ */
+int lanyfs_archive_create (struct lanyfs_vol *vol, const char *path,
+			   int codec, int frame_shift, int threads,
+			   uint64_t *stored)
+{
+	struct archive_hdr hdr, le;
+	struct archive_job job;
+	struct archive_frame *index = NULL;
+	unsigned char *map = NULL, page[ARCHIVE_HDR_SIZE];
+	struct lanyfs_pool *pool = NULL;
+	uint64_t f, pos = ARCHIVE_HDR_SIZE, batch;
+	int fd, i, ret, err;
+
+	if (frame_shift < vol->blocksize || frame_shift > 30) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (threads < 1)
+		threads = 1;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LANYFS_ARCHIVE_MAGIC, LANYFS_DEV_MAGIC_LEN);
+	hdr.version = ARCHIVE_VERSION;
+	hdr.codec = codec;
+	hdr.frame_shift = frame_shift;
+	hdr.block_shift = vol->blocksize;
+	hdr.size = vol->dev->size;
+	hdr.frames = (hdr.size + ((uint64_t) 1 << frame_shift) - 1) >>
+		     frame_shift;
+	batch = (uint64_t) threads * 4;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	map = calloc(1, vol->blocks / 8 + 1);
+	index = calloc(hdr.frames + 1, sizeof(*index));
+	memset(&job, 0, sizeof(job));
+	job.out = calloc(batch, sizeof(*job.out));
+	pool = lanyfs_pool_new(threads, batch, 0);
+	if (!map || !index || !job.out || !pool)
+		goto err;
+	job.held = calloc(lanyfs_pool_threads(pool), sizeof(*job.held));
+	if (!job.held)
+		goto err;
+	for (i = 0; i < lanyfs_pool_threads(pool); i++) {
+		job.held[i] = malloc((size_t) 1 << frame_shift);
+		if (!job.held[i])
+			goto err;
+	}
+	if (lanyfs_free_map(vol, map, 0, NULL))
+		goto err;
+	job.vol = vol;
+	job.free = map;
+	job.hdr = &hdr;
+
+	for (f = 0; f < hdr.frames; f += job.count) {
+		job.first = f;
+		job.count = hdr.frames - f < batch ? hdr.frames - f : batch;
+		job.entries = index + f;
+		ret = 0;
+		for (i = 0; i < (int) job.count && !ret; i++)
+			ret = lanyfs_pool_submit(pool, archive_task, &job, i);
+		if (lanyfs_pool_wait(pool))
+			ret = -1;
+		for (i = 0; i < (int) job.count; i++) {
+			if (!ret && job.out[i] &&
+			    lanyfs_fd_pwrite(fd, job.out[i], index[f + i].length,
+					     pos))
+				ret = -1;
+			index[f + i].offset = pos;
+			pos += index[f + i].length;
+			free(job.out[i]);
+			job.out[i] = NULL;
+		}
+		if (ret)
+			goto err;
+	}
+
+	/* index and header */
+	hdr.index = pos;
+	for (f = 0; f < hdr.frames; f++) {
+		index[f].offset = tole64(index[f].offset);
+		index[f].length = tole32(index[f].length);
+		index[f].flags = tole32(index[f].flags);
+	}
+	if (lanyfs_fd_pwrite(fd, index, hdr.frames * sizeof(*index), pos))
+		goto err;
+	pos += hdr.frames * sizeof(*index);
+	le = hdr;
+	le.version = tole32(hdr.version);
+	le.codec = tole32(hdr.codec);
+	le.frame_shift = tole32(hdr.frame_shift);
+	le.block_shift = tole32(hdr.block_shift);
+	le.size = tole64(hdr.size);
+	le.frames = tole64(hdr.frames);
+	le.index = tole64(hdr.index);
+	memset(page, 0, sizeof(page));
+	memcpy(page, &le, sizeof(le));
+	if (lanyfs_fd_pwrite(fd, page, sizeof(page), 0) || fsync(fd))
+		goto err;
+	if (stored)
+		*stored = pos;
+	free(map);
+	free(index);
+	job_release(&job, pool);
+	return close(fd);
+
+err:
+	err = errno;
+	free(map);
+	free(index);
+	job_release(&job, pool);
+	close(fd);
+	unlink(path);
+	errno = err ? err : EIO;
+	return -1;
+}
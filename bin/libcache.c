@@ -0,0 +1,303 @@
+/*
+ * libcache.c - Sharded Block Cache for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Block cache
+ *
+ * Readers sharing a volume keep reading the same directory, file and
+ * extender blocks while resolving paths. The cache keeps copies of such
+ * blocks in memory. It is split into shards by a hash of the block address,
+ * each shard with a lock of its own, so threads reading different blocks
+ * rarely wait for each other. A shard is a set-associative table of four
+ * ways per set, replaced by a clock over reference bits. Only the lookup
+ * and the copy of a single block happen under the lock.
+ *
+ * Clearing the cache starts a new generation. A lookup that misses hands
+ * out the current generation, and the block read afterwards is only put
+ * into the cache if no clear happened in between, so a block read before
+ * a clear never outlives it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+#define CACHE_SHARDS		64
+#define CACHE_WAYS		4
+
+/**
+ * struct cache_set - Set of ways.
+ * @key:			address plus one of cached block, 0 if empty
+ * @ref:			way was used since the hand passed it
+ * @hand:			next way to consider for replacement
+ */
+struct cache_set {
+	uint64_t		key[CACHE_WAYS];
+	unsigned char		ref[CACHE_WAYS];
+	unsigned char		hand;
+};
+
+/**
+ * struct cache_shard - Independently locked part of the cache.
+ * @lock:			protects all fields below
+ * @sets:			sets
+ * @data:			cached blocks, CACHE_WAYS per set
+ * @hits:			number of lookups found
+ * @misses:			number of lookups not found
+ */
+struct cache_shard {
+	pthread_mutex_t		lock;
+	struct cache_set	*sets;
+	unsigned char		*data;
+	uint64_t		hits;
+	uint64_t		misses;
+};
+
+/**
+ * struct lanyfs_cache - Block cache.
+ * @bsize:			blocksize in bytes
+ * @nsets:			number of sets per shard
+ * @gen:			generation, incremented by every clear
+ * @shards:			shards
+ */
+struct lanyfs_cache {
+	size_t			bsize;
+	size_t			nsets;
+	uint64_t		gen;
+	struct cache_shard	shards[CACHE_SHARDS];
+};
+
+/**
+ * lanyfs_cache_new() - Creates an empty block cache.
+ * @bsize:			blocksize in bytes
+ * @blocks:			number of blocks to hold, rounded up
+ */
+struct lanyfs_cache *lanyfs_cache_new (size_t bsize, size_t blocks)
+{
+	struct lanyfs_cache *cache;
+	struct cache_shard *s;
+	int i;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->bsize = bsize;
+	cache->nsets = (blocks + CACHE_SHARDS * CACHE_WAYS - 1) /
+		       (CACHE_SHARDS * CACHE_WAYS);
+	if (!cache->nsets)
+		cache->nsets = 1;
+	for (i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&cache->shards[i].lock, NULL);
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		s = &cache->shards[i];
+		s->sets = calloc(cache->nsets, sizeof(*s->sets));
+		s->data = malloc(cache->nsets * CACHE_WAYS * bsize);
+		if (!s->sets || !s->data) {
+			lanyfs_cache_free(cache);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	return cache;
+}
+
+/**
+ * cache_hash() - Spreads block addresses over shards and sets.
+ * @addr:			block address
+ */
+static inline uint64_t cache_hash (uint64_t addr)
+{
+	return addr * 0x9e3779b97f4a7c15ULL;
+}
+
+/**
+ * cache_locate() - Finds and locks the shard and set of a block.
+ * @cache:			cache
+ * @addr:			block address
+ * @set:			set of block
+ *
+ * Returns the locked shard.
+ */
+static struct cache_shard *cache_locate (struct lanyfs_cache *cache,
+					 uint64_t addr, struct cache_set **set)
+{
+	uint64_t h = cache_hash(addr);
+	struct cache_shard *s = &cache->shards[h >> 58];
+	pthread_mutex_lock(&s->lock);
+	*set = &s->sets[(h & 0xffffffffffffULL) % cache->nsets];
+	return s;
+}
+
+/**
+ * lanyfs_cache_get() - Copies a block out of the cache.
+ * @cache:			cache
+ * @addr:			block address
+ * @buf:			buffer of at least blocksize bytes
+ * @gen:			set to the generation on a miss, to be passed to
+ * 				lanyfs_cache_put() with the block read instead
+ *
+ * Returns 1 if the block was cached, 0 otherwise.
+ */
+int lanyfs_cache_get (struct lanyfs_cache *cache, uint64_t addr, void *buf,
+		      uint64_t *gen)
+{
+	struct cache_shard *s;
+	struct cache_set *set;
+	int way;
+
+	s = cache_locate(cache, addr, &set);
+	for (way = 0; way < CACHE_WAYS; way++) {
+		if (set->key[way] == addr + 1) {
+			memcpy(buf, s->data + ((set - s->sets) * CACHE_WAYS +
+					       way) * cache->bsize,
+			       cache->bsize);
+			set->ref[way] = 1;
+			s->hits++;
+			pthread_mutex_unlock(&s->lock);
+			return 1;
+		}
+	}
+	s->misses++;
+	*gen = __atomic_load_n(&cache->gen, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+}
+
+/**
+ * lanyfs_cache_put() - Copies a block into the cache.
+ * @cache:			cache
+ * @addr:			block address
+ * @buf:			block
+ * @gen:			generation handed out by the missed lookup
+ *
+ * A cached copy of the block is replaced, otherwise the first way without
+ * its reference bit set makes room. The block is dropped if the cache was
+ * cleared since the lookup.
+ */
+void lanyfs_cache_put (struct lanyfs_cache *cache, uint64_t addr,
+		       const void *buf, uint64_t gen)
+{
+	struct cache_shard *s;
+	struct cache_set *set;
+	int way;
+
+	s = cache_locate(cache, addr, &set);
+	if (__atomic_load_n(&cache->gen, __ATOMIC_RELAXED) != gen) {
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	for (way = 0; way < CACHE_WAYS; way++) {
+		if (set->key[way] == addr + 1)
+			break;
+	}
+	if (way == CACHE_WAYS) {
+		while (set->ref[set->hand]) {
+			set->ref[set->hand] = 0;
+			set->hand = (set->hand + 1) % CACHE_WAYS;
+		}
+		way = set->hand;
+		set->hand = (set->hand + 1) % CACHE_WAYS;
+	}
+	set->key[way] = addr + 1;
+	set->ref[way] = 1;
+	memcpy(s->data + ((set - s->sets) * CACHE_WAYS + way) * cache->bsize,
+	       buf, cache->bsize);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * lanyfs_cache_clear() - Drops all cached blocks.
+ * @cache:			cache
+ *
+ * The generation changes before any shard is emptied, so a put that gets
+ * a shard's lock after it was emptied sees the new generation.
+ */
+void lanyfs_cache_clear (struct lanyfs_cache *cache)
+{
+	struct cache_shard *s;
+	int i;
+	__atomic_fetch_add(&cache->gen, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		s = &cache->shards[i];
+		pthread_mutex_lock(&s->lock);
+		memset(s->sets, 0, cache->nsets * sizeof(*s->sets));
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/**
+ * lanyfs_cache_stats() - Sums up lookups of all shards.
+ * @cache:			cache
+ * @hits:			number of lookups found
+ * @misses:			number of lookups not found
+ */
+void lanyfs_cache_stats (struct lanyfs_cache *cache, uint64_t *hits,
+			 uint64_t *misses)
+{
+	struct cache_shard *s;
+	int i;
+	*hits = *misses = 0;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		s = &cache->shards[i];
+		pthread_mutex_lock(&s->lock);
+		*hits += s->hits;
+		*misses += s->misses;
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/**
+ * lanyfs_cache_free() - Releases a block cache.
+ * @cache:			cache
+ */
+void lanyfs_cache_free (struct lanyfs_cache *cache)
+{
+	int i;
+	if (!cache)
+		return;
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		pthread_mutex_destroy(&cache->shards[i].lock);
+		free(cache->shards[i].sets);
+		free(cache->shards[i].data);
+	}
+	free(cache);
+}
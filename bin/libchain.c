@@ -0,0 +1,271 @@
+/*
+ * libchain.c - Bulk Free Chain Encoding for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Bulk chain encoding
+ *
+ * Building a whole free blocks chain one block at a time costs a seek and a
+ * write per chain block. The encoder takes the addresses of all chain
+ * blocks up front and the free blocks to put into their slots in ascending
+ * order. Chain blocks are assembled in a batch buffer and written with one
+ * call per run of consecutive addresses. Picking the lowest free addresses
+ * as chain blocks keeps these runs long on all but badly fragmented
+ * volumes. The metadata zone's chain is encoded the same way, only the
+ * superblock fields set at the end differ.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "liblanyfs.h"
+
+#define CHAIN_BATCH		256	/* chain blocks per write */
+
+/**
+ * struct lanyfs_chainenc - Free chain encoder.
+ * @vol:			volume
+ * @chains:			addresses of chain blocks
+ * @nchains:			number of chain blocks
+ * @cur:			index of chain block being filled
+ * @slot:			next slot of chain block being filled
+ * @slots:			slots per chain block
+ * @batch:			consecutive chain blocks not yet written
+ * @batchaddr:			address of first block in batch
+ * @nbatch:			number of blocks in batch
+ * @entries:			number of slots filled
+ * @zone:			encoding the metadata zone's chain
+ */
+struct lanyfs_chainenc {
+	struct lanyfs_vol	*vol;
+	const uint64_t		*chains;
+	size_t			nchains;
+	size_t			cur;
+	int			slot;
+	int			slots;
+	unsigned char		*batch;
+	uint64_t		batchaddr;
+	size_t			nbatch;
+	uint64_t		entries;
+	int			zone;
+};
+
+/**
+ * lanyfs_chain_blocks() - Computes the number of chain blocks required.
+ * @vol:			volume
+ * @nfree:			number of free blocks, including chain blocks
+ */
+uint64_t lanyfs_chain_blocks (struct lanyfs_vol *vol, uint64_t nfree)
+{
+	uint64_t per = lanyfs_chain_slots(vol) + 1;
+	return (nfree + per - 1) / per;
+}
+
+/**
+ * chain_flush() - Writes the batch of chain blocks.
+ * @enc:			encoder
+ */
+static int chain_flush (struct lanyfs_chainenc *enc)
+{
+	struct lanyfs_vol *vol = enc->vol;
+	if (!enc->nbatch)
+		return 0;
+	if (lanyfs_dev_pwrite(vol->dev, enc->batch, enc->nbatch * vol->bsize,
+			      enc->batchaddr << vol->blocksize))
+		return -1;
+	enc->nbatch = 0;
+	return 0;
+}
+
+/**
+ * chain_start() - Starts the next chain block.
+ * @enc:			encoder
+ *
+ * The block is appended to the batch, which is written first if it is full
+ * or the new block does not follow the batch's last block.
+ */
+static int chain_start (struct lanyfs_chainenc *enc)
+{
+	struct lanyfs_vol *vol = enc->vol;
+	union lanyfs_b *b;
+	uint64_t addr = enc->chains[enc->cur];
+
+	if (enc->nbatch && (enc->nbatch == CHAIN_BATCH ||
+			    addr != enc->batchaddr + enc->nbatch))
+		if (chain_flush(enc))
+			return -1;
+	if (!enc->nbatch)
+		enc->batchaddr = addr;
+	b = (union lanyfs_b *) (enc->batch + enc->nbatch * vol->bsize);
+	memset(b, 0, vol->bsize);
+	b->chain.type = LANYFS_TYPE_CHAIN;
+	b->chain.wrcnt = tole16(1);
+	if (enc->cur + 1 < enc->nchains)
+		b->chain.next = tole64(enc->chains[enc->cur + 1]);
+	enc->nbatch++;
+	enc->slot = 0;
+	return 0;
+}
+
+/**
+ * chain_open() - Sets up an encoder.
+ * @vol:			volume, writable
+ * @chains:			ascending addresses of chain blocks
+ * @n:				number of chain blocks, at least one
+ * @zone:			encode the metadata zone's chain
+ */
+static struct lanyfs_chainenc *chain_open (struct lanyfs_vol *vol,
+					   const uint64_t *chains, size_t n,
+					   int zone)
+{
+	struct lanyfs_chainenc *enc;
+
+	if (vol->rdonly) {
+		errno = EROFS;
+		return NULL;
+	}
+	if (!n) {
+		errno = EINVAL;
+		return NULL;
+	}
+	enc = calloc(1, sizeof(*enc));
+	if (!enc)
+		return NULL;
+	enc->batch = malloc((size_t) CHAIN_BATCH * vol->bsize);
+	if (!enc->batch) {
+		free(enc);
+		return NULL;
+	}
+	enc->vol = vol;
+	enc->chains = chains;
+	enc->nchains = n;
+	enc->slots = lanyfs_chain_slots(vol);
+	enc->zone = zone;
+	chain_start(enc);
+	return enc;
+}
+
+/**
+ * lanyfs_chain_begin() - Starts encoding a new free blocks chain.
+ * @vol:			volume, writable
+ * @chains:			ascending addresses of chain blocks, as many as
+ * 				lanyfs_chain_blocks() returned, must stay valid
+ * 				until lanyfs_chain_end()
+ * @n:				number of chain blocks, at least one
+ */
+struct lanyfs_chainenc *lanyfs_chain_begin (struct lanyfs_vol *vol,
+					    const uint64_t *chains, size_t n)
+{
+	return chain_open(vol, chains, n, 0);
+}
+
+/**
+ * lanyfs_zone_begin() - Starts encoding a new metadata zone chain.
+ * @vol:			volume, writable
+ * @chains:			ascending addresses of chain blocks, as many as
+ * 				lanyfs_chain_blocks() returned, must stay valid
+ * 				until lanyfs_chain_end()
+ * @n:				number of chain blocks, at least one
+ *
+ * Works like lanyfs_chain_begin(), but lanyfs_chain_end() sets the zone's
+ * head, tail and count. The zone's end is left to the caller.
+ */
+struct lanyfs_chainenc *lanyfs_zone_begin (struct lanyfs_vol *vol,
+					   const uint64_t *chains, size_t n)
+{
+	return chain_open(vol, chains, n, 1);
+}
+
+/**
+ * lanyfs_chain_add() - Adds a free block to the chain being encoded.
+ * @enc:			encoder
+ * @addr:			address of free block, not a chain block
+ */
+int lanyfs_chain_add (struct lanyfs_chainenc *enc, uint64_t addr)
+{
+	union lanyfs_b *b;
+
+	if (enc->slot == enc->slots) {
+		if (enc->cur + 1 == enc->nchains) {
+			errno = ENOSPC;
+			return -1;
+		}
+		enc->cur++;
+		if (chain_start(enc))
+			return -1;
+	}
+	b = (union lanyfs_b *) (enc->batch +
+				(enc->nbatch - 1) * enc->vol->bsize);
+	lanyfs_slot_set(enc->vol, &b->chain.stream, enc->slot++, addr);
+	enc->entries++;
+	return 0;
+}
+
+/**
+ * lanyfs_chain_end() - Finishes encoding and releases the encoder.
+ * @enc:			encoder
+ *
+ * Chain blocks never reached are written empty so the chain stays intact.
+ * The in-memory superblock's free head, tail and count, or those of the
+ * metadata zone, are set to the new chain but not written.
+ */
+int lanyfs_chain_end (struct lanyfs_chainenc *enc)
+{
+	struct lanyfs_vol *vol = enc->vol;
+	int ret = 0;
+
+	while (!ret && enc->cur + 1 < enc->nchains) {
+		enc->cur++;
+		ret = chain_start(enc);
+	}
+	if (!ret)
+		ret = chain_flush(enc);
+	if (!ret && enc->zone) {
+		vol->sb->sb.zonehead = tole64(enc->chains[0]);
+		vol->sb->sb.zonetail = tole64(enc->chains[enc->nchains - 1]);
+		vol->sb->sb.zoneblocks = tole64(enc->nchains + enc->entries);
+	} else if (!ret) {
+		vol->sb->sb.freehead = tole64(enc->chains[0]);
+		vol->sb->sb.freetail = tole64(enc->chains[enc->nchains - 1]);
+		vol->sb->sb.freeblocks = tole64(enc->nchains + enc->entries);
+	}
+	free(enc->batch);
+	free(enc);
+	return ret;
+}
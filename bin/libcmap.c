@@ -0,0 +1,327 @@
+/*
+ * libcmap.c - Compressed Block Bitmaps for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Compressed bitmaps
+ *
+ * A compressed bitmap holds one bit per block in chunks of 65536 bits. A
+ * chunk with few bits set is a sorted array of 16-bit offsets, it turns
+ * into a plain bitmap of 8 KiB once the array would be larger. Chunks
+ * without any bit set take no memory at all. Used blocks of a volume tend
+ * to cluster, so the bitmap stays small even on huge volumes.
+ *
+ * Setting bits is safe from several threads, chunks are guarded by a small
+ * set of striped locks.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+#define CHUNK_SHIFT		16
+#define CHUNK_BITS		(1 << CHUNK_SHIFT)
+#define CHUNK_ARRAY_MAX		(CHUNK_BITS / 16)	/* same size as bitmap */
+#define CMAP_LOCKS		64
+
+/**
+ * struct cmap_chunk - Chunk of 65536 bits.
+ * @n:				number of bits set
+ * @cap:			capacity of array
+ * @arr:			sorted offsets of bits set, if not a bitmap
+ * @bits:			bitmap, NULL while an array
+ */
+struct cmap_chunk {
+	uint32_t		n;
+	uint32_t		cap;
+	uint16_t		*arr;
+	unsigned char		*bits;
+};
+
+/**
+ * struct lanyfs_cmap - Compressed bitmap.
+ * @bits:			number of bits
+ * @nchunks:			number of chunks
+ * @chunks:			chunks
+ * @locks:			striped chunk locks
+ */
+struct lanyfs_cmap {
+	uint64_t		bits;
+	uint64_t		nchunks;
+	struct cmap_chunk	*chunks;
+	pthread_mutex_t		locks[CMAP_LOCKS];
+};
+
+/**
+ * lanyfs_cmap_new() - Creates an empty compressed bitmap.
+ * @bits:			number of bits
+ */
+struct lanyfs_cmap *lanyfs_cmap_new (uint64_t bits)
+{
+	struct lanyfs_cmap *map;
+	int i;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return NULL;
+	map->bits = bits;
+	map->nchunks = (bits + CHUNK_BITS - 1) >> CHUNK_SHIFT;
+	map->chunks = calloc(map->nchunks + 1, sizeof(*map->chunks));
+	if (!map->chunks) {
+		free(map);
+		return NULL;
+	}
+	for (i = 0; i < CMAP_LOCKS; i++)
+		pthread_mutex_init(&map->locks[i], NULL);
+	return map;
+}
+
+/**
+ * lanyfs_cmap_bound() - Returns the most memory a compressed bitmap takes.
+ * @bits:			number of bits
+ *
+ * That is every chunk turned into a bitmap, an array is never larger.
+ */
+uint64_t lanyfs_cmap_bound (uint64_t bits)
+{
+	uint64_t nchunks = (bits + CHUNK_BITS - 1) >> CHUNK_SHIFT;
+	return sizeof(struct lanyfs_cmap) +
+	       (nchunks + 1) * sizeof(struct cmap_chunk) +
+	       nchunks * (CHUNK_BITS / 8);
+}
+
+/**
+ * chunk_find() - Binary search in an array chunk.
+ * @c:				chunk
+ * @off:			offset within chunk
+ *
+ * Returns the index of @off or where it would be inserted.
+ */
+static uint32_t chunk_find (const struct cmap_chunk *c, uint16_t off)
+{
+	uint32_t lo = 0, hi = c->n, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (c->arr[mid] < off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * chunk_to_bits() - Turns an array chunk into a bitmap chunk.
+ * @c:				chunk
+ */
+static int chunk_to_bits (struct cmap_chunk *c)
+{
+	uint32_t i;
+	c->bits = calloc(1, CHUNK_BITS / 8);
+	if (!c->bits)
+		return -1;
+	for (i = 0; i < c->n; i++)
+		lanyfs_setbit(c->bits, c->arr[i]);
+	free(c->arr);
+	c->arr = NULL;
+	c->cap = 0;
+	return 0;
+}
+
+/**
+ * chunk_set() - Sets a bit within a chunk.
+ * @c:				chunk
+ * @off:			offset within chunk
+ *
+ * Returns 1 if the bit was clear, 0 if it was set already, -1 on error.
+ */
+static int chunk_set (struct cmap_chunk *c, uint16_t off)
+{
+	uint16_t *arr;
+	uint32_t i;
+
+	if (c->bits) {
+		if (lanyfs_testbit(c->bits, off))
+			return 0;
+		lanyfs_setbit(c->bits, off);
+		c->n++;
+		return 1;
+	}
+	i = chunk_find(c, off);
+	if (i < c->n && c->arr[i] == off)
+		return 0;
+	if (c->n == CHUNK_ARRAY_MAX) {
+		if (chunk_to_bits(c))
+			return -1;
+		return chunk_set(c, off);
+	}
+	if (c->n == c->cap) {
+		arr = realloc(c->arr, (c->cap ? c->cap * 2 : 16) *
+				      sizeof(*arr));
+		if (!arr)
+			return -1;
+		c->arr = arr;
+		c->cap = c->cap ? c->cap * 2 : 16;
+	}
+	memmove(c->arr + i + 1, c->arr + i, (c->n - i) * sizeof(*c->arr));
+	c->arr[i] = off;
+	c->n++;
+	return 1;
+}
+
+/**
+ * lanyfs_cmap_set() - Sets a bit.
+ * @map:			compressed bitmap
+ * @n:				bit to set
+ *
+ * Returns 1 if the bit was clear, 0 if it was set already, -1 on error.
+ */
+int lanyfs_cmap_set (struct lanyfs_cmap *map, uint64_t n)
+{
+	uint64_t chunk = n >> CHUNK_SHIFT;
+	pthread_mutex_t *lock = &map->locks[chunk % CMAP_LOCKS];
+	int ret;
+
+	if (n >= map->bits) {
+		errno = ERANGE;
+		return -1;
+	}
+	pthread_mutex_lock(lock);
+	ret = chunk_set(&map->chunks[chunk], n & (CHUNK_BITS - 1));
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+/**
+ * chunk_test() - Tests a bit within a chunk.
+ * @c:				chunk
+ * @off:			offset within chunk
+ */
+static int chunk_test (const struct cmap_chunk *c, uint16_t off)
+{
+	uint32_t i;
+	if (c->bits)
+		return !!lanyfs_testbit(c->bits, off);
+	i = chunk_find(c, off);
+	return i < c->n && c->arr[i] == off;
+}
+
+/**
+ * lanyfs_cmap_test() - Tests a bit.
+ * @map:			compressed bitmap, not being modified
+ * @n:				bit to test
+ */
+int lanyfs_cmap_test (struct lanyfs_cmap *map, uint64_t n)
+{
+	if (n >= map->bits)
+		return 0;
+	return chunk_test(&map->chunks[n >> CHUNK_SHIFT], n & (CHUNK_BITS - 1));
+}
+
+/**
+ * lanyfs_cmap_count() - Returns the number of bits set.
+ * @map:			compressed bitmap, not being modified
+ */
+uint64_t lanyfs_cmap_count (struct lanyfs_cmap *map)
+{
+	uint64_t i, n = 0;
+	for (i = 0; i < map->nchunks; i++)
+		n += map->chunks[i].n;
+	return n;
+}
+
+/**
+ * lanyfs_cmap_next_clear() - Finds the next clear bit.
+ * @map:			compressed bitmap, not being modified
+ * @n:				bit to start at
+ *
+ * Returns the first clear bit not below @n, or the number of bits if there
+ * is none. Empty chunks are answered at once and full ones skipped.
+ */
+uint64_t lanyfs_cmap_next_clear (struct lanyfs_cmap *map, uint64_t n)
+{
+	struct cmap_chunk *c;
+	uint32_t off, i;
+
+	while (n < map->bits) {
+		c = &map->chunks[n >> CHUNK_SHIFT];
+		off = n & (CHUNK_BITS - 1);
+		if (c->n == CHUNK_BITS) {
+			n = (n | (CHUNK_BITS - 1)) + 1;
+			continue;
+		}
+		if (c->bits) {
+			while (off < CHUNK_BITS && lanyfs_testbit(c->bits, off))
+				off++;
+		} else {
+			/* walk the run of set offsets starting at off */
+			for (i = chunk_find(c, off); i < c->n &&
+			     c->arr[i] == off; i++)
+				off++;
+		}
+		if (off < CHUNK_BITS) {
+			n = (n & ~(uint64_t) (CHUNK_BITS - 1)) + off;
+			return n < map->bits ? n : map->bits;
+		}
+		n = (n | (CHUNK_BITS - 1)) + 1;
+	}
+	return map->bits;
+}
+
+/**
+ * lanyfs_cmap_free() - Releases a compressed bitmap.
+ * @map:			compressed bitmap
+ */
+void lanyfs_cmap_free (struct lanyfs_cmap *map)
+{
+	uint64_t i;
+	int l;
+	if (!map)
+		return;
+	for (i = 0; i < map->nchunks; i++) {
+		free(map->chunks[i].arr);
+		free(map->chunks[i].bits);
+	}
+	for (l = 0; l < CMAP_LOCKS; l++)
+		pthread_mutex_destroy(&map->locks[l]);
+	free(map->chunks);
+	free(map);
+}
@@ -0,0 +1,386 @@
+/*
+ * libcodec.c - Compression Codecs for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Codecs
+ *
+ * LANYFS_CODEC_LZ4 produces the LZ4 block format and is always available.
+ * The compressor is a greedy single-pass matcher with a small hash table,
+ * which is fast enough to keep up with flash media. LANYFS_CODEC_ZLIB trades
+ * speed for ratio and is only built with HAVE_ZLIB.
+ *
+ * Compressed buffers carry no header, callers store codec and sizes
+ * themselves. Every buffer is compressed independently.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef	HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "liblanyfs.h"
+
+/* parameters of the LZ4 block format */
+#define LZ4_MINMATCH		4
+#define LZ4_LASTLITERALS	5
+#define LZ4_MFLIMIT		12
+#define LZ4_MAXOFFSET		65535
+#define LZ4_HASHLOG		12
+
+/**
+ * read32() - Reads four possibly unaligned bytes.
+ * @p:				source
+ */
+static inline uint32_t read32 (const unsigned char *p)
+{
+	uint32_t n;
+	memcpy(&n, p, sizeof(n));
+	return n;
+}
+
+/**
+ * lz4_hash() - Hashes four bytes for the match finder.
+ * @seq:			bytes to hash
+ */
+static inline unsigned int lz4_hash (uint32_t seq)
+{
+	return (seq * 2654435761U) >> (32 - LZ4_HASHLOG);
+}
+
+/**
+ * lz4_putlen() - Emits the 255-continuation bytes of a length.
+ * @op:				output position
+ * @len:			length beyond the token's nibble
+ */
+static inline unsigned char *lz4_putlen (unsigned char *op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char) len;
+	return op;
+}
+
+/**
+ * lz4_compress() - Compresses a buffer to the LZ4 block format.
+ * @src:			source buffer
+ * @len:			length of source
+ * @dst:			target buffer
+ * @cap:			capacity of target buffer
+ *
+ * Returns compressed length, or 0 if the result would exceed @cap.
+ */
+static size_t lz4_compress (const unsigned char *src, size_t len,
+			    unsigned char *dst, size_t cap)
+{
+	uint32_t table[1 << LZ4_HASHLOG];
+	const unsigned char *ip = src, *anchor = src, *ref;
+	const unsigned char *end = src + len;
+	const unsigned char *mflimit = end - LZ4_MFLIMIT;
+	const unsigned char *matchlimit = end - LZ4_LASTLITERALS;
+	unsigned char *op = dst, *token;
+	unsigned int h, searches;
+	size_t lit, mlen;
+
+	memset(table, 0, sizeof(table));
+	if (len >= LZ4_MFLIMIT + 1) {
+		while (ip < mflimit) {
+			/* find a match, skipping faster through noise */
+			searches = 1 << 6;
+			while (1) {
+				h = lz4_hash(read32(ip));
+				ref = src + table[h];
+				table[h] = (uint32_t) (ip - src);
+				if (ref < ip && ip - ref <= LZ4_MAXOFFSET &&
+				    read32(ref) == read32(ip))
+					break;
+				ip += searches++ >> 6;
+				if (ip >= mflimit)
+					goto last;
+			}
+			/* extend match backwards */
+			while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+				ip--;
+				ref--;
+			}
+			/* extend match forwards */
+			mlen = LZ4_MINMATCH;
+			while (ip + mlen < matchlimit && ip[mlen] == ref[mlen])
+				mlen++;
+
+			/* emit sequence */
+			lit = ip - anchor;
+			if ((size_t) (op - dst) + lit + lit / 255 + mlen / 255 + 8 >
+			    cap)
+				return 0;
+			token = op++;
+			*token = (lit >= 15 ? 15 : lit) << 4;
+			if (lit >= 15)
+				op = lz4_putlen(op, lit - 15);
+			memcpy(op, anchor, lit);
+			op += lit;
+			*op++ = (ip - ref) & 0xff;
+			*op++ = (ip - ref) >> 8;
+			mlen -= LZ4_MINMATCH;
+			*token |= mlen >= 15 ? 15 : mlen;
+			if (mlen >= 15)
+				op = lz4_putlen(op, mlen - 15);
+			ip += mlen + LZ4_MINMATCH;
+			anchor = ip;
+		}
+	}
+last:
+	lit = end - anchor;
+	if ((size_t) (op - dst) + lit + lit / 255 + 2 > cap)
+		return 0;
+	token = op++;
+	*token = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = lz4_putlen(op, lit - 15);
+	memcpy(op, anchor, lit);
+	op += lit;
+	return op - dst;
+}
+
+/**
+ * lz4_getlen() - Reads the 255-continuation bytes of a length.
+ * @ip:				input position, advanced
+ * @end:			end of input
+ * @len:			length, increased
+ */
+static inline int lz4_getlen (const unsigned char **ip,
+			      const unsigned char *end, size_t *len)
+{
+	unsigned char c;
+	do {
+		if (*ip >= end)
+			return -1;
+		c = *(*ip)++;
+		*len += c;
+	} while (c == 255);
+	return 0;
+}
+
+/**
+ * lz4_decompress() - Decompresses an LZ4 block.
+ * @src:			compressed buffer
+ * @len:			length of compressed buffer
+ * @dst:			target buffer
+ * @dstlen:			exact length of decompressed data
+ *
+ * Every length and offset is checked, damaged input fails with EIO and
+ * never touches memory outside of the buffers.
+ */
+static int lz4_decompress (const unsigned char *src, size_t len,
+			   unsigned char *dst, size_t dstlen)
+{
+	const unsigned char *ip = src, *end = src + len;
+	unsigned char *op = dst, *oend = dst + dstlen;
+	const unsigned char *ref;
+	size_t lit, mlen, off;
+	unsigned char token;
+
+	while (ip < end) {
+		token = *ip++;
+		lit = token >> 4;
+		if (lit == 15 && lz4_getlen(&ip, end, &lit))
+			goto err;
+		if (lit > (size_t) (end - ip) || lit > (size_t) (oend - op))
+			goto err;
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == end)
+			break;
+		if (end - ip < 2)
+			goto err;
+		off = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!off || off > (size_t) (op - dst))
+			goto err;
+		mlen = token & 15;
+		if (mlen == 15 && lz4_getlen(&ip, end, &mlen))
+			goto err;
+		mlen += LZ4_MINMATCH;
+		if (mlen > (size_t) (oend - op))
+			goto err;
+		ref = op - off;
+		if (off >= mlen) {
+			memcpy(op, ref, mlen);
+			op += mlen;
+		} else {
+			/* overlapping copy repeats the pattern */
+			while (mlen--)
+				*op++ = *ref++;
+		}
+	}
+	if (op != oend)
+		goto err;
+	return 0;
+
+err:
+	errno = EIO;
+	return -1;
+}
+
+/**
+ * lanyfs_compress_bound() - Returns worst-case compressed length.
+ * @codec:			codec
+ * @len:			length of uncompressed data
+ */
+size_t lanyfs_compress_bound (int codec, size_t len)
+{
+	switch (codec) {
+#ifdef	HAVE_ZLIB
+	case LANYFS_CODEC_ZLIB:
+		return compressBound(len);
+#endif
+	case LANYFS_CODEC_LZ4:
+		return len + len / 255 + 16;
+	default:
+		return len;
+	}
+}
+
+/**
+ * lanyfs_compress() - Compresses a buffer.
+ * @codec:			codec
+ * @src:			source buffer
+ * @len:			length of source
+ * @dst:			target buffer
+ * @cap:			capacity of target buffer
+ *
+ * Returns compressed length, or 0 if the data did not fit into @cap or the
+ * codec is not available. Callers store data uncompressed in that case.
+ */
+size_t lanyfs_compress (int codec, const void *src, size_t len, void *dst,
+			size_t cap)
+{
+#ifdef	HAVE_ZLIB
+	uLongf zlen = cap;
+#endif
+	switch (codec) {
+	case LANYFS_CODEC_LZ4:
+		return lz4_compress(src, len, dst, cap);
+#ifdef	HAVE_ZLIB
+	case LANYFS_CODEC_ZLIB:
+		if (compress2(dst, &zlen, src, len, Z_DEFAULT_COMPRESSION) !=
+		    Z_OK)
+			return 0;
+		return zlen;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/**
+ * lanyfs_decompress() - Decompresses a buffer.
+ * @codec:			codec
+ * @src:			compressed buffer
+ * @len:			length of compressed buffer
+ * @dst:			target buffer
+ * @dstlen:			exact length of decompressed data
+ */
+int lanyfs_decompress (int codec, const void *src, size_t len, void *dst,
+		       size_t dstlen)
+{
+#ifdef	HAVE_ZLIB
+	uLongf zlen = dstlen;
+#endif
+	switch (codec) {
+	case LANYFS_CODEC_NONE:
+		if (len != dstlen)
+			break;
+		memcpy(dst, src, len);
+		return 0;
+	case LANYFS_CODEC_LZ4:
+		return lz4_decompress(src, len, dst, dstlen);
+#ifdef	HAVE_ZLIB
+	case LANYFS_CODEC_ZLIB:
+		if (uncompress(dst, &zlen, src, len) != Z_OK ||
+		    zlen != dstlen)
+			break;
+		return 0;
+#endif
+	default:
+		errno = ENOTSUP;
+		return -1;
+	}
+	errno = EIO;
+	return -1;
+}
+
+/**
+ * lanyfs_codec_name() - Returns the name of a codec.
+ * @codec:			codec
+ */
+const char *lanyfs_codec_name (int codec)
+{
+	switch (codec) {
+	case LANYFS_CODEC_NONE:
+		return "none";
+	case LANYFS_CODEC_LZ4:
+		return "lz4";
+	case LANYFS_CODEC_ZLIB:
+		return "zlib";
+	default:
+		return "unknown";
+	}
+}
+
+/**
+ * lanyfs_codec_parse() - Returns the codec of a name, -1 if unavailable.
+ * @name:			name of codec
+ */
+int lanyfs_codec_parse (const char *name)
+{
+	if (!strcmp(name, "none"))
+		return LANYFS_CODEC_NONE;
+	if (!strcmp(name, "lz4"))
+		return LANYFS_CODEC_LZ4;
+#ifdef	HAVE_ZLIB
+	if (!strcmp(name, "zlib"))
+		return LANYFS_CODEC_ZLIB;
+#endif
+	return -1;
+}
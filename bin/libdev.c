@@ -0,0 +1,484 @@
+/*
+ * libdev.c - Device Backends for Lanyard Filesystem.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Backends
+ *
+ * A device is anything that can be read and written at byte offsets. Plain
+ * files and block devices are handled here, other backends live in their
+ * own files and are picked by lanyfs_dev_open() from the magic bytes at the
+ * start of the file. Tools never need to know which backend they run on.
+ *
+ * Every operation passing through here is timed, see liblatency.c.
+ *
+ * Plain files and block devices with a cached profile, see libtune.c, get
+ * it applied on open. If the profile asks for direct I/O, requests aligned
+ * to the logical block size go through a second descriptor bypassing the
+ * page cache, all others stay buffered. LANYFS_TUNE=0 in the environment
+ * leaves profiles alone.
+ */
+
+#define _GNU_SOURCE		/* fallocate(), O_DIRECT */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>		/* BLKDISCARD */
+#endif
+
+#include "liblanyfs.h"
+
+/**
+ * lanyfs_fd_pread() - Reads exactly @len bytes at @pos.
+ * @fd:				file descriptor
+ * @buf:			target buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ *
+ * Reading beyond the end of file fails with EIO.
+ */
+int lanyfs_fd_pread (int fd, void *buf, size_t len, uint64_t pos)
+{
+	ssize_t n;
+	while (len) {
+		n = pread(fd, buf, len, (off_t) pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			errno = EIO;
+			return -1;
+		}
+		buf = (unsigned char *) buf + n;
+		len -= n;
+		pos += n;
+	}
+	return 0;
+}
+
+/**
+ * lanyfs_fd_pwrite() - Writes exactly @len bytes at @pos.
+ * @fd:				file descriptor
+ * @buf:			source buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ */
+int lanyfs_fd_pwrite (int fd, const void *buf, size_t len, uint64_t pos)
+{
+	ssize_t n;
+	while (len) {
+		n = pwrite(fd, buf, len, (off_t) pos);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf = (const unsigned char *) buf + n;
+		len -= n;
+		pos += n;
+	}
+	return 0;
+}
+
+/**
+ * lanyfs_fd_size() - Returns the size of a file or block device.
+ * @fd:				file descriptor
+ * @size:			size in bytes
+ */
+int lanyfs_fd_size (int fd, uint64_t *size)
+{
+	off_t end = lseek(fd, 0, SEEK_END);
+	if (end < 0)
+		return -1;
+	*size = (uint64_t) end;
+	return 0;
+}
+
+/**
+ * lanyfs_fd_direct() - Opens a file again, bypassing the page cache.
+ * @fd:				file descriptor
+ * @rdonly:			open read-only
+ *
+ * Returns the new descriptor or -1 with errno set, EOPNOTSUPP where direct
+ * I/O is not available.
+ */
+int lanyfs_fd_direct (int fd, int rdonly)
+{
+#if defined(__linux__) && defined(O_DIRECT)
+	char path[64];
+
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+	return open(path, (rdonly ? O_RDONLY : O_RDWR) | O_DIRECT);
+#else
+	(void) fd;
+	(void) rdonly;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/**
+ * file_direct() - Returns the direct descriptor fitting a request.
+ * @dev:			device
+ * @buf:			buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ *
+ * Returns -1 if the request has to stay buffered.
+ */
+static int file_direct (struct lanyfs_dev *dev, const void *buf, size_t len,
+			uint64_t pos)
+{
+	int *dfd = dev->priv;
+
+	if (!dfd || (((uintptr_t) buf | len | pos) & (dev->tune.logical - 1)))
+		return -1;
+	return *dfd;
+}
+
+/**
+ * file_pread() - Reads from a plain file or block device.
+ * @dev:			device
+ * @buf:			target buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ */
+static int file_pread (struct lanyfs_dev *dev, void *buf, size_t len,
+		       uint64_t pos)
+{
+	int fd = file_direct(dev, buf, len, pos);
+
+	return lanyfs_fd_pread(fd < 0 ? dev->fd : fd, buf, len, pos);
+}
+
+/**
+ * file_pwrite() - Writes to a plain file or block device.
+ * @dev:			device
+ * @buf:			source buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ */
+static int file_pwrite (struct lanyfs_dev *dev, const void *buf, size_t len,
+			uint64_t pos)
+{
+	int fd = file_direct(dev, buf, len, pos);
+
+	return lanyfs_fd_pwrite(fd < 0 ? dev->fd : fd, buf, len, pos);
+}
+
+/**
+ * file_sync() - Syncs a plain file or block device.
+ * @dev:			device
+ */
+static int file_sync (struct lanyfs_dev *dev)
+{
+	return fsync(dev->fd);
+}
+
+/**
+ * file_discard() - Discards a range of a plain file or block device.
+ * @dev:			device
+ * @len:			number of bytes
+ * @pos:			byte offset
+ *
+ * Block devices pass the range on to the hardware, plain files get a hole
+ * punched. Fails with EOPNOTSUPP where neither is available.
+ */
+static int file_discard (struct lanyfs_dev *dev, uint64_t len, uint64_t pos)
+{
+#ifdef __linux__
+	struct stat st;
+	uint64_t range[2] = { pos, len };
+
+	if (fstat(dev->fd, &st))
+		return -1;
+	if (S_ISBLK(st.st_mode))
+		return ioctl(dev->fd, BLKDISCARD, range);
+#ifdef FALLOC_FL_PUNCH_HOLE
+	return fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			 (off_t) pos, (off_t) len);
+#endif
+#endif
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+/**
+ * file_close() - Closes a plain file or block device.
+ * @dev:			device
+ */
+static int file_close (struct lanyfs_dev *dev)
+{
+	int *dfd = dev->priv;
+
+	if (dfd) {
+		close(*dfd);
+		free(dfd);
+	}
+	return close(dev->fd);
+}
+
+static const struct lanyfs_dev_ops file_ops = {
+	.name	= "file",
+	.pread	= file_pread,
+	.pwrite	= file_pwrite,
+	.sync	= file_sync,
+	.discard = file_discard,
+	.close	= file_close,
+};
+
+/**
+ * lanyfs_dev_open() - Opens a device with the matching backend.
+ * @path:			path of device or image file
+ * @rdonly:			open read-only
+ *
+ * Reads are verified against a hash tree if LANYFS_VERITY asks for it, see
+ * lanyfs_verity_auto().
+ */
+struct lanyfs_dev *lanyfs_dev_open (const char *path, int rdonly)
+{
+	struct lanyfs_dev *dev;
+	struct lanyfs_tune tune;
+	unsigned char magic[LANYFS_DEV_MAGIC_LEN];
+	const char *env;
+	int fd, err;
+
+	fd = open(path, rdonly ? O_RDONLY : O_RDWR);
+	if (fd < 0)
+		return NULL;
+	if (lanyfs_fd_pread(fd, magic, sizeof(magic), 0))
+		memset(magic, 0, sizeof(magic));
+	if (!memcmp(magic, LANYFS_OVERLAY_MAGIC, sizeof(magic)))
+		return lanyfs_verity_auto(lanyfs_overlay_open(fd, rdonly),
+					  path);
+	if (!memcmp(magic, LANYFS_ARCHIVE_MAGIC, sizeof(magic)))
+		return lanyfs_verity_auto(lanyfs_archive_open(fd, rdonly),
+					  path);
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		goto err;
+	dev->ops = &file_ops;
+	dev->fd = fd;
+	dev->rdonly = rdonly;
+	if (lanyfs_fd_size(fd, &dev->size)) {
+		free(dev);
+		goto err;
+	}
+	env = getenv("LANYFS_TUNE");
+	if ((!env || strcmp(env, "0")) && !lanyfs_tune_probe(dev, &tune) &&
+	    !lanyfs_tune_load(&tune))
+		lanyfs_dev_tune(dev, &tune);
+	return lanyfs_verity_auto(dev, path);
+
+err:
+	err = errno;
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * lanyfs_dev_pread() - Reads from a device.
+ * @dev:			device
+ * @buf:			target buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ */
+int lanyfs_dev_pread (struct lanyfs_dev *dev, void *buf, size_t len,
+		      uint64_t pos)
+{
+	uint64_t start = lanyfs_lat_now();
+	int ret = dev->ops->pread(dev, buf, len, pos);
+	lanyfs_lat_record(LANYFS_LAT_READ, lanyfs_lat_now() - start);
+	return ret;
+}
+
+/**
+ * lanyfs_dev_pwrite() - Writes to a device.
+ * @dev:			device
+ * @buf:			source buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ */
+int lanyfs_dev_pwrite (struct lanyfs_dev *dev, const void *buf, size_t len,
+		       uint64_t pos)
+{
+	uint64_t start;
+	int ret;
+
+	if (dev->rdonly || !dev->ops->pwrite) {
+		errno = EROFS;
+		return -1;
+	}
+	start = lanyfs_lat_now();
+	ret = dev->ops->pwrite(dev, buf, len, pos);
+	lanyfs_lat_record(LANYFS_LAT_WRITE, lanyfs_lat_now() - start);
+	return ret;
+}
+
+/**
+ * lanyfs_dev_sync() - Makes all writes to a device durable.
+ * @dev:			device
+ */
+int lanyfs_dev_sync (struct lanyfs_dev *dev)
+{
+	uint64_t start;
+	int ret;
+
+	if (dev->rdonly || !dev->ops->sync)
+		return 0;
+	start = lanyfs_lat_now();
+	ret = dev->ops->sync(dev);
+	lanyfs_lat_record(LANYFS_LAT_FLUSH, lanyfs_lat_now() - start);
+	return ret;
+}
+
+/**
+ * lanyfs_dev_discard() - Tells a device a range is no longer in use.
+ * @dev:			device
+ * @len:			number of bytes
+ * @pos:			byte offset
+ *
+ * Contents of the range are undefined afterwards. Fails with EOPNOTSUPP
+ * if the backend cannot discard.
+ */
+int lanyfs_dev_discard (struct lanyfs_dev *dev, uint64_t len, uint64_t pos)
+{
+	uint64_t start;
+	int ret;
+
+	if (dev->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (!dev->ops->discard) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	start = lanyfs_lat_now();
+	ret = dev->ops->discard(dev, len, pos);
+	lanyfs_lat_record(LANYFS_LAT_DISCARD, lanyfs_lat_now() - start);
+	return ret;
+}
+
+/**
+ * lanyfs_dev_close() - Syncs and closes a device.
+ * @dev:			device
+ */
+int lanyfs_dev_close (struct lanyfs_dev *dev)
+{
+	int ret = 0;
+	if (!dev)
+		return 0;
+	if (lanyfs_dev_sync(dev))
+		ret = -1;
+	if (dev->ops->close(dev))
+		ret = -1;
+	free(dev);
+	return ret;
+}
+
+/**
+ * lanyfs_dev_tune() - Applies an I/O profile to a device.
+ * @dev:			device, plain file or block device
+ * @tune:			profile
+ *
+ * Direct I/O is only ever used on block devices. Fails with EOPNOTSUPP on
+ * other backends.
+ */
+int lanyfs_dev_tune (struct lanyfs_dev *dev, const struct lanyfs_tune *tune)
+{
+	struct stat st;
+	int *dfd = dev->priv;
+
+	if (dev->ops != &file_ops) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (fstat(dev->fd, &st))
+		return -1;
+	if (tune->direct && S_ISBLK(st.st_mode) && !dfd) {
+		dfd = malloc(sizeof(*dfd));
+		if (!dfd)
+			return -1;
+		*dfd = lanyfs_fd_direct(dev->fd, dev->rdonly);
+		if (*dfd < 0) {
+			free(dfd);
+			return -1;
+		}
+		dev->priv = dfd;
+	} else if (!tune->direct && dfd) {
+		close(*dfd);
+		free(dfd);
+		dev->priv = NULL;
+	}
+	dev->tune = *tune;
+	return 0;
+}
+
+/**
+ * lanyfs_dev_batch() - Returns the preferred request size of a device.
+ * @dev:			device
+ */
+size_t lanyfs_dev_batch (struct lanyfs_dev *dev)
+{
+	return dev->tune.batch ? dev->tune.batch : LANYFS_TUNE_BATCH;
+}
+
+/**
+ * lanyfs_dev_threads() - Limits a number of threads to what suits a device.
+ * @dev:			device
+ * @threads:			number of threads wanted
+ *
+ * Threads issuing I/O beyond the preferred queue depth only make a
+ * spinning disk seek. LANYFS_THREADS in the environment still wins.
+ */
+int lanyfs_dev_threads (struct lanyfs_dev *dev, int threads)
+{
+	const char *env = getenv("LANYFS_THREADS");
+
+	if ((env && atoi(env) > 0) || !dev->tune.batch)
+		return threads;
+	return threads < dev->tune.depth ? threads : dev->tune.depth;
+}
@@ -0,0 +1,412 @@
+/*
+ * libendian.c - Byte Order Conversion for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Canonical byte order
+ *
+ * Most of the library reads and writes single fields through tole*() and
+ * fromle*() and leaves blocks in on-disk byte order. The functions in here
+ * convert every integer field of a whole block at once instead, for tools
+ * that rather build or inspect blocks in host byte order. Converting is
+ * its own inverse, the same call turns a host block into an on-disk block
+ * and back. Without LANYFS_SWAP all of this is a no-op.
+ *
+ * Each block type is described by a table of its integer fields. No field
+ * crosses a 16 byte boundary, so the table compiles into one byte shuffle
+ * per 16 bytes of header, which SSSE3 applies in a single instruction.
+ * Hosts without it swap field by field. Fields behind the lanes, like the
+ * superblock's metadata zone after its label, go in a separate table that
+ * is always swapped field by field.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+#if LANYFS_SWAP && (defined(__x86_64__) || defined(__i386__)) && \
+    defined(__GNUC__)
+#include <tmmintrin.h>
+#define CANON_SSSE3
+#endif
+
+#define CANON_LANES		8	/* header bytes covered, times 16 */
+
+/**
+ * struct canon_field - Integer field of a block.
+ * @off:			offset within block
+ * @len:			length in bytes, 0 ends a table
+ */
+struct canon_field {
+	uint16_t		off;
+	uint8_t			len;
+};
+
+/* fails to compile if a field lies beyond the lanes */
+#define FIELD(s, m)	{ offsetof(struct s, m) +				\
+			  0 * sizeof(char[offsetof(struct s, m) +		\
+					  sizeof(((struct s *) 0)->m) <=	\
+					  CANON_LANES * 16 ? 1 : -1]),		\
+			  sizeof(((struct s *) 0)->m) }
+#define TAIL_FIELD(s, m) { offsetof(struct s, m), sizeof(((struct s *) 0)->m) }
+#define TS_FIELDS(s, m)	FIELD(s, m.year), FIELD(s, m.nsec), FIELD(s, m.offset)
+
+static const struct canon_field sb_fields[] = {
+	FIELD(lanyfs_sb, wrcnt),
+	FIELD(lanyfs_sb, magic),
+	FIELD(lanyfs_sb, rootdir),
+	FIELD(lanyfs_sb, blocks),
+	FIELD(lanyfs_sb, freehead),
+	FIELD(lanyfs_sb, freetail),
+	FIELD(lanyfs_sb, freeblocks),
+	TS_FIELDS(lanyfs_sb, created),
+	TS_FIELDS(lanyfs_sb, updated),
+	TS_FIELDS(lanyfs_sb, checked),
+	FIELD(lanyfs_sb, badblocks),
+	{ 0, 0 }
+};
+
+static const struct canon_field sb_tail[] = {
+	TAIL_FIELD(lanyfs_sb, zonehead),
+	TAIL_FIELD(lanyfs_sb, zonetail),
+	TAIL_FIELD(lanyfs_sb, zoneblocks),
+	TAIL_FIELD(lanyfs_sb, zoneend),
+	{ 0, 0 }
+};
+
+static const struct canon_field dir_fields[] = {
+	FIELD(lanyfs_dir, wrcnt),
+	FIELD(lanyfs_dir, btree.left),
+	FIELD(lanyfs_dir, btree.right),
+	FIELD(lanyfs_dir, subtree),
+	TS_FIELDS(lanyfs_dir, meta.created),
+	TS_FIELDS(lanyfs_dir, meta.modified),
+	FIELD(lanyfs_dir, meta.attr),
+	{ 0, 0 }
+};
+
+static const struct canon_field file_fields[] = {
+	FIELD(lanyfs_file, wrcnt),
+	FIELD(lanyfs_file, btree.left),
+	FIELD(lanyfs_file, btree.right),
+	FIELD(lanyfs_file, data),
+	FIELD(lanyfs_file, size),
+	FIELD(lanyfs_file, stored),
+	TS_FIELDS(lanyfs_file, meta.created),
+	TS_FIELDS(lanyfs_file, meta.modified),
+	FIELD(lanyfs_file, meta.attr),
+	{ 0, 0 }
+};
+
+static const struct canon_field chain_fields[] = {
+	FIELD(lanyfs_chain, wrcnt),
+	FIELD(lanyfs_chain, next),
+	{ 0, 0 }
+};
+
+static const struct canon_field ext_fields[] = {
+	FIELD(lanyfs_ext, wrcnt),
+	{ 0, 0 }
+};
+
+/**
+ * struct canon_layout - Compiled conversion of a block type.
+ * @fields:			integer fields within the lanes
+ * @tail:			integer fields behind the lanes, may be NULL
+ * @lanes:			number of 16 byte lanes holding fields
+ * @used:			lane holds at least one field
+ * @shuf:			byte shuffle of each lane
+ */
+struct canon_layout {
+	const struct canon_field *fields;
+	const struct canon_field *tail;
+	int			lanes;
+	unsigned char		used[CANON_LANES];
+	unsigned char		shuf[CANON_LANES][16];
+};
+
+enum {
+	CANON_SB,
+	CANON_DIR,
+	CANON_FILE,
+	CANON_CHAIN,
+	CANON_EXT,
+	CANON_KINDS,
+};
+
+static struct canon_layout layouts[CANON_KINDS] = {
+	[CANON_SB] = { .fields = sb_fields, .tail = sb_tail },
+	[CANON_DIR] = { .fields = dir_fields },
+	[CANON_FILE] = { .fields = file_fields },
+	[CANON_CHAIN] = { .fields = chain_fields },
+	[CANON_EXT] = { .fields = ext_fields },
+};
+
+static pthread_once_t canon_once = PTHREAD_ONCE_INIT;
+static int canon_simd = 0;
+
+/**
+ * canon_init() - Compiles all field tables into byte shuffles.
+ */
+static void canon_init (void)
+{
+	const struct canon_field *f;
+	struct canon_layout *l;
+	int k, i, end;
+
+	for (k = 0; k < CANON_KINDS; k++) {
+		l = &layouts[k];
+		for (i = 0; i < CANON_LANES * 16; i++)
+			l->shuf[i / 16][i % 16] = i % 16;
+		for (f = l->fields; f->len; f++) {
+			for (i = 0; i < f->len; i++)
+				l->shuf[f->off / 16][(f->off + i) % 16] =
+					(f->off + f->len - 1 - i) % 16;
+			l->used[f->off / 16] = 1;
+			end = (f->off + f->len + 15) / 16;
+			if (end > l->lanes)
+				l->lanes = end;
+		}
+	}
+#ifdef CANON_SSSE3
+	__builtin_cpu_init();
+	canon_simd = __builtin_cpu_supports("ssse3");
+#endif
+}
+
+#ifdef CANON_SSSE3
+/**
+ * canon_ssse3() - Converts blocks with one byte shuffle per lane.
+ * @l:				layout of blocks
+ * @buf:			first block
+ * @n:				number of blocks
+ * @bsize:			distance between blocks in bytes
+ */
+__attribute__((target("ssse3")))
+static void canon_ssse3 (const struct canon_layout *l, unsigned char *buf,
+			 size_t n, size_t bsize)
+{
+	__m128i shuf[CANON_LANES], x;
+	int i;
+
+	for (i = 0; i < l->lanes; i++)
+		shuf[i] = _mm_loadu_si128((const __m128i *) l->shuf[i]);
+	for (; n; n--, buf += bsize) {
+		for (i = 0; i < l->lanes; i++) {
+			if (!l->used[i])
+				continue;
+			x = _mm_loadu_si128((const __m128i *) (buf + i * 16));
+			x = _mm_shuffle_epi8(x, shuf[i]);
+			_mm_storeu_si128((__m128i *) (buf + i * 16), x);
+		}
+	}
+}
+#endif
+
+/**
+ * canon_scalar() - Converts blocks field by field.
+ * @fields:			integer fields
+ * @buf:			first block
+ * @n:				number of blocks
+ * @bsize:			distance between blocks in bytes
+ */
+static void canon_scalar (const struct canon_field *fields,
+			  unsigned char *buf, size_t n, size_t bsize)
+{
+	const struct canon_field *f;
+	uint16_t n16;
+	uint32_t n32;
+	uint64_t n64;
+
+	for (; n; n--, buf += bsize) {
+		for (f = fields; f->len; f++) {
+			switch (f->len) {
+			case 2:
+				memcpy(&n16, buf + f->off, 2);
+				n16 = bswap_16(n16);
+				memcpy(buf + f->off, &n16, 2);
+				break;
+			case 4:
+				memcpy(&n32, buf + f->off, 4);
+				n32 = bswap_32(n32);
+				memcpy(buf + f->off, &n32, 4);
+				break;
+			case 8:
+				memcpy(&n64, buf + f->off, 8);
+				n64 = bswap_64(n64);
+				memcpy(buf + f->off, &n64, 8);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * canon() - Converts blocks of one layout.
+ * @kind:			layout of blocks
+ * @buf:			first block
+ * @n:				number of blocks
+ * @bsize:			distance between blocks in bytes
+ */
+static void canon (int kind, void *buf, size_t n, size_t bsize)
+{
+	const struct canon_layout *l = &layouts[kind];
+
+	if (!LANYFS_SWAP)
+		return;
+	pthread_once(&canon_once, canon_init);
+#ifdef CANON_SSSE3
+	if (canon_simd)
+		canon_ssse3(l, buf, n, bsize);
+	else
+#endif
+		canon_scalar(l->fields, buf, n, bsize);
+	if (l->tail)
+		canon_scalar(l->tail, buf, n, bsize);
+}
+
+/**
+ * lanyfs_canon_sb() - Converts all fields of a superblock.
+ * @sb:				superblock
+ */
+void lanyfs_canon_sb (struct lanyfs_sb *sb)
+{
+	canon(CANON_SB, sb, 1, 0);
+}
+
+/**
+ * lanyfs_canon_dir() - Converts all fields of a directory block.
+ * @dir:			directory block
+ */
+void lanyfs_canon_dir (struct lanyfs_dir *dir)
+{
+	canon(CANON_DIR, dir, 1, 0);
+}
+
+/**
+ * lanyfs_canon_file() - Converts all fields of a file block.
+ * @file:			file block
+ */
+void lanyfs_canon_file (struct lanyfs_file *file)
+{
+	canon(CANON_FILE, file, 1, 0);
+}
+
+/**
+ * lanyfs_canon_chain() - Converts all fields of a chain block.
+ * @chain:			chain block
+ *
+ * The address stream is a byte stream and needs no conversion.
+ */
+void lanyfs_canon_chain (struct lanyfs_chain *chain)
+{
+	canon(CANON_CHAIN, chain, 1, 0);
+}
+
+/**
+ * lanyfs_canon_ext() - Converts all fields of an extender block.
+ * @ext:			extender block
+ */
+void lanyfs_canon_ext (struct lanyfs_ext *ext)
+{
+	canon(CANON_EXT, ext, 1, 0);
+}
+
+/**
+ * lanyfs_canon_blocks() - Converts an array of blocks of the same type.
+ * @type:			block type
+ * @buf:			first block
+ * @n:				number of blocks
+ * @bsize:			blocksize in bytes
+ *
+ * Data, free and bad blocks have no fields and are left alone. Fails with
+ * EINVAL on unknown types.
+ */
+int lanyfs_canon_blocks (int type, void *buf, size_t n, size_t bsize)
+{
+	switch (type) {
+	case LANYFS_TYPE_SB:
+		canon(CANON_SB, buf, n, bsize);
+		break;
+	case LANYFS_TYPE_DIR:
+		canon(CANON_DIR, buf, n, bsize);
+		break;
+	case LANYFS_TYPE_FILE:
+		canon(CANON_FILE, buf, n, bsize);
+		break;
+	case LANYFS_TYPE_CHAIN:
+		canon(CANON_CHAIN, buf, n, bsize);
+		break;
+	case LANYFS_TYPE_EXT:
+		canon(CANON_EXT, buf, n, bsize);
+		break;
+	case LANYFS_TYPE_DATA:
+	case LANYFS_TYPE_FREE:
+	case LANYFS_TYPE_BAD:
+		break;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * lanyfs_canon_block() - Converts a block according to its type.
+ * @b:				block
+ *
+ * The type byte reads the same in either byte order.
+ */
+int lanyfs_canon_block (union lanyfs_b *b)
+{
+	return lanyfs_canon_blocks(b->raw.type, b, 1, 0);
+}
+
+/**
+ * lanyfs_canon_impl() - Returns the name of the conversion in use.
+ */
+const char *lanyfs_canon_impl (void)
+{
+	if (!LANYFS_SWAP)
+		return "none";
+	pthread_once(&canon_once, canon_init);
+	return canon_simd ? "ssse3" : "scalar";
+}
@@ -0,0 +1,674 @@
+/*
+ * libfile.c - Read-Only File Access for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: File access
+ *
+ * Files and directories are read through handles much like POSIX file
+ * descriptors. Opening a file decodes its extender tree once into a sorted
+ * list of runs of consecutive data blocks, so every later read at any
+ * offset costs a binary search and one device read per run touched.
+ * Opening a directory lists its binary tree in name order once, reading it
+ * is then a matter of copying entries.
+ *
+ * Files with LANYFS_ATTR_COMPRESSED set hold a stream of chunks instead of
+ * their contents. Every chunk but the last covers 2^chunk bytes of the file
+ * and is compressed on its own. The stream starts with the chunk index,
+ * one little endian 64 bit offset per chunk plus the length of the stream,
+ * so the chunks covering any range of the file are found without reading
+ * the ones before. A chunk stored with the length it covers is not
+ * compressed at all. Opening such a file reads the chunk index once and
+ * sets up scratch buffers for one chunk. The chunk decompressed last stays
+ * in the handle, so small sequential reads decompress every chunk once.
+ *
+ * Handles never change after they are opened and reads are positional, so
+ * a volume and its handles may be used by any number of threads at once.
+ * Only the chunk kept by a handle of a compressed file is shared, threads
+ * reading through the same such handle take turns on its lock.
+ * Path lookups of concurrent threads meet in the sharded block cache only,
+ * see libcache.c.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+/**
+ * struct file_run - Run of consecutive data blocks.
+ * @iblock:			index of first block within file
+ * @addr:			address of first block
+ * @n:				number of blocks
+ */
+struct file_run {
+	uint64_t		iblock;
+	uint64_t		addr;
+	uint64_t		n;
+};
+
+/**
+ * struct lanyfs_fh - Handle of an open file or directory.
+ * @vol:			volume
+ * @st:				status at time of opening
+ * @runs:			data block runs of a file, ordered by index
+ * @nruns:			number of runs
+ * @ents:			entries of a directory, ordered by name
+ * @nents:			number of entries
+ * @stored:			length of data stream, the size unless compressed
+ * @codec:			codec of chunks of a compressed file
+ * @chunk:			size of chunks (exponent to base 2)
+ * @chunks:			chunk index of a compressed file, one offset per
+ * 				chunk plus the length of the stream
+ * @nchunks:			number of chunks
+ * @lock:			protects the scratch buffers and @cached
+ * @packed:			scratch buffer of a stored chunk
+ * @plain:			decompressed chunk
+ * @cached:			index plus one of chunk held in @plain, 0 if none
+ */
+struct lanyfs_fh {
+	struct lanyfs_vol	*vol;
+	struct lanyfs_stat	st;
+	struct file_run		*runs;
+	size_t			nruns;
+	struct lanyfs_dirent	*ents;
+	size_t			nents;
+	uint64_t		stored;
+	int			codec;
+	int			chunk;
+	uint64_t		*chunks;
+	uint64_t		nchunks;
+	pthread_mutex_t		lock;
+	unsigned char		*packed;
+	unsigned char		*plain;
+	uint64_t		cached;
+};
+
+/**
+ * struct file_map - State of decoding an extender tree.
+ * @runs:			runs found so far
+ * @n:				number of runs
+ * @cap:			number of runs allocated
+ * @nblocks:			number of data blocks the file size allows
+ */
+struct file_map {
+	struct file_run		*runs;
+	size_t			n;
+	size_t			cap;
+	uint64_t		nblocks;
+};
+
+/**
+ * lanyfs_open_volume() - Opens a volume for reading.
+ * @path:			path to device or image
+ * @cache:			number of blocks to cache, 0 for no cache
+ *
+ * The cache holds directory, file and extender blocks read while opening
+ * handles. File data is read around it.
+ */
+struct lanyfs_vol *lanyfs_open_volume (const char *path, size_t cache)
+{
+	struct lanyfs_vol *vol;
+	int err;
+
+	vol = lanyfs_vol_open(path, 1);
+	if (vol && cache && lanyfs_vol_cache(vol, cache)) {
+		err = errno;
+		lanyfs_vol_close(vol);
+		errno = err;
+		return NULL;
+	}
+	return vol;
+}
+
+/**
+ * lanyfs_close_volume() - Closes a volume opened for reading.
+ * @vol:			volume, all handles closed
+ */
+int lanyfs_close_volume (struct lanyfs_vol *vol)
+{
+	return lanyfs_vol_close(vol);
+}
+
+/**
+ * fill_stat() - Fills status from a directory or file block.
+ * @vol:			volume
+ * @addr:			address of block
+ * @b:				the block
+ * @st:				status to fill
+ */
+static int fill_stat (struct lanyfs_vol *vol, uint64_t addr,
+		      union lanyfs_b *b, struct lanyfs_stat *st)
+{
+	if (b->raw.type != LANYFS_TYPE_DIR &&
+	    b->raw.type != LANYFS_TYPE_FILE) {
+		errno = EIO;
+		return -1;
+	}
+	memset(st, 0, sizeof(*st));
+	st->addr = addr;
+	st->type = b->raw.type;
+	st->attr = fromle16(b->vi_meta.attr);
+	st->created = b->vi_meta.created;
+	st->modified = b->vi_meta.modified;
+	memcpy(st->name, b->vi_meta.name, LANYFS_NAME_LENGTH);
+	if (b->raw.type == LANYFS_TYPE_FILE)
+		st->size = fromle64(b->file.size);
+	return 0;
+}
+
+/**
+ * map_visit() - Adds a data block to the runs of a file.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			decoding state
+ */
+static int map_visit (struct lanyfs_vol *vol, uint64_t addr, int type,
+		      uint64_t iblock, void *arg)
+{
+	struct file_map *map = arg;
+	struct file_run *r, *runs;
+	size_t cap;
+
+	if (type != LANYFS_TYPE_DATA)
+		return 0;
+	if (iblock >= map->nblocks) {
+		errno = EIO;
+		return -1;
+	}
+	r = map->n ? &map->runs[map->n - 1] : NULL;
+	if (r && iblock < r->iblock + r->n) {
+		errno = EIO;
+		return -1;
+	}
+	if (r && iblock == r->iblock + r->n && addr == r->addr + r->n) {
+		r->n++;
+		return 0;
+	}
+	if (map->n == map->cap) {
+		cap = map->cap ? map->cap * 2 : 16;
+		runs = realloc(map->runs, cap * sizeof(*runs));
+		if (!runs)
+			return -1;
+		map->runs = runs;
+		map->cap = cap;
+	}
+	r = &map->runs[map->n++];
+	r->iblock = iblock;
+	r->addr = addr;
+	r->n = 1;
+	return 0;
+}
+
+/**
+ * load_runs() - Decodes the extender tree of a file.
+ * @fh:				handle of file
+ * @data:			address of root extender
+ */
+static int load_runs (struct lanyfs_fh *fh, uint64_t data)
+{
+	struct lanyfs_vol *vol = fh->vol;
+	struct file_map map;
+	size_t i;
+
+	memset(&map, 0, sizeof(map));
+	map.nblocks = (fh->stored + vol->bsize - 1) >> vol->blocksize;
+	if (lanyfs_ext_walk(vol, data, map_visit, &map)) {
+		free(map.runs);
+		return -1;
+	}
+	fh->runs = map.runs;
+	fh->nruns = map.n;
+	for (i = 0; i < map.n; i++)
+		fh->st.blocks += map.runs[i].n;
+	return 0;
+}
+
+/**
+ * find_run() - Finds the run holding or following a data block.
+ * @fh:				handle of file
+ * @iblock:			index of data block within file
+ *
+ * Returns the index of the first run not ending before @iblock.
+ */
+static size_t find_run (struct lanyfs_fh *fh, uint64_t iblock)
+{
+	size_t lo = 0, hi = fh->nruns, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (fh->runs[mid].iblock + fh->runs[mid].n <= iblock)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * read_stream() - Reads from the data stream of a file.
+ * @fh:				handle of file, runs loaded
+ * @buf:			buffer
+ * @len:			number of bytes to read, within the stream
+ * @off:			offset within stream
+ *
+ * The stream is the file itself unless the file is compressed. Blocks not
+ * backed by any data block read as zeros.
+ */
+static int read_stream (struct lanyfs_fh *fh, void *buf, size_t len,
+			uint64_t off)
+{
+	struct lanyfs_vol *vol = fh->vol;
+	unsigned char *p = buf;
+	struct file_run *r;
+	uint64_t iblock, end = off + len, n;
+	size_t i;
+
+	i = find_run(fh, off >> vol->blocksize);
+	while (off < end) {
+		iblock = off >> vol->blocksize;
+		r = i < fh->nruns ? &fh->runs[i] : NULL;
+		if (!r || iblock < r->iblock) {
+			/* hole up to the next run */
+			n = r ? (r->iblock << vol->blocksize) - off : end - off;
+			if (n > end - off)
+				n = end - off;
+			memset(p, 0, n);
+		} else {
+			n = ((r->iblock + r->n) << vol->blocksize) - off;
+			if (n > end - off)
+				n = end - off;
+			if (lanyfs_dev_pread(vol->dev, p, n,
+					     ((r->addr - r->iblock) <<
+					      vol->blocksize) + off))
+				return -1;
+			i++;
+		}
+		p += n;
+		off += n;
+	}
+	return 0;
+}
+
+/**
+ * load_chunks() - Reads the chunk index of a compressed file.
+ * @fh:				handle of file, runs loaded
+ */
+static int load_chunks (struct lanyfs_fh *fh)
+{
+	uint64_t len = (uint64_t) 1 << fh->chunk, i;
+
+	fh->nchunks = (fh->st.size + len - 1) >> fh->chunk;
+	if ((fh->nchunks + 1) * sizeof(uint64_t) > fh->stored) {
+		errno = EIO;
+		return -1;
+	}
+	fh->chunks = malloc((fh->nchunks + 1) * sizeof(uint64_t));
+	if (!fh->chunks || read_stream(fh, fh->chunks, (fh->nchunks + 1) *
+				       sizeof(uint64_t), 0))
+		return -1;
+	for (i = 0; i <= fh->nchunks; i++)
+		fh->chunks[i] = fromle64(fh->chunks[i]);
+	/* chunks are never stored larger than they are */
+	if (fh->chunks[0] != (fh->nchunks + 1) * sizeof(uint64_t) ||
+	    fh->chunks[fh->nchunks] != fh->stored)
+		goto err;
+	for (i = 0; i < fh->nchunks; i++) {
+		if (fh->chunks[i + 1] < fh->chunks[i] ||
+		    fh->chunks[i + 1] - fh->chunks[i] > len)
+			goto err;
+	}
+	return 0;
+
+err:
+	errno = EIO;
+	return -1;
+}
+
+/**
+ * load_entries() - Lists the entries of a directory in name order.
+ * @fh:				handle of directory
+ * @subtree:			binary tree root of directory's contents
+ */
+static int load_entries (struct lanyfs_fh *fh, uint64_t subtree)
+{
+	struct lanyfs_vol *vol = fh->vol;
+	struct lanyfs_addrvec stack = {NULL, 0, 0};
+	struct lanyfs_dirent *ents = NULL, *e;
+	union lanyfs_b *b;
+	uint64_t cur = subtree, hops = 0;
+	size_t n = 0, cap = 0;
+
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	/* in-order walk, left pointers are followed before reading a node */
+	while (cur || stack.n) {
+		if (cur) {
+			if (!lanyfs_valid_addr(vol, cur) ||
+			    ++hops > vol->blocks) {
+				errno = EIO;
+				goto err;
+			}
+			if (lanyfs_addrvec_push(&stack, cur) ||
+			    lanyfs_read_block(vol, cur, b))
+				goto err;
+			cur = fromle64(b->vi_btree.left);
+			continue;
+		}
+		cur = stack.a[--stack.n];
+		if (lanyfs_read_block(vol, cur, b))
+			goto err;
+		if (n == cap) {
+			cap = cap ? cap * 2 : 64;
+			e = realloc(ents, cap * sizeof(*e));
+			if (!e)
+				goto err;
+			ents = e;
+		}
+		e = &ents[n++];
+		if (b->raw.type != LANYFS_TYPE_DIR &&
+		    b->raw.type != LANYFS_TYPE_FILE) {
+			errno = EIO;
+			goto err;
+		}
+		e->addr = cur;
+		e->type = b->raw.type;
+		e->wrcnt = fromle16(b->raw.wrcnt);
+		e->attr = fromle16(b->vi_meta.attr);
+		e->size = b->raw.type == LANYFS_TYPE_FILE ?
+			  fromle64(b->file.size) : 0;
+		e->modified = b->vi_meta.modified;
+		memcpy(e->name, b->vi_meta.name, LANYFS_NAME_LENGTH);
+		e->name[LANYFS_NAME_LENGTH] = '\0';
+		cur = fromle64(b->vi_btree.right);
+	}
+	fh->ents = ents;
+	fh->nents = n;
+	lanyfs_addrvec_free(&stack);
+	free(b);
+	return 0;
+
+err:
+	lanyfs_addrvec_free(&stack);
+	free(ents);
+	free(b);
+	return -1;
+}
+
+/**
+ * lanyfs_open() - Opens a file or directory for reading.
+ * @vol:			volume
+ * @path:			slash separated path, relative to root directory
+ *
+ * The extender tree of a file or the entries of a directory are loaded at
+ * once, later calls on the handle read nothing but file data.
+ */
+struct lanyfs_fh *lanyfs_open (struct lanyfs_vol *vol, const char *path)
+{
+	uint64_t addr;
+
+	if (lanyfs_lookup(vol, path, &addr, NULL))
+		return NULL;
+	return lanyfs_open_addr(vol, addr);
+}
+
+/**
+ * lanyfs_open_addr() - Opens a file or directory by its block address.
+ * @vol:			volume
+ * @addr:			address of directory or file block, e.g. from
+ * 				a directory entry
+ *
+ * Saves the path lookup when walking the tree.
+ */
+struct lanyfs_fh *lanyfs_open_addr (struct lanyfs_vol *vol, uint64_t addr)
+{
+	struct lanyfs_fh *fh;
+	union lanyfs_b *b;
+	int ret;
+
+	if (!lanyfs_valid_addr(vol, addr)) {
+		errno = EIO;
+		return NULL;
+	}
+	fh = calloc(1, sizeof(*fh));
+	if (!fh)
+		return NULL;
+	pthread_mutex_init(&fh->lock, NULL);
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		goto err;
+	fh->vol = vol;
+	if (lanyfs_read_block(vol, addr, b) || fill_stat(vol, addr, b, &fh->st))
+		goto err;
+	if (b->raw.type == LANYFS_TYPE_DIR) {
+		ret = load_entries(fh, fromle64(b->dir.subtree));
+	} else if (fh->st.attr & LANYFS_ATTR_COMPRESSED) {
+		fh->stored = fromle64(b->file.stored);
+		fh->codec = b->file.codec;
+		fh->chunk = b->file.chunk;
+		if (fh->chunk < LANYFS_MIN_CHUNK_SHIFT ||
+		    fh->chunk > LANYFS_MAX_CHUNK_SHIFT) {
+			errno = EIO;
+			goto err;
+		}
+		fh->packed = malloc((size_t) 1 << fh->chunk);
+		fh->plain = malloc((size_t) 1 << fh->chunk);
+		if (!fh->packed || !fh->plain)
+			goto err;
+		ret = load_runs(fh, fromle64(b->file.data)) || load_chunks(fh);
+	} else {
+		fh->stored = fh->st.size;
+		ret = load_runs(fh, fromle64(b->file.data));
+	}
+	if (ret)
+		goto err;
+	free(b);
+	return fh;
+
+err:
+	free(b);
+	lanyfs_close(fh);
+	return NULL;
+}
+
+/**
+ * lanyfs_close() - Closes a file or directory.
+ * @fh:				handle
+ */
+void lanyfs_close (struct lanyfs_fh *fh)
+{
+	if (!fh)
+		return;
+	free(fh->runs);
+	free(fh->ents);
+	free(fh->chunks);
+	free(fh->packed);
+	free(fh->plain);
+	pthread_mutex_destroy(&fh->lock);
+	free(fh);
+}
+
+/**
+ * read_chunks() - Reads from a compressed file.
+ * @fh:				handle of file
+ * @buf:			buffer
+ * @len:			number of bytes to read, within the file
+ * @off:			offset within file
+ *
+ * Chunks read whole go straight into @buf, others are served from the
+ * chunk kept by the handle, decompressing it first unless it is the one
+ * asked for. Chunks stored uncompressed are read in place.
+ */
+static int read_chunks (struct lanyfs_fh *fh, unsigned char *buf, size_t len,
+			uint64_t off)
+{
+	uint64_t k, start, clen, stored, n;
+	int ret = -1;
+
+	pthread_mutex_lock(&fh->lock);
+	while (len) {
+		k = off >> fh->chunk;
+		start = off - (k << fh->chunk);
+		clen = fh->st.size - (k << fh->chunk);
+		if (clen > (uint64_t) 1 << fh->chunk)
+			clen = (uint64_t) 1 << fh->chunk;
+		n = clen - start < len ? clen - start : len;
+		stored = fh->chunks[k + 1] - fh->chunks[k];
+		if (stored == clen) {
+			if (read_stream(fh, buf, n, fh->chunks[k] + start))
+				goto out;
+		} else if (fh->cached == k + 1) {
+			memcpy(buf, fh->plain + start, n);
+		} else if (n == clen) {
+			if (read_stream(fh, fh->packed, stored, fh->chunks[k]) ||
+			    lanyfs_decompress(fh->codec, fh->packed, stored,
+					      buf, clen))
+				goto out;
+		} else {
+			fh->cached = 0;
+			if (read_stream(fh, fh->packed, stored, fh->chunks[k]) ||
+			    lanyfs_decompress(fh->codec, fh->packed, stored,
+					      fh->plain, clen))
+				goto out;
+			fh->cached = k + 1;
+			memcpy(buf, fh->plain + start, n);
+		}
+		buf += n;
+		off += n;
+		len -= n;
+	}
+	ret = 0;
+
+out:
+	pthread_mutex_unlock(&fh->lock);
+	return ret;
+}
+
+/**
+ * lanyfs_pread() - Reads from a file at an offset.
+ * @fh:				handle of file
+ * @buf:			buffer
+ * @len:			number of bytes to read
+ * @off:			offset within file
+ *
+ * Returns the number of bytes read, which is less than @len only at the end
+ * of the file, or -1 on error. Blocks not backed by any data block read as
+ * zeros.
+ */
+ssize_t lanyfs_pread (struct lanyfs_fh *fh, void *buf, size_t len,
+		      uint64_t off)
+{
+	if (fh->st.type != LANYFS_TYPE_FILE) {
+		errno = EISDIR;
+		return -1;
+	}
+	if (off >= fh->st.size)
+		return 0;
+	if (len > fh->st.size - off)
+		len = fh->st.size - off;
+	if (fh->st.attr & LANYFS_ATTR_COMPRESSED ?
+	    read_chunks(fh, buf, len, off) : read_stream(fh, buf, len, off))
+		return -1;
+	return len;
+}
+
+/**
+ * lanyfs_readdir() - Reads the next entry of a directory.
+ * @fh:				handle of directory
+ * @pos:			position, 0 to start, advanced on return
+ * @ent:			entry read
+ *
+ * The position is kept by the caller, so several threads may list the same
+ * directory handle. Returns 1 if an entry was read, 0 at the end of the
+ * directory or -1 on error.
+ */
+int lanyfs_readdir (struct lanyfs_fh *fh, uint64_t *pos,
+		    struct lanyfs_dirent *ent)
+{
+	if (fh->st.type != LANYFS_TYPE_DIR) {
+		errno = ENOTDIR;
+		return -1;
+	}
+	if (*pos >= fh->nents)
+		return 0;
+	*ent = fh->ents[(*pos)++];
+	return 1;
+}
+
+/**
+ * lanyfs_fstat() - Returns the status of an open file or directory.
+ * @fh:				handle
+ * @st:				status
+ */
+int lanyfs_fstat (struct lanyfs_fh *fh, struct lanyfs_stat *st)
+{
+	*st = fh->st;
+	return 0;
+}
+
+/**
+ * lanyfs_stat() - Returns the status of a file or directory.
+ * @vol:			volume
+ * @path:			slash separated path, relative to root directory
+ * @st:				status
+ *
+ * Only the block of the file or directory is read, so the number of data
+ * blocks is not known and left 0.
+ */
+int lanyfs_stat (struct lanyfs_vol *vol, const char *path,
+		 struct lanyfs_stat *st)
+{
+	union lanyfs_b *b;
+	uint64_t addr;
+	int ret;
+
+	if (lanyfs_lookup(vol, path, &addr, NULL))
+		return -1;
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	ret = lanyfs_read_block(vol, addr, b);
+	if (!ret)
+		ret = fill_stat(vol, addr, b, st);
+	free(b);
+	return ret;
+}
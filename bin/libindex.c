@@ -0,0 +1,626 @@
+/*
+ * libindex.c - Reverse Pointer Index of Lanyard Filesystem Volumes.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Reverse pointer index
+ *
+ * Moving or repairing a block requires fixing every pointer to it, and
+ * LanyFS keeps no back pointers. The index is a file holding one record
+ * (target, referrer, field) for every pointer of a volume, sorted by
+ * target, so the referrers of a block are found by binary search in the
+ * mapped file.
+ *
+ * Building the index walks the directory tree and all chains once, sorts
+ * the records externally and writes them out sequentially. Pointers live in
+ * directory, file, extender and chain blocks and the superblock only, data
+ * blocks are never read.
+ *
+ * An index is valid as long as the superblock's write counter and date of
+ * last change are the ones recorded, tools changing pointers write the
+ * superblock when done. Each record also carries the write counter of its
+ * referrer, so single records of a stale index can still be verified.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "liblanyfs.h"
+
+/* layout of index files */
+#define INDEX_VERSION		1
+#define INDEX_HDR_SIZE		4096
+#define INDEX_BATCH		4096	/* records buffered per worker */
+#define INDEX_WRITE		(1 << 20)
+
+/**
+ * struct index_hdr - On-disk header of index files, little endian.
+ * @magic:			identifies index files
+ * @version:			version of index format
+ * @recsize:			size of records
+ * @blocks:			number of blocks of indexed volume
+ * @rootdir:			root directory of indexed volume
+ * @count:			number of records
+ * @updated:			superblock's date of last change when indexed
+ * @wrcnt:			superblock's write counter when indexed
+ */
+struct index_hdr {
+	char			magic[LANYFS_DEV_MAGIC_LEN];
+	uint32_t		version;
+	uint32_t		recsize;
+	uint64_t		blocks;
+	uint64_t		rootdir;
+	uint64_t		count;
+	struct lanyfs_ts	updated;
+	uint16_t		wrcnt;
+};
+
+/**
+ * struct lanyfs_index - Open index.
+ * @map:			mapped index file
+ * @len:			length of mapping
+ * @refs:			records, little endian
+ * @count:			number of records
+ * @stale:			volume changed since indexing
+ */
+struct lanyfs_index {
+	void			*map;
+	size_t			len;
+	const struct lanyfs_ref	*refs;
+	uint64_t		count;
+	int			stale;
+};
+
+/**
+ * struct index_buf - Records buffered by a worker.
+ * @refs:			records in CPU byte order
+ * @n:				number of records
+ * @sort:			external sort of records
+ * @b:				block buffer for extenders
+ * @ret:			first error
+ */
+struct index_buf {
+	struct lanyfs_ref	refs[INDEX_BATCH];
+	size_t			n;
+	struct lanyfs_sort	*sort;
+	union lanyfs_b		*b;
+	int			ret;
+};
+
+/**
+ * ref_cmp() - Orders records by target, referrer, field and slot.
+ * @a:				record
+ * @b:				record
+ */
+static int ref_cmp (const void *a, const void *b)
+{
+	const struct lanyfs_ref *x = a, *y = b;
+	if (x->target != y->target)
+		return x->target < y->target ? -1 : 1;
+	if (x->referrer != y->referrer)
+		return x->referrer < y->referrer ? -1 : 1;
+	if (x->field != y->field)
+		return x->field < y->field ? -1 : 1;
+	if (x->slot != y->slot)
+		return x->slot < y->slot ? -1 : 1;
+	return 0;
+}
+
+/**
+ * emit() - Buffers a record.
+ * @buf:			buffer of calling worker
+ * @target:			block pointed to
+ * @referrer:			block holding the pointer
+ * @field:			enum lanyfs_field
+ * @wrcnt:			write counter of referrer, on-disk byte order
+ * @slot:			slot index
+ */
+static int emit (struct index_buf *buf, uint64_t target, uint64_t referrer,
+		 int field, uint16_t wrcnt, uint32_t slot)
+{
+	struct lanyfs_ref *ref;
+	if (!target)
+		return 0;
+	if (buf->n == INDEX_BATCH) {
+		if (lanyfs_sort_add(buf->sort, buf->refs, buf->n))
+			return -1;
+		buf->n = 0;
+	}
+	ref = &buf->refs[buf->n++];
+	ref->target = target;
+	ref->referrer = referrer;
+	ref->field = field;
+	ref->wrcnt = fromle16(wrcnt);
+	ref->slot = slot;
+	return 0;
+}
+
+/**
+ * index_ext() - Records the slots of an extender.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			buffer of calling worker
+ *
+ * The walk does not hand out extender contents, so they are read again.
+ */
+static int index_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+		      uint64_t iblock, void *arg)
+{
+	struct index_buf *buf = arg;
+	int slots = lanyfs_ext_slots(vol), i;
+
+	if (type != LANYFS_TYPE_EXT)
+		return 0;
+	if (lanyfs_read_block(vol, addr, buf->b))
+		return -1;
+	for (i = 0; i < slots; i++) {
+		if (emit(buf, lanyfs_slot_get(vol, &buf->b->ext.stream, i),
+			 addr, LANYFS_FIELD_SLOT, buf->b->raw.wrcnt, i))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * index_node() - Records the pointers of a directory or file block.
+ * @vol:			volume
+ * @worker:			index of calling worker
+ * @addr:			address of block
+ * @b:				the block
+ * @arg:			array of worker buffers
+ */
+static int index_node (struct lanyfs_vol *vol, int worker, uint64_t addr,
+		       union lanyfs_b *b, void *arg)
+{
+	struct index_buf *buf = (struct index_buf *) arg + worker;
+	uint16_t wrcnt = b->raw.wrcnt;
+
+	if (emit(buf, fromle64(b->vi_btree.left), addr, LANYFS_FIELD_LEFT,
+		 wrcnt, 0) ||
+	    emit(buf, fromle64(b->vi_btree.right), addr, LANYFS_FIELD_RIGHT,
+		 wrcnt, 0))
+		return -1;
+	if (b->raw.type == LANYFS_TYPE_DIR)
+		return emit(buf, fromle64(b->dir.subtree), addr,
+			    LANYFS_FIELD_SUBTREE, wrcnt, 0);
+	if (emit(buf, fromle64(b->file.data), addr, LANYFS_FIELD_DATA, wrcnt,
+		 0))
+		return -1;
+	if (!b->file.data)
+		return 0;
+	return lanyfs_ext_walk(vol, fromle64(b->file.data), index_ext, buf);
+}
+
+/**
+ * index_chain() - Records the pointers of a chain.
+ * @vol:			volume
+ * @buf:			buffer
+ * @addr:			first block of chain
+ */
+static int index_chain (struct lanyfs_vol *vol, struct index_buf *buf,
+			uint64_t addr)
+{
+	union lanyfs_b *b = buf->b;
+	uint64_t hops = 0;
+	int slots = lanyfs_chain_slots(vol), i;
+
+	while (addr) {
+		if (!lanyfs_valid_addr(vol, addr) || ++hops > vol->blocks) {
+			errno = EIO;
+			return -1;
+		}
+		if (lanyfs_read_block(vol, addr, b))
+			return -1;
+		for (i = 0; i < slots; i++) {
+			if (emit(buf, lanyfs_slot_get(vol, &b->chain.stream, i),
+				 addr, LANYFS_FIELD_SLOT, b->raw.wrcnt, i))
+				return -1;
+		}
+		if (emit(buf, fromle64(b->chain.next), addr,
+			 LANYFS_FIELD_NEXT, b->raw.wrcnt, 0))
+			return -1;
+		addr = fromle64(b->chain.next);
+	}
+	return 0;
+}
+
+/**
+ * index_collect() - Records all pointers of a volume.
+ * @vol:			volume
+ * @bufs:			one buffer per worker
+ * @threads:			number of worker threads
+ */
+static int index_collect (struct lanyfs_vol *vol, struct index_buf *bufs,
+			  int threads)
+{
+	struct lanyfs_sb *sb = &vol->sb->sb;
+	uint64_t root = fromle64(sb->rootdir);
+	union lanyfs_b *b = bufs[0].b;
+	int i;
+
+	if (emit(&bufs[0], root, 0, LANYFS_FIELD_ROOTDIR, sb->wrcnt, 0) ||
+	    emit(&bufs[0], fromle64(sb->freehead), 0, LANYFS_FIELD_FREEHEAD,
+		 sb->wrcnt, 0) ||
+	    emit(&bufs[0], fromle64(sb->freetail), 0, LANYFS_FIELD_FREETAIL,
+		 sb->wrcnt, 0) ||
+	    emit(&bufs[0], fromle64(sb->badblocks), 0,
+		 LANYFS_FIELD_BADBLOCKS, sb->wrcnt, 0) ||
+	    emit(&bufs[0], fromle64(sb->zonehead), 0, LANYFS_FIELD_ZONEHEAD,
+		 sb->wrcnt, 0) ||
+	    emit(&bufs[0], fromle64(sb->zonetail), 0, LANYFS_FIELD_ZONETAIL,
+		 sb->wrcnt, 0))
+		return -1;
+	if (index_chain(vol, &bufs[0], fromle64(sb->freehead)) ||
+	    index_chain(vol, &bufs[0], fromle64(sb->zonehead)) ||
+	    index_chain(vol, &bufs[0], fromle64(sb->badblocks)))
+		return -1;
+	if (!lanyfs_valid_addr(vol, root) || lanyfs_read_block(vol, root, b) ||
+	    b->raw.type != LANYFS_TYPE_DIR) {
+		errno = EIO;
+		return -1;
+	}
+	if (index_node(vol, 0, root, b, bufs) ||
+	    lanyfs_walk(vol, fromle64(b->dir.subtree), threads, index_node,
+			bufs))
+		return -1;
+	for (i = 0; i < threads; i++) {
+		if (lanyfs_sort_add(bufs[i].sort, bufs[i].refs, bufs[i].n))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * index_write() - Writes sorted records and header to an index file.
+ * @vol:			volume
+ * @sort:			finished sort of records
+ * @fd:				index file
+ * @count:			number of records written
+ */
+static int index_write (struct lanyfs_vol *vol, struct lanyfs_sort *sort,
+			int fd, uint64_t *count)
+{
+	struct lanyfs_sb *sb = &vol->sb->sb;
+	struct index_hdr hdr;
+	struct lanyfs_ref *out, ref;
+	unsigned char page[INDEX_HDR_SIZE];
+	size_t n = 0, cap = INDEX_WRITE / sizeof(ref);
+	uint64_t pos = INDEX_HDR_SIZE, total = 0;
+	int ret;
+
+	out = malloc(cap * sizeof(ref));
+	if (!out)
+		return -1;
+	while ((ret = lanyfs_sort_next(sort, &ref)) == 1) {
+		out[n].target = tole64(ref.target);
+		out[n].referrer = tole64(ref.referrer);
+		out[n].field = tole16(ref.field);
+		out[n].wrcnt = tole16(ref.wrcnt);
+		out[n].slot = tole32(ref.slot);
+		if (++n < cap)
+			continue;
+		if (lanyfs_fd_pwrite(fd, out, n * sizeof(ref), pos))
+			goto err;
+		pos += n * sizeof(ref);
+		total += n;
+		n = 0;
+	}
+	if (ret || lanyfs_fd_pwrite(fd, out, n * sizeof(ref), pos))
+		goto err;
+	total += n;
+	free(out);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LANYFS_INDEX_MAGIC, LANYFS_DEV_MAGIC_LEN);
+	hdr.version = tole32(INDEX_VERSION);
+	hdr.recsize = tole32(sizeof(ref));
+	hdr.blocks = sb->blocks;
+	hdr.rootdir = sb->rootdir;
+	hdr.count = tole64(total);
+	hdr.updated = sb->updated;
+	hdr.wrcnt = sb->wrcnt;
+	memset(page, 0, sizeof(page));
+	memcpy(page, &hdr, sizeof(hdr));
+	if (lanyfs_fd_pwrite(fd, page, sizeof(page), 0) || fsync(fd))
+		return -1;
+	*count = total;
+	return 0;
+
+err:
+	free(out);
+	return -1;
+}
+
+/**
+ * lanyfs_index_build() - Writes the reverse pointer index of a volume.
+ * @vol:			volume
+ * @path:			path of index file
+ * @threads:			number of worker threads
+ * @tmpdir:			directory for temporary files, NULL for default
+ * @memcap:			memory cap of sorting in bytes
+ * @count:			number of records written, may be NULL
+ *
+ * The index is written next to @path and renamed into place, so readers
+ * never see a partial index.
+ */
+int lanyfs_index_build (struct lanyfs_vol *vol, const char *path,
+			int threads, const char *tmpdir, size_t memcap,
+			uint64_t *count)
+{
+	struct lanyfs_sort *sort;
+	struct index_buf *bufs;
+	char tmp[LANYFS_OVERLAY_PATHLEN];
+	uint64_t n = 0;
+	int fd = -1, i, ret = -1, err;
+
+	if (threads < 1)
+		threads = 1;
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	sort = lanyfs_sort_open(tmpdir, sizeof(struct lanyfs_ref), ref_cmp,
+				memcap);
+	bufs = calloc(threads, sizeof(*bufs));
+	if (!sort || !bufs)
+		goto out;
+	for (i = 0; i < threads; i++) {
+		bufs[i].sort = sort;
+		bufs[i].b = lanyfs_alloc_block(vol);
+		if (!bufs[i].b)
+			goto out;
+	}
+	if (index_collect(vol, bufs, threads) ||
+	    lanyfs_sort_finish(sort, NULL))
+		goto out;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+	if (index_write(vol, sort, fd, &n) || close(fd)) {
+		fd = -1;
+		unlink(tmp);
+		goto out;
+	}
+	fd = -1;
+	if (rename(tmp, path)) {
+		unlink(tmp);
+		goto out;
+	}
+	if (count)
+		*count = n;
+	ret = 0;
+out:
+	err = errno;
+	if (fd >= 0) {
+		close(fd);
+		unlink(tmp);
+	}
+	if (bufs) {
+		for (i = 0; i < threads; i++)
+			free(bufs[i].b);
+	}
+	free(bufs);
+	lanyfs_sort_close(sort);
+	errno = err;
+	return ret;
+}
+
+/**
+ * lanyfs_index_open() - Maps an index file.
+ * @vol:			volume the index belongs to
+ * @path:			path of index file
+ * @strict:			refuse an index not matching the volume
+ *
+ * An index refused as stale fails with ESTALE. A stale index opened
+ * nonetheless is flagged, see lanyfs_index_stale().
+ */
+struct lanyfs_index *lanyfs_index_open (struct lanyfs_vol *vol,
+					const char *path, int strict)
+{
+	struct lanyfs_sb *sb = &vol->sb->sb;
+	struct lanyfs_index *idx;
+	struct index_hdr hdr;
+	uint64_t size;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	idx = calloc(1, sizeof(*idx));
+	if (!idx)
+		goto err;
+	if (lanyfs_fd_pread(fd, &hdr, sizeof(hdr), 0) ||
+	    lanyfs_fd_size(fd, &size))
+		goto err;
+	idx->count = fromle64(hdr.count);
+	if (memcmp(hdr.magic, LANYFS_INDEX_MAGIC, LANYFS_DEV_MAGIC_LEN) ||
+	    fromle32(hdr.version) != INDEX_VERSION ||
+	    fromle32(hdr.recsize) != sizeof(struct lanyfs_ref) ||
+	    size < INDEX_HDR_SIZE + idx->count * sizeof(struct lanyfs_ref)) {
+		errno = EINVAL;
+		goto err;
+	}
+	idx->stale = hdr.blocks != sb->blocks || hdr.rootdir != sb->rootdir ||
+		     hdr.wrcnt != sb->wrcnt ||
+		     memcmp(&hdr.updated, &sb->updated, sizeof(hdr.updated));
+	if (idx->stale && strict) {
+		errno = ESTALE;
+		goto err;
+	}
+	idx->len = INDEX_HDR_SIZE + idx->count * sizeof(struct lanyfs_ref);
+	idx->map = mmap(NULL, idx->len, PROT_READ, MAP_SHARED, fd, 0);
+	if (idx->map == MAP_FAILED)
+		goto err;
+	idx->refs = (const struct lanyfs_ref *)
+		    ((const unsigned char *) idx->map + INDEX_HDR_SIZE);
+	close(fd);
+	return idx;
+
+err:
+	err = errno;
+	free(idx);
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * lanyfs_index_find() - Finds all records pointing to a block.
+ * @idx:			index
+ * @target:			block pointed to
+ * @refs:			first record, in on-disk byte order
+ *
+ * Returns the number of records, which follow each other.
+ */
+size_t lanyfs_index_find (struct lanyfs_index *idx, uint64_t target,
+			  const struct lanyfs_ref **refs)
+{
+	uint64_t lo = 0, hi = idx->count, mid, end;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fromle64(idx->refs[mid].target) < target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (end = lo; end < idx->count &&
+	     fromle64(idx->refs[end].target) == target; end++)
+		;
+	*refs = idx->refs + lo;
+	return end - lo;
+}
+
+/**
+ * ref_field() - Reads the pointer a record refers to.
+ * @vol:			volume
+ * @ref:			record, in on-disk byte order
+ * @b:				referrer
+ */
+static uint64_t ref_field (struct lanyfs_vol *vol, const struct lanyfs_ref *ref,
+			   union lanyfs_b *b)
+{
+	uint32_t slot = fromle32(ref->slot);
+	switch (fromle16(ref->field)) {
+	case LANYFS_FIELD_SUBTREE:
+		return fromle64(b->dir.subtree);
+	case LANYFS_FIELD_LEFT:
+		return fromle64(b->vi_btree.left);
+	case LANYFS_FIELD_RIGHT:
+		return fromle64(b->vi_btree.right);
+	case LANYFS_FIELD_DATA:
+		return fromle64(b->file.data);
+	case LANYFS_FIELD_NEXT:
+		return fromle64(b->chain.next);
+	case LANYFS_FIELD_SLOT:
+		if (b->raw.type == LANYFS_TYPE_EXT &&
+		    slot < (uint32_t) lanyfs_ext_slots(vol))
+			return lanyfs_slot_get(vol, &b->ext.stream, slot);
+		if (slot < (uint32_t) lanyfs_chain_slots(vol))
+			return lanyfs_slot_get(vol, &b->chain.stream, slot);
+		return 0;
+	case LANYFS_FIELD_ROOTDIR:
+		return fromle64(b->sb.rootdir);
+	case LANYFS_FIELD_FREEHEAD:
+		return fromle64(b->sb.freehead);
+	case LANYFS_FIELD_FREETAIL:
+		return fromle64(b->sb.freetail);
+	case LANYFS_FIELD_BADBLOCKS:
+		return fromle64(b->sb.badblocks);
+	case LANYFS_FIELD_ZONEHEAD:
+		return fromle64(b->sb.zonehead);
+	case LANYFS_FIELD_ZONETAIL:
+		return fromle64(b->sb.zonetail);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * lanyfs_index_verify() - Checks whether a record still holds.
+ * @vol:			volume
+ * @ref:			record, in on-disk byte order
+ *
+ * Returns 1 if the referrer is unchanged and still points to the target,
+ * 0 if not, and -1 on error.
+ */
+int lanyfs_index_verify (struct lanyfs_vol *vol, const struct lanyfs_ref *ref)
+{
+	union lanyfs_b *b;
+	int ret;
+
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	if (lanyfs_read_block(vol, fromle64(ref->referrer), b)) {
+		free(b);
+		return -1;
+	}
+	ret = b->raw.wrcnt == ref->wrcnt &&
+	      ref_field(vol, ref, b) == fromle64(ref->target);
+	free(b);
+	return ret;
+}
+
+/**
+ * lanyfs_index_stale() - Tells whether the volume changed since indexing.
+ * @idx:			index
+ */
+int lanyfs_index_stale (struct lanyfs_index *idx)
+{
+	return idx->stale;
+}
+
+/**
+ * lanyfs_index_close() - Unmaps an index.
+ * @idx:			index
+ */
+void lanyfs_index_close (struct lanyfs_index *idx)
+{
+	if (!idx)
+		return;
+	munmap(idx->map, idx->len);
+	free(idx);
+}
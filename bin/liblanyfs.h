@@ -0,0 +1,828 @@
+/*
+ * liblanyfs.h - Userspace Library for Lanyard Filesystem.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Overview
+ *
+ * The library holds everything the utilities share beyond the on-disk
+ * format in lanyfs.h: device backends, opening a volume, reading and
+ * writing blocks, decoding address streams, resolving paths, walking
+ * extender trees and directory trees, and maintaining the free blocks chain.
+ *
+ * Functions return 0 on success and -1 on error with errno set, unless
+ * documented otherwise. Nothing in here prints or exits, that is up to
+ * the utilities.
+ */
+
+#ifndef __LIBLANYFS_H_
+#define __LIBLANYFS_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#ifdef __FreeBSD__
+#include <sys/endian.h>
+#define bswap_16(x) __bswap16(x)
+#define bswap_32(x) __bswap32(x)
+#define bswap_64(x) __bswap64(x)
+#elif defined __APPLE__
+#include <libkern/OSByteOrder.h>
+#define bswap_16(x) OSSwapInt16(x)
+#define bswap_32(x) OSSwapInt32(x)
+#define bswap_64(x) OSSwapInt64(x)
+#else
+#include <endian.h>
+#include <byteswap.h>
+#endif
+
+#include "lanyfs.h"
+
+/*
+ * Byte order is decided at compile time. LANYFS_SWAP is 1 if on-disk
+ * integers need swapping on this host. Building with -DLANYFS_FORCE_SWAP
+ * swaps on little endian hosts as well, which runs the big endian code
+ * paths on x86. Volumes written by such a build are byte-swapped and only
+ * make sense to a build with the same flag.
+ */
+#if defined(LANYFS_FORCE_SWAP)
+#define LANYFS_SWAP		1
+#elif defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__)
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define LANYFS_SWAP		1
+#else
+#define LANYFS_SWAP		0
+#endif
+#elif defined(__BIG_ENDIAN__)
+#define LANYFS_SWAP		1
+#elif defined(__LITTLE_ENDIAN__)
+#define LANYFS_SWAP		0
+#elif defined(_BYTE_ORDER) && defined(_BIG_ENDIAN)
+#if _BYTE_ORDER == _BIG_ENDIAN
+#define LANYFS_SWAP		1
+#else
+#define LANYFS_SWAP		0
+#endif
+#elif defined(__BYTE_ORDER) && defined(__BIG_ENDIAN)
+#if __BYTE_ORDER == __BIG_ENDIAN
+#define LANYFS_SWAP		1
+#else
+#define LANYFS_SWAP		0
+#endif
+#else
+#error "unknown byte order"
+#endif
+
+/* limits of the library */
+#define LANYFS_MAX_LEVEL	10	/* deepest extender indirection */
+
+/* walk callback return value, do not descend from visited block */
+#define LANYFS_WALK_PRUNE	1
+
+/* device operations timed in latency histograms */
+#define LANYFS_LAT_READ		0
+#define LANYFS_LAT_WRITE	1
+#define LANYFS_LAT_DISCARD	2
+#define LANYFS_LAT_FLUSH	3
+#define LANYFS_LAT_OPS		4
+
+/* thread pool flags */
+#define LANYFS_POOL_AFFINITY	(1<<0)	/* pin workers to processors */
+
+/* shapes of binary trees built from sorted names */
+#define LANYFS_BTREE_BALANCED	0
+#define LANYFS_BTREE_LINEAR	1
+#define LANYFS_BTREE_RANDOM	2
+
+/* device backends */
+#define LANYFS_DEV_MAGIC_LEN	8	/* length of backend magic bytes */
+#define LANYFS_OVERLAY_MAGIC	"LANYOVL1"
+#define LANYFS_OVERLAY_PATHLEN	1024	/* maximum path length of base */
+#define LANYFS_OVERLAY_SHIFT	12	/* default granule size 2**12 */
+#define LANYFS_ARCHIVE_MAGIC	"LANYARC1"
+#define LANYFS_ARCHIVE_SHIFT	16	/* default frame size 2**16 */
+
+/* compressed files */
+#define LANYFS_CHUNK_SHIFT	16	/* default chunk size 2**16 */
+#define LANYFS_MIN_CHUNK_SHIFT	12
+#define LANYFS_MAX_CHUNK_SHIFT	22
+
+/* device profiles */
+#define LANYFS_TUNE_MODEL	64	/* length of device model key */
+#define LANYFS_TUNE_BATCH	(64 << 10)	/* request size if untuned */
+
+/* reverse pointer index files */
+#define LANYFS_INDEX_MAGIC	"LANYIDX1"
+
+/* hash tree sidecars */
+#define LANYFS_VERITY_MAGIC	"LANYVRT1"
+#define LANYFS_VERITY_HASH	32	/* length of SHA-256 digests */
+#define LANYFS_VERITY_LEVELS	16	/* maximum number of levels */
+#define LANYFS_VERITY_CACHE	1024	/* hash blocks cached */
+
+/* codecs, values are stored on disk */
+#define LANYFS_CODEC_NONE	0
+#define LANYFS_CODEC_LZ4	1
+#define LANYFS_CODEC_ZLIB	2
+
+/**
+ * tole16() - Convert from CPU endianess to little endian.
+ * @n:				unsigned integer to convert
+ */
+static inline uint16_t tole16 (uint16_t n)
+{
+#if LANYFS_SWAP
+	n = bswap_16(n);
+#endif
+	return n;
+}
+
+/**
+ * fromle16() - Convert from little endian to CPU endianess.
+ * @n:				unsigned integer to convert
+ */
+static inline uint16_t fromle16 (uint16_t n)
+{
+#if LANYFS_SWAP
+	n = bswap_16(n);
+#endif
+	return n;
+}
+
+/**
+ * tole32() - Convert from CPU endianess to little endian.
+ * @n:				unsigned integer to convert
+ */
+static inline uint32_t tole32 (uint32_t n)
+{
+#if LANYFS_SWAP
+	n = bswap_32(n);
+#endif
+	return n;
+}
+
+/**
+ * fromle32() - Convert from little endian to CPU endianess.
+ * @n:				unsigned integer to convert
+ */
+static inline uint32_t fromle32 (uint32_t n)
+{
+#if LANYFS_SWAP
+	n = bswap_32(n);
+#endif
+	return n;
+}
+
+/**
+ * tole64() - Convert from CPU endianess to little endian.
+ * @n:				unsigned integer to convert
+ */
+static inline uint64_t tole64 (uint64_t n)
+{
+#if LANYFS_SWAP
+	n = bswap_64(n);
+#endif
+	return n;
+}
+
+/**
+ * fromle64() - Convert from little endian to CPU endianess.
+ * @n:				unsigned integer to convert
+ */
+static inline uint64_t fromle64 (uint64_t n)
+{
+#if LANYFS_SWAP
+	n = bswap_64(n);
+#endif
+	return n;
+}
+
+/**
+ * lanyfs_setbit() - Sets a bit in a bitmap.
+ * @map:			bitmap
+ * @n:				bit to set
+ */
+static inline void lanyfs_setbit (unsigned char *map, uint64_t n)
+{
+	map[n >> 3] |= 1 << (n & 7);
+}
+
+/**
+ * lanyfs_clearbit() - Clears a bit in a bitmap.
+ * @map:			bitmap
+ * @n:				bit to clear
+ */
+static inline void lanyfs_clearbit (unsigned char *map, uint64_t n)
+{
+	map[n >> 3] &= ~(1 << (n & 7));
+}
+
+/**
+ * lanyfs_testbit() - Tests a bit in a bitmap.
+ * @map:			bitmap
+ * @n:				bit to test
+ */
+static inline int lanyfs_testbit (const unsigned char *map, uint64_t n)
+{
+	return map[n >> 3] & (1 << (n & 7));
+}
+
+struct lanyfs_dev;
+struct lanyfs_sort;
+struct lanyfs_index;
+struct lanyfs_cmap;
+struct lanyfs_chainenc;
+struct lanyfs_fh;
+struct lanyfs_cache;
+struct lanyfs_pool;
+
+/**
+ * struct lanyfs_tune - I/O profile of a device class.
+ * @model:			vendor and model, key of the profile cache
+ * @rotational:			spinning media
+ * @max_sectors_kb:		largest request the device takes in KiB
+ * @nr_requests:		requests the device queue holds
+ * @logical:			logical block size in bytes, alignment of
+ * 				direct I/O
+ * @batch:			preferred request size in bytes, 0 if the
+ * 				device was not tuned
+ * @depth:			preferred number of requests in flight
+ * @direct:			bypass the page cache for aligned requests
+ * @latency:			median latency of small reads in nanoseconds,
+ * 				0 if not calibrated
+ */
+struct lanyfs_tune {
+	char			model[LANYFS_TUNE_MODEL];
+	int			rotational;
+	unsigned int		max_sectors_kb;
+	unsigned int		nr_requests;
+	unsigned int		logical;
+	size_t			batch;
+	int			depth;
+	int			direct;
+	uint64_t		latency;
+};
+
+/**
+ * struct lanyfs_dev_ops - Operations of a device backend.
+ * @name:			name of backend
+ * @pread:			reads exactly len bytes at pos
+ * @pwrite:			writes exactly len bytes at pos, NULL if the
+ * 				backend is read-only
+ * @sync:			makes all writes durable, may be NULL
+ * @discard:			tells the device len bytes at pos are unused,
+ * 				their contents become undefined, may be NULL
+ * @close:			releases backend resources, not the device
+ *
+ * All operations return 0 on success and -1 on error with errno set. Reads
+ * and writes may be called concurrently from several threads.
+ */
+struct lanyfs_dev_ops {
+	const char		*name;
+	int			(*pread)(struct lanyfs_dev *dev, void *buf,
+					 size_t len, uint64_t pos);
+	int			(*pwrite)(struct lanyfs_dev *dev,
+					  const void *buf, size_t len,
+					  uint64_t pos);
+	int			(*sync)(struct lanyfs_dev *dev);
+	int			(*discard)(struct lanyfs_dev *dev, uint64_t len,
+					   uint64_t pos);
+	int			(*close)(struct lanyfs_dev *dev);
+};
+
+/**
+ * struct lanyfs_dev - Open device.
+ * @ops:			backend operations
+ * @fd:				file descriptor of device or image file
+ * @rdonly:			device opened read-only
+ * @size:			size of device in bytes
+ * @tune:			I/O profile in effect
+ * @priv:			backend private data
+ */
+struct lanyfs_dev {
+	const struct lanyfs_dev_ops *ops;
+	int			fd;
+	int			rdonly;
+	uint64_t		size;
+	struct lanyfs_tune	tune;
+	void			*priv;
+};
+
+/**
+ * struct lanyfs_vol - Open volume.
+ * @dev:			device holding the volume
+ * @rdonly:			volume opened read-only
+ * @blocksize:			blocksize (exponent to base 2)
+ * @bsize:			blocksize in bytes
+ * @addrlen:			length of block addresses in bytes
+ * @blocks:			number of blocks on the device
+ * @sb:				in-memory copy of the superblock
+ * @cache:			block cache, NULL if none
+ * @retired:			superblock copies replaced by a refresh
+ * @nretired:			number of replaced copies
+ *
+ * The superblock copy is kept in on-disk byte order, just like every other
+ * block buffer handed out by the library. On read-only volumes a refresh
+ * publishes a new copy instead of changing the current one, so a reader
+ * still holding the old copy never sees it torn. That is no snapshot: the
+ * blocks it points to may already have been rewritten in place.
+ */
+struct lanyfs_vol {
+	struct lanyfs_dev	*dev;
+	int			rdonly;
+	int			blocksize;
+	size_t			bsize;
+	int			addrlen;
+	uint64_t		blocks;
+	union lanyfs_b		*sb;
+	struct lanyfs_cache	*cache;
+	union lanyfs_b		**retired;
+	size_t			nretired;
+};
+
+/**
+ * struct lanyfs_addrvec - Growing vector of block addresses.
+ * @a:				addresses
+ * @n:				number of addresses in use
+ * @cap:			number of addresses allocated
+ */
+struct lanyfs_addrvec {
+	uint64_t		*a;
+	size_t			n;
+	size_t			cap;
+};
+
+/**
+ * struct lanyfs_table - Table of fixed-size records in a temporary file.
+ * @fd:				temporary file
+ * @recsize:			size of records in bytes
+ * @n:				number of records
+ * @fill:			number of records buffered
+ * @buf:			append buffer
+ * @map:			mapped records, NULL until mapped
+ */
+struct lanyfs_table {
+	int			fd;
+	size_t			recsize;
+	uint64_t		n;
+	size_t			fill;
+	unsigned char		*buf;
+	unsigned char		*map;
+};
+
+/**
+ * enum lanyfs_field - Field of a block holding a block address.
+ * @LANYFS_FIELD_SUBTREE:	directory's subtree
+ * @LANYFS_FIELD_LEFT:		left node of binary tree
+ * @LANYFS_FIELD_RIGHT:		right node of binary tree
+ * @LANYFS_FIELD_DATA:		file's root extender
+ * @LANYFS_FIELD_NEXT:		next block of a chain
+ * @LANYFS_FIELD_SLOT:		slot of an extender or chain block
+ * @LANYFS_FIELD_ROOTDIR:	superblock's root directory
+ * @LANYFS_FIELD_FREEHEAD:	superblock's start of free blocks chain
+ * @LANYFS_FIELD_FREETAIL:	superblock's end of free blocks chain
+ * @LANYFS_FIELD_BADBLOCKS:	superblock's start of bad blocks chain
+ * @LANYFS_FIELD_ZONEHEAD:	superblock's start of metadata zone's chain
+ * @LANYFS_FIELD_ZONETAIL:	superblock's end of metadata zone's chain
+ */
+enum lanyfs_field {
+	LANYFS_FIELD_SUBTREE,
+	LANYFS_FIELD_LEFT,
+	LANYFS_FIELD_RIGHT,
+	LANYFS_FIELD_DATA,
+	LANYFS_FIELD_NEXT,
+	LANYFS_FIELD_SLOT,
+	LANYFS_FIELD_ROOTDIR,
+	LANYFS_FIELD_FREEHEAD,
+	LANYFS_FIELD_FREETAIL,
+	LANYFS_FIELD_BADBLOCKS,
+	LANYFS_FIELD_ZONEHEAD,
+	LANYFS_FIELD_ZONETAIL,
+};
+
+/**
+ * struct lanyfs_ref - Reverse pointer, little endian on disk.
+ * @target:			block pointed to
+ * @referrer:			block holding the pointer, 0 for superblock
+ * @field:			enum lanyfs_field
+ * @wrcnt:			write counter of referrer when indexed
+ * @slot:			slot index for LANYFS_FIELD_SLOT
+ */
+struct lanyfs_ref {
+	uint64_t		target;
+	uint64_t		referrer;
+	uint16_t		field;
+	uint16_t		wrcnt;
+	uint32_t		slot;
+};
+
+/**
+ * struct lanyfs_stat - Status of a file or directory.
+ * @addr:			address of directory or file block
+ * @type:			LANYFS_TYPE_DIR or LANYFS_TYPE_FILE
+ * @attr:			attributes
+ * @size:			size of file in bytes, 0 for directories
+ * @blocks:			number of data blocks allocated
+ * @created:			date and time of creation
+ * @modified:			date and time of last modification
+ * @name:			name, terminated
+ */
+struct lanyfs_stat {
+	uint64_t		addr;
+	int			type;
+	uint16_t		attr;
+	uint64_t		size;
+	uint64_t		blocks;
+	struct lanyfs_ts	created;
+	struct lanyfs_ts	modified;
+	char			name[LANYFS_NAME_LENGTH + 1];
+};
+
+/**
+ * struct lanyfs_dirent - Entry of a directory.
+ * @addr:			address of directory or file block
+ * @type:			LANYFS_TYPE_DIR or LANYFS_TYPE_FILE
+ * @wrcnt:			write counter of the block
+ * @attr:			attributes
+ * @size:			size of file in bytes, 0 for directories
+ * @modified:			date and time of last modification
+ * @name:			name, terminated
+ */
+struct lanyfs_dirent {
+	uint64_t		addr;
+	int			type;
+	uint16_t		wrcnt;
+	uint16_t		attr;
+	uint64_t		size;
+	struct lanyfs_ts	modified;
+	char			name[LANYFS_NAME_LENGTH + 1];
+};
+
+/**
+ * struct lanyfs_link - Location of a pointer to a directory or file block.
+ * @holder:			address of block holding the pointer
+ * @field:			field of holder holding the pointer
+ * @parent:			address of directory the target belongs to
+ */
+struct lanyfs_link {
+	uint64_t		holder;
+	enum lanyfs_field	field;
+	uint64_t		parent;
+};
+
+/**
+ * lanyfs_visit_t - Callback of directory tree walks.
+ * @vol:			volume being walked
+ * @worker:			index of worker thread calling back
+ * @addr:			address of visited directory or file block
+ * @b:				visited block, valid during callback only
+ * @arg:			user argument
+ *
+ * A non-zero return value stops the walk, except for LANYFS_WALK_PRUNE which
+ * skips the binary tree children and subtree of the visited block.
+ */
+typedef int (*lanyfs_visit_t)(struct lanyfs_vol *vol, int worker,
+			      uint64_t addr, union lanyfs_b *b, void *arg);
+
+/**
+ * struct lanyfs_lat - Latency summary of an operation type.
+ * @count:			operations recorded
+ * @p50:			median in nanoseconds
+ * @p99:			99th percentile in nanoseconds
+ * @p999:			99.9th percentile in nanoseconds
+ * @max:			maximum in nanoseconds
+ */
+struct lanyfs_lat {
+	uint64_t		count;
+	uint64_t		p50;
+	uint64_t		p99;
+	uint64_t		p999;
+	uint64_t		max;
+};
+
+/**
+ * lanyfs_task_t - Task run by a thread pool.
+ * @pool:			pool running the task
+ * @worker:			index of worker thread running the task
+ * @arg:			pointer given at submission
+ * @n:				number given at submission
+ *
+ * A non-zero return value fails the batch of tasks, see lanyfs_pool_wait().
+ */
+typedef int (*lanyfs_task_t)(struct lanyfs_pool *pool, int worker, void *arg,
+			     uint64_t n);
+
+/**
+ * struct lanyfs_pool_stats - Utilization of a pool worker.
+ * @tasks:			tasks run
+ * @steals:			tasks taken from other workers
+ * @busy:			nanoseconds spent running tasks
+ * @idle:			nanoseconds spent waiting for tasks
+ */
+struct lanyfs_pool_stats {
+	uint64_t		tasks;
+	uint64_t		steals;
+	uint64_t		busy;
+	uint64_t		idle;
+};
+
+/**
+ * lanyfs_cmp_t - Comparison of records, as for qsort().
+ */
+typedef int (*lanyfs_cmp_t)(const void *a, const void *b);
+
+/**
+ * lanyfs_extvisit_t - Callback of extender tree walks.
+ * @vol:			volume being walked
+ * @addr:			address of extender or data block
+ * @type:			LANYFS_TYPE_EXT or LANYFS_TYPE_DATA
+ * @iblock:			index of data block within file
+ * @arg:			user argument
+ *
+ * A non-zero return value, LANYFS_WALK_PRUNE included, stops the walk and is
+ * passed back by lanyfs_ext_walk().
+ */
+typedef int (*lanyfs_extvisit_t)(struct lanyfs_vol *vol, uint64_t addr,
+				 int type, uint64_t iblock, void *arg);
+
+/* libarchive.c */
+extern struct lanyfs_dev *lanyfs_archive_open(int fd, int rdonly);
+extern int lanyfs_archive_create(struct lanyfs_vol *vol, const char *path,
+				 int codec, int frame_shift, int threads,
+				 uint64_t *stored);
+
+/* libcache.c */
+extern struct lanyfs_cache *lanyfs_cache_new(size_t bsize, size_t blocks);
+extern int lanyfs_cache_get(struct lanyfs_cache *cache, uint64_t addr,
+			    void *buf, uint64_t *gen);
+extern void lanyfs_cache_put(struct lanyfs_cache *cache, uint64_t addr,
+			     const void *buf, uint64_t gen);
+extern void lanyfs_cache_clear(struct lanyfs_cache *cache);
+extern void lanyfs_cache_stats(struct lanyfs_cache *cache, uint64_t *hits,
+			       uint64_t *misses);
+extern void lanyfs_cache_free(struct lanyfs_cache *cache);
+
+/* libchain.c */
+extern uint64_t lanyfs_chain_blocks(struct lanyfs_vol *vol, uint64_t nfree);
+extern struct lanyfs_chainenc *lanyfs_chain_begin(struct lanyfs_vol *vol,
+						  const uint64_t *chains,
+						  size_t n);
+extern struct lanyfs_chainenc *lanyfs_zone_begin(struct lanyfs_vol *vol,
+						 const uint64_t *chains,
+						 size_t n);
+extern int lanyfs_chain_add(struct lanyfs_chainenc *enc, uint64_t addr);
+extern int lanyfs_chain_end(struct lanyfs_chainenc *enc);
+
+/* libcmap.c */
+extern struct lanyfs_cmap *lanyfs_cmap_new(uint64_t bits);
+extern uint64_t lanyfs_cmap_bound(uint64_t bits);
+extern int lanyfs_cmap_set(struct lanyfs_cmap *map, uint64_t n);
+extern int lanyfs_cmap_test(struct lanyfs_cmap *map, uint64_t n);
+extern uint64_t lanyfs_cmap_count(struct lanyfs_cmap *map);
+extern uint64_t lanyfs_cmap_next_clear(struct lanyfs_cmap *map, uint64_t n);
+extern void lanyfs_cmap_free(struct lanyfs_cmap *map);
+
+/* libcodec.c */
+extern size_t lanyfs_compress_bound(int codec, size_t len);
+extern size_t lanyfs_compress(int codec, const void *src, size_t len,
+			      void *dst, size_t cap);
+extern int lanyfs_decompress(int codec, const void *src, size_t len,
+			     void *dst, size_t dstlen);
+extern const char *lanyfs_codec_name(int codec);
+extern int lanyfs_codec_parse(const char *name);
+
+/* libdev.c */
+extern int lanyfs_fd_pread(int fd, void *buf, size_t len, uint64_t pos);
+extern int lanyfs_fd_pwrite(int fd, const void *buf, size_t len, uint64_t pos);
+extern int lanyfs_fd_size(int fd, uint64_t *size);
+extern int lanyfs_fd_direct(int fd, int rdonly);
+extern struct lanyfs_dev *lanyfs_dev_open(const char *path, int rdonly);
+extern int lanyfs_dev_pread(struct lanyfs_dev *dev, void *buf, size_t len,
+			    uint64_t pos);
+extern int lanyfs_dev_pwrite(struct lanyfs_dev *dev, const void *buf,
+			     size_t len, uint64_t pos);
+extern int lanyfs_dev_sync(struct lanyfs_dev *dev);
+extern int lanyfs_dev_discard(struct lanyfs_dev *dev, uint64_t len,
+			      uint64_t pos);
+extern int lanyfs_dev_close(struct lanyfs_dev *dev);
+extern int lanyfs_dev_tune(struct lanyfs_dev *dev,
+			   const struct lanyfs_tune *tune);
+extern size_t lanyfs_dev_batch(struct lanyfs_dev *dev);
+extern int lanyfs_dev_threads(struct lanyfs_dev *dev, int threads);
+
+/* libendian.c */
+extern void lanyfs_canon_sb(struct lanyfs_sb *sb);
+extern void lanyfs_canon_dir(struct lanyfs_dir *dir);
+extern void lanyfs_canon_file(struct lanyfs_file *file);
+extern void lanyfs_canon_chain(struct lanyfs_chain *chain);
+extern void lanyfs_canon_ext(struct lanyfs_ext *ext);
+extern int lanyfs_canon_block(union lanyfs_b *b);
+extern int lanyfs_canon_blocks(int type, void *buf, size_t n, size_t bsize);
+extern const char *lanyfs_canon_impl(void);
+
+/* libfile.c */
+extern struct lanyfs_vol *lanyfs_open_volume(const char *path, size_t cache);
+extern int lanyfs_close_volume(struct lanyfs_vol *vol);
+extern struct lanyfs_fh *lanyfs_open(struct lanyfs_vol *vol,
+				     const char *path);
+extern struct lanyfs_fh *lanyfs_open_addr(struct lanyfs_vol *vol,
+					  uint64_t addr);
+extern void lanyfs_close(struct lanyfs_fh *fh);
+extern ssize_t lanyfs_pread(struct lanyfs_fh *fh, void *buf, size_t len,
+			    uint64_t off);
+extern int lanyfs_readdir(struct lanyfs_fh *fh, uint64_t *pos,
+			  struct lanyfs_dirent *ent);
+extern int lanyfs_fstat(struct lanyfs_fh *fh, struct lanyfs_stat *st);
+extern int lanyfs_stat(struct lanyfs_vol *vol, const char *path,
+		       struct lanyfs_stat *st);
+
+/* libindex.c */
+extern int lanyfs_index_build(struct lanyfs_vol *vol, const char *path,
+			      int threads, const char *tmpdir, size_t memcap,
+			      uint64_t *count);
+extern struct lanyfs_index *lanyfs_index_open(struct lanyfs_vol *vol,
+					      const char *path, int strict);
+extern size_t lanyfs_index_find(struct lanyfs_index *idx, uint64_t target,
+				const struct lanyfs_ref **refs);
+extern int lanyfs_index_verify(struct lanyfs_vol *vol,
+			       const struct lanyfs_ref *ref);
+extern int lanyfs_index_stale(struct lanyfs_index *idx);
+extern void lanyfs_index_close(struct lanyfs_index *idx);
+
+/* liblatency.c */
+extern uint64_t lanyfs_lat_now(void);
+extern void lanyfs_lat_record(int op, uint64_t ns);
+extern void lanyfs_lat_summary(int op, struct lanyfs_lat *sum);
+extern void lanyfs_lat_reset(void);
+extern const char *lanyfs_lat_name(int op);
+extern void lanyfs_lat_report(FILE *fp, int json);
+extern int lanyfs_lat_atexit(void);
+
+/* libmove.c */
+extern int lanyfs_move_blocks(struct lanyfs_vol *vol, const uint64_t *from,
+			      const uint64_t *to, size_t n, uint64_t lo,
+			      uint64_t hi, int threads);
+extern int lanyfs_move_region(struct lanyfs_vol *vol, uint64_t *addrs,
+			      size_t n, int meta, int threads,
+			      uint64_t *start);
+
+/* liboverlay.c */
+extern struct lanyfs_dev *lanyfs_overlay_open(int fd, int rdonly);
+extern int lanyfs_overlay_create(const char *base, const char *path,
+				 int shift);
+extern int lanyfs_overlay_merge(const char *path, int commit,
+				uint64_t *granules);
+extern int lanyfs_overlay_stat(const char *path, char *base, uint64_t *gsize,
+			       uint64_t *total, uint64_t *present);
+
+/* libpool.c */
+extern struct lanyfs_pool *lanyfs_pool_new(int threads, size_t bound,
+					   int flags);
+extern int lanyfs_pool_threads(struct lanyfs_pool *pool);
+extern int lanyfs_pool_submit(struct lanyfs_pool *pool, lanyfs_task_t task,
+			      void *arg, uint64_t n);
+extern int lanyfs_pool_idle(struct lanyfs_pool *pool);
+extern int lanyfs_pool_wait(struct lanyfs_pool *pool);
+extern void lanyfs_pool_stats(struct lanyfs_pool *pool, int worker,
+			      struct lanyfs_pool_stats *st);
+extern void lanyfs_pool_free(struct lanyfs_pool *pool);
+
+/* libsort.c */
+extern struct lanyfs_sort *lanyfs_sort_open(const char *tmpdir,
+					    size_t recsize, lanyfs_cmp_t cmp,
+					    size_t memcap);
+extern int lanyfs_sort_add(struct lanyfs_sort *s, const void *recs, size_t n);
+extern int lanyfs_sort_finish(struct lanyfs_sort *s, int *passes);
+extern int lanyfs_sort_next(struct lanyfs_sort *s, void *rec);
+extern uint64_t lanyfs_sort_count(struct lanyfs_sort *s);
+extern void lanyfs_sort_close(struct lanyfs_sort *s);
+
+/* libtable.c */
+extern int lanyfs_tmpfile(const char *dir);
+extern int lanyfs_table_open(struct lanyfs_table *tab, const char *dir,
+			     size_t recsize);
+extern int lanyfs_table_append(struct lanyfs_table *tab, const void *rec);
+extern int lanyfs_table_map(struct lanyfs_table *tab);
+extern void lanyfs_table_close(struct lanyfs_table *tab);
+extern unsigned char *lanyfs_bitmap_open(const char *dir, uint64_t bits);
+extern void lanyfs_bitmap_close(unsigned char *map, uint64_t bits);
+
+/* libtune.c */
+extern int lanyfs_tune_probe(struct lanyfs_dev *dev, struct lanyfs_tune *tune);
+extern int lanyfs_tune_calibrate(struct lanyfs_dev *dev,
+				 struct lanyfs_tune *tune, int write);
+extern int lanyfs_tune_load(struct lanyfs_tune *tune);
+extern int lanyfs_tune_save(const struct lanyfs_tune *tune);
+
+/* libverity.c */
+extern void lanyfs_sha256(const void *buf, size_t len, unsigned char *digest);
+extern int lanyfs_verity_parse(const char *hex, unsigned char *root);
+extern void lanyfs_verity_format(const unsigned char *root, char *hex);
+extern int lanyfs_verity_build(struct lanyfs_vol *vol, const char *path,
+			       int threads, unsigned char *root,
+			       uint64_t *count);
+extern struct lanyfs_dev *lanyfs_verity_open(struct lanyfs_dev *lower,
+					     const char *path,
+					     const unsigned char *root);
+extern struct lanyfs_dev *lanyfs_verity_auto(struct lanyfs_dev *dev,
+					     const char *path);
+extern int lanyfs_verity_stats(struct lanyfs_dev *dev, uint64_t *verified,
+			       uint64_t *nodes);
+
+/* libvol.c */
+extern struct lanyfs_vol *lanyfs_vol_open(const char *path, int rdonly);
+extern struct lanyfs_vol *lanyfs_vol_attach(struct lanyfs_dev *dev);
+extern struct lanyfs_vol *lanyfs_vol_forge(struct lanyfs_dev *dev,
+					   int blocksize, int addrlen);
+extern int lanyfs_vol_close(struct lanyfs_vol *vol);
+extern int lanyfs_vol_cache(struct lanyfs_vol *vol, size_t blocks);
+extern int lanyfs_vol_refresh(struct lanyfs_vol *vol);
+extern union lanyfs_b *lanyfs_alloc_block(struct lanyfs_vol *vol);
+extern int lanyfs_read_block(struct lanyfs_vol *vol, uint64_t addr, void *buf);
+extern int lanyfs_write_block(struct lanyfs_vol *vol, uint64_t addr,
+			      void *buf);
+extern int lanyfs_write_sb(struct lanyfs_vol *vol);
+extern int lanyfs_valid_addr(struct lanyfs_vol *vol, uint64_t addr);
+extern struct lanyfs_ts lanyfs_ts_now(void);
+extern int lanyfs_chain_slots(struct lanyfs_vol *vol);
+extern int lanyfs_ext_slots(struct lanyfs_vol *vol);
+extern uint64_t lanyfs_slot_get(struct lanyfs_vol *vol,
+				const unsigned char *stream, int slot);
+extern void lanyfs_slot_set(struct lanyfs_vol *vol, unsigned char *stream,
+			    int slot, uint64_t addr);
+extern int lanyfs_lookup(struct lanyfs_vol *vol, const char *path,
+			 uint64_t *addr, struct lanyfs_link *link);
+extern int lanyfs_btree_unlink(struct lanyfs_vol *vol,
+			       const struct lanyfs_link *link, uint64_t addr);
+extern int lanyfs_ext_walk(struct lanyfs_vol *vol, uint64_t addr,
+			   lanyfs_extvisit_t visit, void *arg);
+extern int lanyfs_free_append(struct lanyfs_vol *vol, uint64_t *addrs,
+			      size_t n);
+extern int lanyfs_free_take(struct lanyfs_vol *vol, uint64_t *addrs,
+			    size_t n);
+extern int lanyfs_meta_take(struct lanyfs_vol *vol, uint64_t *addrs,
+			    size_t n);
+extern int lanyfs_free_map(struct lanyfs_vol *vol, unsigned char *map,
+			   int chains, uint64_t *count);
+extern int lanyfs_addrvec_push(struct lanyfs_addrvec *vec, uint64_t addr);
+extern int lanyfs_addrvec_merge(struct lanyfs_addrvec *dst,
+				struct lanyfs_addrvec *src);
+extern void lanyfs_addrvec_sort(struct lanyfs_addrvec *vec);
+extern void lanyfs_addrvec_free(struct lanyfs_addrvec *vec);
+
+/* libwalk.c */
+extern int lanyfs_walk(struct lanyfs_vol *vol, uint64_t subtree, int threads,
+		       lanyfs_visit_t visit, void *arg);
+extern int lanyfs_default_threads(void);
+
+/* libwrite.c */
+extern struct lanyfs_vol *lanyfs_vol_create(const char *path, int blocksize,
+					    int addrlen, uint64_t blocks);
+extern void lanyfs_node_init(struct lanyfs_vol *vol, union lanyfs_b *b,
+			     int type, const char *name, struct lanyfs_ts ts);
+extern uint64_t lanyfs_ext_count(struct lanyfs_vol *vol, uint64_t nblocks);
+extern int lanyfs_ext_build(struct lanyfs_vol *vol, const uint64_t *data,
+			    uint64_t nblocks, const uint64_t *ext,
+			    uint64_t *root);
+extern int lanyfs_is_zero(const void *buf, size_t len);
+extern uint64_t lanyfs_rand(uint64_t *state);
+extern int lanyfs_btree_build(const uint64_t *addrs, size_t n, int shape,
+			      uint64_t seed, uint64_t *left, uint64_t *right,
+			      uint64_t *root);
+
+#endif /* __LIBLANYFS_H_ */
@@ -0,0 +1,346 @@
+/*
+ * liblatency.c - I/O Latency Histograms for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Latency histograms
+ *
+ * Every device operation is timed and counted in a histogram of its type.
+ * Buckets are log-linear: below 128 ns every nanosecond has its own bucket,
+ * above each power of two is split into 64 buckets, so any value is known
+ * within 1.6 percent over the whole range up to about 18 minutes. The
+ * exact maximum is kept on the side.
+ *
+ * Each thread records into histograms of its own without locks or atomic
+ * read-modify-write instructions. Histograms are merged when a summary is
+ * asked for. Counts of threads that exit are folded into a shared set of
+ * histograms, so pools coming and going leak nothing.
+ *
+ * Tools call lanyfs_lat_atexit() early. If LANYFS_LATENCY is set in the
+ * environment, to "text" or "json", a report goes to standard error when
+ * the tool exits.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+#define LAT_SUB_BITS		6
+#define LAT_SUB			(1 << LAT_SUB_BITS)
+#define LAT_MAX_BITS		40	/* larger values are clamped */
+#define LAT_BUCKETS		((LAT_MAX_BITS - LAT_SUB_BITS + 1) * LAT_SUB)
+
+/**
+ * struct lat_set - Histograms of all operation types.
+ * @count:			values per bucket
+ * @max:			largest value recorded
+ * @next:			next set in list of live threads
+ */
+struct lat_set {
+	uint64_t		count[LANYFS_LAT_OPS][LAT_BUCKETS];
+	uint64_t		max[LANYFS_LAT_OPS];
+	struct lat_set		*next;
+};
+
+static const char *lat_names[LANYFS_LAT_OPS] = {
+	[LANYFS_LAT_READ] = "read",
+	[LANYFS_LAT_WRITE] = "write",
+	[LANYFS_LAT_DISCARD] = "discard",
+	[LANYFS_LAT_FLUSH] = "flush",
+};
+
+static pthread_mutex_t lat_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t lat_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lat_key;
+static struct lat_set *lat_live = NULL;
+static struct lat_set lat_retired;
+static __thread struct lat_set *lat_self = NULL;
+static int lat_json = 0;
+
+/**
+ * lat_bucket() - Returns the bucket of a value.
+ * @v:				value in nanoseconds
+ */
+static int lat_bucket (uint64_t v)
+{
+	int shift;
+
+	if (v >> LAT_MAX_BITS)
+		v = ((uint64_t) 1 << LAT_MAX_BITS) - 1;
+	if (v < 2 * LAT_SUB)
+		return (int) v;
+	shift = 63 - __builtin_clzll(v) - LAT_SUB_BITS;
+	return shift * LAT_SUB + (int) (v >> shift);
+}
+
+/**
+ * lat_value() - Returns the largest value falling into a bucket.
+ * @i:				bucket
+ */
+static uint64_t lat_value (int i)
+{
+	int shift;
+
+	if (i < 2 * LAT_SUB)
+		return i;
+	shift = i / LAT_SUB - 1;
+	return ((uint64_t) (i - shift * LAT_SUB + 1) << shift) - 1;
+}
+
+/**
+ * lat_exit() - Folds the histograms of an exiting thread into the shared set.
+ * @arg:			histograms of thread
+ */
+static void lat_exit (void *arg)
+{
+	struct lat_set *set = arg, **p;
+	int op, i;
+
+	pthread_mutex_lock(&lat_lock);
+	for (p = &lat_live; *p; p = &(*p)->next) {
+		if (*p == set) {
+			*p = set->next;
+			break;
+		}
+	}
+	for (op = 0; op < LANYFS_LAT_OPS; op++) {
+		for (i = 0; i < LAT_BUCKETS; i++)
+			lat_retired.count[op][i] += set->count[op][i];
+		if (set->max[op] > lat_retired.max[op])
+			lat_retired.max[op] = set->max[op];
+	}
+	pthread_mutex_unlock(&lat_lock);
+	free(set);
+}
+
+/**
+ * lat_init() - Creates the key of per-thread histograms.
+ */
+static void lat_init (void)
+{
+	pthread_key_create(&lat_key, lat_exit);
+}
+
+/**
+ * lanyfs_lat_now() - Returns nanoseconds on the monotonic clock.
+ */
+uint64_t lanyfs_lat_now (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * lanyfs_lat_record() - Records the latency of an operation.
+ * @op:				LANYFS_LAT_READ, _WRITE, _DISCARD or _FLUSH
+ * @ns:				latency in nanoseconds
+ *
+ * Gives up silently if the thread's histograms cannot be allocated.
+ */
+void lanyfs_lat_record (int op, uint64_t ns)
+{
+	struct lat_set *set = lat_self;
+	uint64_t *c;
+
+	if (!set) {
+		pthread_once(&lat_once, lat_init);
+		set = calloc(1, sizeof(*set));
+		if (!set)
+			return;
+		pthread_mutex_lock(&lat_lock);
+		set->next = lat_live;
+		lat_live = set;
+		pthread_mutex_unlock(&lat_lock);
+		pthread_setspecific(lat_key, set);
+		lat_self = set;
+	}
+	/* single writer, readers merging may see a slightly old value */
+	c = &set->count[op][lat_bucket(ns)];
+	__atomic_store_n(c, __atomic_load_n(c, __ATOMIC_RELAXED) + 1,
+			 __ATOMIC_RELAXED);
+	if (ns > __atomic_load_n(&set->max[op], __ATOMIC_RELAXED))
+		__atomic_store_n(&set->max[op], ns, __ATOMIC_RELAXED);
+}
+
+/**
+ * lanyfs_lat_summary() - Merges all histograms of an operation type.
+ * @op:				operation type
+ * @sum:			returns count and percentiles in nanoseconds
+ *
+ * Percentiles are the largest value of the bucket they fall into.
+ */
+void lanyfs_lat_summary (int op, struct lanyfs_lat *sum)
+{
+	static const double pct[3] = { 0.5, 0.99, 0.999 };
+	uint64_t *merged, *val[3], rank, seen = 0;
+	struct lat_set *set;
+	int i, k;
+
+	memset(sum, 0, sizeof(*sum));
+	merged = calloc(LAT_BUCKETS, sizeof(*merged));
+	if (!merged)
+		return;
+	pthread_mutex_lock(&lat_lock);
+	for (i = 0; i < LAT_BUCKETS; i++)
+		merged[i] = lat_retired.count[op][i];
+	sum->max = lat_retired.max[op];
+	for (set = lat_live; set; set = set->next) {
+		for (i = 0; i < LAT_BUCKETS; i++)
+			merged[i] += __atomic_load_n(&set->count[op][i],
+						     __ATOMIC_RELAXED);
+		if (set->max[op] > sum->max)
+			sum->max = set->max[op];
+	}
+	pthread_mutex_unlock(&lat_lock);
+	for (i = 0; i < LAT_BUCKETS; i++)
+		sum->count += merged[i];
+	val[0] = &sum->p50;
+	val[1] = &sum->p99;
+	val[2] = &sum->p999;
+	for (i = 0, k = 0; i < LAT_BUCKETS && k < 3; i++) {
+		seen += merged[i];
+		while (k < 3) {
+			rank = (uint64_t) (pct[k] * sum->count + 0.999999);
+			if (!rank || seen < rank)
+				break;
+			*val[k++] = lat_value(i) < sum->max ?
+				    lat_value(i) : sum->max;
+		}
+	}
+	free(merged);
+}
+
+/**
+ * lanyfs_lat_reset() - Clears all histograms.
+ *
+ * Operations running meanwhile may or may not be counted.
+ */
+void lanyfs_lat_reset (void)
+{
+	struct lat_set *set;
+
+	pthread_mutex_lock(&lat_lock);
+	memset(&lat_retired, 0, sizeof(lat_retired));
+	for (set = lat_live; set; set = set->next) {
+		memset(set->count, 0, sizeof(set->count));
+		memset(set->max, 0, sizeof(set->max));
+	}
+	pthread_mutex_unlock(&lat_lock);
+}
+
+/**
+ * lanyfs_lat_name() - Returns the name of an operation type.
+ * @op:				operation type
+ */
+const char *lanyfs_lat_name (int op)
+{
+	return op >= 0 && op < LANYFS_LAT_OPS ? lat_names[op] : "unknown";
+}
+
+/**
+ * lanyfs_lat_report() - Writes a summary of all operation types.
+ * @fp:				stream to write to
+ * @json:			JSON instead of a table for humans
+ *
+ * The table lists microseconds and skips operations never done, JSON
+ * lists nanoseconds of all operations.
+ */
+void lanyfs_lat_report (FILE *fp, int json)
+{
+	struct lanyfs_lat s;
+	int op;
+
+	if (json)
+		fprintf(fp, "{");
+	else
+		fprintf(fp, "%-8s %10s %10s %10s %10s %10s\n", "latency",
+			"count", "p50 us", "p99 us", "p99.9 us", "max us");
+	for (op = 0; op < LANYFS_LAT_OPS; op++) {
+		lanyfs_lat_summary(op, &s);
+		if (json) {
+			fprintf(fp, "%s\"%s\": {\"count\": %"PRIu64", "
+				"\"p50\": %"PRIu64", \"p99\": %"PRIu64", "
+				"\"p99.9\": %"PRIu64", \"max\": %"PRIu64"}",
+				op ? ", " : "", lat_names[op], s.count, s.p50,
+				s.p99, s.p999, s.max);
+			continue;
+		}
+		if (!s.count)
+			continue;
+		fprintf(fp, "%-8s %10"PRIu64" %10.1f %10.1f %10.1f %10.1f\n",
+			lat_names[op], s.count, s.p50 / 1e3, s.p99 / 1e3,
+			s.p999 / 1e3, s.max / 1e3);
+	}
+	if (json)
+		fprintf(fp, "}\n");
+}
+
+/**
+ * lat_atexit() - Reports to standard error at exit.
+ */
+static void lat_atexit (void)
+{
+	lanyfs_lat_report(stderr, lat_json);
+}
+
+/**
+ * lanyfs_lat_atexit() - Arranges for a report at exit if asked for.
+ *
+ * Reports if LANYFS_LATENCY is "text" or "json". Returns -1 with EINVAL
+ * on other values.
+ */
+int lanyfs_lat_atexit (void)
+{
+	const char *env = getenv("LANYFS_LATENCY");
+
+	if (!env || !*env)
+		return 0;
+	if (!strcmp(env, "json"))
+		lat_json = 1;
+	else if (strcmp(env, "text")) {
+		errno = EINVAL;
+		return -1;
+	}
+	return atexit(lat_atexit) ? -1 : 0;
+}
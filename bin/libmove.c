@@ -0,0 +1,818 @@
+/*
+ * libmove.c - Block Relocation for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Moving blocks
+ *
+ * Blocks in use are moved to free blocks, never onto each other, so the old
+ * tree stays intact until the last step. A first walk writes every moved
+ * directory, file and extender block to its new address with its pointers
+ * already changed, and notes the blocks staying in place that point to a
+ * moved block. Data blocks are copied next, a run of destinations at a
+ * time. Only then are the noted blocks rewritten in place and the root
+ * directory changed in the superblock.
+ *
+ * The free blocks chain is written anew at last, from chain blocks the old
+ * chain does not use, and takes effect with the superblock. An
+ * interruption before that leaves the destinations listed as free while in
+ * use, which fsck.lanyfs reports, but loses no data.
+ *
+ * Moving blocks into a region starts by moving the blocks in use there out
+ * of the way, into the lowest free blocks elsewhere. The region chosen is
+ * the one with the fewest blocks not free.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "liblanyfs.h"
+
+/**
+ * struct move_pair - Old and new address of a block.
+ * @from:			address of block in use
+ * @to:				address of free block
+ */
+struct move_pair {
+	uint64_t		from;
+	uint64_t		to;
+};
+
+/**
+ * struct move_worker - Private state of a walking or copying worker.
+ * @b:				block buffer
+ * @fix:			blocks staying in place but pointing to moved ones
+ * @copies:			data blocks to copy, pairs of from and to
+ * @found:			moved blocks found in the tree
+ * @run:			buffer of a run of data blocks
+ */
+struct move_worker {
+	union lanyfs_b		*b;
+	struct lanyfs_addrvec	fix;
+	struct lanyfs_addrvec	copies;
+	uint64_t		found;
+	unsigned char		*run;
+};
+
+/**
+ * struct move_ctx - State of a move.
+ * @vol:			volume
+ * @pairs:			blocks to move, sorted by old address
+ * @n:				number of blocks to move
+ * @copies:			data blocks to copy, sorted by new address
+ * @ncopies:			number of data blocks to copy
+ * @batch:			blocks copied at once
+ * @workers:			workers, as many as threads
+ */
+struct move_ctx {
+	struct lanyfs_vol	*vol;
+	struct move_pair	*pairs;
+	size_t			n;
+	struct move_pair	*copies;
+	size_t			ncopies;
+	size_t			batch;
+	struct move_worker	*workers;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * cmp_from() - Orders pairs by old address, for qsort() and bsearch().
+ * @a:				first pair
+ * @b:				second pair
+ */
+static int cmp_from (const void *a, const void *b)
+{
+	uint64_t x = ((const struct move_pair *) a)->from;
+	uint64_t y = ((const struct move_pair *) b)->from;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * cmp_addr() - Orders addresses, for bsearch().
+ * @a:				first address
+ * @b:				second address
+ */
+static int cmp_addr (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * cmp_to() - Orders pairs by new address, for qsort().
+ * @a:				first pair
+ * @b:				second pair
+ */
+static int cmp_to (const void *a, const void *b)
+{
+	uint64_t x = ((const struct move_pair *) a)->to;
+	uint64_t y = ((const struct move_pair *) b)->to;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * move_find() - Returns the new address of a moved block, 0 if not moved.
+ * @ctx:			move
+ * @addr:			address of block
+ */
+static uint64_t move_find (struct move_ctx *ctx, uint64_t addr)
+{
+	struct move_pair key, *p;
+
+	if (!addr)
+		return 0;
+	key.from = addr;
+	p = bsearch(&key, ctx->pairs, ctx->n, sizeof(*p), cmp_from);
+	return p ? p->to : 0;
+}
+
+/**
+ * move_ptr() - Changes a pointer to a moved block.
+ * @ctx:			move
+ * @ptr:			pointer, little endian
+ *
+ * Returns 1 if the pointer was changed, 0 otherwise.
+ */
+static int move_ptr (struct move_ctx *ctx, uint64_t *ptr)
+{
+	uint64_t to = move_find(ctx, fromle64(*ptr));
+
+	if (!to)
+		return 0;
+	*ptr = tole64(to);
+	return 1;
+}
+
+/**
+ * move_ptrs() - Changes all pointers of a block to moved blocks.
+ * @ctx:			move
+ * @b:				directory, file or extender block
+ *
+ * Returns the number of pointers changed.
+ */
+static int move_ptrs (struct move_ctx *ctx, union lanyfs_b *b)
+{
+	struct lanyfs_vol *vol = ctx->vol;
+	uint64_t to;
+	int slots, i, n = 0;
+
+	if (b->raw.type == LANYFS_TYPE_EXT) {
+		slots = lanyfs_ext_slots(vol);
+		for (i = 0; i < slots; i++) {
+			to = move_find(ctx, lanyfs_slot_get(vol,
+							    &b->ext.stream, i));
+			if (!to)
+				continue;
+			lanyfs_slot_set(vol, &b->ext.stream, i, to);
+			n++;
+		}
+		return n;
+	}
+	n += move_ptr(ctx, &b->vi_btree.left);
+	n += move_ptr(ctx, &b->vi_btree.right);
+	if (b->raw.type == LANYFS_TYPE_DIR)
+		n += move_ptr(ctx, &b->dir.subtree);
+	else
+		n += move_ptr(ctx, &b->file.data);
+	return n;
+}
+
+/**
+ * move_place() - Writes a moved block or notes a block to fix.
+ * @ctx:			move
+ * @w:				worker
+ * @addr:			address of block
+ * @b:				the block, pointers already changed
+ * @changed:			number of pointers changed
+ */
+static int move_place (struct move_ctx *ctx, struct move_worker *w,
+		       uint64_t addr, union lanyfs_b *b, int changed)
+{
+	uint64_t to = move_find(ctx, addr);
+
+	if (to) {
+		w->found++;
+		return lanyfs_write_block(ctx->vol, to, b);
+	}
+	if (changed)
+		return lanyfs_addrvec_push(&w->fix, addr);
+	return 0;
+}
+
+/**
+ * move_ext() - Moves the blocks of an extender tree.
+ * @ctx:			move
+ * @w:				worker
+ * @addr:			address of extender
+ *
+ * Data blocks are only noted for copying.
+ */
+static int move_ext (struct move_ctx *ctx, struct move_worker *w,
+		     uint64_t addr)
+{
+	struct lanyfs_vol *vol = ctx->vol;
+	union lanyfs_b *b;
+	uint64_t target, to;
+	int slots, i, ret = -1;
+
+	if (!addr)
+		return 0;
+	if (!lanyfs_valid_addr(vol, addr)) {
+		errno = EIO;
+		return -1;
+	}
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	if (lanyfs_read_block(vol, addr, b))
+		goto out;
+	if (b->raw.type != LANYFS_TYPE_EXT ||
+	    b->ext.level > LANYFS_MAX_LEVEL) {
+		errno = EIO;
+		goto out;
+	}
+	slots = lanyfs_ext_slots(vol);
+	for (i = 0; i < slots; i++) {
+		target = lanyfs_slot_get(vol, &b->ext.stream, i);
+		if (!target)
+			continue;
+		if (b->ext.level) {
+			if (move_ext(ctx, w, target))
+				goto out;
+			continue;
+		}
+		to = move_find(ctx, target);
+		if (!to)
+			continue;
+		w->found++;
+		if (lanyfs_addrvec_push(&w->copies, target) ||
+		    lanyfs_addrvec_push(&w->copies, to))
+			goto out;
+	}
+	ret = move_place(ctx, w, addr, b, move_ptrs(ctx, b));
+
+out:
+	free(b);
+	return ret;
+}
+
+/**
+ * move_node() - Walk callback moving a directory or file and its extenders.
+ * @vol:			volume
+ * @worker:			index of calling worker
+ * @addr:			address of block
+ * @b:				the block
+ * @arg:			move
+ */
+static int move_node (struct lanyfs_vol *vol, int worker, uint64_t addr,
+		      union lanyfs_b *b, void *arg)
+{
+	struct move_ctx *ctx = arg;
+	struct move_worker *w = &ctx->workers[worker];
+
+	if (b->raw.type == LANYFS_TYPE_FILE &&
+	    move_ext(ctx, w, fromle64(b->file.data)))
+		return -1;
+	memcpy(w->b, b, vol->bsize);
+	return move_place(ctx, w, addr, w->b, move_ptrs(ctx, w->b));
+}
+
+/**
+ * copy_run() - Pool task copying a run of data blocks.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			move
+ * @first:			index of first copy of run
+ *
+ * Sources are read a run of consecutive blocks at a time, the run of
+ * destinations is written at once.
+ */
+static int copy_run (struct lanyfs_pool *pool, int worker, void *arg,
+		     uint64_t first)
+{
+	struct move_ctx *ctx = arg;
+	struct lanyfs_vol *vol = ctx->vol;
+	struct move_pair *c = ctx->copies + first;
+	unsigned char *run = ctx->workers[worker].run;
+	size_t n = 1, i, k;
+
+	while (first + n < ctx->ncopies && n < ctx->batch &&
+	       c[n].to == c[0].to + n)
+		n++;
+	for (i = 0; i < n; i += k) {
+		for (k = 1; i + k < n && c[i + k].from == c[i].from + k; k++)
+			;
+		if (lanyfs_dev_pread(vol->dev, run + (i << vol->blocksize),
+				     k << vol->blocksize,
+				     c[i].from << vol->blocksize))
+			return -1;
+	}
+	return lanyfs_dev_pwrite(vol->dev, run, n << vol->blocksize,
+				 c[0].to << vol->blocksize);
+}
+
+/**
+ * copy_data() - Copies all data blocks noted by the walk.
+ * @ctx:			move
+ * @threads:			number of worker threads
+ */
+static int copy_data (struct move_ctx *ctx, int threads)
+{
+	struct lanyfs_pool *pool;
+	struct move_worker *w;
+	size_t i, k;
+	int ret = -1;
+
+	for (i = 0; i < (size_t) threads; i++)
+		ctx->ncopies += ctx->workers[i].copies.n / 2;
+	if (!ctx->ncopies)
+		return 0;
+	ctx->copies = malloc(ctx->ncopies * sizeof(*ctx->copies));
+	if (!ctx->copies)
+		return -1;
+	for (i = 0, k = 0; i < (size_t) threads; i++) {
+		w = &ctx->workers[i];
+		memcpy(ctx->copies + k, w->copies.a, w->copies.n *
+		       sizeof(*w->copies.a));
+		k += w->copies.n / 2;
+	}
+	qsort(ctx->copies, ctx->ncopies, sizeof(*ctx->copies), cmp_to);
+	ctx->batch = lanyfs_dev_batch(ctx->vol->dev) >> ctx->vol->blocksize;
+	if (!ctx->batch)
+		ctx->batch = 1;
+	for (i = 0; i < (size_t) threads; i++) {
+		/* aligned, runs may go out bypassing the page cache */
+		if (posix_memalign((void **) &ctx->workers[i].run, 4096,
+				   ctx->batch << ctx->vol->blocksize)) {
+			ctx->workers[i].run = NULL;
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		return -1;
+	for (i = 0; i < ctx->ncopies; i += k) {
+		if (lanyfs_pool_submit(pool, copy_run, ctx, i))
+			break;
+		for (k = 1; i + k < ctx->ncopies && k < ctx->batch &&
+		     ctx->copies[i + k].to == ctx->copies[i].to + k; k++)
+			;
+	}
+	ret = lanyfs_pool_wait(pool) || i < ctx->ncopies ? -1 : 0;
+	lanyfs_pool_free(pool);
+	return ret;
+}
+
+/**
+ * fix_blocks() - Rewrites blocks in place that point to moved blocks.
+ * @ctx:			move
+ * @threads:			number of workers holding blocks to fix
+ */
+static int fix_blocks (struct move_ctx *ctx, int threads)
+{
+	struct lanyfs_addrvec *fix;
+	union lanyfs_b *b = ctx->workers[0].b;
+	size_t k;
+	int i;
+
+	for (i = 0; i < threads; i++) {
+		fix = &ctx->workers[i].fix;
+		for (k = 0; k < fix->n; k++) {
+			if (lanyfs_read_block(ctx->vol, fix->a[k], b))
+				return -1;
+			move_ptrs(ctx, b);
+			if (lanyfs_write_block(ctx->vol, fix->a[k], b))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * chain_range() - Writes one free blocks chain after a move.
+ * @vol:			volume
+ * @map:			blocks free after the move, chain blocks included
+ * @old:			chain blocks of the old chains
+ * @start:			first block covered by the chain
+ * @end:			block after those covered
+ * @lo:				first block of a range to keep chain blocks out of
+ * @hi:				block after that range
+ * @zone:			metadata zone's chain rather than main chain
+ * @check:			only check that enough chain blocks are at hand
+ */
+static int chain_range (struct lanyfs_vol *vol, const unsigned char *map,
+			const unsigned char *old, uint64_t start, uint64_t end,
+			uint64_t lo, uint64_t hi, int zone, int check)
+{
+	struct lanyfs_chainenc *enc;
+	uint64_t *chains, nfree = 0, m, k, addr;
+	int ret = -1;
+
+	for (addr = start; addr < end; addr++)
+		nfree += lanyfs_testbit(map, addr);
+	m = lanyfs_chain_blocks(vol, nfree);
+	if (!m) {
+		if (!check && zone) {
+			vol->sb->sb.zonehead = 0;
+			vol->sb->sb.zonetail = 0;
+			vol->sb->sb.zoneblocks = 0;
+		} else if (!check) {
+			vol->sb->sb.freehead = 0;
+			vol->sb->sb.freetail = 0;
+			vol->sb->sb.freeblocks = 0;
+		}
+		return 0;
+	}
+	chains = malloc(m * sizeof(*chains));
+	if (!chains)
+		return -1;
+	for (addr = start, k = 0; addr < end && k < m; addr++) {
+		if (lanyfs_testbit(map, addr) && !lanyfs_testbit(old, addr) &&
+		    (addr < lo || addr >= hi))
+			chains[k++] = addr;
+	}
+	if (k < m) {
+		errno = ENOSPC;
+		goto out;
+	}
+	if (check) {
+		ret = 0;
+		goto out;
+	}
+	enc = zone ? lanyfs_zone_begin(vol, chains, m) :
+		     lanyfs_chain_begin(vol, chains, m);
+	if (!enc)
+		goto out;
+	for (addr = start, k = 0; addr < end; addr++) {
+		if (!lanyfs_testbit(map, addr))
+			continue;
+		if (k < m && chains[k] == addr) {
+			k++;
+			continue;
+		}
+		if (lanyfs_chain_add(enc, addr)) {
+			lanyfs_chain_end(enc);
+			goto out;
+		}
+	}
+	ret = lanyfs_chain_end(enc);
+
+out:
+	free(chains);
+	return ret;
+}
+
+/**
+ * move_chain() - Writes the free blocks chains after a move.
+ * @vol:			volume
+ * @map:			blocks free after the move, chain blocks included
+ * @old:			chain blocks of the old chains
+ * @lo:				first block of a range to keep chain blocks out of
+ * @hi:				block after that range
+ * @check:			only check that enough chain blocks are at hand
+ *
+ * Free blocks inside the metadata zone go to the zone's chain, the others
+ * to the main chain. The in-memory superblock is updated but not written.
+ */
+static int move_chain (struct lanyfs_vol *vol, const unsigned char *map,
+		       const unsigned char *old, uint64_t lo, uint64_t hi,
+		       int check)
+{
+	uint64_t start = LANYFS_SUPERBLOCK + 1;
+	uint64_t zoneend = fromle64(vol->sb->sb.zoneend);
+
+	if (zoneend) {
+		if (chain_range(vol, map, old, start, zoneend, lo, hi, 1,
+				check))
+			return -1;
+		start = zoneend;
+	}
+	return chain_range(vol, map, old, start, vol->blocks, lo, hi, 0,
+			   check);
+}
+
+/**
+ * free_maps() - Maps the free blocks of a volume.
+ * @vol:			volume
+ * @map:			free blocks, chain blocks included, on return
+ * @chains:			chain blocks only, on return
+ */
+static int free_maps (struct lanyfs_vol *vol, unsigned char **map,
+		      unsigned char **chains)
+{
+	uint64_t k, len = (vol->blocks + 7) / 8;
+
+	*map = calloc(len, 1);
+	*chains = calloc(len, 1);
+	if (!*map || !*chains || lanyfs_free_map(vol, *map, 1, NULL) ||
+	    lanyfs_free_map(vol, *chains, 0, NULL))
+		return -1;
+	/* the second map holds free blocks but chain blocks, flip it */
+	for (k = 0; k < len; k++)
+		(*chains)[k] = (*map)[k] & ~(*chains)[k];
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * lanyfs_move_blocks() - Moves blocks in use to free blocks.
+ * @vol:			volume, writable
+ * @from:			addresses of directory, file, extender or data
+ * 				blocks in use
+ * @to:				addresses of free blocks, not chain blocks
+ * @n:				number of blocks to move
+ * @lo:				first block of a range to keep the new chain's
+ * 				blocks out of
+ * @hi:				block after that range, @lo for none
+ * @threads:			number of worker threads
+ *
+ * All pointers to moved blocks are changed and the free blocks chain is
+ * rewritten, the superblock is written last. Fails with EINVAL if a block
+ * is not free or not in use as required, or if not all blocks to move are
+ * reachable, and with ENOSPC if there is no room for the new chain. Nothing
+ * in use is written before these checks pass.
+ */
+int lanyfs_move_blocks (struct lanyfs_vol *vol, const uint64_t *from,
+			const uint64_t *to, size_t n, uint64_t lo, uint64_t hi,
+			int threads)
+{
+	struct move_ctx ctx;
+	unsigned char *map = NULL, *chains = NULL;
+	uint64_t found = 0, root;
+	size_t i;
+	int ret = -1;
+
+	if (vol->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (threads < 1)
+		threads = 1;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.vol = vol;
+	ctx.n = n;
+	ctx.pairs = malloc((n + 1) * sizeof(*ctx.pairs));
+	ctx.workers = calloc(threads, sizeof(*ctx.workers));
+	if (!ctx.pairs || !ctx.workers || free_maps(vol, &map, &chains))
+		goto out;
+
+	/* destinations must be free, sources in use, both only once */
+	for (i = 0; i < n; i++) {
+		ctx.pairs[i].from = from[i];
+		ctx.pairs[i].to = to[i];
+		if (!lanyfs_valid_addr(vol, from[i]) ||
+		    !lanyfs_valid_addr(vol, to[i]) ||
+		    lanyfs_testbit(map, from[i]) ||
+		    !lanyfs_testbit(map, to[i]) ||
+		    lanyfs_testbit(chains, to[i]))
+			goto inval;
+	}
+	qsort(ctx.pairs, n, sizeof(*ctx.pairs), cmp_to);
+	for (i = 1; i < n; i++) {
+		if (ctx.pairs[i].to == ctx.pairs[i - 1].to)
+			goto inval;
+	}
+	qsort(ctx.pairs, n, sizeof(*ctx.pairs), cmp_from);
+	for (i = 1; i < n; i++) {
+		if (ctx.pairs[i].from == ctx.pairs[i - 1].from)
+			goto inval;
+	}
+	for (i = 0; i < n; i++) {
+		lanyfs_clearbit(map, ctx.pairs[i].to);
+		lanyfs_setbit(map, ctx.pairs[i].from);
+	}
+	if (move_chain(vol, map, chains, lo, hi, 1))
+		goto out;
+
+	for (i = 0; i < (size_t) threads; i++) {
+		ctx.workers[i].b = lanyfs_alloc_block(vol);
+		if (!ctx.workers[i].b)
+			goto out;
+	}
+	root = fromle64(vol->sb->sb.rootdir);
+	if (n && lanyfs_walk(vol, root, threads, move_node, &ctx))
+		goto out;
+	for (i = 0; i < (size_t) threads; i++)
+		found += ctx.workers[i].found;
+	if (found != n)
+		goto inval;
+	if (copy_data(&ctx, threads) || lanyfs_dev_sync(vol->dev))
+		goto out;
+
+	/* nothing but free blocks written so far */
+	if (fix_blocks(&ctx, threads))
+		goto out;
+	if (move_find(&ctx, root))
+		vol->sb->sb.rootdir = tole64(move_find(&ctx, root));
+	if (lanyfs_dev_sync(vol->dev) ||
+	    move_chain(vol, map, chains, lo, hi, 0) ||
+	    lanyfs_write_sb(vol) || lanyfs_dev_sync(vol->dev))
+		goto out;
+	ret = 0;
+	goto out;
+
+inval:
+	errno = EINVAL;
+out:
+	for (i = 0; ctx.workers && i < (size_t) threads; i++) {
+		free(ctx.workers[i].b);
+		free(ctx.workers[i].run);
+		lanyfs_addrvec_free(&ctx.workers[i].fix);
+		lanyfs_addrvec_free(&ctx.workers[i].copies);
+	}
+	free(ctx.workers);
+	free(ctx.pairs);
+	free(ctx.copies);
+	free(map);
+	free(chains);
+	return ret;
+}
+
+/**
+ * evict_targets() - Picks free blocks to move blocks out of a region to.
+ * @map:			free blocks, chain blocks included
+ * @chains:			chain blocks
+ * @lo:				first block to pick from
+ * @hi:				block after the last one to pick from
+ * @best:			first block of region
+ * @n:				number of blocks of region
+ * @to:				picked blocks, appended
+ * @k:				number of blocks picked so far
+ * @m:				number of blocks to pick
+ *
+ * Returns the number of blocks picked so far, the lowest free blocks
+ * first.
+ */
+static uint64_t evict_targets (const unsigned char *map,
+			       const unsigned char *chains, uint64_t lo,
+			       uint64_t hi, uint64_t best, uint64_t n,
+			       uint64_t *to, uint64_t k, uint64_t m)
+{
+	uint64_t addr;
+	for (addr = lo; k < m && addr < hi; addr++) {
+		if (addr >= best && addr < best + n)
+			continue;
+		if (lanyfs_testbit(map, addr) && !lanyfs_testbit(chains, addr))
+			to[k++] = addr;
+	}
+	return k;
+}
+
+/**
+ * lanyfs_move_region() - Moves blocks in use into one region, in order.
+ * @vol:			volume, writable
+ * @addrs:			addresses of blocks in use, changed to their new
+ * 				addresses on return
+ * @n:				number of blocks
+ * @meta:			blocks are directory, file and extender blocks
+ * @threads:			number of worker threads
+ * @start:			first block of region on return
+ *
+ * Blocks already in place are left alone. Otherwise the region of @n
+ * blocks with the fewest blocks not free is chosen, the lowest of those,
+ * and blocks in use there are moved out of the way first. On volumes with
+ * a metadata zone, the region is looked for inside the zone if @meta is
+ * set and behind it otherwise, as long as it fits there. Blocks moved out
+ * of the way stay on the same side of the zone's end, unless it is full.
+ * Fails with ENOSPC if the free blocks do not suffice.
+ */
+int lanyfs_move_region (struct lanyfs_vol *vol, uint64_t *addrs, size_t n,
+			int meta, int threads, uint64_t *start)
+{
+	unsigned char *map = NULL, *chains = NULL;
+	uint64_t *from = NULL, *to = NULL, s, best, cost, least, addr, k, m;
+	uint64_t lo = LANYFS_SUPERBLOCK + 1, hi = vol->blocks;
+	uint64_t zoneend = fromle64(vol->sb->sb.zoneend);
+	uint64_t split = zoneend ? zoneend : vol->blocks;
+	size_t i;
+	int ret = -1;
+
+	*start = n ? addrs[0] : 0;
+	for (i = 1; i < n && addrs[i] == addrs[0] + i; i++)
+		;
+	if (i >= n)
+		return 0;
+	if (n >= vol->blocks - LANYFS_SUPERBLOCK) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (free_maps(vol, &map, &chains))
+		goto out;
+	if (zoneend && meta && n < zoneend - lo)
+		hi = zoneend;
+	else if (zoneend && !meta && zoneend + n < vol->blocks)
+		lo = zoneend;
+
+	/* slide a window over the area, counting blocks not free */
+	s = lo;
+	for (cost = 0, addr = s; addr < s + n; addr++)
+		cost += !lanyfs_testbit(map, addr) ||
+			lanyfs_testbit(chains, addr);
+	best = s;
+	least = cost;
+	for (; s + n < hi && least; s++) {
+		cost -= !lanyfs_testbit(map, s) || lanyfs_testbit(chains, s);
+		cost += !lanyfs_testbit(map, s + n) ||
+			lanyfs_testbit(chains, s + n);
+		if (cost < least) {
+			least = cost;
+			best = s + 1;
+		}
+	}
+
+	/* clear the region */
+	if (least) {
+		from = malloc(n * sizeof(*from));
+		to = malloc(n * sizeof(*to));
+		if (!from || !to)
+			goto out;
+		for (m = 0, addr = best; addr < best + n; addr++) {
+			if (!lanyfs_testbit(map, addr))
+				from[m++] = addr;
+		}
+		if (meta || !zoneend) {
+			k = evict_targets(map, chains, LANYFS_SUPERBLOCK + 1,
+					  split, best, n, to, 0, m);
+			k = evict_targets(map, chains, split, vol->blocks,
+					  best, n, to, k, m);
+		} else {
+			k = evict_targets(map, chains, split, vol->blocks,
+					  best, n, to, 0, m);
+			k = evict_targets(map, chains, LANYFS_SUPERBLOCK + 1,
+					  split, best, n, to, k, m);
+		}
+		if (k < m) {
+			errno = ENOSPC;
+			goto out;
+		}
+		if (lanyfs_move_blocks(vol, from, to, m, best, best + n,
+				       threads))
+			goto out;
+		/* blocks to be placed may have been in the way */
+		for (i = 0; i < n; i++) {
+			if (addrs[i] >= best && addrs[i] < best + n)
+				addrs[i] = to[(uint64_t *)
+					      bsearch(&addrs[i], from, m,
+						      sizeof(*from),
+						      cmp_addr) - from];
+		}
+	} else {
+		to = malloc(n * sizeof(*to));
+		if (!to)
+			goto out;
+	}
+
+	for (i = 0; i < n; i++)
+		to[i] = best + i;
+	if (lanyfs_move_blocks(vol, addrs, to, n, best, best + n, threads))
+		goto out;
+	memcpy(addrs, to, n * sizeof(*addrs));
+	*start = best;
+	ret = 0;
+
+out:
+	free(map);
+	free(chains);
+	free(from);
+	free(to);
+	return ret;
+}
@@ -0,0 +1,683 @@
+/*
+ * liboverlay.c - Copy-on-Write Overlay Backend for Lanyard Filesystem.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Overlay files
+ *
+ * An overlay presents a read-only base image with private modifications.
+ * The overlay file starts with a header naming the base, followed by a
+ * presence bitmap with one bit per granule and a sparse data region that
+ * mirrors the base byte for byte. Creating an overlay writes the header
+ * only, so it costs the same for any size of base.
+ *
+ * Reads are served granule-wise from the data region if the granule's bit
+ * is set and from the base otherwise. Writes always go to the data region.
+ * A partial write to a granule not yet present copies the granule up from
+ * the base first. Bits only ever go from 0 to 1 while an overlay is open,
+ * so readers test them without locking. The bitmap is written back on sync,
+ * after the data it describes has been made durable.
+ *
+ * The base must not change underneath an overlay. Its size and time of last
+ * modification are recorded at creation and checked on every open.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "liblanyfs.h"
+
+/* layout of overlay files */
+#define OVERLAY_VERSION		1
+#define OVERLAY_HDR_SIZE	4096
+#define OVERLAY_PAGE		4096
+#define OVERLAY_COPY_SIZE	(1 << 20)
+
+/**
+ * struct overlay_hdr - On-disk header of overlay files, little endian.
+ * @magic:			identifies overlay files
+ * @version:			version of overlay format
+ * @shift:			granule size (exponent to base 2)
+ * @size:			size of base in bytes
+ * @mtime:			base's time of last modification
+ * @bitmap:			byte offset of presence bitmap
+ * @data:			byte offset of data region
+ * @base:			absolute path of base
+ */
+struct overlay_hdr {
+	char			magic[LANYFS_DEV_MAGIC_LEN];
+	uint32_t		version;
+	uint32_t		shift;
+	uint64_t		size;
+	uint64_t		mtime;
+	uint64_t		bitmap;
+	uint64_t		data;
+	char			base[LANYFS_OVERLAY_PATHLEN];
+};
+
+/**
+ * struct overlay - Open overlay.
+ * @base:			file descriptor of base, read-only
+ * @shift:			granule size (exponent to base 2)
+ * @granules:			number of granules
+ * @bitmap_off:			byte offset of presence bitmap
+ * @data_off:			byte offset of data region
+ * @bitmap:			presence bitmap
+ * @bitmap_len:			length of presence bitmap in bytes
+ * @dirty:			one flag per bitmap page changed since last sync
+ * @lock:			serializes copy-up of granules
+ */
+struct overlay {
+	int			base;
+	int			shift;
+	uint64_t		granules;
+	uint64_t		bitmap_off;
+	uint64_t		data_off;
+	unsigned char		*bitmap;
+	size_t			bitmap_len;
+	unsigned char		*dirty;
+	pthread_mutex_t		lock;
+};
+
+/**
+ * round_up() - Rounds up to a multiple of a power of two.
+ * @n:				value to round
+ * @align:			power of two
+ */
+static inline uint64_t round_up (uint64_t n, uint64_t align)
+{
+	return (n + align - 1) & ~(align - 1);
+}
+
+/**
+ * ovl_present() - Checks if a granule is held by the overlay.
+ * @ovl:			overlay
+ * @g:				granule
+ */
+static inline int ovl_present (struct overlay *ovl, uint64_t g)
+{
+	return __atomic_load_n(&ovl->bitmap[g >> 3], __ATOMIC_ACQUIRE) &
+	       (1 << (g & 7));
+}
+
+/**
+ * ovl_mark() - Marks a granule as held by the overlay.
+ * @ovl:			overlay
+ * @g:				granule
+ */
+static inline void ovl_mark (struct overlay *ovl, uint64_t g)
+{
+	__atomic_fetch_or(&ovl->bitmap[g >> 3], 1 << (g & 7),
+			  __ATOMIC_RELEASE);
+	__atomic_store_n(&ovl->dirty[(g >> 3) / OVERLAY_PAGE], 1,
+			 __ATOMIC_RELAXED);
+}
+
+/**
+ * ovl_pread() - Reads from an overlay.
+ * @dev:			device
+ * @buf:			target buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ *
+ * Consecutive granules with the same source are read in one go.
+ */
+static int ovl_pread (struct lanyfs_dev *dev, void *buf, size_t len,
+		      uint64_t pos)
+{
+	struct overlay *ovl = dev->priv;
+	uint64_t g, end;
+	size_t n;
+	int present;
+
+	if (pos + len > dev->size) {
+		errno = EIO;
+		return -1;
+	}
+	while (len) {
+		g = pos >> ovl->shift;
+		present = ovl_present(ovl, g);
+		end = (g + 1) << ovl->shift;
+		while (end < pos + len &&
+		       !ovl_present(ovl, end >> ovl->shift) == !present)
+			end += (uint64_t) 1 << ovl->shift;
+		n = end - pos < len ? end - pos : len;
+		if (present) {
+			if (lanyfs_fd_pread(dev->fd, buf, n,
+					    ovl->data_off + pos))
+				return -1;
+		} else {
+			if (lanyfs_fd_pread(ovl->base, buf, n, pos))
+				return -1;
+		}
+		buf = (unsigned char *) buf + n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * ovl_copy_up() - Writes part of a granule not yet held by the overlay.
+ * @dev:			device
+ * @buf:			source buffer
+ * @len:			number of bytes, within one granule
+ * @pos:			byte offset
+ */
+static int ovl_copy_up (struct lanyfs_dev *dev, const void *buf, size_t len,
+			uint64_t pos)
+{
+	struct overlay *ovl = dev->priv;
+	uint64_t g = pos >> ovl->shift;
+	uint64_t start = g << ovl->shift;
+	size_t gsize = (size_t) 1 << ovl->shift;
+	unsigned char *tmp;
+	int ret = -1;
+
+	pthread_mutex_lock(&ovl->lock);
+	if (ovl_present(ovl, g)) {
+		/* somebody else was faster */
+		ret = lanyfs_fd_pwrite(dev->fd, buf, len, ovl->data_off + pos);
+		goto out;
+	}
+	if (start + gsize > dev->size)
+		gsize = dev->size - start;
+	tmp = malloc(gsize);
+	if (!tmp)
+		goto out;
+	if (!lanyfs_fd_pread(ovl->base, tmp, gsize, start)) {
+		memcpy(tmp + (pos - start), buf, len);
+		ret = lanyfs_fd_pwrite(dev->fd, tmp, gsize,
+				       ovl->data_off + start);
+	}
+	free(tmp);
+	if (!ret)
+		ovl_mark(ovl, g);
+out:
+	pthread_mutex_unlock(&ovl->lock);
+	return ret;
+}
+
+/**
+ * ovl_pwrite() - Writes to an overlay.
+ * @dev:			device
+ * @buf:			source buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ */
+static int ovl_pwrite (struct lanyfs_dev *dev, const void *buf, size_t len,
+		       uint64_t pos)
+{
+	struct overlay *ovl = dev->priv;
+	uint64_t g, gstart, gend;
+	size_t n;
+
+	if (pos + len > dev->size) {
+		errno = ENOSPC;
+		return -1;
+	}
+	while (len) {
+		g = pos >> ovl->shift;
+		gstart = g << ovl->shift;
+		gend = gstart + ((uint64_t) 1 << ovl->shift);
+		if (gend > dev->size)
+			gend = dev->size;
+		n = gend - pos < len ? gend - pos : len;
+		if (ovl_present(ovl, g)) {
+			if (lanyfs_fd_pwrite(dev->fd, buf, n,
+					     ovl->data_off + pos))
+				return -1;
+		} else if (pos == gstart && n == gend - gstart) {
+			pthread_mutex_lock(&ovl->lock);
+			if (lanyfs_fd_pwrite(dev->fd, buf, n,
+					     ovl->data_off + pos)) {
+				pthread_mutex_unlock(&ovl->lock);
+				return -1;
+			}
+			ovl_mark(ovl, g);
+			pthread_mutex_unlock(&ovl->lock);
+		} else if (ovl_copy_up(dev, buf, n, pos)) {
+			return -1;
+		}
+		buf = (const unsigned char *) buf + n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/**
+ * ovl_sync() - Makes data and presence bitmap of an overlay durable.
+ * @dev:			device
+ */
+static int ovl_sync (struct lanyfs_dev *dev)
+{
+	struct overlay *ovl = dev->priv;
+	size_t page, len;
+
+	if (fdatasync(dev->fd))
+		return -1;
+	for (page = 0; page * OVERLAY_PAGE < ovl->bitmap_len; page++) {
+		if (!__atomic_exchange_n(&ovl->dirty[page], 0,
+					 __ATOMIC_ACQ_REL))
+			continue;
+		len = ovl->bitmap_len - page * OVERLAY_PAGE;
+		if (len > OVERLAY_PAGE)
+			len = OVERLAY_PAGE;
+		if (lanyfs_fd_pwrite(dev->fd, ovl->bitmap + page * OVERLAY_PAGE,
+				     len, ovl->bitmap_off +
+				     page * OVERLAY_PAGE))
+			return -1;
+	}
+	return fdatasync(dev->fd);
+}
+
+/**
+ * ovl_close() - Closes an overlay.
+ * @dev:			device
+ */
+static int ovl_close (struct lanyfs_dev *dev)
+{
+	struct overlay *ovl = dev->priv;
+	int ret = 0;
+	if (close(ovl->base))
+		ret = -1;
+	if (close(dev->fd))
+		ret = -1;
+	pthread_mutex_destroy(&ovl->lock);
+	free(ovl->bitmap);
+	free(ovl->dirty);
+	free(ovl);
+	return ret;
+}
+
+static const struct lanyfs_dev_ops overlay_ops = {
+	.name	= "overlay",
+	.pread	= ovl_pread,
+	.pwrite	= ovl_pwrite,
+	.sync	= ovl_sync,
+	.discard = NULL,
+	.close	= ovl_close,
+};
+
+/**
+ * hdr_load() - Reads and validates an overlay header.
+ * @fd:				file descriptor of overlay
+ * @hdr:			header, converted to CPU byte order
+ */
+static int hdr_load (int fd, struct overlay_hdr *hdr)
+{
+	if (lanyfs_fd_pread(fd, hdr, sizeof(*hdr), 0))
+		return -1;
+	hdr->version = fromle32(hdr->version);
+	hdr->shift = fromle32(hdr->shift);
+	hdr->size = fromle64(hdr->size);
+	hdr->mtime = fromle64(hdr->mtime);
+	hdr->bitmap = fromle64(hdr->bitmap);
+	hdr->data = fromle64(hdr->data);
+	hdr->base[LANYFS_OVERLAY_PATHLEN - 1] = '\0';
+	if (memcmp(hdr->magic, LANYFS_OVERLAY_MAGIC, LANYFS_DEV_MAGIC_LEN) ||
+	    hdr->version != OVERLAY_VERSION ||
+	    hdr->shift < LANYFS_MIN_BLOCKSIZE || hdr->shift > 30) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * hdr_store() - Writes an overlay header.
+ * @fd:				file descriptor of overlay
+ * @hdr:			header in CPU byte order
+ */
+static int hdr_store (int fd, const struct overlay_hdr *hdr)
+{
+	unsigned char page[OVERLAY_HDR_SIZE];
+	struct overlay_hdr *le = (struct overlay_hdr *) page;
+
+	memset(page, 0, sizeof(page));
+	memcpy(le, hdr, sizeof(*hdr));
+	le->version = tole32(hdr->version);
+	le->shift = tole32(hdr->shift);
+	le->size = tole64(hdr->size);
+	le->mtime = tole64(hdr->mtime);
+	le->bitmap = tole64(hdr->bitmap);
+	le->data = tole64(hdr->data);
+	return lanyfs_fd_pwrite(fd, page, sizeof(page), 0);
+}
+
+/**
+ * base_open() - Opens the base of an overlay and checks it is unchanged.
+ * @hdr:			overlay header
+ * @rdonly:			open read-only
+ */
+static int base_open (const struct overlay_hdr *hdr, int rdonly)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(hdr->base, rdonly ? O_RDONLY : O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st))
+		goto err;
+	if ((uint64_t) st.st_mtime != hdr->mtime) {
+		errno = ESTALE;
+		goto err;
+	}
+	return fd;
+
+err:
+	close(fd);
+	return -1;
+}
+
+/**
+ * lanyfs_overlay_open() - Opens an overlay file as device.
+ * @fd:				file descriptor of overlay, taken over
+ * @rdonly:			open read-only
+ *
+ * Called by lanyfs_dev_open() after having found the overlay magic.
+ */
+struct lanyfs_dev *lanyfs_overlay_open (int fd, int rdonly)
+{
+	struct lanyfs_dev *dev = NULL;
+	struct overlay *ovl = NULL;
+	struct overlay_hdr hdr;
+	uint64_t size;
+	int err;
+
+	if (hdr_load(fd, &hdr))
+		goto err;
+	dev = calloc(1, sizeof(*dev));
+	ovl = calloc(1, sizeof(*ovl));
+	if (!dev || !ovl)
+		goto err;
+	ovl->base = base_open(&hdr, 1);
+	if (ovl->base < 0)
+		goto err;
+	if (lanyfs_fd_size(ovl->base, &size))
+		goto err_base;
+	if (size != hdr.size) {
+		errno = ESTALE;
+		goto err_base;
+	}
+	ovl->shift = hdr.shift;
+	ovl->granules = round_up(hdr.size, (uint64_t) 1 << hdr.shift) >>
+			hdr.shift;
+	ovl->bitmap_off = hdr.bitmap;
+	ovl->data_off = hdr.data;
+	ovl->bitmap_len = (ovl->granules + 7) / 8;
+	ovl->bitmap = calloc(1, ovl->bitmap_len + 1);
+	ovl->dirty = calloc(1, ovl->bitmap_len / OVERLAY_PAGE + 1);
+	if (!ovl->bitmap || !ovl->dirty)
+		goto err_base;
+	if (ovl->bitmap_len &&
+	    lanyfs_fd_pread(fd, ovl->bitmap, ovl->bitmap_len, hdr.bitmap))
+		goto err_base;
+	pthread_mutex_init(&ovl->lock, NULL);
+	dev->ops = &overlay_ops;
+	dev->fd = fd;
+	dev->rdonly = rdonly;
+	dev->size = hdr.size;
+	dev->priv = ovl;
+	return dev;
+
+err_base:
+	err = errno;
+	close(ovl->base);
+	errno = err;
+err:
+	err = errno;
+	if (ovl) {
+		free(ovl->bitmap);
+		free(ovl->dirty);
+	}
+	free(ovl);
+	free(dev);
+	close(fd);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * lanyfs_overlay_create() - Creates an empty overlay on top of a base.
+ * @base:			path of base image
+ * @path:			path of overlay file to create
+ * @shift:			granule size (exponent to base 2)
+ *
+ * The data region is allocated sparsely, so this is cheap for any base.
+ */
+int lanyfs_overlay_create (const char *base, const char *path, int shift)
+{
+	struct overlay_hdr hdr;
+	struct stat st;
+	char real[PATH_MAX];
+	uint64_t granules;
+	int fd, err;
+
+	if (shift < LANYFS_MIN_BLOCKSIZE || shift > 30) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!realpath(base, real))
+		return -1;
+	if (strlen(real) >= LANYFS_OVERLAY_PATHLEN) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&hdr, 0, sizeof(hdr));
+	fd = open(real, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) || lanyfs_fd_size(fd, &hdr.size)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	close(fd);
+
+	memcpy(hdr.magic, LANYFS_OVERLAY_MAGIC, LANYFS_DEV_MAGIC_LEN);
+	hdr.version = OVERLAY_VERSION;
+	hdr.shift = shift;
+	hdr.mtime = (uint64_t) st.st_mtime;
+	strcpy(hdr.base, real);
+	granules = round_up(hdr.size, (uint64_t) 1 << shift) >> shift;
+	hdr.bitmap = OVERLAY_HDR_SIZE;
+	hdr.data = round_up(hdr.bitmap + (granules + 7) / 8,
+			    (uint64_t) 1 << (shift > 12 ? shift : 12));
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return -1;
+	if (hdr_store(fd, &hdr) || ftruncate(fd, hdr.data + hdr.size) ||
+	    fsync(fd)) {
+		err = errno;
+		close(fd);
+		unlink(path);
+		errno = err;
+		return -1;
+	}
+	return close(fd);
+}
+
+/**
+ * overlay_clear() - Drops all modifications held by an overlay.
+ * @fd:				file descriptor of overlay
+ * @hdr:			overlay header, base time is refreshed
+ * @mtime:			new time of last modification of base
+ */
+static int overlay_clear (int fd, struct overlay_hdr *hdr, uint64_t mtime)
+{
+	/* truncate and re-extend to punch out the data region */
+	if (ftruncate(fd, hdr->bitmap) ||
+	    ftruncate(fd, hdr->data + hdr->size))
+		return -1;
+	hdr->mtime = mtime;
+	if (hdr_store(fd, hdr))
+		return -1;
+	return fsync(fd);
+}
+
+/**
+ * lanyfs_overlay_merge() - Writes modifications back to the base.
+ * @path:			path of overlay file
+ * @commit:			copy modified granules to base before clearing
+ * @granules:			number of granules merged, may be NULL
+ *
+ * Without @commit the overlay is reset to the state of the base. Either
+ * way the overlay is empty and valid for the base afterwards, while other
+ * overlays of the same base become stale.
+ */
+int lanyfs_overlay_merge (const char *path, int commit, uint64_t *granules)
+{
+	struct overlay_hdr hdr;
+	struct stat st;
+	unsigned char *bitmap = NULL, *buf = NULL;
+	uint64_t g, run, count = 0, total, gsize;
+	size_t len;
+	int fd, base = -1, err;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -1;
+	if (hdr_load(fd, &hdr))
+		goto err;
+	base = base_open(&hdr, !commit);
+	if (base < 0)
+		goto err;
+	gsize = (uint64_t) 1 << hdr.shift;
+	total = round_up(hdr.size, gsize) >> hdr.shift;
+	bitmap = malloc((total + 7) / 8 + 1);
+	buf = malloc(OVERLAY_COPY_SIZE > gsize ? OVERLAY_COPY_SIZE : gsize);
+	if (!bitmap || !buf)
+		goto err;
+	if (total && lanyfs_fd_pread(fd, bitmap, (total + 7) / 8, hdr.bitmap))
+		goto err;
+
+	for (g = 0; g < total; g += run) {
+		run = 1;
+		if (!(bitmap[g >> 3] & (1 << (g & 7))))
+			continue;
+		while (g + run < total && (run + 1) * gsize <= OVERLAY_COPY_SIZE &&
+		       (bitmap[(g + run) >> 3] & (1 << ((g + run) & 7))))
+			run++;
+		count += run;
+		if (!commit)
+			continue;
+		len = run * gsize;
+		if ((g << hdr.shift) + len > hdr.size)
+			len = hdr.size - (g << hdr.shift);
+		if (lanyfs_fd_pread(fd, buf, len, hdr.data + (g << hdr.shift)) ||
+		    lanyfs_fd_pwrite(base, buf, len, g << hdr.shift))
+			goto err;
+	}
+	if (commit && fsync(base))
+		goto err;
+	if (fstat(base, &st) || overlay_clear(fd, &hdr, st.st_mtime))
+		goto err;
+	if (granules)
+		*granules = count;
+	free(bitmap);
+	free(buf);
+	close(base);
+	return close(fd);
+
+err:
+	err = errno;
+	free(bitmap);
+	free(buf);
+	if (base >= 0)
+		close(base);
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/**
+ * lanyfs_overlay_stat() - Reports on an overlay file.
+ * @path:			path of overlay file
+ * @base:			path of base, at least LANYFS_OVERLAY_PATHLEN
+ * 				bytes
+ * @gsize:			granule size in bytes
+ * @total:			number of granules
+ * @present:			number of granules held by the overlay
+ */
+int lanyfs_overlay_stat (const char *path, char *base, uint64_t *gsize,
+			 uint64_t *total, uint64_t *present)
+{
+	struct overlay_hdr hdr;
+	unsigned char *bitmap;
+	uint64_t i, len;
+	int fd, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (hdr_load(fd, &hdr))
+		goto err;
+	strcpy(base, hdr.base);
+	*gsize = (uint64_t) 1 << hdr.shift;
+	*total = round_up(hdr.size, *gsize) >> hdr.shift;
+	len = (*total + 7) / 8;
+	bitmap = malloc(len + 1);
+	if (!bitmap)
+		goto err;
+	if (len && lanyfs_fd_pread(fd, bitmap, len, hdr.bitmap)) {
+		free(bitmap);
+		goto err;
+	}
+	*present = 0;
+	for (i = 0; i < len; i++)
+		*present += __builtin_popcount(bitmap[i]);
+	free(bitmap);
+	return close(fd);
+
+err:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
@@ -0,0 +1,580 @@
+/*
+ * libpool.c - Work-Stealing Thread Pool for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Thread pool
+ *
+ * A pool runs tasks on a fixed set of worker threads. Every worker owns a
+ * double-ended queue. Tasks submitted by a worker go to the bottom of its
+ * own queue and are taken from there again, last in first out, which keeps
+ * depth-first work on a warm cache. Workers running out of work steal the
+ * oldest task from the top of another worker's queue, usually the largest
+ * piece of work left.
+ *
+ * Tasks submitted from outside the pool are dealt round robin and are
+ * bounded: submitting blocks while the pool holds too many unfinished
+ * tasks, so a producer reading from a device cannot run ahead of the
+ * workers. Tasks submitted by workers are never bounded, blocking them
+ * could deadlock the pool.
+ *
+ * The worker count defaults to lanyfs_default_threads(). Setting
+ * LANYFS_AFFINITY in the environment pins workers to processors in every
+ * tool, as does the LANYFS_POOL_AFFINITY flag.
+ */
+
+#define _GNU_SOURCE		/* pthread_setaffinity_np() */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "liblanyfs.h"
+
+#define POOL_DEQUE_MIN		64	/* initial capacity of a queue */
+#define POOL_BOUND_FACTOR	4	/* default bound per worker */
+
+/**
+ * struct pool_task - Queued task.
+ * @fn:				task function
+ * @arg:			pointer argument
+ * @n:				number argument
+ */
+struct pool_task {
+	lanyfs_task_t		fn;
+	void			*arg;
+	uint64_t		n;
+};
+
+/**
+ * struct pool_worker - Worker thread and its queue.
+ * @pool:			pool the worker belongs to
+ * @index:			index of worker
+ * @thread:			thread running the worker
+ * @lock:			protects the queue
+ * @ring:			queue, a ring buffer
+ * @cap:			capacity of ring, a power of two
+ * @top:			position of oldest task, taken by thieves
+ * @bottom:			position after newest task, taken by owner
+ * @seed:			state of victim selection
+ * @st:				utilization, written by the worker only
+ */
+struct pool_worker {
+	struct lanyfs_pool	*pool;
+	int			index;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	struct pool_task	*ring;
+	uint64_t		cap;
+	uint64_t		top;
+	uint64_t		bottom;
+	uint64_t		seed;
+	struct lanyfs_pool_stats st;
+};
+
+/**
+ * struct lanyfs_pool - Thread pool.
+ * @threads:			number of workers
+ * @bound:			unfinished tasks allowed before submit blocks
+ * @w:				workers
+ * @lock:			protects sleeping on the conditions below
+ * @work:			signals new tasks or shutdown
+ * @change:			signals finished tasks
+ * @queued:			tasks waiting in queues
+ * @pending:			tasks submitted but not finished
+ * @sleeping:			workers waiting for work
+ * @waiting:			threads waiting for finished tasks
+ * @next:			next worker for outside submissions
+ * @stop:			workers shall exit
+ * @failed:			a task failed, drop the remaining ones
+ * @ret:			first non-zero return value of a task
+ * @err:			errno after first failed task
+ */
+struct lanyfs_pool {
+	int			threads;
+	size_t			bound;
+	struct pool_worker	*w;
+	pthread_mutex_t		lock;
+	pthread_cond_t		work;
+	pthread_cond_t		change;
+	uint64_t		queued;
+	uint64_t		pending;
+	int			sleeping;
+	int			waiting;
+	unsigned int		next;
+	int			stop;
+	int			failed;
+	int			ret;
+	int			err;
+};
+
+/* worker run by the calling thread, NULL outside of pools */
+static __thread struct pool_worker *pool_self = NULL;
+
+/**
+ * pool_now() - Returns nanoseconds on the monotonic clock.
+ */
+static uint64_t pool_now (void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * deque_push() - Adds a task to the bottom of a worker's queue.
+ * @w:				worker
+ * @t:				task
+ *
+ * Queues grow as needed.
+ */
+static int deque_push (struct pool_worker *w, const struct pool_task *t)
+{
+	struct pool_task *ring;
+	uint64_t i;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->bottom - w->top == w->cap) {
+		ring = malloc(2 * w->cap * sizeof(*ring));
+		if (!ring) {
+			pthread_mutex_unlock(&w->lock);
+			errno = ENOMEM;
+			return -1;
+		}
+		for (i = w->top; i < w->bottom; i++)
+			ring[i & (2 * w->cap - 1)] = w->ring[i & (w->cap - 1)];
+		free(w->ring);
+		w->ring = ring;
+		w->cap *= 2;
+	}
+	w->ring[w->bottom++ & (w->cap - 1)] = *t;
+	pthread_mutex_unlock(&w->lock);
+	return 0;
+}
+
+/**
+ * deque_pop() - Takes the newest task from a worker's own queue.
+ * @w:				worker
+ * @t:				taken task
+ */
+static int deque_pop (struct pool_worker *w, struct pool_task *t)
+{
+	int ret = 0;
+	pthread_mutex_lock(&w->lock);
+	if (w->bottom != w->top) {
+		*t = w->ring[--w->bottom & (w->cap - 1)];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+/**
+ * deque_steal() - Takes the oldest task from another worker's queue.
+ * @w:				victim
+ * @t:				taken task
+ */
+static int deque_steal (struct pool_worker *w, struct pool_task *t)
+{
+	int ret = 0;
+	/* unlocked peek, a stale value only costs a missed steal */
+	if (__atomic_load_n(&w->bottom, __ATOMIC_RELAXED) ==
+	    __atomic_load_n(&w->top, __ATOMIC_RELAXED))
+		return 0;
+	pthread_mutex_lock(&w->lock);
+	if (w->bottom != w->top) {
+		*t = w->ring[w->top++ & (w->cap - 1)];
+		ret = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+/**
+ * pool_enqueue() - Queues a task and wakes a sleeping worker.
+ * @pool:			pool
+ * @w:				worker whose queue takes the task
+ * @t:				task
+ */
+static int pool_enqueue (struct lanyfs_pool *pool, struct pool_worker *w,
+			 const struct pool_task *t)
+{
+	__atomic_add_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	if (deque_push(w, t)) {
+		__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+		return -1;
+	}
+	__atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return 0;
+}
+
+/**
+ * pool_find() - Takes a task from the own queue or steals one.
+ * @w:				worker
+ * @t:				taken task
+ */
+static int pool_find (struct pool_worker *w, struct pool_task *t)
+{
+	struct lanyfs_pool *pool = w->pool;
+	int i, victim;
+
+	if (deque_pop(w, t))
+		goto found;
+	/* start at a random victim so thieves spread out */
+	victim = lanyfs_rand(&w->seed) % pool->threads;
+	for (i = 0; i < pool->threads; i++, victim = (victim + 1) %
+						      pool->threads) {
+		if (victim == w->index)
+			continue;
+		if (deque_steal(&pool->w[victim], t)) {
+			w->st.steals++;
+			goto found;
+		}
+	}
+	return 0;
+found:
+	__atomic_sub_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+	return 1;
+}
+
+/**
+ * pool_finish() - Accounts for a finished task.
+ * @pool:			pool
+ * @ret:			return value of task
+ * @err:			errno after task
+ */
+static void pool_finish (struct lanyfs_pool *pool, int ret, int err)
+{
+	if (ret) {
+		pthread_mutex_lock(&pool->lock);
+		if (!pool->failed) {
+			pool->failed = 1;
+			pool->ret = ret;
+			pool->err = err;
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	__atomic_sub_fetch(&pool->pending, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&pool->waiting, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->change);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/**
+ * pool_pin() - Pins a worker to a processor.
+ * @w:				worker
+ */
+static void pool_pin (struct pool_worker *w)
+{
+#ifdef __linux__
+	cpu_set_t set;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(w->index % cpus, &set);
+	/* containers may forbid some processors, ignore errors */
+	pthread_setaffinity_np(w->thread, sizeof(set), &set);
+#else
+	(void) w;
+#endif
+}
+
+/**
+ * pool_worker() - Thread function of pool workers.
+ * @arg:			worker
+ */
+static void *pool_worker (void *arg)
+{
+	struct pool_worker *w = arg;
+	struct lanyfs_pool *pool = w->pool;
+	struct pool_task t;
+	uint64_t start;
+	int ret, err;
+
+	pool_self = w;
+	for (;;) {
+		if (pool_find(w, &t)) {
+			ret = err = 0;
+			start = pool_now();
+			if (!__atomic_load_n(&pool->failed, __ATOMIC_RELAXED)) {
+				errno = 0;
+				ret = t.fn(pool, w->index, t.arg, t.n);
+				err = errno;
+				w->st.tasks++;
+			}
+			w->st.busy += pool_now() - start;
+			pool_finish(pool, ret, err);
+			continue;
+		}
+		start = pool_now();
+		pthread_mutex_lock(&pool->lock);
+		__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (!pool->stop &&
+		       !__atomic_load_n(&pool->queued, __ATOMIC_SEQ_CST))
+			pthread_cond_wait(&pool->work, &pool->lock);
+		__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		ret = pool->stop;
+		pthread_mutex_unlock(&pool->lock);
+		w->st.idle += pool_now() - start;
+		if (ret)
+			break;
+	}
+	return NULL;
+}
+
+/**
+ * pool_release() - Frees a pool whose workers are not running.
+ * @pool:			pool
+ * @n:				number of workers with a queue
+ */
+static void pool_release (struct lanyfs_pool *pool, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		free(pool->w[i].ring);
+		pthread_mutex_destroy(&pool->w[i].lock);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work);
+	pthread_cond_destroy(&pool->change);
+	free(pool->w);
+	free(pool);
+}
+
+/**
+ * lanyfs_pool_new() - Starts a thread pool.
+ * @threads:			number of workers, 0 for the default
+ * @bound:			unfinished tasks allowed before submitting from
+ * 				outside blocks, 0 for four per worker
+ * @flags:			LANYFS_POOL_AFFINITY or 0
+ *
+ * Starts fewer workers rather than failing if threads cannot be created,
+ * but at least one. Pinning workers is best effort.
+ */
+struct lanyfs_pool *lanyfs_pool_new (int threads, size_t bound, int flags)
+{
+	struct lanyfs_pool *pool;
+	const char *env;
+	int i, started;
+
+	if (threads < 1)
+		threads = lanyfs_default_threads();
+	env = getenv("LANYFS_AFFINITY");
+	if (env && *env && *env != '0')
+		flags |= LANYFS_POOL_AFFINITY;
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->w = calloc(threads, sizeof(*pool->w));
+	if (!pool->w) {
+		free(pool);
+		return NULL;
+	}
+	pool->threads = threads;
+	pool->bound = bound ? bound : (size_t) threads * POOL_BOUND_FACTOR;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->change, NULL);
+	for (i = 0; i < threads; i++) {
+		pool->w[i].pool = pool;
+		pool->w[i].index = i;
+		pool->w[i].seed = i;
+		pool->w[i].cap = POOL_DEQUE_MIN;
+		pthread_mutex_init(&pool->w[i].lock, NULL);
+		pool->w[i].ring = malloc(POOL_DEQUE_MIN *
+					 sizeof(*pool->w[i].ring));
+		if (!pool->w[i].ring) {
+			pool_release(pool, i + 1);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+	for (started = 0; started < threads; started++) {
+		if (pthread_create(&pool->w[started].thread, NULL, pool_worker,
+				   &pool->w[started]))
+			break;
+		if (flags & LANYFS_POOL_AFFINITY)
+			pool_pin(&pool->w[started]);
+	}
+	if (!started) {
+		pool_release(pool, threads);
+		errno = EAGAIN;
+		return NULL;
+	}
+	/* run with fewer workers rather than failing */
+	for (i = started; i < threads; i++) {
+		free(pool->w[i].ring);
+		pthread_mutex_destroy(&pool->w[i].lock);
+	}
+	pool->threads = started;
+	return pool;
+}
+
+/**
+ * lanyfs_pool_threads() - Returns the number of workers of a pool.
+ * @pool:			pool
+ */
+int lanyfs_pool_threads (struct lanyfs_pool *pool)
+{
+	return pool->threads;
+}
+
+/**
+ * lanyfs_pool_submit() - Submits a task to a pool.
+ * @pool:			pool
+ * @task:			task function
+ * @arg:			pointer argument of task
+ * @n:				number argument of task
+ *
+ * Called by a worker, the task goes to the worker's own queue. Called from
+ * outside, it blocks while the pool is at its bound. Tasks submitted after
+ * a task failed are dropped without running.
+ */
+int lanyfs_pool_submit (struct lanyfs_pool *pool, lanyfs_task_t task,
+			void *arg, uint64_t n)
+{
+	struct pool_task t;
+	struct pool_worker *w = pool_self;
+
+	t.fn = task;
+	t.arg = arg;
+	t.n = n;
+	if (w && w->pool == pool)
+		return pool_enqueue(pool, w, &t);
+	if (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) >= pool->bound) {
+		pthread_mutex_lock(&pool->lock);
+		__atomic_add_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST) >=
+		       pool->bound)
+			pthread_cond_wait(&pool->change, &pool->lock);
+		__atomic_sub_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	w = &pool->w[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) %
+		     pool->threads];
+	return pool_enqueue(pool, w, &t);
+}
+
+/**
+ * lanyfs_pool_idle() - Tells whether some worker waits for work.
+ * @pool:			pool
+ *
+ * A hint for tasks deciding whether to split off work.
+ */
+int lanyfs_pool_idle (struct lanyfs_pool *pool)
+{
+	return __atomic_load_n(&pool->sleeping, __ATOMIC_RELAXED) > 0;
+}
+
+/**
+ * lanyfs_pool_wait() - Waits until all submitted tasks are finished.
+ * @pool:			pool
+ *
+ * Must not be called by a worker. Returns 0 or the first non-zero value
+ * returned by a task, with errno as that task left it. The pool is ready
+ * for the next batch of tasks afterwards.
+ */
+int lanyfs_pool_wait (struct lanyfs_pool *pool)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&pool->pending, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pool->change, &pool->lock);
+	__atomic_sub_fetch(&pool->waiting, 1, __ATOMIC_SEQ_CST);
+	ret = pool->ret;
+	if (ret)
+		errno = pool->err ? pool->err : EIO;
+	pool->failed = 0;
+	pool->ret = 0;
+	pool->err = 0;
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+/**
+ * lanyfs_pool_stats() - Returns the utilization of a worker.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @st:				returns utilization
+ *
+ * Exact once lanyfs_pool_wait() returned, approximate before.
+ */
+void lanyfs_pool_stats (struct lanyfs_pool *pool, int worker,
+			struct lanyfs_pool_stats *st)
+{
+	*st = pool->w[worker].st;
+}
+
+/**
+ * lanyfs_pool_free() - Stops the workers of a pool and frees it.
+ * @pool:			pool, may be NULL
+ *
+ * Waits for submitted tasks to finish first.
+ */
+void lanyfs_pool_free (struct lanyfs_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+	lanyfs_pool_wait(pool);
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->w[i].thread, NULL);
+	pool_release(pool, pool->threads);
+}
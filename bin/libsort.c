@@ -0,0 +1,492 @@
+/*
+ * libsort.c - External Sorting for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: External sorting
+ *
+ * Checking and recovering a volume boils down to relations between blocks,
+ * e.g. which block points to which, and there is one such edge per block.
+ * On large volumes these do not fit into memory, so they are sorted
+ * externally and validated by merging sorted streams.
+ *
+ * Records are collected in a buffer of the configured memory cap. A full
+ * buffer is sorted and written out as a run. Reading back merges all runs.
+ * If there are more runs than the cap allows buffers for, groups of runs are
+ * merged into longer runs first. Every record is thus written and read a
+ * bounded number of times, sequentially. Sorts fitting into the cap never
+ * touch the disk.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+/* smallest read buffer per run while merging */
+#define SORT_READBUF		(256 << 10)
+
+/**
+ * struct sort_run - Sorted run in a temporary file.
+ * @off:			byte offset of run
+ * @n:				number of records
+ */
+struct sort_run {
+	uint64_t		off;
+	uint64_t		n;
+};
+
+/**
+ * struct sort_src - Run being merged.
+ * @run:			remaining part of run
+ * @buf:			read buffer
+ * @len:			number of records in buffer
+ * @pos:			next record in buffer
+ */
+struct sort_src {
+	struct sort_run		run;
+	unsigned char		*buf;
+	size_t			len;
+	size_t			pos;
+};
+
+/**
+ * struct lanyfs_sort - External sort.
+ * @recsize:			size of records
+ * @cmp:			comparison of records
+ * @tmpdir:			directory for temporary files, may be NULL
+ * @memcap:			memory cap in bytes
+ * @lock:			serializes adding records
+ * @buf:			records not yet written out
+ * @cap:			capacity of buffer in records
+ * @fill:			number of records in buffer
+ * @fd:				temporary file holding runs
+ * @end:			end of data in temporary file
+ * @runs:			runs written
+ * @nruns:			number of runs
+ * @pos:			next record in buffer, if nothing was written out
+ * @src:			runs being merged
+ * @nsrc:			number of runs being merged
+ * @heap:			indices of sources, smallest record on top
+ * @nheap:			number of sources in heap
+ * @total:			number of records added
+ */
+struct lanyfs_sort {
+	size_t			recsize;
+	lanyfs_cmp_t		cmp;
+	const char		*tmpdir;
+	size_t			memcap;
+	pthread_mutex_t		lock;
+	unsigned char		*buf;
+	size_t			cap;
+	size_t			fill;
+	int			fd;
+	uint64_t		end;
+	struct sort_run		*runs;
+	size_t			nruns;
+	size_t			pos;
+	struct sort_src		*src;
+	size_t			nsrc;
+	size_t			*heap;
+	size_t			nheap;
+	uint64_t		total;
+};
+
+/**
+ * sort_spill() - Sorts the buffer and writes it out as a run.
+ * @s:				sort
+ */
+static int sort_spill (struct lanyfs_sort *s)
+{
+	struct sort_run *runs;
+	size_t len = s->fill * s->recsize;
+
+	if (!s->fill)
+		return 0;
+	if (s->fd < 0) {
+		s->fd = lanyfs_tmpfile(s->tmpdir);
+		if (s->fd < 0)
+			return -1;
+	}
+	runs = realloc(s->runs, (s->nruns + 1) * sizeof(*runs));
+	if (!runs)
+		return -1;
+	s->runs = runs;
+	qsort(s->buf, s->fill, s->recsize, s->cmp);
+	if (lanyfs_fd_pwrite(s->fd, s->buf, len, s->end))
+		return -1;
+	s->runs[s->nruns].off = s->end;
+	s->runs[s->nruns].n = s->fill;
+	s->nruns++;
+	s->end += len;
+	s->fill = 0;
+	return 0;
+}
+
+/**
+ * lanyfs_sort_open() - Sets up an external sort.
+ * @tmpdir:			directory for temporary files, NULL for default
+ * @recsize:			size of records in bytes
+ * @cmp:			comparison of records, as for qsort()
+ * @memcap:			memory to use at most, in bytes
+ */
+struct lanyfs_sort *lanyfs_sort_open (const char *tmpdir, size_t recsize,
+				      lanyfs_cmp_t cmp, size_t memcap)
+{
+	struct lanyfs_sort *s;
+
+	if (memcap < 2 * SORT_READBUF)
+		memcap = 2 * SORT_READBUF;
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->recsize = recsize;
+	s->cmp = cmp;
+	s->tmpdir = tmpdir;
+	s->memcap = memcap;
+	s->cap = memcap / recsize;
+	s->fd = -1;
+	s->buf = malloc(s->cap * recsize);
+	if (!s->buf) {
+		free(s);
+		return NULL;
+	}
+	pthread_mutex_init(&s->lock, NULL);
+	return s;
+}
+
+/**
+ * lanyfs_sort_add() - Adds records.
+ * @s:				sort
+ * @recs:			records
+ * @n:				number of records
+ *
+ * May be called concurrently. Threads adding many records should batch them
+ * to keep the lock cold.
+ */
+int lanyfs_sort_add (struct lanyfs_sort *s, const void *recs, size_t n)
+{
+	const unsigned char *p = recs;
+	size_t k;
+	int ret = 0;
+
+	pthread_mutex_lock(&s->lock);
+	while (n) {
+		if (s->fill == s->cap && (ret = sort_spill(s)))
+			break;
+		k = s->cap - s->fill < n ? s->cap - s->fill : n;
+		memcpy(s->buf + s->fill * s->recsize, p, k * s->recsize);
+		s->fill += k;
+		s->total += k;
+		p += k * s->recsize;
+		n -= k;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return ret;
+}
+
+/**
+ * src_fill() - Refills the read buffer of a source.
+ * @s:				sort
+ * @src:			source
+ * @fd:				file holding the run
+ * @cap:			capacity of read buffer in records
+ */
+static int src_fill (struct lanyfs_sort *s, struct sort_src *src, int fd,
+		     size_t cap)
+{
+	src->pos = 0;
+	src->len = src->run.n < cap ? src->run.n : cap;
+	if (!src->len)
+		return 0;
+	if (lanyfs_fd_pread(fd, src->buf, src->len * s->recsize, src->run.off))
+		return -1;
+	src->run.off += src->len * s->recsize;
+	src->run.n -= src->len;
+	return 0;
+}
+
+/**
+ * src_rec() - Returns the current record of a source.
+ * @s:				sort
+ * @i:				index of source
+ */
+static inline void *src_rec (struct lanyfs_sort *s, size_t i)
+{
+	return s->src[i].buf + s->src[i].pos * s->recsize;
+}
+
+/**
+ * heap_sift() - Moves a heap entry down until the heap property holds.
+ * @s:				sort
+ * @i:				index of heap entry
+ */
+static void heap_sift (struct lanyfs_sort *s, size_t i)
+{
+	size_t c, t;
+	while ((c = 2 * i + 1) < s->nheap) {
+		if (c + 1 < s->nheap &&
+		    s->cmp(src_rec(s, s->heap[c + 1]), src_rec(s, s->heap[c])) < 0)
+			c++;
+		if (s->cmp(src_rec(s, s->heap[c]), src_rec(s, s->heap[i])) >= 0)
+			break;
+		t = s->heap[i];
+		s->heap[i] = s->heap[c];
+		s->heap[c] = t;
+		i = c;
+	}
+}
+
+/**
+ * merge_stop() - Releases the state of a merge.
+ * @s:				sort
+ */
+static void merge_stop (struct lanyfs_sort *s)
+{
+	size_t i;
+	for (i = 0; i < s->nsrc; i++)
+		free(s->src[i].buf);
+	free(s->src);
+	free(s->heap);
+	s->src = NULL;
+	s->nsrc = 0;
+	s->heap = NULL;
+	s->nheap = 0;
+}
+
+/**
+ * merge_start() - Starts merging runs.
+ * @s:				sort
+ * @runs:			runs to merge
+ * @n:				number of runs
+ *
+ * The memory cap is split evenly among the read buffers of all runs.
+ */
+static int merge_start (struct lanyfs_sort *s, struct sort_run *runs,
+			size_t n)
+{
+	size_t cap = s->memcap / (n + 1) / s->recsize, i;
+
+	s->src = calloc(n, sizeof(*s->src));
+	s->heap = calloc(n, sizeof(*s->heap));
+	if (!s->src || !s->heap)
+		return -1;
+	s->nsrc = n;
+	s->nheap = 0;
+	for (i = 0; i < n; i++) {
+		s->src[i].run = runs[i];
+		s->src[i].buf = malloc(cap * s->recsize);
+		if (!s->src[i].buf || src_fill(s, &s->src[i], s->fd, cap))
+			return -1;
+		if (s->src[i].len)
+			s->heap[s->nheap++] = i;
+	}
+	for (i = s->nheap / 2; i--; )
+		heap_sift(s, i);
+	return 0;
+}
+
+/**
+ * merge_next() - Takes the smallest record of all runs being merged.
+ * @s:				sort
+ * @rec:			record
+ *
+ * Returns 1 if a record was taken, 0 at the end and -1 on error.
+ */
+static int merge_next (struct lanyfs_sort *s, void *rec)
+{
+	size_t cap = s->memcap / (s->nsrc + 1) / s->recsize;
+	struct sort_src *src;
+
+	if (!s->nheap)
+		return 0;
+	src = &s->src[s->heap[0]];
+	memcpy(rec, src->buf + src->pos * s->recsize, s->recsize);
+	if (++src->pos == src->len) {
+		if (src_fill(s, src, s->fd, cap))
+			return -1;
+		if (!src->len)
+			s->heap[0] = s->heap[--s->nheap];
+	}
+	heap_sift(s, 0);
+	return 1;
+}
+
+/**
+ * merge_pass() - Merges groups of runs into longer runs.
+ * @s:				sort
+ * @fanin:			number of runs merged at once
+ *
+ * Merged runs are appended to the temporary file, the space of their
+ * sources is not reused.
+ */
+static int merge_pass (struct lanyfs_sort *s, size_t fanin)
+{
+	struct sort_run *out;
+	size_t nout = 0, i, k, len, half = s->memcap / 2 / s->recsize;
+	unsigned char *wbuf = NULL;
+	int ret = -1;
+
+	out = calloc((s->nruns + fanin - 1) / fanin, sizeof(*out));
+	if (!out)
+		return -1;
+	/* the write buffer takes half of the cap, the read buffers the rest */
+	s->memcap /= 2;
+	wbuf = malloc(half * s->recsize);
+	if (!wbuf)
+		goto out;
+	for (i = 0; i < s->nruns; i += fanin) {
+		k = s->nruns - i < fanin ? s->nruns - i : fanin;
+		out[nout].off = s->end;
+		if (merge_start(s, s->runs + i, k))
+			goto out;
+		len = 0;
+		while ((ret = merge_next(s, wbuf + len * s->recsize)) == 1) {
+			if (++len < half)
+				continue;
+			if (lanyfs_fd_pwrite(s->fd, wbuf, len * s->recsize,
+					     s->end))
+				goto out;
+			s->end += len * s->recsize;
+			out[nout].n += len;
+			len = 0;
+		}
+		merge_stop(s);
+		if (ret || lanyfs_fd_pwrite(s->fd, wbuf, len * s->recsize,
+					    s->end)) {
+			ret = -1;
+			goto out;
+		}
+		s->end += len * s->recsize;
+		out[nout].n += len;
+		nout++;
+	}
+	free(s->runs);
+	s->runs = out;
+	s->nruns = nout;
+	out = NULL;
+	ret = 0;
+out:
+	s->memcap *= 2;
+	merge_stop(s);
+	free(wbuf);
+	free(out);
+	return ret;
+}
+
+/**
+ * lanyfs_sort_finish() - Ends adding records and prepares reading them.
+ * @s:				sort
+ * @passes:			number of merge passes needed, may be NULL
+ */
+int lanyfs_sort_finish (struct lanyfs_sort *s, int *passes)
+{
+	size_t fanin = s->memcap / SORT_READBUF - 1;
+	int n = 0;
+
+	if (!s->nruns) {
+		/* everything fits, the buffer is read directly */
+		qsort(s->buf, s->fill, s->recsize, s->cmp);
+		s->pos = 0;
+		if (passes)
+			*passes = 0;
+		return 0;
+	}
+	if (sort_spill(s))
+		return -1;
+	free(s->buf);
+	s->buf = NULL;
+	s->fill = 0;
+	if (fanin < 2)
+		fanin = 2;
+	while (s->nruns > fanin) {
+		if (merge_pass(s, fanin))
+			return -1;
+		n++;
+	}
+	if (passes)
+		*passes = n + 1;
+	return merge_start(s, s->runs, s->nruns);
+}
+
+/**
+ * lanyfs_sort_next() - Reads the next record in order.
+ * @s:				sort, finished
+ * @rec:			record
+ *
+ * Returns 1 if a record was read, 0 at the end and -1 on error.
+ */
+int lanyfs_sort_next (struct lanyfs_sort *s, void *rec)
+{
+	if (!s->nruns) {
+		if (s->pos == s->fill)
+			return 0;
+		memcpy(rec, s->buf + s->pos++ * s->recsize, s->recsize);
+		return 1;
+	}
+	return merge_next(s, rec);
+}
+
+/**
+ * lanyfs_sort_count() - Returns the number of records added.
+ * @s:				sort
+ */
+uint64_t lanyfs_sort_count (struct lanyfs_sort *s)
+{
+	return s->total;
+}
+
+/**
+ * lanyfs_sort_close() - Releases a sort and its temporary file.
+ * @s:				sort
+ */
+void lanyfs_sort_close (struct lanyfs_sort *s)
+{
+	if (!s)
+		return;
+	merge_stop(s);
+	if (s->fd >= 0)
+		close(s->fd);
+	pthread_mutex_destroy(&s->lock);
+	free(s->runs);
+	free(s->buf);
+	free(s);
+}
@@ -0,0 +1,233 @@
+/*
+ * libtable.c - Out-of-Core Tables for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Tables
+ *
+ * Tools dealing with every block of a volume keep per-block state that can
+ * outgrow memory on large devices. Such state lives in unlinked temporary
+ * files mapped into memory, so the kernel pages it out instead of the tool
+ * running out of memory.
+ *
+ * A table is a sequence of fixed-size records. It is filled by appending,
+ * which is buffered and sequential, and then mapped for reading. A bitmap is
+ * a sparse temporary file mapped for reading and writing, holding one bit
+ * per block.
+ *
+ * The directory for temporary files is taken from TMPDIR unless given.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "liblanyfs.h"
+
+/* bytes buffered before appended records are written out */
+#define TABLE_BUFSIZE		(1 << 20)
+
+/**
+ * lanyfs_tmpfile() - Creates an unlinked temporary file.
+ * @dir:			directory, NULL for default
+ */
+int lanyfs_tmpfile (const char *dir)
+{
+	char path[LANYFS_OVERLAY_PATHLEN];
+	int fd, err;
+
+	if (!dir)
+		dir = getenv("TMPDIR");
+	if (!dir || !*dir)
+		dir = "/tmp";
+	if (snprintf(path, sizeof(path), "%s/lanyfs.XXXXXX", dir) >=
+	    (int) sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = mkstemp(path);
+	if (fd < 0)
+		return -1;
+	if (unlink(path)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * lanyfs_table_open() - Creates an empty table.
+ * @tab:			table
+ * @dir:			directory for temporary file, NULL for default
+ * @recsize:			size of records in bytes
+ */
+int lanyfs_table_open (struct lanyfs_table *tab, const char *dir,
+		       size_t recsize)
+{
+	memset(tab, 0, sizeof(*tab));
+	tab->fd = -1;
+	tab->recsize = recsize;
+	tab->buf = malloc(TABLE_BUFSIZE / recsize * recsize);
+	if (!tab->buf)
+		return -1;
+	tab->fd = lanyfs_tmpfile(dir);
+	if (tab->fd < 0) {
+		free(tab->buf);
+		tab->buf = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * table_flush() - Writes out buffered records.
+ * @tab:			table
+ */
+static int table_flush (struct lanyfs_table *tab)
+{
+	uint64_t pos = (tab->n - tab->fill) * tab->recsize;
+	if (!tab->fill)
+		return 0;
+	if (lanyfs_fd_pwrite(tab->fd, tab->buf, tab->fill * tab->recsize,
+			     pos))
+		return -1;
+	tab->fill = 0;
+	return 0;
+}
+
+/**
+ * lanyfs_table_append() - Appends a record.
+ * @tab:			table, not mapped
+ * @rec:			record of table's record size
+ */
+int lanyfs_table_append (struct lanyfs_table *tab, const void *rec)
+{
+	if (tab->fill == TABLE_BUFSIZE / tab->recsize && table_flush(tab))
+		return -1;
+	memcpy(tab->buf + tab->fill * tab->recsize, rec, tab->recsize);
+	tab->fill++;
+	tab->n++;
+	return 0;
+}
+
+/**
+ * lanyfs_table_map() - Maps all records of a table for reading.
+ * @tab:			table
+ *
+ * Records are found at tab->map afterwards. A table without records maps
+ * to NULL.
+ */
+int lanyfs_table_map (struct lanyfs_table *tab)
+{
+	void *map;
+	if (tab->map)
+		return 0;
+	if (table_flush(tab))
+		return -1;
+	if (!tab->n)
+		return 0;
+	map = mmap(NULL, tab->n * tab->recsize, PROT_READ, MAP_SHARED,
+		   tab->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+	tab->map = map;
+	return 0;
+}
+
+/**
+ * lanyfs_table_close() - Releases a table and its temporary file.
+ * @tab:			table
+ */
+void lanyfs_table_close (struct lanyfs_table *tab)
+{
+	if (tab->map)
+		munmap(tab->map, tab->n * tab->recsize);
+	if (tab->fd >= 0)
+		close(tab->fd);
+	free(tab->buf);
+	memset(tab, 0, sizeof(*tab));
+	tab->fd = -1;
+}
+
+/**
+ * lanyfs_bitmap_open() - Creates a zeroed bitmap of @bits bits.
+ * @dir:			directory for temporary file, NULL for default
+ * @bits:			number of bits
+ *
+ * Returns the mapped bitmap or NULL on error. Release with
+ * lanyfs_bitmap_close().
+ */
+unsigned char *lanyfs_bitmap_open (const char *dir, uint64_t bits)
+{
+	size_t len = bits / 8 + 1;
+	void *map;
+	int fd, err;
+
+	fd = lanyfs_tmpfile(dir);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, len)) {
+		map = MAP_FAILED;
+	} else {
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+			   0);
+	}
+	err = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = err;
+		return NULL;
+	}
+	return map;
+}
+
+/**
+ * lanyfs_bitmap_close() - Releases a bitmap.
+ * @map:			bitmap
+ * @bits:			number of bits, as passed to lanyfs_bitmap_open()
+ */
+void lanyfs_bitmap_close (unsigned char *map, uint64_t bits)
+{
+	if (map)
+		munmap(map, bits / 8 + 1);
+}
@@ -0,0 +1,555 @@
+/*
+ * libtune.c - Device Profiles for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Device profiles
+ *
+ * Spinning disks, SD cards, USB sticks and NVMe drives want different I/O.
+ * A profile records what suits a device class: the request size worth
+ * batching up to, how many requests to keep in flight and whether to
+ * bypass the page cache.
+ *
+ * Probing reads what the kernel knows about the queue from sysfs and
+ * derives a profile from that alone. Calibration then times reads of
+ * growing size on the device itself, buffered and direct, and optionally
+ * rewrites what it read to time writes as well. Calibrated profiles are
+ * cached per device model, so identical devices are only calibrated once
+ * and every tool opening such a device picks the profile up, see
+ * lanyfs_dev_open().
+ *
+ * Image files are keyed by the model of the device holding them and never
+ * use direct I/O, the page cache is what makes them fast.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>	/* major(), minor() */
+#endif
+
+#include "liblanyfs.h"
+
+#define TUNE_ROUNDS		8	/* requests timed per size */
+#define TUNE_MIN_SHIFT		12	/* smallest request size 2**12 */
+#define TUNE_MAX_SHIFT		20	/* largest request size 2**20 */
+#define TUNE_GOOD		90	/* percent of best throughput */
+#define TUNE_MAX_DEPTH		32	/* requests in flight at most */
+
+/**
+ * struct tune_sample - Timing of requests of one size.
+ * @size:			request size in bytes
+ * @rate:			throughput in bytes per second
+ * @latency:			median latency in nanoseconds
+ */
+struct tune_sample {
+	size_t			size;
+	double			rate;
+	uint64_t		latency;
+};
+
+/**
+ * read_attr() - Reads a sysfs attribute.
+ * @dir:			directory of attribute
+ * @name:			name of attribute
+ * @buf:			value, trailing white space removed
+ * @len:			size of buffer
+ */
+static int read_attr (const char *dir, const char *name, char *buf,
+		      size_t len)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	size_t n;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >=
+	    (int) sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	n = fread(buf, 1, len - 1, fp);
+	fclose(fp);
+	while (n && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+		n--;
+	buf[n] = '\0';
+	return n ? 0 : -1;
+}
+
+/**
+ * read_uint() - Reads a numeric sysfs attribute.
+ * @dir:			directory of attribute
+ * @name:			name of attribute
+ * @val:			value, left alone if the attribute is missing
+ */
+static void read_uint (const char *dir, const char *name, unsigned int *val)
+{
+	char buf[32];
+
+	if (!read_attr(dir, name, buf, sizeof(buf)))
+		*val = (unsigned int) strtoul(buf, NULL, 10);
+}
+
+/**
+ * find_attr() - Reads an attribute of a disk or the disk holding a
+ * partition.
+ * @dir:			sysfs directory of disk or partition
+ * @name:			name of attribute, relative to @dir
+ * @buf:			value
+ * @len:			size of buffer
+ */
+static int find_attr (const char *dir, const char *name, char *buf,
+		      size_t len)
+{
+	char parent[PATH_MAX];
+
+	if (!read_attr(dir, name, buf, len))
+		return 0;
+	if (snprintf(parent, sizeof(parent), "%s/..", dir) >=
+	    (int) sizeof(parent)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return read_attr(parent, name, buf, len);
+}
+
+#ifdef __linux__
+/**
+ * dev_name() - Returns the kernel's name of a block device.
+ * @dir:			sysfs directory of device
+ * @devno:			device number
+ * @buf:			name
+ * @len:			size of buffer
+ *
+ * Stands in for the model of devices without one, e.g. device mapper
+ * targets. Falls back to the device number.
+ */
+static void dev_name (const char *dir, dev_t devno, char *buf, size_t len)
+{
+	char uevent[512], *p;
+
+	snprintf(buf, len, "%u:%u", major(devno), minor(devno));
+	if (read_attr(dir, "uevent", uevent, sizeof(uevent)))
+		return;
+	p = strstr(uevent, "DEVNAME=");
+	if (p) {
+		p += strlen("DEVNAME=");
+		p[strcspn(p, "\n")] = '\0';
+		snprintf(buf, len, "%s", p);
+	}
+}
+#endif
+
+/**
+ * set_model() - Builds the profile key from vendor and model.
+ * @tune:			profile
+ * @prefix:			prefix, marks image files
+ * @vendor:			vendor, may be empty
+ * @model:			model
+ *
+ * White space becomes '_', the key is one word in the cache file.
+ */
+static void set_model (struct lanyfs_tune *tune, const char *prefix,
+		       const char *vendor, const char *model)
+{
+	char *p;
+
+	snprintf(tune->model, sizeof(tune->model), "%s%s%s%s", prefix,
+		 vendor, *vendor ? " " : "", model);
+	for (p = tune->model; *p; p++) {
+		if (*p == ' ' || *p == '\t' || *p == '\n')
+			*p = '_';
+	}
+}
+
+/**
+ * lanyfs_tune_probe() - Derives a profile from what the kernel knows.
+ * @dev:			device, plain file or block device
+ * @tune:			profile
+ *
+ * The profile always comes out usable, devices unknown to sysfs get a
+ * conservative one. Fails with EOPNOTSUPP on backends other than plain
+ * files and block devices.
+ */
+int lanyfs_tune_probe (struct lanyfs_dev *dev, struct lanyfs_tune *tune)
+{
+	char dir[PATH_MAX], vendor[32] = "", model[64] = "unknown";
+	unsigned int rotational = 1;
+	struct stat st;
+	dev_t devno;
+	int file;
+
+	memset(tune, 0, sizeof(*tune));
+	tune->rotational = 1;
+	tune->max_sectors_kb = 128;
+	tune->nr_requests = 1;
+	tune->logical = 512;
+	if (strcmp(dev->ops->name, "file")) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	if (fstat(dev->fd, &st))
+		return -1;
+	file = !S_ISBLK(st.st_mode);
+	devno = file ? st.st_dev : st.st_rdev;
+#ifdef __linux__
+	snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u", major(devno),
+		 minor(devno));
+	if (!find_attr(dir, "device/model", model, sizeof(model)))
+		find_attr(dir, "device/vendor", vendor, sizeof(vendor));
+	else
+		dev_name(dir, devno, model, sizeof(model));
+	snprintf(dir + strlen(dir), sizeof(dir) - strlen(dir), "/queue");
+	if (access(dir, R_OK))
+		snprintf(dir, sizeof(dir), "/sys/dev/block/%u:%u/../queue",
+			 major(devno), minor(devno));
+	read_uint(dir, "rotational", &rotational);
+	tune->rotational = rotational != 0;
+	read_uint(dir, "max_sectors_kb", &tune->max_sectors_kb);
+	read_uint(dir, "nr_requests", &tune->nr_requests);
+	read_uint(dir, "logical_block_size", &tune->logical);
+#else
+	(void) devno;
+#endif
+	set_model(tune, file ? "file:" : "", vendor, model);
+	if (!tune->max_sectors_kb)
+		tune->max_sectors_kb = 128;
+	if (!tune->nr_requests)
+		tune->nr_requests = 1;
+	if (!tune->logical || tune->logical & (tune->logical - 1))
+		tune->logical = 512;
+	tune->batch = (size_t) tune->max_sectors_kb << 10;
+	if (tune->batch > (size_t) 1 << TUNE_MAX_SHIFT)
+		tune->batch = (size_t) 1 << TUNE_MAX_SHIFT;
+	/* a spinning disk seeks between requests in flight */
+	tune->depth = tune->rotational ? 1 : (int) tune->nr_requests / 4;
+	if (tune->depth < 1)
+		tune->depth = 1;
+	if (tune->depth > TUNE_MAX_DEPTH)
+		tune->depth = TUNE_MAX_DEPTH;
+	tune->direct = 0;
+	return 0;
+}
+
+/**
+ * cmp_u64() - Orders unsigned integers ascending, for qsort().
+ * @a:				first integer
+ * @b:				second integer
+ */
+static int cmp_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * time_requests() - Times requests of one size at random offsets.
+ * @fd:				file descriptor, buffered or direct
+ * @buf:			buffer, aligned for direct I/O
+ * @size:			request size
+ * @span:			requests stay below this offset
+ * @write:			rewrite what was read, only writes are timed
+ * @cold:			drop cached pages before reading
+ * @seed:			state of random sequence
+ * @sample:			timing
+ *
+ * Rewrites are followed by fdatasync(), which is timed with them, so
+ * buffered writes pay for reaching the device just as direct ones do.
+ */
+static int time_requests (int fd, void *buf, size_t size, uint64_t span,
+			  int write, int cold, uint64_t *seed,
+			  struct tune_sample *sample)
+{
+	uint64_t lat[TUNE_ROUNDS], pos, start, total = 0;
+	int i;
+
+	for (i = 0; i < TUNE_ROUNDS; i++) {
+		pos = (lanyfs_rand(seed) % (span / size)) * size;
+#ifdef POSIX_FADV_DONTNEED
+		if (cold)
+			posix_fadvise(fd, (off_t) pos, size,
+				      POSIX_FADV_DONTNEED);
+#endif
+		start = lanyfs_lat_now();
+		if (lanyfs_fd_pread(fd, buf, size, pos))
+			return -1;
+		if (write) {
+			start = lanyfs_lat_now();
+			if (lanyfs_fd_pwrite(fd, buf, size, pos) ||
+			    fdatasync(fd))
+				return -1;
+		}
+		lat[i] = lanyfs_lat_now() - start;
+		total += lat[i];
+	}
+	qsort(lat, TUNE_ROUNDS, sizeof(*lat), cmp_u64);
+	sample->size = size;
+	sample->latency = lat[TUNE_ROUNDS / 2];
+	sample->rate = total ? (double) size * TUNE_ROUNDS / total * 1e9 : 0;
+	return 0;
+}
+
+/**
+ * lanyfs_tune_calibrate() - Refines a probed profile by timing the device.
+ * @dev:			device, plain file or block device
+ * @tune:			profile from lanyfs_tune_probe()
+ * @write:			also time writes by rewriting what was read
+ *
+ * Reads of 4 KiB up to 1 MiB are timed, direct on block devices where
+ * possible, buffered with cold pages on image files. The batch
+ * size becomes the smallest size reaching 90% of the best throughput.
+ * Block devices use direct I/O if it is at least as fast as cold buffered
+ * I/O at that size. Rewrites leave the contents alone but must not race
+ * with other writers of the device.
+ */
+int lanyfs_tune_calibrate (struct lanyfs_dev *dev, struct lanyfs_tune *tune,
+			   int write)
+{
+	struct tune_sample s[TUNE_MAX_SHIFT - TUNE_MIN_SHIFT + 1];
+	struct tune_sample buffered, direct;
+	uint64_t seed = 0x4c414e5954554e45ULL;
+	struct stat st;
+	void *buf = NULL;
+	double best = 0;
+	int n = 0, i, dfd, fd, ret = -1, err;
+
+	if (write && dev->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (fstat(dev->fd, &st))
+		return -1;
+	for (i = TUNE_MIN_SHIFT; i <= TUNE_MAX_SHIFT; i++) {
+		if (((uint64_t) 1 << i) * 4 > dev->size)
+			break;
+		n++;
+	}
+	if (!n) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (posix_memalign(&buf, 4096, (size_t) 1 << TUNE_MAX_SHIFT)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	/* image files are read through the page cache, time them that way */
+	dfd = S_ISBLK(st.st_mode) ? lanyfs_fd_direct(dev->fd, !write) : -1;
+	fd = dfd >= 0 ? dfd : dev->fd;
+	for (i = 0; i < n; i++) {
+		if (time_requests(fd, buf, (size_t) 1 << (TUNE_MIN_SHIFT + i),
+				  dev->size, 0, 1, &seed, &s[i]))
+			goto out;
+		if (s[i].rate > best)
+			best = s[i].rate;
+	}
+	tune->latency = s[0].latency;
+	for (i = 0; i < n - 1; i++) {
+		if (s[i].rate * 100 >= best * TUNE_GOOD)
+			break;
+	}
+	tune->batch = s[i].size;
+	if (tune->batch > (size_t) tune->max_sectors_kb << 10 &&
+	    tune->max_sectors_kb >= 4)
+		tune->batch = (size_t) tune->max_sectors_kb << 10;
+	tune->direct = 0;
+	if (dfd >= 0) {
+		if (time_requests(dev->fd, buf, tune->batch, dev->size, 0, 1,
+				  &seed, &buffered) ||
+		    time_requests(dfd, buf, tune->batch, dev->size, 0, 1,
+				  &seed, &direct))
+			goto out;
+		tune->direct = direct.rate >= buffered.rate;
+		if (tune->direct && write) {
+			if (time_requests(dev->fd, buf, tune->batch,
+					  dev->size, 1, 0, &seed,
+					  &buffered) ||
+			    time_requests(dfd, buf, tune->batch, dev->size,
+					  1, 0, &seed, &direct))
+				goto out;
+			tune->direct = direct.rate >= buffered.rate;
+		}
+	}
+	ret = 0;
+
+out:
+	err = errno;
+	if (dfd >= 0)
+		close(dfd);
+	free(buf);
+	errno = err;
+	return ret;
+}
+
+/**
+ * cache_path() - Returns the path of the profile cache.
+ * @path:			path
+ * @len:			size of path buffer
+ *
+ * LANYFS_TUNE_CACHE names the file, otherwise it lives in the user's cache
+ * directory.
+ */
+static int cache_path (char *path, size_t len)
+{
+	const char *env = getenv("LANYFS_TUNE_CACHE");
+
+	if (env && *env) {
+		snprintf(path, len, "%s", env);
+		return 0;
+	}
+	env = getenv("XDG_CACHE_HOME");
+	if (env && *env) {
+		snprintf(path, len, "%s/lanyfs-tune", env);
+		return 0;
+	}
+	env = getenv("HOME");
+	if (env && *env) {
+		snprintf(path, len, "%s/.cache/lanyfs-tune", env);
+		return 0;
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/**
+ * parse_line() - Parses a line of the profile cache.
+ * @line:			line
+ * @tune:			profile
+ */
+static int parse_line (const char *line, struct lanyfs_tune *tune)
+{
+	char model[LANYFS_TUNE_MODEL];
+
+	if (sscanf(line, "%63s %d %u %u %u %zu %d %d %"SCNu64, model,
+		   &tune->rotational, &tune->max_sectors_kb,
+		   &tune->nr_requests, &tune->logical, &tune->batch,
+		   &tune->depth, &tune->direct, &tune->latency) != 9)
+		return -1;
+	strcpy(tune->model, model);
+	return 0;
+}
+
+/**
+ * lanyfs_tune_load() - Looks up the cached profile of a device model.
+ * @tune:			profile, model set by lanyfs_tune_probe()
+ *
+ * Fails with ENOENT if no profile is cached for the model.
+ */
+int lanyfs_tune_load (struct lanyfs_tune *tune)
+{
+	struct lanyfs_tune found;
+	char path[PATH_MAX], line[256];
+	FILE *fp;
+
+	if (cache_path(path, sizeof(path)))
+		return -1;
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (parse_line(line, &found) || strcmp(found.model, tune->model))
+			continue;
+		fclose(fp);
+		if (found.batch < found.logical || found.depth < 1) {
+			errno = EINVAL;
+			return -1;
+		}
+		*tune = found;
+		return 0;
+	}
+	fclose(fp);
+	errno = ENOENT;
+	return -1;
+}
+
+/**
+ * lanyfs_tune_save() - Caches the profile of a device model.
+ * @tune:			profile
+ *
+ * Replaces an older profile of the same model. The cache file is rewritten
+ * and renamed into place, readers never see half of it.
+ */
+int lanyfs_tune_save (const struct lanyfs_tune *tune)
+{
+	struct lanyfs_tune old;
+	char path[PATH_MAX], tmp[PATH_MAX + 16], line[256], *slash;
+	FILE *in, *out;
+	int err;
+
+	if (cache_path(path, sizeof(path)))
+		return -1;
+	slash = strrchr(path, '/');
+	if (slash && slash != path) {
+		*slash = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST)
+			return -1;
+		*slash = '/';
+	}
+	snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long) getpid());
+	out = fopen(tmp, "w");
+	if (!out)
+		return -1;
+	in = fopen(path, "r");
+	while (in && fgets(line, sizeof(line), in)) {
+		if (!parse_line(line, &old) && !strcmp(old.model, tune->model))
+			continue;
+		fputs(line, out);
+	}
+	if (in)
+		fclose(in);
+	fprintf(out, "%s %d %u %u %u %zu %d %d %"PRIu64"\n", tune->model,
+		tune->rotational, tune->max_sectors_kb, tune->nr_requests,
+		tune->logical, tune->batch, tune->depth, tune->direct,
+		tune->latency);
+	if (fclose(out) || rename(tmp, path)) {
+		err = errno;
+		unlink(tmp);
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
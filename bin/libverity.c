@@ -0,0 +1,841 @@
+/*
+ * libverity.c - Hash Trees of Lanyard Filesystem Images.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Hash trees
+ *
+ * A hash tree lets a read-only image be checked as it is read instead of
+ * as a whole up front. It lives in a sidecar file next to the image, which
+ * stays untouched. Level 0 holds the SHA-256 digest of every block of the
+ * volume, packed into hash blocks of the volume's blocksize. Every further
+ * level holds the digests of the hash blocks of the level below, up to a
+ * single hash block, whose digest is the root hash. The levels are stored
+ * top-down after a header, as dm-verity stores them.
+ *
+ * Free blocks are not hashed, their digests are left zero and they read as
+ * zeros through the verifying backend. Chain blocks are hashed like all
+ * blocks in use.
+ *
+ * The verifying backend checks every block read against its digest and
+ * every hash block against its parent, up to the root hash. Verified hash
+ * blocks are cached, so reading a block costs a single digest once its
+ * neighbourhood has been read. A mismatch fails the read with EIO. The root
+ * hash recorded in the sidecar only protects against accidental damage,
+ * passing the root hash obtained when building protects against tampering.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "liblanyfs.h"
+
+/* layout of sidecar files */
+#define VERITY_VERSION		1
+#define VERITY_HDR_SIZE		4096
+#define VERITY_BATCH		16	/* hash blocks per pool task */
+
+/**
+ * struct verity_hdr - On-disk header of sidecar files, little endian.
+ * @magic:			identifies sidecar files
+ * @version:			version of sidecar format
+ * @blocksize:			blocksize of volume and hash blocks (exponent
+ * 				to base 2)
+ * @blocks:			number of blocks of volume
+ * @levels:			number of levels
+ * @__reserved:			reserved
+ * @start:			first hash block of each level, level 0 is the
+ * 				one holding digests of volume blocks
+ * @root:			root hash
+ */
+struct verity_hdr {
+	char			magic[LANYFS_DEV_MAGIC_LEN];
+	uint32_t		version;
+	uint32_t		blocksize;
+	uint64_t		blocks;
+	uint32_t		levels;
+	uint32_t		__reserved;
+	uint64_t		start[LANYFS_VERITY_LEVELS];
+	unsigned char		root[LANYFS_VERITY_HASH];
+};
+
+/**
+ * struct verity - Open verifying backend.
+ * @lower:			device holding the image
+ * @blocksize:			blocksize (exponent to base 2)
+ * @bsize:			blocksize in bytes
+ * @per:			digests per hash block
+ * @levels:			number of levels
+ * @start:			first hash block of each level
+ * @root:			root hash
+ * @cache:			verified hash blocks
+ * @verified:			number of volume blocks verified
+ * @nodes:			number of hash blocks read and verified
+ */
+struct verity {
+	struct lanyfs_dev	*lower;
+	int			blocksize;
+	size_t			bsize;
+	uint64_t		per;
+	int			levels;
+	uint64_t		start[LANYFS_VERITY_LEVELS];
+	unsigned char		root[LANYFS_VERITY_HASH];
+	struct lanyfs_cache	*cache;
+	uint64_t		verified;
+	uint64_t		nodes;
+};
+
+/**
+ * struct verity_build - Hash tree being built.
+ * @vol:			volume
+ * @fd:				file descriptor of sidecar
+ * @free:			bitmap of free blocks
+ * @per:			digests per hash block
+ * @level:			level being built
+ * @n:				number of hash blocks of each level
+ * @start:			first hash block of each level
+ * @bufs:			per worker buffer of @per blocks
+ * @out:			per worker hash block
+ */
+struct verity_build {
+	struct lanyfs_vol	*vol;
+	int			fd;
+	unsigned char		*free;
+	uint64_t		per;
+	int			level;
+	uint64_t		n[LANYFS_VERITY_LEVELS];
+	uint64_t		start[LANYFS_VERITY_LEVELS];
+	unsigned char		**bufs;
+	unsigned char		**out;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* SHA-256 round constants, FIPS 180-4 */
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/**
+ * ror32() - Rotates right.
+ * @x:				value
+ * @n:				number of bits, 1 to 31
+ */
+static inline uint32_t ror32 (uint32_t x, int n)
+{
+	return x >> n | x << (32 - n);
+}
+
+/**
+ * sha256_block() - Feeds one 64 byte block into a SHA-256 state.
+ * @h:				state
+ * @p:				block
+ */
+static void sha256_block (uint32_t *h, const unsigned char *p)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t) p[4 * i] << 24 | (uint32_t) p[4 * i + 1] << 16 |
+		       (uint32_t) p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (i = 16; i < 64; i++)
+		w[i] = w[i - 16] + w[i - 7] +
+		       (ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^
+			w[i - 15] >> 3) +
+		       (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^
+			w[i - 2] >> 10);
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+	f = h[5];
+	g = h[6];
+	k = h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) +
+		     ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) +
+		     ((a & b) ^ (a & c) ^ (b & c));
+		k = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+	h[5] += f;
+	h[6] += g;
+	h[7] += k;
+}
+
+/**
+ * lanyfs_sha256() - Computes the SHA-256 digest of a buffer.
+ * @buf:			buffer
+ * @len:			length of buffer
+ * @digest:			digest of LANYFS_VERITY_HASH bytes
+ */
+void lanyfs_sha256 (const void *buf, size_t len, unsigned char *digest)
+{
+	uint32_t h[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	const unsigned char *p = buf;
+	unsigned char tail[128];
+	uint64_t bits = (uint64_t) len << 3;
+	size_t rest, n;
+	int i;
+
+	for (; len >= 64; len -= 64, p += 64)
+		sha256_block(h, p);
+	/* padding: a one bit, zeros, the length in bits, big endian */
+	memset(tail, 0, sizeof(tail));
+	memcpy(tail, p, len);
+	tail[len] = 0x80;
+	rest = len + 9 <= 64 ? 64 : 128;
+	for (i = 0; i < 8; i++)
+		tail[rest - 1 - i] = bits >> (8 * i);
+	for (n = 0; n < rest; n += 64)
+		sha256_block(h, tail + n);
+	for (i = 0; i < 8; i++) {
+		digest[4 * i] = h[i] >> 24;
+		digest[4 * i + 1] = h[i] >> 16;
+		digest[4 * i + 2] = h[i] >> 8;
+		digest[4 * i + 3] = h[i];
+	}
+}
+
+/**
+ * lanyfs_verity_parse() - Parses a root hash given in hex.
+ * @hex:			root hash, 64 hex digits
+ * @root:			root hash of LANYFS_VERITY_HASH bytes
+ */
+int lanyfs_verity_parse (const char *hex, unsigned char *root)
+{
+	unsigned int byte;
+	int i;
+
+	if (strlen(hex) != 2 * LANYFS_VERITY_HASH)
+		goto err;
+	for (i = 0; i < LANYFS_VERITY_HASH; i++) {
+		if (!isxdigit((unsigned char) hex[2 * i]) ||
+		    !isxdigit((unsigned char) hex[2 * i + 1]) ||
+		    sscanf(hex + 2 * i, "%2x", &byte) != 1)
+			goto err;
+		root[i] = byte;
+	}
+	return 0;
+
+err:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * lanyfs_verity_format() - Formats a root hash in hex.
+ * @root:			root hash of LANYFS_VERITY_HASH bytes
+ * @hex:			buffer of 2 * LANYFS_VERITY_HASH + 1 bytes
+ */
+void lanyfs_verity_format (const unsigned char *root, char *hex)
+{
+	int i;
+	for (i = 0; i < LANYFS_VERITY_HASH; i++)
+		sprintf(hex + 2 * i, "%02x", root[i]);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * geometry() - Works out the number of levels and their hash blocks.
+ * @blocks:			number of volume blocks
+ * @per:			digests per hash block
+ * @n:				number of hash blocks of each level
+ * @start:			first hash block of each level
+ *
+ * Returns the number of levels.
+ */
+static int geometry (uint64_t blocks, uint64_t per, uint64_t *n,
+		     uint64_t *start)
+{
+	int levels = 0, l;
+
+	do {
+		n[levels] = (blocks + per - 1) / per;
+		blocks = n[levels++];
+	} while (blocks > 1 && levels < LANYFS_VERITY_LEVELS);
+	/* top-down */
+	start[levels - 1] = 0;
+	for (l = levels - 2; l >= 0; l--)
+		start[l] = start[l + 1] + n[l + 1];
+	return levels;
+}
+
+/**
+ * node_pos() - Returns the byte offset of a hash block in the sidecar.
+ * @blocksize:			blocksize (exponent to base 2)
+ * @k:				hash block
+ */
+static inline uint64_t node_pos (int blocksize, uint64_t k)
+{
+	return VERITY_HDR_SIZE + (k << blocksize);
+}
+
+/**
+ * build_batch() - Pool task hashing a batch of blocks into their parents.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			hash tree being built
+ * @first:			first hash block of batch, within its level
+ *
+ * Level 0 hashes volume blocks, skipping runs of free blocks, every other
+ * level the hash blocks of the level below.
+ */
+static int build_batch (struct lanyfs_pool *pool, int worker, void *arg,
+			uint64_t first)
+{
+	struct verity_build *vb = arg;
+	struct lanyfs_vol *vol = vb->vol;
+	unsigned char *buf = vb->bufs[worker], *out = vb->out[worker];
+	uint64_t j, i, below, n, used;
+	int level = vb->level;
+
+	below = level ? vb->n[level - 1] : vol->blocks;
+	for (j = first; j < first + VERITY_BATCH && j < vb->n[level]; j++) {
+		n = below - j * vb->per < vb->per ? below - j * vb->per :
+		    vb->per;
+		memset(out, 0, vol->bsize);
+		if (level) {
+			if (lanyfs_fd_pread(vb->fd, buf, n << vol->blocksize,
+					    node_pos(vol->blocksize,
+						     vb->start[level - 1] +
+						     j * vb->per)))
+				return -1;
+		} else {
+			for (i = 0, used = 0; i < n; i++)
+				used += !lanyfs_testbit(vb->free,
+							j * vb->per + i);
+			if (used && lanyfs_dev_pread(vol->dev, buf,
+						     n << vol->blocksize,
+						     (j * vb->per) <<
+						     vol->blocksize))
+				return -1;
+		}
+		for (i = 0; i < n; i++) {
+			if (!level && lanyfs_testbit(vb->free, j * vb->per + i))
+				continue;
+			lanyfs_sha256(buf + (i << vol->blocksize), vol->bsize,
+				      out + i * LANYFS_VERITY_HASH);
+		}
+		if (lanyfs_fd_pwrite(vb->fd, out, vol->bsize,
+				     node_pos(vol->blocksize,
+					      vb->start[level] + j)))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * lanyfs_verity_build() - Writes the hash tree of a volume to a sidecar.
+ * @vol:			volume, not to be changed afterwards
+ * @path:			path of sidecar file
+ * @threads:			number of worker threads
+ * @root:			root hash of LANYFS_VERITY_HASH bytes
+ * @count:			number of blocks hashed, may be NULL
+ *
+ * Each level is hashed by all threads before the next one is started. The
+ * sidecar is written next to @path and renamed into place, so readers
+ * never see a partial tree.
+ */
+int lanyfs_verity_build (struct lanyfs_vol *vol, const char *path,
+			 int threads, unsigned char *root, uint64_t *count)
+{
+	unsigned char page[VERITY_HDR_SIZE];
+	struct verity_hdr *hdr = (struct verity_hdr *) page;
+	struct verity_build vb;
+	struct lanyfs_pool *pool = NULL;
+	char tmp[LANYFS_OVERLAY_PATHLEN];
+	uint64_t nfree = 0, j;
+	int levels, l, i, ret = -1, err;
+
+	memset(&vb, 0, sizeof(vb));
+	vb.vol = vol;
+	vb.fd = -1;
+	vb.per = vol->bsize / LANYFS_VERITY_HASH;
+	levels = geometry(vol->blocks, vb.per, vb.n, vb.start);
+	if (vb.n[levels - 1] > 1) {
+		errno = EFBIG;
+		return -1;
+	}
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	vb.free = calloc(1, (vol->blocks + 7) / 8);
+	if (!vb.free || lanyfs_free_map(vol, vb.free, 0, &nfree))
+		goto out;
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		goto out;
+	vb.bufs = calloc(lanyfs_pool_threads(pool), sizeof(*vb.bufs));
+	vb.out = calloc(lanyfs_pool_threads(pool), sizeof(*vb.out));
+	if (!vb.bufs || !vb.out)
+		goto out;
+	for (i = 0; i < lanyfs_pool_threads(pool); i++) {
+		/* aligned, runs may go out bypassing the page cache */
+		if (posix_memalign((void **) &vb.bufs[i], 4096,
+				   vb.per << vol->blocksize))
+			vb.bufs[i] = NULL;
+		vb.out[i] = malloc(vol->bsize);
+		if (!vb.bufs[i] || !vb.out[i])
+			goto out;
+	}
+	vb.fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (vb.fd < 0)
+		goto out;
+	for (l = 0; l < levels; l++) {
+		vb.level = l;
+		for (j = 0; j < vb.n[l]; j += VERITY_BATCH)
+			if (lanyfs_pool_submit(pool, build_batch, &vb, j))
+				break;
+		if (lanyfs_pool_wait(pool) || j < vb.n[l])
+			goto out;
+	}
+	if (lanyfs_fd_pread(vb.fd, vb.out[0], vol->bsize,
+			    node_pos(vol->blocksize, 0)))
+		goto out;
+	lanyfs_sha256(vb.out[0], vol->bsize, root);
+
+	/* the header goes last, after the tree it describes is durable */
+	memset(page, 0, sizeof(page));
+	memcpy(hdr->magic, LANYFS_VERITY_MAGIC, LANYFS_DEV_MAGIC_LEN);
+	hdr->version = tole32(VERITY_VERSION);
+	hdr->blocksize = tole32(vol->blocksize);
+	hdr->blocks = tole64(vol->blocks);
+	hdr->levels = tole32(levels);
+	for (l = 0; l < levels; l++)
+		hdr->start[l] = tole64(vb.start[l]);
+	memcpy(hdr->root, root, LANYFS_VERITY_HASH);
+	if (fdatasync(vb.fd) ||
+	    lanyfs_fd_pwrite(vb.fd, page, sizeof(page), 0) || fsync(vb.fd))
+		goto out;
+	if (close(vb.fd)) {
+		vb.fd = -1;
+		goto out;
+	}
+	vb.fd = -1;
+	if (rename(tmp, path))
+		goto out;
+	if (count)
+		*count = vol->blocks - nfree;
+	ret = 0;
+
+out:
+	err = errno;
+	if (vb.fd >= 0)
+		close(vb.fd);
+	if (ret)
+		unlink(tmp);
+	if (pool) {
+		for (i = 0; i < lanyfs_pool_threads(pool); i++) {
+			if (vb.bufs)
+				free(vb.bufs[i]);
+			if (vb.out)
+				free(vb.out[i]);
+		}
+		lanyfs_pool_free(pool);
+	}
+	free(vb.bufs);
+	free(vb.out);
+	free(vb.free);
+	errno = err;
+	return ret;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * vrt_node() - Gets a verified hash block.
+ * @dev:			device
+ * @level:			level of hash block
+ * @idx:			index of hash block within its level
+ * @node:			buffer of a block
+ *
+ * Hash blocks not cached are checked against their parents, which are
+ * fetched the same way, up to the root hash.
+ */
+static int vrt_node (struct lanyfs_dev *dev, int level, uint64_t idx,
+		     unsigned char *node)
+{
+	struct verity *vrt = dev->priv;
+	uint64_t k = vrt->start[level] + idx;
+	unsigned char want[LANYFS_VERITY_HASH], got[LANYFS_VERITY_HASH];
+	unsigned char *parent;
+	uint64_t gen;
+
+	if (lanyfs_cache_get(vrt->cache, k, node, &gen))
+		return 0;
+	if (level + 1 == vrt->levels) {
+		memcpy(want, vrt->root, LANYFS_VERITY_HASH);
+	} else {
+		parent = malloc(vrt->bsize);
+		if (!parent)
+			return -1;
+		if (vrt_node(dev, level + 1, idx / vrt->per, parent)) {
+			free(parent);
+			return -1;
+		}
+		memcpy(want, parent + (idx % vrt->per) * LANYFS_VERITY_HASH,
+		       LANYFS_VERITY_HASH);
+		free(parent);
+	}
+	if (lanyfs_fd_pread(dev->fd, node, vrt->bsize,
+			    node_pos(vrt->blocksize, k)))
+		return -1;
+	lanyfs_sha256(node, vrt->bsize, got);
+	if (memcmp(got, want, LANYFS_VERITY_HASH)) {
+		errno = EIO;
+		return -1;
+	}
+	__atomic_fetch_add(&vrt->nodes, 1, __ATOMIC_RELAXED);
+	lanyfs_cache_put(vrt->cache, k, node, gen);
+	return 0;
+}
+
+/**
+ * vrt_check() - Verifies consecutive volume blocks in place.
+ * @dev:			device
+ * @buf:			blocks
+ * @first:			address of first block
+ * @n:				number of blocks
+ *
+ * Free blocks are zeroed.
+ */
+static int vrt_check (struct lanyfs_dev *dev, unsigned char *buf,
+		      uint64_t first, uint64_t n)
+{
+	struct verity *vrt = dev->priv;
+	unsigned char got[LANYFS_VERITY_HASH], *node, *want;
+	uint64_t i, idx, cur = UINT64_MAX;
+	int ret = -1;
+
+	node = malloc(vrt->bsize);
+	if (!node)
+		return -1;
+	for (i = 0; i < n; i++, buf += vrt->bsize) {
+		idx = (first + i) / vrt->per;
+		if (idx != cur) {
+			if (vrt_node(dev, 0, idx, node))
+				goto out;
+			cur = idx;
+		}
+		want = node + ((first + i) % vrt->per) * LANYFS_VERITY_HASH;
+		if (lanyfs_is_zero(want, LANYFS_VERITY_HASH)) {
+			memset(buf, 0, vrt->bsize);
+			continue;
+		}
+		lanyfs_sha256(buf, vrt->bsize, got);
+		if (memcmp(got, want, LANYFS_VERITY_HASH)) {
+			errno = EIO;
+			goto out;
+		}
+	}
+	__atomic_fetch_add(&vrt->verified, n, __ATOMIC_RELAXED);
+	ret = 0;
+
+out:
+	free(node);
+	return ret;
+}
+
+/**
+ * vrt_pread() - Reads verified data.
+ * @dev:			device
+ * @buf:			target buffer
+ * @len:			number of bytes
+ * @pos:			byte offset
+ *
+ * Reads of whole blocks are verified in @buf, others through a scratch
+ * buffer covering the blocks touched.
+ */
+static int vrt_pread (struct lanyfs_dev *dev, void *buf, size_t len,
+		      uint64_t pos)
+{
+	struct verity *vrt = dev->priv;
+	uint64_t mask = vrt->bsize - 1, first, end;
+	unsigned char *tmp;
+	int ret = -1;
+
+	if (pos + len > dev->size) {
+		errno = EIO;
+		return -1;
+	}
+	if (!len)
+		return 0;
+	if (!(pos & mask) && !(len & mask)) {
+		if (lanyfs_dev_pread(vrt->lower, buf, len, pos))
+			return -1;
+		return vrt_check(dev, buf, pos >> vrt->blocksize,
+				 len >> vrt->blocksize);
+	}
+	first = pos >> vrt->blocksize;
+	end = (pos + len + mask) >> vrt->blocksize;
+	if (posix_memalign((void **) &tmp, 4096,
+			   (end - first) << vrt->blocksize))
+		return -1;
+	if (!lanyfs_dev_pread(vrt->lower, tmp, (end - first) <<
+			      vrt->blocksize, first << vrt->blocksize) &&
+	    !vrt_check(dev, tmp, first, end - first)) {
+		memcpy(buf, tmp + (pos & mask), len);
+		ret = 0;
+	}
+	free(tmp);
+	return ret;
+}
+
+/**
+ * vrt_close() - Closes a verifying backend and the device below.
+ * @dev:			device
+ */
+static int vrt_close (struct lanyfs_dev *dev)
+{
+	struct verity *vrt = dev->priv;
+	int ret = 0;
+	if (lanyfs_dev_close(vrt->lower))
+		ret = -1;
+	if (close(dev->fd))
+		ret = -1;
+	lanyfs_cache_free(vrt->cache);
+	free(vrt);
+	return ret;
+}
+
+static const struct lanyfs_dev_ops verity_ops = {
+	.name	= "verity",
+	.pread	= vrt_pread,
+	.pwrite	= NULL,
+	.sync	= NULL,
+	.discard = NULL,
+	.close	= vrt_close,
+};
+
+/**
+ * hdr_load() - Reads and validates a sidecar header.
+ * @fd:				file descriptor of sidecar
+ * @hdr:			header, converted to CPU byte order
+ */
+static int hdr_load (int fd, struct verity_hdr *hdr)
+{
+	int l;
+
+	if (lanyfs_fd_pread(fd, hdr, sizeof(*hdr), 0))
+		return -1;
+	hdr->version = fromle32(hdr->version);
+	hdr->blocksize = fromle32(hdr->blocksize);
+	hdr->blocks = fromle64(hdr->blocks);
+	hdr->levels = fromle32(hdr->levels);
+	for (l = 0; l < LANYFS_VERITY_LEVELS; l++)
+		hdr->start[l] = fromle64(hdr->start[l]);
+	if (memcmp(hdr->magic, LANYFS_VERITY_MAGIC, LANYFS_DEV_MAGIC_LEN) ||
+	    hdr->version != VERITY_VERSION ||
+	    hdr->blocksize < LANYFS_MIN_BLOCKSIZE ||
+	    hdr->blocksize > LANYFS_MAX_BLOCKSIZE ||
+	    !hdr->levels || hdr->levels > LANYFS_VERITY_LEVELS) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * lanyfs_verity_open() - Stacks a verifying backend onto a device.
+ * @lower:			device holding the image, taken over
+ * @path:			path of sidecar file
+ * @root:			expected root hash, NULL to trust the sidecar's
+ *
+ * The device is closed on error. Fails with ESTALE if the sidecar was built
+ * for another geometry and with EIO if its root hash is not @root. The
+ * backend is read-only.
+ */
+struct lanyfs_dev *lanyfs_verity_open (struct lanyfs_dev *lower,
+				       const char *path,
+				       const unsigned char *root)
+{
+	struct lanyfs_dev *dev = NULL;
+	struct verity *vrt = NULL;
+	struct verity_hdr hdr;
+	uint64_t n[LANYFS_VERITY_LEVELS], start[LANYFS_VERITY_LEVELS];
+	int fd, l, err;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		goto err;
+	if (hdr_load(fd, &hdr))
+		goto err;
+	if (root && memcmp(root, hdr.root, LANYFS_VERITY_HASH)) {
+		errno = EIO;
+		goto err;
+	}
+	if (hdr.blocks > lower->size >> hdr.blocksize ||
+	    geometry(hdr.blocks, ((uint64_t) 1 << hdr.blocksize) /
+		     LANYFS_VERITY_HASH, n, start) != (int) hdr.levels) {
+		errno = ESTALE;
+		goto err;
+	}
+	for (l = 0; l < (int) hdr.levels; l++) {
+		if (start[l] != hdr.start[l]) {
+			errno = ESTALE;
+			goto err;
+		}
+	}
+	dev = calloc(1, sizeof(*dev));
+	vrt = calloc(1, sizeof(*vrt));
+	if (!dev || !vrt)
+		goto err;
+	vrt->lower = lower;
+	vrt->blocksize = hdr.blocksize;
+	vrt->bsize = (size_t) 1 << hdr.blocksize;
+	vrt->per = vrt->bsize / LANYFS_VERITY_HASH;
+	vrt->levels = hdr.levels;
+	memcpy(vrt->start, hdr.start, sizeof(vrt->start));
+	memcpy(vrt->root, hdr.root, LANYFS_VERITY_HASH);
+	vrt->cache = lanyfs_cache_new(vrt->bsize, LANYFS_VERITY_CACHE);
+	if (!vrt->cache)
+		goto err;
+	dev->ops = &verity_ops;
+	dev->fd = fd;
+	dev->rdonly = 1;
+	dev->size = hdr.blocks << hdr.blocksize;
+	dev->tune = lower->tune;
+	dev->priv = vrt;
+	return dev;
+
+err:
+	err = errno;
+	free(vrt);
+	free(dev);
+	if (fd >= 0)
+		close(fd);
+	lanyfs_dev_close(lower);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * lanyfs_verity_auto() - Stacks a verifying backend if asked to.
+ * @dev:			device just opened, taken over
+ * @path:			path of device
+ *
+ * If LANYFS_VERITY is set and not 0, the device is verified against the
+ * sidecar at @path with .verity appended, pinned to the root hash in
+ * LANYFS_VERITY_ROOT if set. A missing sidecar fails the open then. Called
+ * by lanyfs_dev_open().
+ */
+struct lanyfs_dev *lanyfs_verity_auto (struct lanyfs_dev *dev,
+				       const char *path)
+{
+	unsigned char root[LANYFS_VERITY_HASH];
+	char sidecar[LANYFS_OVERLAY_PATHLEN];
+	const char *env;
+
+	env = getenv("LANYFS_VERITY");
+	if (!dev || !env || !strcmp(env, "0"))
+		return dev;
+	if (!dev->rdonly) {
+		lanyfs_dev_close(dev);
+		errno = EROFS;
+		return NULL;
+	}
+	if (snprintf(sidecar, sizeof(sidecar), "%s.verity", path) >=
+	    (int) sizeof(sidecar)) {
+		lanyfs_dev_close(dev);
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	env = getenv("LANYFS_VERITY_ROOT");
+	if (env && lanyfs_verity_parse(env, root)) {
+		lanyfs_dev_close(dev);
+		return NULL;
+	}
+	return lanyfs_verity_open(dev, sidecar, env ? root : NULL);
+}
+
+/**
+ * lanyfs_verity_stats() - Reports the work of a verifying backend.
+ * @dev:			device
+ * @verified:			number of volume blocks verified
+ * @nodes:			number of hash blocks read and verified
+ *
+ * Fails with EINVAL if @dev is not a verifying backend.
+ */
+int lanyfs_verity_stats (struct lanyfs_dev *dev, uint64_t *verified,
+			 uint64_t *nodes)
+{
+	struct verity *vrt = dev->priv;
+
+	if (dev->ops != &verity_ops) {
+		errno = EINVAL;
+		return -1;
+	}
+	*verified = __atomic_load_n(&vrt->verified, __ATOMIC_RELAXED);
+	*nodes = __atomic_load_n(&vrt->nodes, __ATOMIC_RELAXED);
+	return 0;
+}
@@ -0,0 +1,1119 @@
+/*
+ * libvol.c - Volume Access for Lanyard Filesystem.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "liblanyfs.h"
+
+/**
+ * free_null() - Frees memory and sets pointer to NULL.
+ * @p:				pointer to dynamically allocated memory
+ *
+ * This is a preprocessor macro-function.
+ */
+#define free_null(p)		\
+	do {			\
+		free(p);	\
+		p = NULL;	\
+	} while (0)
+
+/**
+ * lanyfs_vol_open() - Opens a volume and loads its superblock.
+ * @path:			device path
+ * @rdonly:			open read-only
+ *
+ * Returns the volume or NULL on error. errno is EINVAL if the device does
+ * not hold a valid LanyFS superblock.
+ */
+struct lanyfs_vol *lanyfs_vol_open (const char *path, int rdonly)
+{
+	struct lanyfs_dev *dev;
+	struct lanyfs_vol *vol;
+	int err;
+
+	dev = lanyfs_dev_open(path, rdonly);
+	if (!dev)
+		return NULL;
+	vol = lanyfs_vol_attach(dev);
+	if (!vol) {
+		err = errno;
+		lanyfs_dev_close(dev);
+		errno = err;
+	}
+	return vol;
+}
+
+/**
+ * lanyfs_vol_attach() - Loads the superblock of a volume on an open device.
+ * @dev:			device, owned by the volume on success
+ *
+ * Returns the volume or NULL on error. errno is EINVAL if the device does
+ * not hold a valid LanyFS superblock.
+ */
+struct lanyfs_vol *lanyfs_vol_attach (struct lanyfs_dev *dev)
+{
+	struct lanyfs_vol *vol;
+	struct lanyfs_sb sb;
+
+	vol = calloc(1, sizeof(*vol));
+	if (!vol)
+		return NULL;
+	vol->dev = dev;
+	vol->rdonly = dev->rdonly;
+	if (lanyfs_dev_pread(dev, &sb, sizeof(sb), 0))
+		goto err;
+	if (sb.type != LANYFS_TYPE_SB ||
+	    fromle32(sb.magic) != LANYFS_SUPER_MAGIC ||
+	    sb.blocksize < LANYFS_MIN_BLOCKSIZE ||
+	    sb.blocksize > LANYFS_MAX_BLOCKSIZE ||
+	    sb.addrlen < LANYFS_MIN_ADDRLEN ||
+	    sb.addrlen > LANYFS_MAX_ADDRLEN) {
+		errno = EINVAL;
+		goto err;
+	}
+	vol->blocksize = sb.blocksize;
+	vol->bsize = (size_t) 1 << sb.blocksize;
+	vol->addrlen = sb.addrlen;
+	vol->blocks = fromle64(sb.blocks);
+	vol->sb = lanyfs_alloc_block(vol);
+	if (!vol->sb)
+		goto err;
+	if (lanyfs_read_block(vol, LANYFS_SUPERBLOCK, vol->sb))
+		goto err;
+	return vol;
+
+err:
+	free_null(vol->sb);
+	free_null(vol);
+	return NULL;
+}
+
+/**
+ * lanyfs_vol_forge() - Sets up a volume of given geometry on an open device.
+ * @dev:			device, owned by the volume on success
+ * @blocksize:			blocksize (exponent to base 2)
+ * @addrlen:			length of block addresses in bytes
+ *
+ * The superblock on the device is not looked at, which is what recovery
+ * needs when it is damaged. The volume spans the whole device and its
+ * in-memory superblock is zeroed, so it has neither root directory nor
+ * free blocks chain. Returns the volume or NULL on error.
+ */
+struct lanyfs_vol *lanyfs_vol_forge (struct lanyfs_dev *dev, int blocksize,
+				     int addrlen)
+{
+	struct lanyfs_vol *vol;
+
+	if (blocksize < LANYFS_MIN_BLOCKSIZE ||
+	    blocksize > LANYFS_MAX_BLOCKSIZE ||
+	    addrlen < LANYFS_MIN_ADDRLEN || addrlen > LANYFS_MAX_ADDRLEN) {
+		errno = EINVAL;
+		return NULL;
+	}
+	vol = calloc(1, sizeof(*vol));
+	if (!vol)
+		return NULL;
+	vol->dev = dev;
+	vol->rdonly = dev->rdonly;
+	vol->blocksize = blocksize;
+	vol->bsize = (size_t) 1 << blocksize;
+	vol->addrlen = addrlen;
+	vol->blocks = dev->size >> blocksize;
+	vol->sb = lanyfs_alloc_block(vol);
+	if (!vol->sb) {
+		free_null(vol);
+		return NULL;
+	}
+	return vol;
+}
+
+/**
+ * lanyfs_vol_close() - Closes a volume and its device.
+ * @vol:			volume to close
+ *
+ * Pending writes are synced to the device before closing.
+ */
+int lanyfs_vol_close (struct lanyfs_vol *vol)
+{
+	size_t i;
+	int ret;
+	if (!vol)
+		return 0;
+	ret = lanyfs_dev_close(vol->dev);
+	lanyfs_cache_free(vol->cache);
+	for (i = 0; i < vol->nretired; i++)
+		free(vol->retired[i]);
+	free_null(vol->retired);
+	free_null(vol->sb);
+	free_null(vol);
+	return ret;
+}
+
+/**
+ * lanyfs_vol_cache() - Sets up a block cache for a read-only volume.
+ * @vol:			volume, opened read-only
+ * @blocks:			number of blocks to cache
+ *
+ * Blocks read by lanyfs_read_block() are served from the cache from now
+ * on. Writable volumes get no cache, since blocks are also written around
+ * lanyfs_write_block().
+ */
+int lanyfs_vol_cache (struct lanyfs_vol *vol, size_t blocks)
+{
+	if (!vol->rdonly || vol->cache) {
+		errno = EINVAL;
+		return -1;
+	}
+	vol->cache = lanyfs_cache_new(vol->bsize, blocks);
+	return vol->cache ? 0 : -1;
+}
+
+/**
+ * lanyfs_vol_refresh() - Reloads the superblock of a read-only volume.
+ * @vol:			volume, opened read-only
+ *
+ * Picks up changes made to the device by others. The new superblock copy
+ * is published with a single pointer store and the old one is kept until
+ * the volume is closed, so concurrent readers never see a torn copy. The
+ * block cache is emptied, blocks other readers are reading meanwhile do
+ * not go into it. Concurrent refreshes are serialized.
+ */
+int lanyfs_vol_refresh (struct lanyfs_vol *vol)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	union lanyfs_b *sb, **retired;
+
+	if (!vol->rdonly) {
+		errno = EINVAL;
+		return -1;
+	}
+	sb = lanyfs_alloc_block(vol);
+	if (!sb)
+		return -1;
+	pthread_mutex_lock(&lock);
+	retired = realloc(vol->retired,
+			  (vol->nretired + 1) * sizeof(*retired));
+	if (!retired)
+		goto err;
+	vol->retired = retired;
+	if (vol->cache)
+		lanyfs_cache_clear(vol->cache);
+	if (lanyfs_dev_pread(vol->dev, sb, vol->bsize, 0))
+		goto err;
+	if (sb->raw.type != LANYFS_TYPE_SB ||
+	    fromle32(sb->sb.magic) != LANYFS_SUPER_MAGIC ||
+	    sb->sb.blocksize != vol->blocksize ||
+	    sb->sb.addrlen != vol->addrlen) {
+		errno = EINVAL;
+		goto err;
+	}
+	vol->retired[vol->nretired++] = __atomic_exchange_n(&vol->sb, sb,
+							    __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lock);
+	return 0;
+
+err:
+	pthread_mutex_unlock(&lock);
+	free(sb);
+	return -1;
+}
+
+/**
+ * lanyfs_alloc_block() - Allocates a zeroed block buffer.
+ * @vol:			volume the buffer is used with
+ */
+union lanyfs_b *lanyfs_alloc_block (struct lanyfs_vol *vol)
+{
+	return calloc(1, vol->bsize);
+}
+
+/**
+ * lanyfs_valid_addr() - Checks if address may point to a block.
+ * @vol:			volume
+ * @addr:			address to check
+ *
+ * Address 0 is the superblock and never a valid target of a pointer.
+ */
+int lanyfs_valid_addr (struct lanyfs_vol *vol, uint64_t addr)
+{
+	return addr > LANYFS_SUPERBLOCK && addr < vol->blocks;
+}
+
+/**
+ * lanyfs_read_block() - Reads a block from the device.
+ * @vol:			volume
+ * @addr:			address of block
+ * @buf:			buffer of at least blocksize bytes
+ */
+int lanyfs_read_block (struct lanyfs_vol *vol, uint64_t addr, void *buf)
+{
+	uint64_t gen;
+
+	if (addr >= vol->blocks) {
+		errno = ERANGE;
+		return -1;
+	}
+	if (vol->cache && lanyfs_cache_get(vol->cache, addr, buf, &gen))
+		return 0;
+	if (lanyfs_dev_pread(vol->dev, buf, vol->bsize,
+			     addr << vol->blocksize))
+		return -1;
+	if (vol->cache)
+		lanyfs_cache_put(vol->cache, addr, buf, gen);
+	return 0;
+}
+
+/**
+ * lanyfs_write_block() - Writes a block to the device.
+ * @vol:			volume
+ * @addr:			address of block
+ * @buf:			block to write
+ *
+ * The block's write counter is incremented before writing.
+ */
+int lanyfs_write_block (struct lanyfs_vol *vol, uint64_t addr, void *buf)
+{
+	struct lanyfs_raw *raw = buf;
+	if (vol->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if (addr >= vol->blocks) {
+		errno = ERANGE;
+		return -1;
+	}
+	raw->wrcnt = tole16(fromle16(raw->wrcnt) + 1);
+	return lanyfs_dev_pwrite(vol->dev, buf, vol->bsize,
+				 addr << vol->blocksize);
+}
+
+/**
+ * lanyfs_write_sb() - Writes the in-memory superblock to the device.
+ * @vol:			volume
+ *
+ * Sets the superblock's date of last change to now.
+ */
+int lanyfs_write_sb (struct lanyfs_vol *vol)
+{
+	vol->sb->sb.updated = lanyfs_ts_now();
+	return lanyfs_write_block(vol, LANYFS_SUPERBLOCK, vol->sb);
+}
+
+/**
+ * lanyfs_ts_now() - Crafts a timestamp of current time in LanyFS format.
+ */
+struct lanyfs_ts lanyfs_ts_now (void)
+{
+	struct lanyfs_ts ts;
+	time_t tnow;
+	struct tm tm;
+
+	memset(&ts, 0, sizeof(ts));
+	tnow = time(NULL);
+	gmtime_r(&tnow, &tm);
+	ts.year = tole16(tm.tm_year + 1900);
+	ts.mon = tm.tm_mon + 1;
+	ts.day = tm.tm_mday;
+	ts.hour = tm.tm_hour;
+	ts.min = tm.tm_min;
+	ts.sec = tm.tm_sec;
+	localtime_r(&tnow, &tm);
+	ts.offset = (int16_t) tole16((uint16_t) (tm.tm_gmtoff / 60));
+	return ts;
+}
+
+/**
+ * lanyfs_chain_slots() - Returns the number of slots of chain blocks.
+ * @vol:			volume
+ */
+int lanyfs_chain_slots (struct lanyfs_vol *vol)
+{
+	return (vol->bsize - offsetof(struct lanyfs_chain, stream)) /
+	       vol->addrlen;
+}
+
+/**
+ * lanyfs_ext_slots() - Returns the number of slots of extender blocks.
+ * @vol:			volume
+ */
+int lanyfs_ext_slots (struct lanyfs_vol *vol)
+{
+	return (vol->bsize - offsetof(struct lanyfs_ext, stream)) /
+	       vol->addrlen;
+}
+
+/**
+ * lanyfs_slot_get() - Returns the address stored in a slot.
+ * @vol:			volume
+ * @stream:			start of block address stream
+ * @slot:			slot to be read
+ *
+ * Slots hold little endian addresses of addrlen bytes. Streams are never
+ * swapped as a whole, so a forced swap build still stores them this way.
+ */
+uint64_t lanyfs_slot_get (struct lanyfs_vol *vol, const unsigned char *stream,
+			  int slot)
+{
+	uint64_t addr = 0;
+#if LANYFS_SWAP
+	int i;
+	stream += slot * vol->addrlen;
+	for (i = vol->addrlen - 1; i >= 0; i--)
+		addr = (addr << 8) | stream[i];
+#else
+	memcpy(&addr, stream + (slot * vol->addrlen), vol->addrlen);
+#endif
+	return addr;
+}
+
+/**
+ * lanyfs_slot_set() - Stores an address in a slot.
+ * @vol:			volume
+ * @stream:			start of block address stream
+ * @slot:			slot to be written
+ * @addr:			address to store, 0 empties the slot
+ */
+void lanyfs_slot_set (struct lanyfs_vol *vol, unsigned char *stream, int slot,
+		      uint64_t addr)
+{
+#if LANYFS_SWAP
+	int i;
+	stream += slot * vol->addrlen;
+	for (i = 0; i < vol->addrlen; i++, addr >>= 8)
+		stream[i] = addr & 0xff;
+#else
+	memcpy(stream + (slot * vol->addrlen), &addr, vol->addrlen);
+#endif
+}
+
+/**
+ * btree_field() - Returns pointer to the field of a block holding an address.
+ * @b:				directory or file block
+ * @field:			requested field
+ */
+static uint64_t *btree_field (union lanyfs_b *b, enum lanyfs_field field)
+{
+	switch (field) {
+	case LANYFS_FIELD_SUBTREE:
+		return &b->dir.subtree;
+	case LANYFS_FIELD_LEFT:
+		return &b->vi_btree.left;
+	case LANYFS_FIELD_RIGHT:
+	default:
+		return &b->vi_btree.right;
+	}
+}
+
+/**
+ * is_node() - Checks if a block may be part of a binary tree.
+ * @b:				block to check
+ */
+static int is_node (union lanyfs_b *b)
+{
+	return b->raw.type == LANYFS_TYPE_DIR || b->raw.type == LANYFS_TYPE_FILE;
+}
+
+/**
+ * lanyfs_lookup() - Resolves a path to the address of its block.
+ * @vol:			volume
+ * @path:			slash separated path, relative to root directory
+ * @addr:			resolved address
+ * @link:			location of pointer to resolved block, may be
+ * 				NULL
+ *
+ * Directory contents are binary trees ordered by name. The root directory
+ * itself is not linked from any binary tree, its link holder is 0. A path
+ * ending in a slash must resolve to a directory, or ENOTDIR is set.
+ */
+int lanyfs_lookup (struct lanyfs_vol *vol, const char *path, uint64_t *addr,
+		   struct lanyfs_link *link)
+{
+	union lanyfs_b *b;
+	struct lanyfs_link l;
+	char name[LANYFS_NAME_LENGTH + 1];
+	const char *end;
+	uint64_t cur;
+	size_t len;
+	int cmp, dironly, found = 0;
+
+	len = strlen(path);
+	dironly = len && path[len - 1] == '/';
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	cur = fromle64(__atomic_load_n(&vol->sb, __ATOMIC_ACQUIRE)->sb.rootdir);
+	l.holder = 0;
+	l.field = LANYFS_FIELD_SUBTREE;
+	l.parent = 0;
+	while (*path) {
+		while (*path == '/')
+			path++;
+		if (!*path)
+			break;
+		end = strchr(path, '/');
+		len = end ? (size_t) (end - path) : strlen(path);
+		if (len > LANYFS_NAME_LENGTH) {
+			errno = ENAMETOOLONG;
+			goto err;
+		}
+		memcpy(name, path, len);
+		name[len] = '\0';
+		path += len;
+
+		/* descend into directory */
+		if (lanyfs_read_block(vol, cur, b))
+			goto err;
+		if (b->raw.type != LANYFS_TYPE_DIR) {
+			errno = ENOTDIR;
+			goto err;
+		}
+		l.parent = l.holder = cur;
+		l.field = LANYFS_FIELD_SUBTREE;
+		cur = fromle64(b->dir.subtree);
+
+		/* search binary tree */
+		while (1) {
+			if (!cur) {
+				errno = ENOENT;
+				goto err;
+			}
+			if (!lanyfs_valid_addr(vol, cur) ||
+			    lanyfs_read_block(vol, cur, b) || !is_node(b)) {
+				errno = EIO;
+				goto err;
+			}
+			cmp = strncmp(name, (char *) b->vi_meta.name,
+				      LANYFS_NAME_LENGTH);
+			if (!cmp) {
+				found = 1;
+				break;
+			}
+			l.holder = cur;
+			l.field = cmp < 0 ? LANYFS_FIELD_LEFT :
+					    LANYFS_FIELD_RIGHT;
+			cur = fromle64(*btree_field(b, l.field));
+		}
+	}
+	/* b holds the resolved block unless the path named the root */
+	if (dironly && found && b->raw.type != LANYFS_TYPE_DIR) {
+		errno = ENOTDIR;
+		goto err;
+	}
+	*addr = cur;
+	if (link)
+		*link = l;
+	free_null(b);
+	return 0;
+
+err:
+	free_null(b);
+	return -1;
+}
+
+/**
+ * lanyfs_btree_unlink() - Removes a block from its directory's binary tree.
+ * @vol:			volume
+ * @link:			location of pointer to block, see lanyfs_lookup()
+ * @addr:			address of block to remove
+ *
+ * The pointer held by @link is replaced by one of the block's children. A
+ * block with at most one child is unlinked with a single write. Otherwise
+ * the right child is grafted to the rightmost node of the left child first,
+ * costing one more write. The removed block itself is left untouched.
+ */
+int lanyfs_btree_unlink (struct lanyfs_vol *vol,
+			 const struct lanyfs_link *link, uint64_t addr)
+{
+	union lanyfs_b *b;
+	uint64_t left, right, cur, next;
+
+	if (!link->holder) {
+		errno = EBUSY;
+		return -1;
+	}
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	if (lanyfs_read_block(vol, addr, b))
+		goto err;
+	left = fromle64(b->vi_btree.left);
+	right = fromle64(b->vi_btree.right);
+	if (left && right) {
+		cur = left;
+		while (1) {
+			if (!lanyfs_valid_addr(vol, cur) ||
+			    lanyfs_read_block(vol, cur, b) || !is_node(b)) {
+				errno = EIO;
+				goto err;
+			}
+			next = fromle64(b->vi_btree.right);
+			if (!next)
+				break;
+			cur = next;
+		}
+		b->vi_btree.right = tole64(right);
+		if (lanyfs_write_block(vol, cur, b))
+			goto err;
+		right = 0;
+	}
+	if (lanyfs_read_block(vol, link->holder, b))
+		goto err;
+	if (fromle64(*btree_field(b, link->field)) != addr) {
+		errno = EIO;
+		goto err;
+	}
+	*btree_field(b, link->field) = tole64(left ? left : right);
+	if (lanyfs_write_block(vol, link->holder, b))
+		goto err;
+	free_null(b);
+	return 0;
+
+err:
+	free_null(b);
+	return -1;
+}
+
+/**
+ * ext_walk() - Recursive helper of lanyfs_ext_walk().
+ * @vol:			volume
+ * @addr:			address of extender
+ * @level:			expected level of extender, -1 if unknown
+ * @base:			index of first data block covered by extender
+ * @span:			data blocks covered by one slot at @level,
+ * 				computed on the fly if @level is -1
+ * @visit:			callback
+ * @arg:			user argument
+ */
+static int ext_walk (struct lanyfs_vol *vol, uint64_t addr, int level,
+		     uint64_t base, uint64_t span, lanyfs_extvisit_t visit,
+		     void *arg)
+{
+	union lanyfs_b *b;
+	uint64_t target;
+	int slots, i, ret;
+
+	if (!lanyfs_valid_addr(vol, addr)) {
+		errno = EIO;
+		return -1;
+	}
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	if (lanyfs_read_block(vol, addr, b))
+		goto err;
+	if (b->raw.type != LANYFS_TYPE_EXT ||
+	    b->ext.level > LANYFS_MAX_LEVEL ||
+	    (level >= 0 && b->ext.level != level)) {
+		errno = EIO;
+		goto err;
+	}
+	slots = lanyfs_ext_slots(vol);
+	if (level < 0) {
+		level = b->ext.level;
+		for (span = 1, i = 0; i < level; i++)
+			span *= slots;
+	}
+	ret = visit(vol, addr, LANYFS_TYPE_EXT, base, arg);
+	if (ret)
+		goto out;
+	for (i = 0; i < slots; i++) {
+		target = lanyfs_slot_get(vol, &b->ext.stream, i);
+		if (!target)
+			continue;
+		if (level) {
+			ret = ext_walk(vol, target, level - 1,
+				       base + i * span, span / slots, visit,
+				       arg);
+		} else if (lanyfs_valid_addr(vol, target)) {
+			ret = visit(vol, target, LANYFS_TYPE_DATA, base + i,
+				    arg);
+		} else {
+			errno = EIO;
+			ret = -1;
+		}
+		if (ret)
+			goto out;
+	}
+out:
+	free_null(b);
+	return ret;
+
+err:
+	free_null(b);
+	return -1;
+}
+
+/**
+ * lanyfs_ext_walk() - Visits all blocks of an extender tree.
+ * @vol:			volume
+ * @addr:			address of root extender, as in a file block
+ * @visit:			callback, called for every extender before its
+ * 				slots and for every data block
+ * @arg:			user argument
+ *
+ * Extenders of level 0 point to data blocks, extenders of level n point to
+ * extenders of level n-1. Returns -1 on I/O error or structural damage, or
+ * the non-zero value returned by @visit.
+ */
+int lanyfs_ext_walk (struct lanyfs_vol *vol, uint64_t addr,
+		     lanyfs_extvisit_t visit, void *arg)
+{
+	if (!addr)
+		return 0;
+	return ext_walk(vol, addr, -1, 0, 0, visit, arg);
+}
+
+/**
+ * struct free_chain - Superblock fields of a free blocks chain.
+ * @head:			start of chain
+ * @tail:			end of chain
+ * @count:			number of free blocks, chain blocks included
+ */
+struct free_chain {
+	uint64_t		*head;
+	uint64_t		*tail;
+	uint64_t		*count;
+};
+
+/**
+ * free_chain() - Looks up the fields of the main or the zone's chain.
+ * @vol:			volume
+ * @zone:			metadata zone's chain instead of main chain
+ * @c:				fields, point into the in-memory superblock
+ */
+static void free_chain (struct lanyfs_vol *vol, int zone,
+			struct free_chain *c)
+{
+	struct lanyfs_sb *sb = &vol->sb->sb;
+	c->head = zone ? &sb->zonehead : &sb->freehead;
+	c->tail = zone ? &sb->zonetail : &sb->freetail;
+	c->count = zone ? &sb->zoneblocks : &sb->freeblocks;
+}
+
+/**
+ * append_chain() - Appends sorted blocks to one free blocks chain.
+ * @vol:			volume
+ * @zone:			append to metadata zone's chain
+ * @addrs:			ascending addresses of blocks
+ * @n:				number of addresses
+ */
+static int append_chain (struct lanyfs_vol *vol, int zone, uint64_t *addrs,
+			 size_t n)
+{
+	struct free_chain c;
+	union lanyfs_b *tail, *chain;
+	uint64_t tailaddr, head;
+	size_t i;
+	int slots, slot;
+
+	if (!n)
+		return 0;
+	free_chain(vol, zone, &c);
+	slots = lanyfs_chain_slots(vol);
+	tail = lanyfs_alloc_block(vol);
+	chain = lanyfs_alloc_block(vol);
+	if (!tail || !chain)
+		goto err;
+
+	/* fill the tail's empty slots */
+	i = 0;
+	tailaddr = fromle64(*c.tail);
+	if (tailaddr) {
+		if (lanyfs_read_block(vol, tailaddr, tail))
+			goto err;
+		for (slot = 0; slot < slots && i < n; slot++) {
+			if (lanyfs_slot_get(vol, &tail->chain.stream, slot))
+				continue;
+			lanyfs_slot_set(vol, &tail->chain.stream, slot,
+					addrs[i++]);
+		}
+	}
+
+	/* pack the remaining blocks into new chain blocks */
+	head = i < n ? addrs[i] : 0;
+	while (i < n) {
+		uint64_t self = addrs[i++];
+		memset(chain, 0, vol->bsize);
+		chain->chain.type = LANYFS_TYPE_CHAIN;
+		for (slot = 0; slot < slots && i < n; slot++)
+			lanyfs_slot_set(vol, &chain->chain.stream, slot,
+					addrs[i++]);
+		if (i < n)
+			chain->chain.next = tole64(addrs[i]);
+		if (lanyfs_write_block(vol, self, chain))
+			goto err;
+		*c.tail = tole64(self);
+	}
+
+	/* link old tail to new chain blocks */
+	if (tailaddr) {
+		if (head)
+			tail->chain.next = tole64(head);
+		if (lanyfs_write_block(vol, tailaddr, tail))
+			goto err;
+	} else {
+		*c.head = tole64(head);
+	}
+	*c.count = tole64(fromle64(*c.count) + n);
+	free_null(tail);
+	free_null(chain);
+	return 0;
+
+err:
+	free_null(tail);
+	free_null(chain);
+	return -1;
+}
+
+/**
+ * lanyfs_free_append() - Returns blocks to the free blocks chain.
+ * @vol:			volume
+ * @addrs:			addresses of blocks, sorted on return
+ * @n:				number of addresses
+ *
+ * Blocks inside the metadata zone go back to the zone's chain, all others
+ * to the main chain. Empty slots of a chain's tail are filled first. The
+ * remaining blocks are packed into new chain blocks built from the freed
+ * blocks themselves, which are written in ascending order before the old
+ * tail is linked to them. The in-memory superblock is updated but not
+ * written, so callers freeing blocks in several steps pay for a single
+ * superblock write.
+ */
+int lanyfs_free_append (struct lanyfs_vol *vol, uint64_t *addrs, size_t n)
+{
+	struct lanyfs_addrvec vec = {addrs, n, n};
+	uint64_t zoneend = fromle64(vol->sb->sb.zoneend);
+	size_t k = 0;
+
+	if (!n)
+		return 0;
+	lanyfs_addrvec_sort(&vec);
+	while (k < n && addrs[k] < zoneend)
+		k++;
+	if (append_chain(vol, 1, addrs, k) ||
+	    append_chain(vol, 0, addrs + k, n - k))
+		return -1;
+	return 0;
+}
+
+/**
+ * take_chain() - Takes blocks off one free blocks chain.
+ * @vol:			volume
+ * @zone:			take from metadata zone's chain
+ * @addrs:			addresses of blocks taken
+ * @n:				number of blocks to take, no more than the chain
+ * 				holds
+ */
+static int take_chain (struct lanyfs_vol *vol, int zone, uint64_t *addrs,
+		       size_t n)
+{
+	struct free_chain c;
+	union lanyfs_b *chain;
+	uint64_t head, target;
+	size_t i = 0;
+	int slots, slot;
+
+	if (!n)
+		return 0;
+	free_chain(vol, zone, &c);
+	slots = lanyfs_chain_slots(vol);
+	chain = lanyfs_alloc_block(vol);
+	if (!chain)
+		return -1;
+	head = fromle64(*c.head);
+	while (i < n) {
+		if (!lanyfs_valid_addr(vol, head) ||
+		    lanyfs_read_block(vol, head, chain) ||
+		    chain->raw.type != LANYFS_TYPE_CHAIN) {
+			errno = EIO;
+			goto err;
+		}
+		for (slot = 0; slot < slots && i < n; slot++) {
+			target = lanyfs_slot_get(vol, &chain->chain.stream,
+						 slot);
+			if (!target)
+				continue;
+			addrs[i++] = target;
+			lanyfs_slot_set(vol, &chain->chain.stream, slot, 0);
+		}
+		for (; slot < slots; slot++) {
+			if (lanyfs_slot_get(vol, &chain->chain.stream, slot))
+				break;
+		}
+		if (i == n || slot < slots) {
+			if (lanyfs_write_block(vol, head, chain))
+				goto err;
+			break;
+		}
+		/* the empty chain block is taken too */
+		addrs[i++] = head;
+		head = fromle64(chain->chain.next);
+		*c.head = tole64(head);
+		if (!head)
+			*c.tail = 0;
+	}
+	*c.count = tole64(fromle64(*c.count) - n);
+	free_null(chain);
+	return 0;
+
+err:
+	free_null(chain);
+	return -1;
+}
+
+/**
+ * take_split() - Takes blocks off one chain, then off the other.
+ * @vol:			volume
+ * @zone:			metadata zone's chain comes first
+ * @addrs:			addresses of blocks taken
+ * @n:				number of blocks to take
+ */
+static int take_split (struct lanyfs_vol *vol, int zone, uint64_t *addrs,
+		       size_t n)
+{
+	struct free_chain first, second;
+	uint64_t k;
+
+	free_chain(vol, zone, &first);
+	free_chain(vol, !zone, &second);
+	k = fromle64(*first.count);
+	if (k + fromle64(*second.count) < n) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (k > n)
+		k = n;
+	if (take_chain(vol, zone, addrs, k) ||
+	    take_chain(vol, !zone, addrs + k, n - k))
+		return -1;
+	return 0;
+}
+
+/**
+ * lanyfs_free_take() - Takes blocks for data off the free blocks chain.
+ * @vol:			volume
+ * @addrs:			addresses of blocks taken
+ * @n:				number of blocks to take
+ *
+ * Blocks are taken from the chain's head in chain order, so a chain built
+ * in ascending order hands out runs of consecutive blocks. A chain block
+ * running empty is taken as well if more blocks are needed. Blocks of the
+ * metadata zone are only handed out once the main chain runs dry. Fails
+ * with ENOSPC without touching a chain if both together hold fewer than @n
+ * blocks. The in-memory superblock is updated but not written. Callers
+ * write it before writing to the blocks taken, otherwise an interruption
+ * could leave the superblock pointing to a chain block holding data.
+ */
+int lanyfs_free_take (struct lanyfs_vol *vol, uint64_t *addrs, size_t n)
+{
+	return take_split(vol, 0, addrs, n);
+}
+
+/**
+ * lanyfs_meta_take() - Takes blocks for metadata off the free blocks chain.
+ * @vol:			volume
+ * @addrs:			addresses of blocks taken
+ * @n:				number of blocks to take
+ *
+ * Works like lanyfs_free_take(), but directory, file, extender and chain
+ * blocks are meant to stay together, so the metadata zone's chain is used
+ * first and the main chain only once the zone is full.
+ */
+int lanyfs_meta_take (struct lanyfs_vol *vol, uint64_t *addrs, size_t n)
+{
+	return take_split(vol, 1, addrs, n);
+}
+
+/**
+ * map_chain() - Marks the blocks of one free blocks chain in a bitmap.
+ * @vol:			volume
+ * @addr:			head of chain
+ * @b:				block buffer
+ * @map:			bitmap
+ * @chains:			mark chain blocks as well
+ * @n:				number of blocks marked, counted up
+ */
+static int map_chain (struct lanyfs_vol *vol, uint64_t addr,
+		      union lanyfs_b *b, unsigned char *map, int chains,
+		      uint64_t *n)
+{
+	uint64_t target, hops = 0;
+	int slots, slot;
+
+	slots = lanyfs_chain_slots(vol);
+	while (addr) {
+		if (!lanyfs_valid_addr(vol, addr) || ++hops > vol->blocks ||
+		    lanyfs_read_block(vol, addr, b)) {
+			errno = EIO;
+			return -1;
+		}
+		if (chains) {
+			lanyfs_setbit(map, addr);
+			(*n)++;
+		}
+		for (slot = 0; slot < slots; slot++) {
+			target = lanyfs_slot_get(vol, &b->chain.stream, slot);
+			if (!target)
+				continue;
+			if (!lanyfs_valid_addr(vol, target)) {
+				errno = EIO;
+				return -1;
+			}
+			lanyfs_setbit(map, target);
+			(*n)++;
+		}
+		addr = fromle64(b->chain.next);
+	}
+	return 0;
+}
+
+/**
+ * lanyfs_free_map() - Marks all blocks of the free blocks chains in a bitmap.
+ * @vol:			volume
+ * @map:			zeroed bitmap of at least vol->blocks bits
+ * @chains:			mark chain blocks as well
+ * @count:			number of blocks marked, may be NULL
+ *
+ * Covers the main chain and the metadata zone's chain. Chain blocks are
+ * free blocks too, but hold the chain itself. Callers omitting free blocks
+ * from copies must keep them, so they are only marked on request.
+ */
+int lanyfs_free_map (struct lanyfs_vol *vol, unsigned char *map, int chains,
+		     uint64_t *count)
+{
+	union lanyfs_b *b;
+	uint64_t n = 0;
+	int ret;
+
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		return -1;
+	ret = map_chain(vol, fromle64(vol->sb->sb.freehead), b, map, chains,
+			&n);
+	if (!ret)
+		ret = map_chain(vol, fromle64(vol->sb->sb.zonehead), b, map,
+				chains, &n);
+	if (!ret && count)
+		*count = n;
+	free_null(b);
+	return ret;
+}
+
+/**
+ * lanyfs_addrvec_push() - Appends an address to a vector.
+ * @vec:			vector
+ * @addr:			address to append
+ */
+int lanyfs_addrvec_push (struct lanyfs_addrvec *vec, uint64_t addr)
+{
+	uint64_t *a;
+	size_t cap;
+	if (vec->n == vec->cap) {
+		cap = vec->cap ? vec->cap * 2 : 256;
+		a = realloc(vec->a, cap * sizeof(*a));
+		if (!a)
+			return -1;
+		vec->a = a;
+		vec->cap = cap;
+	}
+	vec->a[vec->n++] = addr;
+	return 0;
+}
+
+/**
+ * lanyfs_addrvec_merge() - Moves all addresses from one vector to another.
+ * @dst:			target vector
+ * @src:			source vector, empty on return
+ */
+int lanyfs_addrvec_merge (struct lanyfs_addrvec *dst,
+			  struct lanyfs_addrvec *src)
+{
+	uint64_t *a;
+	if (!dst->a) {
+		*dst = *src;
+		memset(src, 0, sizeof(*src));
+		return 0;
+	}
+	if (dst->n + src->n > dst->cap) {
+		a = realloc(dst->a, (dst->n + src->n) * sizeof(*a));
+		if (!a)
+			return -1;
+		dst->a = a;
+		dst->cap = dst->n + src->n;
+	}
+	memcpy(dst->a + dst->n, src->a, src->n * sizeof(*src->a));
+	dst->n += src->n;
+	lanyfs_addrvec_free(src);
+	return 0;
+}
+
+/**
+ * cmp_addr() - Compares two addresses for qsort().
+ * @a:				first address
+ * @b:				second address
+ */
+static int cmp_addr (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * lanyfs_addrvec_sort() - Sorts a vector in ascending order.
+ * @vec:			vector
+ */
+void lanyfs_addrvec_sort (struct lanyfs_addrvec *vec)
+{
+	qsort(vec->a, vec->n, sizeof(*vec->a), cmp_addr);
+}
+
+/**
+ * lanyfs_addrvec_free() - Releases a vector's memory.
+ * @vec:			vector, empty on return
+ */
+void lanyfs_addrvec_free (struct lanyfs_addrvec *vec)
+{
+	free_null(vec->a);
+	vec->n = vec->cap = 0;
+}
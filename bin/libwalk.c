@@ -0,0 +1,210 @@
+/*
+ * libwalk.c - Parallel Directory Tree Walk for Lanyard Filesystem.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Walking
+ *
+ * A walk visits every directory and file block below a binary tree root.
+ * It runs on a thread pool, each binary tree is a task. A task walks its
+ * tree depth-first on the private stack of the worker running it and
+ * submits subtrees of directories as new tasks. Siblings become tasks as
+ * well while some worker is idle, so even a single huge directory keeps
+ * all workers busy. The walk ends when no task is left.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "liblanyfs.h"
+
+/**
+ * struct walk_ctx - State shared by the tasks of a walk.
+ * @vol:			volume being walked
+ * @visit:			callback
+ * @arg:			user argument of callback
+ * @stacks:			private stacks, one per worker
+ * @bufs:			block buffers, one per worker
+ * @done:			a task failed, stop early
+ */
+struct walk_ctx {
+	struct lanyfs_vol	*vol;
+	lanyfs_visit_t		visit;
+	void			*arg;
+	struct lanyfs_addrvec	*stacks;
+	union lanyfs_b		**bufs;
+	int			done;
+};
+
+/**
+ * walk_tree() - Walks a binary tree depth-first.
+ * @pool:			pool running the walk
+ * @worker:			index of worker
+ * @arg:			shared state
+ * @root:			root of binary tree
+ */
+static int walk_tree (struct lanyfs_pool *pool, int worker, void *arg,
+		      uint64_t root)
+{
+	struct walk_ctx *ctx = arg;
+	struct lanyfs_vol *vol = ctx->vol;
+	struct lanyfs_addrvec *stack = &ctx->stacks[worker];
+	union lanyfs_b *b = ctx->bufs[worker];
+	uint64_t addr, child[3];
+	int i, ret = 0;
+
+	stack->n = 0;
+	if (lanyfs_addrvec_push(stack, root))
+		goto fail;
+	while (stack->n) {
+		addr = stack->a[--stack->n];
+		if (!lanyfs_valid_addr(vol, addr) ||
+		    lanyfs_read_block(vol, addr, b) ||
+		    (b->raw.type != LANYFS_TYPE_DIR &&
+		     b->raw.type != LANYFS_TYPE_FILE)) {
+			errno = EIO;
+			goto fail;
+		}
+		child[0] = fromle64(b->vi_btree.left);
+		child[1] = fromle64(b->vi_btree.right);
+		child[2] = b->raw.type == LANYFS_TYPE_DIR ?
+			   fromle64(b->dir.subtree) : 0;
+		ret = ctx->visit(vol, worker, addr, b, ctx->arg);
+		if (ret == LANYFS_WALK_PRUNE) {
+			/* a later failure must not return the prune */
+			ret = 0;
+			continue;
+		}
+		if (ret)
+			goto fail;
+		if (child[2] &&
+		    lanyfs_pool_submit(pool, walk_tree, ctx, child[2]))
+			goto fail;
+		for (i = 0; i < 2; i++) {
+			if (!child[i])
+				continue;
+			if (lanyfs_pool_idle(pool))
+				ret = lanyfs_pool_submit(pool, walk_tree, ctx,
+							 child[i]);
+			else
+				ret = lanyfs_addrvec_push(stack, child[i]);
+			if (ret)
+				goto fail;
+		}
+		if (__atomic_load_n(&ctx->done, __ATOMIC_RELAXED))
+			break;
+	}
+	return 0;
+fail:
+	__atomic_store_n(&ctx->done, 1, __ATOMIC_RELAXED);
+	return ret ? ret : -1;
+}
+
+/**
+ * lanyfs_walk() - Visits all directory and file blocks below a subtree.
+ * @vol:			volume
+ * @subtree:			binary tree root, e.g. a directory's subtree
+ * @threads:			number of worker threads
+ * @visit:			callback, called concurrently by all workers
+ * @arg:			user argument
+ *
+ * Blocks are visited in no particular order. If @visit returns
+ * LANYFS_WALK_PRUNE, the walk goes on without descending from that block.
+ * Returns -1 on I/O error or structural damage, or the first other non-zero
+ * value returned by @visit.
+ */
+int lanyfs_walk (struct lanyfs_vol *vol, uint64_t subtree, int threads,
+		 lanyfs_visit_t visit, void *arg)
+{
+	struct walk_ctx ctx;
+	struct lanyfs_pool *pool;
+	int i, n, ret = -1;
+
+	if (!subtree)
+		return 0;
+	if (threads < 1)
+		threads = 1;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.vol = vol;
+	ctx.visit = visit;
+	ctx.arg = arg;
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		return -1;
+	n = lanyfs_pool_threads(pool);
+	ctx.stacks = calloc(n, sizeof(*ctx.stacks));
+	ctx.bufs = calloc(n, sizeof(*ctx.bufs));
+	if (!ctx.stacks || !ctx.bufs)
+		goto out;
+	for (i = 0; i < n; i++) {
+		ctx.bufs[i] = lanyfs_alloc_block(vol);
+		if (!ctx.bufs[i])
+			goto out;
+	}
+	if (lanyfs_pool_submit(pool, walk_tree, &ctx, subtree))
+		goto out;
+	ret = lanyfs_pool_wait(pool);
+out:
+	lanyfs_pool_free(pool);
+	for (i = 0; ctx.stacks && i < n; i++)
+		lanyfs_addrvec_free(&ctx.stacks[i]);
+	for (i = 0; ctx.bufs && i < n; i++)
+		free(ctx.bufs[i]);
+	free(ctx.stacks);
+	free(ctx.bufs);
+	return ret;
+}
+
+/**
+ * lanyfs_default_threads() - Returns the default number of worker threads.
+ *
+ * LANYFS_THREADS in the environment overrides the number of online
+ * processors for all tools at once.
+ */
+int lanyfs_default_threads (void)
+{
+	const char *env = getenv("LANYFS_THREADS");
+	long n;
+
+	if (env && atoi(env) > 0)
+		return atoi(env);
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
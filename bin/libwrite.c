@@ -0,0 +1,427 @@
+/*
+ * libwrite.c - Image Writing for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Writing images
+ *
+ * Tools building whole images do not allocate blocks one at a time. They
+ * plan where every block goes first and then write each block exactly once,
+ * in any order and from any number of threads. The helpers here turn such
+ * a plan into blocks: a new image with its in-memory superblock, binary
+ * trees of directory contents and extender trees of files. Blocks are
+ * written with a write counter of 1, as mkfs.lanyfs does for new blocks.
+ *
+ * Data blocks holding nothing but zeros need not be written at all, a
+ * zero slot in an extender is a hole that reads as zeros. Builders test
+ * every block for zeros, which on x86 goes 128 bytes per step with AVX2
+ * where the processor has it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "liblanyfs.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define ZERO_AVX2
+#endif
+
+static pthread_once_t zero_once = PTHREAD_ONCE_INIT;
+static int zero_simd = 0;
+
+/**
+ * lanyfs_vol_create() - Creates a new image file.
+ * @path:			path of image, replaced if it exists
+ * @blocksize:			blocksize (exponent to base 2)
+ * @addrlen:			length of block addresses in bytes
+ * @blocks:			number of blocks
+ *
+ * The image is sparse, blocks never written read as zeros. The in-memory
+ * superblock is set up but has neither root directory nor free blocks
+ * chain and is written by the caller once these are in place. Block
+ * devices are used as they are and must be large enough.
+ */
+struct lanyfs_vol *lanyfs_vol_create (const char *path, int blocksize,
+				      int addrlen, uint64_t blocks)
+{
+	struct lanyfs_dev *dev;
+	struct lanyfs_vol *vol;
+	struct lanyfs_sb *sb;
+	struct stat st;
+	int fd, err;
+
+	if (addrlen < 8 && blocks > (uint64_t) 1 << (addrlen * 8)) {
+		errno = EFBIG;
+		return NULL;
+	}
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return NULL;
+	/* truncate first, so no stale overlay or archive header survives */
+	if (fstat(fd, &st) || (S_ISREG(st.st_mode) &&
+	    (ftruncate(fd, 0) || ftruncate(fd, blocks << blocksize)))) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	close(fd);
+	dev = lanyfs_dev_open(path, 0);
+	if (!dev)
+		return NULL;
+	if (dev->size < blocks << blocksize) {
+		lanyfs_dev_close(dev);
+		errno = ENOSPC;
+		return NULL;
+	}
+	vol = lanyfs_vol_forge(dev, blocksize, addrlen);
+	if (!vol) {
+		err = errno;
+		lanyfs_dev_close(dev);
+		errno = err;
+		return NULL;
+	}
+	vol->blocks = blocks;
+	sb = &vol->sb->sb;
+	sb->type = LANYFS_TYPE_SB;
+	sb->major = LANYFS_MAJOR_VERSION;
+	sb->minor = LANYFS_MINOR_VERSION;
+	sb->magic = tole32(LANYFS_SUPER_MAGIC);
+	sb->blocksize = blocksize;
+	sb->addrlen = addrlen;
+	sb->blocks = tole64(blocks);
+	sb->created = sb->updated = lanyfs_ts_now();
+	return vol;
+}
+
+/**
+ * lanyfs_node_init() - Sets up a directory or file block.
+ * @vol:			volume
+ * @b:				block buffer
+ * @type:			LANYFS_TYPE_DIR or LANYFS_TYPE_FILE
+ * @name:			name, truncated to LANYFS_NAME_LENGTH - 1
+ * @ts:				date and time of creation and modification
+ *
+ * Pointers and size are left 0 for the caller to fill in.
+ */
+void lanyfs_node_init (struct lanyfs_vol *vol, union lanyfs_b *b, int type,
+		       const char *name, struct lanyfs_ts ts)
+{
+	memset(b, 0, vol->bsize);
+	b->raw.type = type;
+	b->raw.wrcnt = tole16(1);
+	b->vi_meta.created = ts;
+	b->vi_meta.modified = ts;
+	strncpy((char *) b->vi_meta.name, name, LANYFS_NAME_LENGTH - 1);
+}
+
+/**
+ * lanyfs_ext_count() - Computes the number of extenders of a file.
+ * @vol:			volume
+ * @nblocks:			number of data blocks, holes included
+ */
+uint64_t lanyfs_ext_count (struct lanyfs_vol *vol, uint64_t nblocks)
+{
+	uint64_t slots = lanyfs_ext_slots(vol), n = 0;
+
+	if (!nblocks)
+		return 0;
+	do {
+		nblocks = (nblocks + slots - 1) / slots;
+		n += nblocks;
+	} while (nblocks > 1);
+	return n;
+}
+
+/**
+ * lanyfs_ext_build() - Writes the extender tree of a file.
+ * @vol:			volume
+ * @data:			addresses of data blocks, 0 for holes
+ * @nblocks:			number of data blocks, holes included
+ * @ext:			addresses for the extenders, as many as
+ * 				lanyfs_ext_count() returned
+ * @root:			address of root extender, 0 for empty files
+ *
+ * Extenders take the addresses of @ext in depth-first order, the root
+ * first. Every extender is written as soon as it is complete.
+ */
+int lanyfs_ext_build (struct lanyfs_vol *vol, const uint64_t *data,
+		      uint64_t nblocks, const uint64_t *ext, uint64_t *root)
+{
+	union lanyfs_b *path[LANYFS_MAX_LEVEL + 1];
+	uint64_t addr[LANYFS_MAX_LEVEL + 1], span[LANYFS_MAX_LEVEL + 1];
+	uint64_t slots = lanyfs_ext_slots(vol), next = 0, i;
+	int level, top, ret = -1;
+
+	*root = 0;
+	if (!nblocks)
+		return 0;
+	for (top = 0, span[0] = 1; span[top] * slots < nblocks; top++) {
+		if (top == LANYFS_MAX_LEVEL) {
+			errno = EFBIG;
+			return -1;
+		}
+		span[top + 1] = span[top] * slots;
+	}
+	memset(path, 0, sizeof(path));
+	for (level = 0; level <= top; level++) {
+		path[level] = lanyfs_alloc_block(vol);
+		if (!path[level])
+			goto out;
+	}
+
+	/*
+	 * One extender per level is open at a time. Data block i enters the
+	 * level 0 extender at slot i % slots, a new extender is opened below
+	 * each level whenever i crosses a multiple of that level's coverage.
+	 */
+	for (i = 0; i < nblocks; i++) {
+		for (level = top; level >= 0; level--) {
+			if (i % (span[level] * slots) && level != top)
+				continue;
+			if (i && level == top)
+				continue;
+			if (level != top) {
+				/* flush the previous extender of this level */
+				if (i && lanyfs_dev_pwrite(vol->dev,
+					path[level], vol->bsize,
+					addr[level] << vol->blocksize))
+					goto out;
+				lanyfs_slot_set(vol, &path[level + 1]->ext.stream,
+						(i / (span[level] * slots)) % slots,
+						ext[next]);
+			}
+			addr[level] = ext[next++];
+			memset(path[level], 0, vol->bsize);
+			path[level]->ext.type = LANYFS_TYPE_EXT;
+			path[level]->ext.wrcnt = tole16(1);
+			path[level]->ext.level = level;
+		}
+		lanyfs_slot_set(vol, &path[0]->ext.stream, i % slots, data[i]);
+	}
+	for (level = 0; level <= top; level++) {
+		if (lanyfs_dev_pwrite(vol->dev, path[level], vol->bsize,
+				      addr[level] << vol->blocksize))
+			goto out;
+	}
+	*root = addr[top];
+	ret = 0;
+out:
+	for (level = 0; level <= top; level++)
+		free(path[level]);
+	return ret;
+}
+
+/**
+ * zero_init() - Picks the zero test the processor supports.
+ */
+static void zero_init (void)
+{
+#ifdef ZERO_AVX2
+	__builtin_cpu_init();
+	zero_simd = __builtin_cpu_supports("avx2");
+#endif
+}
+
+/**
+ * zero_scalar() - Tests a buffer for zeros a word at a time.
+ * @p:				buffer
+ * @len:			length of buffer
+ */
+static int zero_scalar (const unsigned char *p, size_t len)
+{
+	uint64_t acc = 0, n;
+	size_t i = 0, w;
+
+	for (; i + 64 <= len; i += 64) {
+		for (w = 0; w < 64; w += 8) {
+			memcpy(&n, p + i + w, 8);
+			acc |= n;
+		}
+		if (acc)
+			return 0;
+	}
+	for (; i < len; i++)
+		acc |= p[i];
+	return !acc;
+}
+
+#ifdef ZERO_AVX2
+/**
+ * zero_avx2() - Tests a buffer for zeros 128 bytes at a time.
+ * @p:				buffer
+ * @len:			length of buffer
+ */
+__attribute__((target("avx2")))
+static int zero_avx2 (const unsigned char *p, size_t len)
+{
+	__m256i a, b;
+	size_t i = 0;
+
+	for (; i + 128 <= len; i += 128) {
+		a = _mm256_or_si256(
+			_mm256_loadu_si256((const __m256i *) (p + i)),
+			_mm256_loadu_si256((const __m256i *) (p + i + 32)));
+		b = _mm256_or_si256(
+			_mm256_loadu_si256((const __m256i *) (p + i + 64)),
+			_mm256_loadu_si256((const __m256i *) (p + i + 96)));
+		a = _mm256_or_si256(a, b);
+		if (!_mm256_testz_si256(a, a))
+			return 0;
+	}
+	return zero_scalar(p + i, len - i);
+}
+#endif
+
+/**
+ * lanyfs_is_zero() - Tests a buffer for holding nothing but zeros.
+ * @buf:			buffer
+ * @len:			length of buffer
+ *
+ * Stops at the first 128 bytes holding anything else.
+ */
+int lanyfs_is_zero (const void *buf, size_t len)
+{
+	pthread_once(&zero_once, zero_init);
+#ifdef ZERO_AVX2
+	if (zero_simd)
+		return zero_avx2(buf, len);
+#endif
+	return zero_scalar(buf, len);
+}
+
+/**
+ * lanyfs_rand() - Returns the next number of a pseudo-random sequence.
+ * @state:			state of sequence, any value to start
+ *
+ * A splitmix64 sequence, the same on every platform, so images built from
+ * the same seed come out bit for bit the same.
+ */
+uint64_t lanyfs_rand (uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/**
+ * struct btree_range - Part of a sorted node list still to be linked.
+ * @lo:				first node
+ * @hi:				one past last node
+ * @ptr:			pointer to set to the subtree root
+ */
+struct btree_range {
+	size_t			lo;
+	size_t			hi;
+	uint64_t		*ptr;
+};
+
+/**
+ * lanyfs_btree_build() - Links directory contents into a binary tree.
+ * @addrs:			addresses of nodes, sorted by name
+ * @n:				number of nodes
+ * @shape:			LANYFS_BTREE_BALANCED, _LINEAR or _RANDOM
+ * @seed:			seed of random shape
+ * @left:			left pointers, set for every node
+ * @right:			right pointers, set for every node
+ * @root:			address of root node, 0 if there are no nodes
+ *
+ * Linear trees are what inserting names in sorted order produces, random
+ * ones what inserting them in random order produces.
+ */
+int lanyfs_btree_build (const uint64_t *addrs, size_t n, int shape,
+			uint64_t seed, uint64_t *left, uint64_t *right,
+			uint64_t *root)
+{
+	struct btree_range r, *stack = NULL, *grown;
+	size_t depth = 0, cap = 0, mid;
+
+	*root = 0;
+	r.lo = 0;
+	r.hi = n;
+	r.ptr = root;
+	while (1) {
+		if (r.lo >= r.hi) {
+			if (!depth)
+				break;
+			r = stack[--depth];
+			continue;
+		}
+		switch (shape) {
+		case LANYFS_BTREE_LINEAR:
+			mid = r.lo;
+			break;
+		case LANYFS_BTREE_RANDOM:
+			mid = r.lo + lanyfs_rand(&seed) % (r.hi - r.lo);
+			break;
+		default:
+			mid = r.lo + (r.hi - r.lo) / 2;
+			break;
+		}
+		*r.ptr = addrs[mid];
+		left[mid] = right[mid] = 0;
+		/* walk down the right, come back for the left */
+		if (mid > r.lo) {
+			if (depth == cap) {
+				cap = cap ? cap * 2 : 64;
+				grown = realloc(stack, cap * sizeof(*stack));
+				if (!grown) {
+					free(stack);
+					return -1;
+				}
+				stack = grown;
+			}
+			stack[depth].lo = r.lo;
+			stack[depth].hi = mid;
+			stack[depth].ptr = &left[mid];
+			depth++;
+		}
+		r.lo = mid + 1;
+		r.ptr = &right[mid];
+	}
+	free(stack);
+	return 0;
+}
@@ -39,43 +39,33 @@
 /* -------------------------------------------------------------------------- */
 
 /**
- * DOC: Caution
+ * DOC: Byte order
  *
- * This programm works well on big and little endian architectures.
- * I have not tried with any other byte sex. However, functions
- * are already there. Just fill in the correct code for mixed endian
- * or whatever you like (have) to use.
+ * Blocks are built in host byte order and converted as a whole right before
+ * they are written, see lanyfs_canon_block(). The free blocks chains are
+ * encoded by the library once superblock and root directory are on the
+ * device, see map_free().
+ */
+
+/**
+ * DOC: Metadata zone
  *
- * The functions are named tole16(), fromle16(), tole64() and fromle64().
- * See their documenation for further details.
+ * With -z, a share of the device right after the superblock is set aside
+ * as metadata zone. It holds the root directory and gets a free blocks
+ * chain of its own, which the library takes directory, file and extender
+ * blocks from first, while data blocks come from the main chain behind the
+ * zone. Each chain's own chain blocks sit at the start of its area. Keeping
+ * metadata together makes walking the tree read a small, dense region
+ * instead of seeking across the data.
  */
 
-#include <stddef.h>		/* offsetof() */
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>		/* va_*(), vprintf() */
 #include <string.h>
 #include <unistd.h>		/* getopt() */
 #include <time.h>		/* timestamp creation */
-#ifdef __FreeBSD__
-#include <sys/endian.h>
-#define bswap_16(x) __bswap16(x)
-#define bswap_64(x) __bswap64(x)
-#define off64_t off_t
-#define fseeko64 fseeko
-#define ftello64 ftello
-#elif defined __APPLE__
-#include <libkern/OSByteOrder.h>
-#define bswap_16(x) OSSwapInt16(x)
-#define bswap_64(x) OSSwapInt64(x)
-#define off64_t off_t
-#define fseeko64 fseeko
-#define ftello64 ftello
-#else
-#include <byteswap.h>
-#endif
-
-#include "lanyfs.h"
+#include "liblanyfs.h"
 
  /* gettext support, e.g. for i18n */
 #ifdef	HAVE_GETTEXT
@@ -90,6 +80,7 @@
 #define MKLANYFS_ADDRLEN	4
 #define MKLANYFS_MIN_BLOCKS	16
 #define MKLANYFS_ROOTDIR	"LANYFSROOT"
+#define MKLANYFS_MAX_ZONE	50	/* percent of device */
 
 /* constants */
 const char *progname = "mkfs.lanyfs";
@@ -114,8 +105,10 @@ enum mklanyfs_time {
  * @blocksize:			blocksize in bytes
  * @addrlen:			address length in bytes
  * @vol_label:			volume label
+ * @zone:			percent of blocks for the metadata zone
+ * @zone_end:			first block after the metadata zone, 0 if none
  * @dev_name:			device path
- * @dev_fp:			filepointer for device
+ * @dev:			open device
  * @dev_bytes:			size of device in bytes
  * @dev_blocks:			number of blocks the device can hold
  * @dev_overhead:		number of unused bytes after last block
@@ -126,8 +119,10 @@ struct mklanyfs_cfg {
 	int			blocksize;
 	int			addrlen;
 	char			*vol_label;
+	int			zone;
+	uint64_t		zone_end;
 	char			*dev_name;
-	FILE			*dev_fp;
+	struct lanyfs_dev	*dev;
 	uint64_t		dev_bytes;
 	uint64_t		dev_blocks;
 	int			dev_overhead;
@@ -146,7 +141,6 @@ struct mklanyfs_b {
 		struct lanyfs_raw	raw;
 		struct lanyfs_sb	sb;
 		struct lanyfs_dir	dir;
-		struct lanyfs_chain	chain;
 		unsigned char		blob[(1 << LANYFS_MAX_BLOCKSIZE)];
 	} b;
 };
@@ -165,55 +159,6 @@ struct mklanyfs_b {
 		p = NULL;	\
 	} while (0)
 
-/**
- * tole16() - Convert from CPU endianess to little endian.
- * @n:				unsigned integer to convert
- */
-static inline uint16_t tole16 (uint16_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_16(n);
-	return n;
-}
-
-/**
- * fromle16() - Convert from little endian to CPU endianess.
- * @n:				unsigned integer to convert
- */
-static inline uint16_t fromle16 (uint16_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_16(n);
-	return n;
-}
-
-/**
- * tole64() - Convert from CPU endianess to little endian.
- * @n:				unsigned integer to convert
- */
-
-static inline uint64_t tole64 (uint64_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_64(n);
-	return n;
-}
-
-/**
- * fromle64() - Convert from little endian to CPU endianess.
- * @n:				unsigned integer to convert
- */
-static inline uint64_t fromle64 (uint64_t n)
-{
-	int i = 1;
-	if (!*((unsigned char *) &i) == 0x01)
-		n =  bswap_64(n);
-	return n;
-}
-
 /**
  * intlog2() - Simple logarithm check.
  * @n:				value to check
@@ -250,7 +195,7 @@ static void show_usage (void)
 	fprintf(stderr,
 		_("usage: %s"
 		  " [-v] [-l label] [-b blocksize] [-a address length]"
-		  " device\n"),
+		  " [-z zone percent] device\n"),
 		progname);
 	exit(EXIT_FAILURE);
 }
@@ -327,29 +272,14 @@ static struct lanyfs_ts make_timestamp (enum mklanyfs_time t) {
  */
 static void open_device (struct mklanyfs_cfg *cfg)
 {
-	cfg->dev_fp = fopen(cfg->dev_name, "rb+");
-	if (cfg->dev_fp) {
-		fflush(cfg->dev_fp);
-		rewind(cfg->dev_fp);
-		fseeko64(cfg->dev_fp, 0LL, SEEK_END);
-		cfg->dev_bytes = (uint64_t) ftello64(cfg->dev_fp);
-		rewind(cfg->dev_fp);
+	cfg->dev = lanyfs_dev_open(cfg->dev_name, 0);
+	if (cfg->dev) {
+		cfg->dev_bytes = cfg->dev->size;
 		cfg->dev_overhead = cfg->dev_bytes % (1 << cfg->blocksize);
 		cfg->dev_blocks = cfg->dev_bytes / (1 << cfg->blocksize);
 	}
 }
 
-/**
- * close_device() - Closes a device (or file).
- * @cfg:			configuration set containing device
- * 				information and user defined options
- */
-static void close_device (struct mklanyfs_cfg *cfg)
-{
-	fclose(cfg->dev_fp);
-	cfg->dev_fp = NULL;
-}
-
 /**
  * flush_block() - Writes a block from memory to target device.
  * @cfg:			configuration set containing device
@@ -358,16 +288,15 @@ static void close_device (struct mklanyfs_cfg *cfg)
  */
 static int flush_block (struct mklanyfs_cfg *cfg, struct mklanyfs_b *b)
 {
-	off64_t pos;
-	if (!cfg || !b || !cfg->dev_fp)
+	unsigned char blob[1 << LANYFS_MAX_BLOCKSIZE];
+	if (!cfg || !b || !cfg->dev)
 		return EXIT_FAILURE;
 	verbose("write block addr=%"PRIu64" type=0x%x", b->addr, b->b.raw.type);
-	pos = b->addr * (1 << cfg->blocksize);
-	if (fseeko(cfg->dev_fp, pos, SEEK_SET) != 0) {
-		show_error("seek error at block %"PRIu64, b->addr);
-	}
-	b->b.raw.wrcnt = tole16(fromle16(b->b.raw.wrcnt) + 1);
-	if (fwrite(b->b.blob, 1 << cfg->blocksize, 1, cfg->dev_fp) != 1) {
+	b->b.raw.wrcnt++;
+	memcpy(blob, b->b.blob, 1 << cfg->blocksize);
+	lanyfs_canon_block((union lanyfs_b *) blob);
+	if (lanyfs_dev_pwrite(cfg->dev, blob, 1 << cfg->blocksize,
+			      b->addr << cfg->blocksize)) {
 		show_error("write error at block %"PRIu64, b->addr);
 	}
 	return EXIT_SUCCESS;
@@ -405,6 +334,7 @@ static struct mklanyfs_b *allocate_superblock (struct mklanyfs_cfg *cfg,
 		b->b.sb.checked = make_timestamp(TS_NULL);
 		b->b.sb.badblocks = 0;
 		strncpy(b->b.sb.label, cfg->vol_label, LANYFS_NAME_LENGTH);
+		b->b.sb.zoneend = cfg->zone_end;
 	}
 	return b;
 }
@@ -440,105 +370,43 @@ static struct mklanyfs_b *allocate_rootdir (struct mklanyfs_cfg *cfg,
 }
 
 /**
- * allocate_chain() - Allocates a chain block in memory.
- * @cfg:			configuration set containing device
- * 				information and user defined options
- * @addr:			on-disk target address of block
- */
-static struct mklanyfs_b *allocate_chain (struct mklanyfs_cfg *cfg,
-					  uint64_t addr)
-{
-	struct mklanyfs_b *b;
-	if (!cfg)
-		return NULL;
-	verbose("allocating chain block at addr=%"PRIu64, addr);
-	b = calloc(1, sizeof(*b));
-	if (b) {
-		b->addr = addr;
-		b->b.chain.type = LANYFS_TYPE_EXT;
-		b->b.chain.wrcnt = 0;
-		b->b.chain.next = 0;
-	}
-	return b;
-}
-
-/**
- * chain_count_slots() - Returns the number of slots of extender blocks.
+ * map_free() - Encodes a range of free blocks into a free blocks chain.
  * @cfg:			configuration set containing device
  * 				information and user defined options
+ * @vol:			volume on the device
+ * @start:			first free block
+ * @end:			first block after the range
+ * @zone:			encode the metadata zone's chain
+ *
+ * The lowest blocks of the range become chain blocks, so the chain is
+ * written in a few large runs instead of one write per chain block.
  */
-static int chain_count_slots (struct mklanyfs_cfg *cfg)
-{
-	int slots = 0;
-	if (cfg) {
-		slots = (1 << cfg->blocksize);
-		slots -= offsetof(struct lanyfs_chain, stream);
-		slots /= cfg->addrlen;
-	}
-	return slots;
-}
-
-/**
- * chain_get_slot() - Returns the address stored in slot.
- * @cfg:			configuration set containing device
- * 				information and user defined options
- * @b:				extender block
- * @slot:			slot to be read
- */
-static uint64_t chain_get_slot (struct mklanyfs_cfg *cfg, struct mklanyfs_b *b,
-				unsigned int slot)
-{
-	uint64_t addr;
-	if (!cfg || !b)
-		return 0;
-	if (slot >= chain_count_slots(cfg))
-		return 0;
-	/*
-	 * this works fine on little endian machines,
-	 * remember to swap bytes before running this
-	 * code on big endian ones!
-	 */
-	addr = 0;
-	memcpy(&addr, &b->b.chain.stream + (slot * cfg->addrlen), cfg->addrlen);
-	return fromle64(addr);
-}
-
-/**
- * chain_get_free_slot() - Returns next free slot in an extender.
- * @cfg:			configuration set containing device
- * 				information and user defined options
- * @b:				extender block
- */
-static int chain_get_free_slot (struct mklanyfs_cfg *cfg, struct mklanyfs_b *b)
+static void map_free (struct mklanyfs_cfg *cfg, struct lanyfs_vol *vol,
+		      uint64_t start, uint64_t end, int zone)
 {
-	for (int i = 0; i < chain_count_slots(cfg); i++) {
-		if (!chain_get_slot(cfg, b, i))
-			return i;
+	struct lanyfs_chainenc *enc;
+	uint64_t *chains, nchains, addr;
+
+	nchains = lanyfs_chain_blocks(vol, end - start);
+	verbose("mapping blocks %"PRIu64" to %"PRIu64" into %"PRIu64
+		" chain blocks", start, end - 1, nchains);
+	chains = malloc(nchains * sizeof(*chains));
+	if (!chains)
+		show_error(_("out of memory"));
+	for (addr = 0; addr < nchains; addr++)
+		chains[addr] = start + addr;
+	enc = zone ? lanyfs_zone_begin(vol, chains, nchains) :
+		     lanyfs_chain_begin(vol, chains, nchains);
+	if (!enc)
+		show_error(_("error writing chain on %s"), cfg->dev_name);
+	for (addr = start + nchains; addr < end; addr++) {
+		if (lanyfs_chain_add(enc, addr))
+			show_error(_("error writing chain on %s"),
+				   cfg->dev_name);
 	}
-	verbose("chain block at addr=%"PRIu64" no free slot", b->addr);
-	return -1;
-}
-
-/**
- * chain_set_slot() - Sets next free slot of extender to given address.
- * @cfg:			configuration set containing device
- * 				information and user defined options
- * @b:				extender block
- * @addr:			target address
- */
-static int chain_set_slot (struct mklanyfs_cfg *cfg, struct mklanyfs_b *b,
-			   uint64_t addr)
-{
-	int slot;
-	if (!cfg || !b)
-		return -1;
-	slot = chain_get_free_slot(cfg, b);
-	if (slot < 0)
-		return -1;
-	verbose("chain block at addr=%"PRIu64" slot=%d target=%"PRIu64, b->addr, slot, addr);
-	addr = tole64(addr);
-	memcpy(&b->b.chain.stream + (slot * cfg->addrlen), &addr, cfg->addrlen);
-	return 0;
+	if (lanyfs_chain_end(enc))
+		show_error(_("error writing chain on %s"), cfg->dev_name);
+	free(chains);
 }
 
 /* -------------------------------------------------------------------------- */
@@ -548,20 +416,24 @@ int main (int argc, char *argv[])
 	/* essentials */
 	struct mklanyfs_b *super;
 	struct mklanyfs_b *root;
-	struct mklanyfs_b *chain;
+	struct lanyfs_vol *vol;
 	uint64_t current = LANYFS_SUPERBLOCK + 1;
-	uint64_t freeblocks = 0;
+	uint64_t rootdir;
 
 	/* fill configuration set with defaults */
 	struct mklanyfs_cfg cfg;
 	cfg.blocksize = MKLANYFS_BLOCKSIZE;
 	cfg.addrlen = MKLANYFS_ADDRLEN;
 	cfg.vol_label = MKLANYFS_LABEL;
+	cfg.zone = 0;
+	cfg.zone_end = 0;
 
 	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
 	/* parse command line options */
 	int c;
-	while ((c = getopt(argc, argv, "a:b:l:v")) != -1) {
+	while ((c = getopt(argc, argv, "a:b:l:vz:")) != -1) {
 		int tmp;
 		switch (c) {
 		case 'a':
@@ -590,6 +462,14 @@ int main (int argc, char *argv[])
 		case 'v':
 			v = 1;
 			break;
+		case 'z':
+			tmp = atoi(optarg);
+			if (tmp >= 0 && tmp <= MKLANYFS_MAX_ZONE) {
+				cfg.zone = tmp;
+			} else {
+				show_error(_("invalid metadata zone size"));
+			}
+			break;
 		default:
 			show_usage();
 			break;
@@ -603,7 +483,7 @@ int main (int argc, char *argv[])
 
 	/* open device */
 	open_device(&cfg);
-	if (cfg.dev_fp == NULL) {
+	if (cfg.dev == NULL) {
 		show_error(_("error opening device %s"), cfg.dev_name);
 	}
 	if (cfg.dev_blocks < MKLANYFS_MIN_BLOCKS) {
@@ -624,6 +504,16 @@ int main (int argc, char *argv[])
 		       cfg.dev_overhead);
 	}
 
+	/* the zone needs room for root directory and a chain block */
+	if (cfg.zone) {
+		cfg.zone_end = current + cfg.dev_blocks * cfg.zone / 100;
+		if (cfg.zone_end < current + 2)
+			show_error(_("metadata zone of %d%% holds less than "
+				     "2 blocks"), cfg.zone);
+		printf(_("metadata zone: %"PRIu64" blocks\n"),
+		       cfg.zone_end - current);
+	}
+
 	/* write superblock */
 	super = allocate_superblock(&cfg, LANYFS_SUPERBLOCK);
 	if (!super) {
@@ -631,9 +521,7 @@ int main (int argc, char *argv[])
 	}
 	printf(_("writing superblock\n"));
 	flush_block(&cfg, super);
-
-	/* TODO: write badblocks chain */
-	super->b.sb.badblocks = 0;
+	free_null(super);
 
 	/* create root directory */
 	root = allocate_rootdir(&cfg, current++);
@@ -642,54 +530,35 @@ int main (int argc, char *argv[])
 	}
 	printf(_("creating root directory\n"));
 	flush_block(&cfg, root);
-	super->b.sb.rootdir = root->addr;
+	rootdir = root->addr;
 	free_null(root);
 
-	/* write first chain block for free blocks */
-	chain = allocate_chain(&cfg, current++);
-	if (!chain) {
-		show_error("error allocating chain");
-	}
-	super->b.sb.freehead = chain->addr;
-	freeblocks++;
+	/* the library takes over the device from here */
+	vol = lanyfs_vol_attach(cfg.dev);
+	if (!vol)
+		show_error(_("error reading superblock from %s"),
+			   cfg.dev_name);
+	vol->sb->sb.rootdir = tole64(rootdir);
+
+	/* TODO: write badblocks chain */
+	vol->sb->sb.badblocks = 0;
 
 	/* map remaining free space */
 	printf(_("mapping free space\n"));
-	printf(_("\r\t%"PRIu64"/%"PRIu64), current, cfg.dev_blocks);
-	fflush(stdout);
-	while (current < cfg.dev_blocks) {
-		if (chain_get_free_slot(&cfg, chain) < 0) {
-			chain->b.chain.next = current;
-			flush_block(&cfg, chain);
-			free_null(chain);
-			chain = allocate_chain(&cfg, current++);
-			if (!chain)
-				show_error("error allocating chain");
-			freeblocks++;
-			printf(_("\r\t%"PRIu64"/%"PRIu64), current, cfg.dev_blocks);
-			if (v)
-				printf("\n");
-			continue;
-		}
-		chain_set_slot(&cfg, chain, current++);
-		freeblocks++;
-		if (v)
-			printf(_("\r\t%"PRIu64"/%"PRIu64"\n"), current, cfg.dev_blocks);
+	if (cfg.zone_end) {
+		map_free(&cfg, vol, current, cfg.zone_end, 1);
+		current = cfg.zone_end;
 	}
-	printf(_("\r\t%"PRIu64"/%"PRIu64"\n"), current, cfg.dev_blocks);
-	super->b.sb.freetail = chain->addr;
-	super->b.sb.freeblocks = freeblocks;
-	flush_block(&cfg, chain);
-	free_null(chain);
+	map_free(&cfg, vol, current, vol->blocks, 0);
 
 	/* update superblock */
 	printf(_("updating superblock\n"));
-	super->b.sb.updated = make_timestamp(TS_NOW);
-	flush_block(&cfg, super);
-	free_null(super);
+	if (lanyfs_write_sb(vol))
+		show_error(_("error writing superblock to %s"), cfg.dev_name);
 
 	/* close device */
-	close_device(&cfg);
+	if (lanyfs_vol_close(vol))
+		show_error(_("error closing device %s"), cfg.dev_name);
 
 	printf(_("all done\n"));
 	return EXIT_SUCCESS;
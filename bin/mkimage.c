@@ -0,0 +1,1559 @@
+/*
+ * mkimage.c - Build Lanyard Filesystem Images from Directories.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Building images
+ *
+ * The source directory is scanned once, breadth first, into a flat list of
+ * nodes in which the entries of every directory follow each other sorted
+ * by name. Names, sizes, dates and attributes are taken from the source,
+ * entries other than directories and regular files are skipped.
+ *
+ * With a codec, files are packed into chunks first, in parallel, each
+ * worker appending to a spool file of its own. Files that do not shrink by
+ * at least one block are stored as they are.
+ *
+ * Files stored as they are get their all-zero blocks found in the same
+ * pass, skipping what the source itself has as holes. Those blocks become
+ * holes in the image: zero addresses in the extenders, or no extenders at
+ * all past the last block holding data.
+ *
+ * Addresses are then planned as gen.lanyfs plans them: depth-first, every
+ * directory followed by its files, every file block followed by its
+ * extenders and data blocks. The nodes are written by all threads, data
+ * coming from the spool or straight from the source. The blocks after the
+ * last one in use become the free blocks chain.
+ */
+
+/**
+ * DOC: Updating images
+ *
+ * With -u the image is updated in place. The source is scanned as before,
+ * then every source directory is matched by name against its counterpart
+ * in the image. Files of the same size and date of last modification are
+ * taken to be unchanged. With -C they are compared against the image
+ * instead, whatever their dates, so a file touched but not changed only
+ * gets its date rewritten.
+ *
+ * Changed files keep their file block, new directories and files get fresh
+ * blocks, and all their extenders and data blocks are taken off the head of
+ * the free blocks chain. On images formatted with a metadata zone, see
+ * mkfs.lanyfs -z, directory, file and extender blocks come from the zone's
+ * chain as long as it lasts. A directory gaining or losing entries has its
+ * binary tree rebuilt, which rewrites the entries' blocks but not their
+ * data. Blocks of removed entries and the old data of changed files are
+ * appended to the chain once everything else is written, the superblock
+ * goes last. Blocks are rewritten in place, so an interrupted update
+ * leaves an image to be built anew.
+ */
+
+#define _GNU_SOURCE		/* asprintf() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>		/* getopt() */
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "mkimage.lanyfs";
+const char *progdate = "December 2012";
+#define MKIMAGE_ROOTDIR		"LANYFSROOT"
+#define MKIMAGE_BATCH		64	/* nodes handed out at once */
+#define MKIMAGE_META		0x01	/* dates and attributes */
+#define MKIMAGE_LINKS		0x02	/* binary tree pointers */
+#define MKIMAGE_SUB		0x04	/* binary tree root of entries */
+#define MKIMAGE_DATA		0x08	/* extenders and data */
+#define MKIMAGE_CHECK		0x10	/* data to be compared first */
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct mk_node - Directory or file to be written.
+ * @path:			path of source
+ * @name:			name, within @path
+ * @type:			LANYFS_TYPE_DIR or LANYFS_TYPE_FILE
+ * @first:			first entry of a directory in the node list
+ * @n:				number of entries of a directory
+ * @size:			size of a file
+ * @stored:			length of a file's data stream
+ * @spool:			spool holding the data stream, -1 for the source
+ * @spoff:			offset of data stream within spool
+ * @holes:			bitmap of data blocks left as holes, NULL for none
+ * @nholes:			number of data blocks left as holes
+ * @span:			number of data blocks covered by extenders
+ * @ts:				date of last modification
+ * @attr:			attributes
+ * @addr:			address of directory or file block
+ * @left:			left pointer
+ * @right:			right pointer
+ * @sub:			binary tree root of a directory's entries
+ * @prev:			block found in the image being updated
+ * @dirty:			parts of a block found to rewrite, MKIMAGE_*
+ * @take:			index of first extender in the blocks taken
+ */
+struct mk_node {
+	char			*path;
+	const char		*name;
+	int			type;
+	uint64_t		first;
+	uint64_t		n;
+	uint64_t		size;
+	uint64_t		stored;
+	int			spool;
+	uint64_t		spoff;
+	uint64_t		*holes;
+	uint64_t		nholes;
+	uint64_t		span;
+	struct lanyfs_ts	ts;
+	uint16_t		attr;
+	uint64_t		addr;
+	uint64_t		left;
+	uint64_t		right;
+	uint64_t		sub;
+	int			prev;
+	int			dirty;
+	uint64_t		take;
+};
+
+/**
+ * struct mk_image - Image being built.
+ * @nodes:			directories and files, the root first
+ * @n:				number of nodes
+ * @cap:			number of nodes allocated
+ * @codec:			codec of compressed files, LANYFS_CODEC_NONE for
+ * 				none
+ * @chunk:			size of chunks (exponent to base 2)
+ * @sparse:			leave all-zero blocks as holes
+ * @spools:			spool file of each worker, -1 until used
+ * @blocksize:			blocksize (exponent to base 2)
+ * @used:			first block after the last block in use
+ * @run:			data blocks written at once, the batch size of
+ * 				the device
+ * @update:			update an image in place
+ * @compare:			compare files of unchanged size by content
+ * @taken:			blocks taken off the free blocks chain
+ * @freed:			blocks to be appended to the free blocks chain
+ */
+struct mk_image {
+	struct mk_node		*nodes;
+	uint64_t		n;
+	uint64_t		cap;
+	int			codec;
+	int			chunk;
+	int			sparse;
+	int			*spools;
+	int			blocksize;
+	uint64_t		used;
+	uint64_t		run;
+	int			update;
+	int			compare;
+	uint64_t		*taken;
+	struct lanyfs_addrvec	freed;
+};
+
+/**
+ * struct mk_worker - Buffers of a pool worker.
+ * @img:			image
+ * @vol:			volume, NULL while packing a new image
+ * @tmpdir:			directory of spool files
+ * @spend:			end of worker's spool
+ * @b:				block buffer
+ * @run:			buffer of a run of data blocks
+ * @data:			data block addresses of current file
+ * @cap:			number of addresses allocated
+ * @plain:			chunk read from source
+ * @packed:			chunk compressed, or read from the image
+ */
+struct mk_worker {
+	struct mk_image		*img;
+	struct lanyfs_vol	*vol;
+	const char		*tmpdir;
+	uint64_t		spend;
+	union lanyfs_b		*b;
+	unsigned char		*run;
+	uint64_t		*data;
+	uint64_t		cap;
+	unsigned char		*plain;
+	unsigned char		*packed;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * intlog2() - Simple logarithm check.
+ * @n:				value to check
+ */
+static int intlog2 (unsigned int n)
+{
+	int b = 0;
+	while (n) {
+		if (n & 1) {
+			if (n > 1)
+				return -1;
+			return b;
+		}
+		n >>= 1;
+		b++;
+	}
+	return -1;
+}
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-j threads] [-b blocksize] [-a addrlen] "
+		  "[-c codec] [-k chunksize] [-s spare] [-l label] "
+		  "[-t tmpdir] [-z] source image\n"
+		  "       %s -u [-v] [-C] [-j threads] [-c codec] "
+		  "[-k chunksize] [-l label] [-t tmpdir] [-z] source image\n"),
+		progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * make_ts() - Converts a time to a LanyFS timestamp.
+ * @t:				time, in UTC
+ */
+static struct lanyfs_ts make_ts (struct timespec t)
+{
+	struct lanyfs_ts ts;
+	struct tm tm;
+
+	memset(&ts, 0, sizeof(ts));
+	gmtime_r(&t.tv_sec, &tm);
+	ts.year = tole16(tm.tm_year + 1900);
+	ts.mon = tm.tm_mon + 1;
+	ts.day = tm.tm_mday;
+	ts.hour = tm.tm_hour;
+	ts.min = tm.tm_min;
+	ts.sec = tm.tm_sec;
+	ts.nsec = tole32(t.tv_nsec);
+	return ts;
+}
+
+/**
+ * add_node() - Appends a node for a source directory or file.
+ * @img:			image
+ * @path:			path of source, taken over
+ * @name:			name, within @path
+ * @st:				status of source
+ */
+static void add_node (struct mk_image *img, char *path, const char *name,
+		      const struct stat *st)
+{
+	struct mk_node *node;
+
+	if (img->n == img->cap) {
+		img->cap = img->cap ? img->cap * 2 : 1024;
+		node = realloc(img->nodes, img->cap * sizeof(*node));
+		if (!node)
+			show_error(_("out of memory"));
+		img->nodes = node;
+	}
+	node = &img->nodes[img->n++];
+	memset(node, 0, sizeof(*node));
+	node->path = path;
+	node->name = name;
+	node->type = S_ISDIR(st->st_mode) ? LANYFS_TYPE_DIR : LANYFS_TYPE_FILE;
+	node->size = node->stored = S_ISREG(st->st_mode) ? st->st_size : 0;
+	node->spool = -1;
+	node->ts = make_ts(st->st_mtim);
+	if (!(st->st_mode & S_IWUSR))
+		node->attr |= LANYFS_ATTR_NOWRITE;
+	if (S_ISREG(st->st_mode) && !(st->st_mode & S_IXUSR))
+		node->attr |= LANYFS_ATTR_NOEXEC;
+	if (name[0] == '.')
+		node->attr |= LANYFS_ATTR_HIDDEN;
+}
+
+/**
+ * cmp_node() - Orders nodes by name, for qsort().
+ * @a:				first node
+ * @b:				second node
+ */
+static int cmp_node (const void *a, const void *b)
+{
+	return strcmp(((const struct mk_node *) a)->name,
+		      ((const struct mk_node *) b)->name);
+}
+
+/**
+ * scan_source() - Lists the source tree into the node list.
+ * @img:			image
+ * @source:			source directory
+ *
+ * The list itself is the queue of directories still to be listed.
+ */
+static void scan_source (struct mk_image *img, const char *source)
+{
+	struct dirent *de;
+	struct stat st;
+	uint64_t d;
+	char *path;
+	DIR *dir;
+
+	path = strdup(source);
+	if (!path)
+		show_error(_("out of memory"));
+	if (stat(path, &st))
+		show_error(_("error reading %s: %s"), path, strerror(errno));
+	if (!S_ISDIR(st.st_mode))
+		show_error(_("%s is not a directory"), path);
+	add_node(img, path, MKIMAGE_ROOTDIR, &st);
+	for (d = 0; d < img->n; d++) {
+		if (img->nodes[d].type != LANYFS_TYPE_DIR)
+			continue;
+		dir = opendir(img->nodes[d].path);
+		if (!dir)
+			show_error(_("error reading %s: %s"),
+				   img->nodes[d].path, strerror(errno));
+		img->nodes[d].first = img->n;
+		while ((de = readdir(dir))) {
+			if (!strcmp(de->d_name, ".") ||
+			    !strcmp(de->d_name, ".."))
+				continue;
+			if (asprintf(&path, "%s/%s", img->nodes[d].path,
+				     de->d_name) < 0)
+				show_error(_("out of memory"));
+			if (lstat(path, &st))
+				show_error(_("error reading %s: %s"), path,
+					   strerror(errno));
+			if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+				fprintf(stderr, _("%s: skipping %s\n"),
+					progname, path);
+				free(path);
+				continue;
+			}
+			if (strlen(de->d_name) >= LANYFS_NAME_LENGTH)
+				show_error(_("name too long: %s"), path);
+			add_node(img, path, strrchr(path, '/') + 1, &st);
+		}
+		closedir(dir);
+		img->nodes[d].n = img->n - img->nodes[d].first;
+		qsort(img->nodes + img->nodes[d].first, img->nodes[d].n,
+		      sizeof(*img->nodes), cmp_node);
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * blocks() - Returns the number of blocks holding a number of bytes.
+ * @img:			image
+ * @len:			number of bytes
+ */
+static uint64_t blocks (struct mk_image *img, uint64_t len)
+{
+	return (len + ((uint64_t) 1 << img->blocksize) - 1) >> img->blocksize;
+}
+
+/**
+ * pack_file() - Packs a file into chunks on the worker's spool.
+ * @w:				worker
+ * @worker:			index of worker
+ * @node:			file
+ *
+ * The chunk index goes first and is written last. Files not saving a
+ * block are left to be copied from the source.
+ */
+static int pack_file (struct mk_worker *w, int worker, struct mk_node *node)
+{
+	struct mk_image *img = w->img;
+	size_t len = (size_t) 1 << img->chunk, clen, n;
+	uint64_t nchunks, *idx, pos, k;
+	int fd, ret = -1;
+
+	nchunks = (node->size + len - 1) >> img->chunk;
+	idx = malloc((nchunks + 1) * sizeof(*idx));
+	fd = open(node->path, O_RDONLY);
+	if (!idx || fd < 0)
+		goto out;
+	if (img->spools[worker] < 0) {
+		img->spools[worker] = lanyfs_tmpfile(w->tmpdir);
+		if (img->spools[worker] < 0)
+			goto out;
+	}
+	pos = (nchunks + 1) * sizeof(*idx);
+	for (k = 0; k < nchunks; k++) {
+		clen = node->size - (k << img->chunk) < len ?
+		       node->size - (k << img->chunk) : len;
+		if (lanyfs_fd_pread(fd, w->plain, clen, k << img->chunk))
+			goto out;
+		/* chunks not shrinking are stored as they are */
+		n = lanyfs_compress(img->codec, w->plain, clen, w->packed,
+				    clen - 1);
+		if (lanyfs_fd_pwrite(img->spools[worker], n ? w->packed :
+				     w->plain, n ? n : clen, w->spend + pos))
+			goto out;
+		idx[k] = tole64(pos);
+		pos += n ? n : clen;
+	}
+	idx[nchunks] = tole64(pos);
+	ret = 0;
+	if (blocks(img, pos) >= blocks(img, node->size))
+		goto out;
+	ret = -1;
+	if (lanyfs_fd_pwrite(img->spools[worker], idx,
+			     (nchunks + 1) * sizeof(*idx), w->spend))
+		goto out;
+	node->spool = worker;
+	node->spoff = w->spend;
+	node->stored = pos;
+	node->attr |= LANYFS_ATTR_COMPRESSED;
+	w->spend += pos;
+	ret = 0;
+
+out:
+	if (fd >= 0)
+		close(fd);
+	free(idx);
+	return ret;
+}
+
+/**
+ * is_hole() - Tells whether a data block of a file is left as a hole.
+ * @node:			file
+ * @i:				index of data block
+ */
+static int is_hole (const struct mk_node *node, uint64_t i)
+{
+	return node->holes && (node->holes[i >> 6] >> (i & 63) & 1);
+}
+
+/**
+ * add_hole() - Marks a data block of a file as a hole.
+ * @img:			image
+ * @node:			file
+ * @i:				index of data block
+ */
+static int add_hole (struct mk_image *img, struct mk_node *node, uint64_t i)
+{
+	if (!node->holes) {
+		node->holes = calloc((blocks(img, node->size) + 63) >> 6,
+				     sizeof(*node->holes));
+		if (!node->holes)
+			return -1;
+	}
+	node->holes[i >> 6] |= (uint64_t) 1 << (i & 63);
+	node->nholes++;
+	return 0;
+}
+
+/**
+ * find_holes() - Finds the all-zero blocks of a file stored as it is.
+ * @w:				worker
+ * @node:			file
+ *
+ * Ranges the source reports as holes are not read at all. Sources not
+ * reporting holes are read in full.
+ */
+static int find_holes (struct mk_worker *w, struct mk_node *node)
+{
+	struct mk_image *img = w->img;
+	uint64_t bsize = (uint64_t) 1 << img->blocksize, off = 0, k, n;
+	off_t data;
+	size_t len;
+	int fd, ret = -1;
+
+	fd = open(node->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	while (off < node->size) {
+		data = lseek(fd, off, SEEK_DATA);
+		if (data < 0)
+			data = errno == ENXIO ? node->size : off;
+		data &= ~(bsize - 1);
+		for (; off < (uint64_t) data && off < node->size; off += bsize)
+			if (add_hole(img, node, off >> img->blocksize))
+				goto out;
+		if (off >= node->size)
+			break;
+		len = node->size - off < (uint64_t) 1 << img->chunk ?
+		      node->size - off : (size_t) 1 << img->chunk;
+		if (lanyfs_fd_pread(fd, w->plain, len, off))
+			goto out;
+		for (k = 0; k < len; k += bsize) {
+			n = len - k < bsize ? len - k : bsize;
+			if (lanyfs_is_zero(w->plain + k, n) &&
+			    add_hole(img, node, (off + k) >> img->blocksize))
+				goto out;
+		}
+		off += len;
+	}
+	/* trailing holes need no extenders */
+	node->span = blocks(img, node->size);
+	while (node->span && is_hole(node, node->span - 1))
+		node->span--;
+	ret = 0;
+
+out:
+	close(fd);
+	return ret;
+}
+
+/**
+ * same_file() - Compares a file against its counterpart in the image.
+ * @w:				worker
+ * @node:			file found in the image, of the same size
+ *
+ * Returns 1 if the contents match, 0 if not or -1 on error.
+ */
+static int same_file (struct mk_worker *w, struct mk_node *node)
+{
+	struct lanyfs_fh *fh;
+	size_t len = (size_t) 1 << w->img->chunk, n;
+	uint64_t off;
+	int fd, ret = -1;
+
+	fd = open(node->path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	fh = lanyfs_open_addr(w->vol, node->addr);
+	if (!fh)
+		goto out;
+	for (off = 0; off < node->size; off += n) {
+		n = node->size - off < len ? node->size - off : len;
+		if (lanyfs_fd_pread(fd, w->plain, n, off) ||
+		    lanyfs_pread(fh, w->packed, n, off) != (ssize_t) n)
+			goto out;
+		if (memcmp(w->plain, w->packed, n)) {
+			ret = 0;
+			goto out;
+		}
+	}
+	ret = 1;
+
+out:
+	if (fh)
+		lanyfs_close(fh);
+	close(fd);
+	return ret;
+}
+
+/**
+ * pack_batch() - Pool task packing a batch of files.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			array of struct mk_worker, one per worker
+ * @first:			first node of batch
+ *
+ * Files not packed are searched for holes instead. When updating, files
+ * left to be compared are compared first and files kept are skipped.
+ */
+static int pack_batch (struct lanyfs_pool *pool, int worker, void *arg,
+		       uint64_t first)
+{
+	struct mk_worker *w = (struct mk_worker *) arg + worker;
+	struct mk_image *img = w->img;
+	struct mk_node *node;
+	uint64_t i;
+	int same;
+
+	for (i = first; i < first + MKIMAGE_BATCH && i < img->n; i++) {
+		node = &img->nodes[i];
+		if (node->type != LANYFS_TYPE_FILE)
+			continue;
+		if (node->dirty & MKIMAGE_CHECK) {
+			same = same_file(w, node);
+			if (same < 0)
+				return -1;
+			node->dirty &= ~MKIMAGE_CHECK;
+			if (!same)
+				node->dirty |= MKIMAGE_DATA;
+		}
+		if (!node->size ||
+		    (node->prev && !(node->dirty & MKIMAGE_DATA)))
+			continue;
+		if (img->codec != LANYFS_CODEC_NONE &&
+		    pack_file(w, worker, node))
+			return -1;
+		if (img->sparse && !(node->attr & LANYFS_ATTR_COMPRESSED) &&
+		    find_holes(w, node))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * plan_btrees() - Links the entries of every directory.
+ * @img:			image with addresses assigned
+ *
+ * Directories found in the image are relinked only if they gained or lost
+ * entries.
+ */
+static void plan_btrees (struct mk_image *img)
+{
+	uint64_t *addrs, *left, *right, d, i, max = 0;
+	struct mk_node *dir, *ent;
+
+	for (d = 0; d < img->n; d++)
+		max = img->nodes[d].n > max ? img->nodes[d].n : max;
+	addrs = malloc((max + 1) * sizeof(*addrs));
+	left = malloc((max + 1) * sizeof(*left));
+	right = malloc((max + 1) * sizeof(*right));
+	if (!addrs || !left || !right)
+		show_error(_("out of memory"));
+	for (d = 0; d < img->n; d++) {
+		dir = &img->nodes[d];
+		if (dir->type != LANYFS_TYPE_DIR ||
+		    (dir->prev && !(dir->dirty & MKIMAGE_SUB)))
+			continue;
+		for (i = 0; i < dir->n; i++)
+			addrs[i] = img->nodes[dir->first + i].addr;
+		if (lanyfs_btree_build(addrs, dir->n, LANYFS_BTREE_BALANCED,
+				       0, left, right, &dir->sub))
+			show_error(_("out of memory"));
+		for (i = 0; i < dir->n; i++) {
+			ent = &img->nodes[dir->first + i];
+			ent->left = left[i];
+			ent->right = right[i];
+		}
+	}
+	free(addrs);
+	free(left);
+	free(right);
+}
+
+/**
+ * plan_image() - Assigns addresses to all blocks.
+ * @img:			image, scanned and packed
+ * @vol:			volume of the image's geometry, for slot counts
+ */
+static void plan_image (struct mk_image *img, struct lanyfs_vol *vol)
+{
+	struct lanyfs_addrvec stack = {NULL, 0, 0};
+	struct mk_node *dir, *ent;
+	uint64_t cur = LANYFS_SUPERBLOCK + 1, nblocks, i;
+
+	/* depth-first, every directory followed by its files */
+	if (lanyfs_addrvec_push(&stack, 0))
+		show_error(_("out of memory"));
+	while (stack.n) {
+		dir = &img->nodes[stack.a[--stack.n]];
+		dir->addr = cur++;
+		for (i = 0; i < dir->n; i++) {
+			ent = &img->nodes[dir->first + i];
+			if (ent->type != LANYFS_TYPE_FILE)
+				continue;
+			nblocks = blocks(img, ent->stored);
+			if (!ent->holes)
+				ent->span = nblocks;
+			ent->addr = cur++;
+			cur += lanyfs_ext_count(vol, ent->span) + nblocks -
+			       ent->nholes;
+		}
+		for (i = dir->n; i > 0; i--) {
+			if (img->nodes[dir->first + i - 1].type ==
+			    LANYFS_TYPE_DIR &&
+			    lanyfs_addrvec_push(&stack, dir->first + i - 1))
+				show_error(_("out of memory"));
+		}
+	}
+	lanyfs_addrvec_free(&stack);
+	img->used = cur;
+	plan_btrees(img);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * collect_ext() - Collects extender and data blocks of a file.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			address vector
+ */
+static int collect_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+			uint64_t iblock, void *arg)
+{
+	return lanyfs_addrvec_push(arg, addr);
+}
+
+/**
+ * collect_node() - Collects a directory or file block and its extenders.
+ * @vol:			volume
+ * @worker:			index of calling worker
+ * @addr:			address of block
+ * @b:				the block
+ * @arg:			address vector
+ */
+static int collect_node (struct lanyfs_vol *vol, int worker, uint64_t addr,
+			 union lanyfs_b *b, void *arg)
+{
+	if (lanyfs_addrvec_push(arg, addr))
+		return -1;
+	if (b->raw.type == LANYFS_TYPE_FILE)
+		return lanyfs_ext_walk(vol, fromle64(b->file.data),
+				       collect_ext, arg);
+	return 0;
+}
+
+/**
+ * collect_gone() - Collects all blocks of an entry gone from the source.
+ * @img:			image
+ * @vol:			volume
+ * @addr:			address of directory or file block
+ * @b:				block buffer
+ */
+static void collect_gone (struct mk_image *img, struct lanyfs_vol *vol,
+			  uint64_t addr, union lanyfs_b *b)
+{
+	if (lanyfs_read_block(vol, addr, b) ||
+	    lanyfs_addrvec_push(&img->freed, addr) ||
+	    (b->raw.type == LANYFS_TYPE_DIR ?
+	     lanyfs_walk(vol, fromle64(b->dir.subtree), 1, collect_node,
+			 &img->freed) :
+	     lanyfs_ext_walk(vol, fromle64(b->file.data), collect_ext,
+			     &img->freed)))
+		show_error(_("error walking block %"PRIu64": %s"), addr,
+			   strerror(errno));
+}
+
+/**
+ * match_entry() - Decides what to rewrite of an entry found in the image.
+ * @img:			image
+ * @ent:			entry of the source
+ * @e:				entry of the image, of the same name and type
+ */
+static void match_entry (struct mk_image *img, struct mk_node *ent,
+			 const struct lanyfs_dirent *e)
+{
+	int redated = memcmp(&ent->ts, &e->modified, sizeof(ent->ts));
+
+	ent->prev = 1;
+	ent->addr = e->addr;
+	/* compression is a matter of the data, not of the source */
+	if (redated || ent->attr != (e->attr & ~LANYFS_ATTR_COMPRESSED))
+		ent->dirty |= MKIMAGE_META;
+	if (ent->type != LANYFS_TYPE_FILE)
+		return;
+	if (ent->size != e->size)
+		ent->dirty |= MKIMAGE_DATA;
+	else if (!ent->size)
+		return;
+	else if (img->compare)
+		ent->dirty |= MKIMAGE_CHECK;
+	else if (redated)
+		ent->dirty |= MKIMAGE_DATA;
+}
+
+/**
+ * match_dir() - Matches the entries of a directory found in the image.
+ * @img:			image
+ * @vol:			volume
+ * @dir:			directory found in the image
+ * @b:				block buffer
+ *
+ * Entries found in the image but not in the source, or of another type,
+ * are collected for freeing. Gaining or losing entries marks the
+ * directory's binary tree for rebuilding.
+ */
+static void match_dir (struct mk_image *img, struct lanyfs_vol *vol,
+		       struct mk_node *dir, union lanyfs_b *b)
+{
+	struct lanyfs_dirent e;
+	struct lanyfs_fh *fh;
+	struct mk_node key, *ent;
+	uint64_t pos = 0, i;
+	int ret;
+
+	fh = lanyfs_open_addr(vol, dir->addr);
+	if (!fh)
+		show_error(_("error reading directory at block %"PRIu64": %s"),
+			   dir->addr, strerror(errno));
+	while ((ret = lanyfs_readdir(fh, &pos, &e)) > 0) {
+		key.name = e.name;
+		ent = bsearch(&key, img->nodes + dir->first, dir->n,
+			      sizeof(*ent), cmp_node);
+		if (!ent || ent->type != e.type || ent->prev) {
+			verbose("removing %s/%s", dir->path, e.name);
+			collect_gone(img, vol, e.addr, b);
+			dir->dirty |= MKIMAGE_SUB;
+			continue;
+		}
+		match_entry(img, ent, &e);
+	}
+	if (ret < 0)
+		show_error(_("error reading directory at block %"PRIu64": %s"),
+			   dir->addr, strerror(errno));
+	lanyfs_close(fh);
+	for (i = 0; i < dir->n; i++) {
+		if (!img->nodes[dir->first + i].prev)
+			dir->dirty |= MKIMAGE_SUB;
+	}
+	if (!(dir->dirty & MKIMAGE_SUB))
+		return;
+	for (i = 0; i < dir->n; i++)
+		img->nodes[dir->first + i].dirty |= MKIMAGE_LINKS;
+}
+
+/**
+ * match_image() - Matches the source against the image being updated.
+ * @img:			image, scanned
+ * @vol:			volume
+ *
+ * The node list is in breadth-first order, so every directory is matched
+ * after its parent. Directories new to the image hold nothing but new
+ * entries and are not looked at.
+ */
+static void match_image (struct mk_image *img, struct lanyfs_vol *vol)
+{
+	struct lanyfs_dirent e;
+	struct mk_node *root = &img->nodes[0];
+	union lanyfs_b *b;
+	uint64_t d;
+
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		show_error(_("out of memory"));
+	memset(&e, 0, sizeof(e));
+	e.addr = fromle64(vol->sb->sb.rootdir);
+	if (lanyfs_read_block(vol, e.addr, b) ||
+	    b->raw.type != LANYFS_TYPE_DIR)
+		show_error(_("root directory not found"));
+	e.type = LANYFS_TYPE_DIR;
+	e.attr = fromle16(b->dir.meta.attr);
+	e.modified = b->dir.meta.modified;
+	match_entry(img, root, &e);
+	for (d = 0; d < img->n; d++) {
+		if (img->nodes[d].type == LANYFS_TYPE_DIR &&
+		    img->nodes[d].prev)
+			match_dir(img, vol, &img->nodes[d], b);
+	}
+	free(b);
+}
+
+/**
+ * plan_update() - Assigns addresses to all blocks to be written.
+ * @img:			image, matched and packed
+ * @vol:			volume
+ *
+ * The old data of changed files is collected before anything is written.
+ * The blocks needed are then taken off the chains at once, directory, file
+ * and extender blocks preferably from the metadata zone and data blocks
+ * from the main chain, and the superblock is written, so they are never
+ * both in use and free.
+ */
+static void plan_update (struct mk_image *img, struct lanyfs_vol *vol)
+{
+	struct mk_node *node;
+	union lanyfs_b *b;
+	uint64_t need = 0, meta = 0, nblocks, *addrs, i, k, m, d, n;
+
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		show_error(_("out of memory"));
+	for (i = 0; i < img->n; i++) {
+		node = &img->nodes[i];
+		if (node->type == LANYFS_TYPE_FILE && node->prev &&
+		    node->dirty & MKIMAGE_DATA &&
+		    (lanyfs_read_block(vol, node->addr, b) ||
+		     lanyfs_ext_walk(vol, fromle64(b->file.data), collect_ext,
+				     &img->freed)))
+			show_error(_("error walking %s: %s"), node->path,
+				   strerror(errno));
+	}
+	free(b);
+	/* a block claimed twice means the image is damaged */
+	lanyfs_addrvec_sort(&img->freed);
+	for (i = 1; i < img->freed.n; i++) {
+		if (img->freed.a[i] == img->freed.a[i - 1])
+			show_error(_("block %"PRIu64" claimed twice, "
+				     "image needs checking"), img->freed.a[i]);
+	}
+
+	for (i = 0; i < img->n; i++) {
+		node = &img->nodes[i];
+		meta += !node->prev;
+		if (node->type != LANYFS_TYPE_FILE ||
+		    (node->prev && !(node->dirty & MKIMAGE_DATA)))
+			continue;
+		nblocks = blocks(img, node->stored);
+		if (!node->holes)
+			node->span = nblocks;
+		meta += lanyfs_ext_count(vol, node->span);
+		need += nblocks - node->nholes;
+	}
+	need += meta;
+	img->taken = malloc((need + 1) * sizeof(*img->taken));
+	addrs = malloc((need + 1) * sizeof(*addrs));
+	if (!img->taken || !addrs)
+		show_error(_("out of memory"));
+	/* once enough blocks are free in both chains, neither take fails */
+	if (fromle64(vol->sb->sb.freeblocks) +
+	    fromle64(vol->sb->sb.zoneblocks) < need) {
+		errno = ENOSPC;
+		show_error(_("error taking %"PRIu64" free blocks: %s"), need,
+			   strerror(errno));
+	}
+	if (lanyfs_meta_take(vol, addrs, meta) ||
+	    lanyfs_free_take(vol, addrs + meta, need - meta))
+		show_error(_("error taking %"PRIu64" free blocks: %s"), need,
+			   strerror(errno));
+	if (lanyfs_write_sb(vol))
+		show_error(_("error writing superblock: %s"), strerror(errno));
+
+	/* extenders come first among a file's blocks, data follows */
+	for (i = 0, k = 0, m = 0, d = meta; i < img->n; i++) {
+		node = &img->nodes[i];
+		if (!node->prev)
+			node->addr = addrs[m++];
+		if (node->type != LANYFS_TYPE_FILE ||
+		    (node->prev && !(node->dirty & MKIMAGE_DATA)))
+			continue;
+		node->take = k;
+		for (n = lanyfs_ext_count(vol, node->span); n; n--)
+			img->taken[k++] = addrs[m++];
+		for (n = blocks(img, node->stored) - node->nholes; n; n--)
+			img->taken[k++] = addrs[d++];
+	}
+	free(addrs);
+	img->used = need;
+	plan_btrees(img);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * write_block() - Writes a block planned at an address.
+ * @vol:			volume
+ * @addr:			address
+ * @b:				block
+ */
+static int write_block (struct lanyfs_vol *vol, uint64_t addr, const void *b)
+{
+	return lanyfs_dev_pwrite(vol->dev, b, vol->bsize,
+				 addr << vol->blocksize);
+}
+
+/**
+ * node_block() - Returns the address of an extender or data block of a file.
+ * @img:			image
+ * @node:			file
+ * @k:				index among the file's extenders and data blocks
+ */
+static uint64_t node_block (struct mk_image *img, struct mk_node *node,
+			    uint64_t k)
+{
+	return img->update ? img->taken[node->take + k] : node->addr + 1 + k;
+}
+
+/**
+ * load_node() - Prepares the block of a directory or file.
+ * @w:				worker
+ * @node:			directory or file
+ *
+ * A block found in the image is read and keeps its name, date of creation
+ * and write counter, and its binary tree pointers unless relinked.
+ */
+static int load_node (struct mk_worker *w, struct mk_node *node)
+{
+	union lanyfs_b *b = w->b;
+	uint16_t keep = 0;
+
+	if (!node->prev) {
+		lanyfs_node_init(w->vol, b, node->type, node->name, node->ts);
+	} else {
+		if (lanyfs_read_block(w->vol, node->addr, b))
+			return -1;
+		if (b->raw.type != node->type) {
+			errno = EIO;
+			return -1;
+		}
+		if (!(node->dirty & MKIMAGE_DATA))
+			keep = fromle16(b->vi_meta.attr) &
+			       LANYFS_ATTR_COMPRESSED;
+		b->vi_meta.modified = node->ts;
+	}
+	b->vi_meta.attr = tole16(node->attr | keep);
+	if (!node->prev || node->dirty & MKIMAGE_LINKS) {
+		b->vi_btree.left = tole64(node->left);
+		b->vi_btree.right = tole64(node->right);
+	}
+	return 0;
+}
+
+/**
+ * store_node() - Writes the block of a directory or file.
+ * @w:				worker
+ * @node:			directory or file
+ *
+ * Blocks found in the image have their write counter advanced.
+ */
+static int store_node (struct mk_worker *w, struct mk_node *node)
+{
+	if (node->prev)
+		return lanyfs_write_block(w->vol, node->addr, w->b);
+	return write_block(w->vol, node->addr, w->b);
+}
+
+/**
+ * write_data() - Writes the data blocks of a file.
+ * @w:				worker
+ * @node:			file, data block addresses in the worker's buffer
+ *
+ * Data comes from the spool if the file was packed, from the source
+ * otherwise. A source that shrank since it was scanned fails with EIO.
+ */
+static int write_data (struct mk_worker *w, struct mk_node *node)
+{
+	struct mk_image *img = w->img;
+	struct lanyfs_vol *vol = w->vol;
+	uint64_t nblocks = node->span, pos, i, n;
+	size_t len;
+	int fd, ret = -1;
+
+	if (node->spool >= 0) {
+		fd = img->spools[node->spool];
+		pos = node->spoff;
+	} else {
+		fd = open(node->path, O_RDONLY);
+		if (fd < 0)
+			return -1;
+		pos = 0;
+	}
+	/* consecutive data blocks between holes go out a run at a time */
+	for (i = 0; i < nblocks; i += n) {
+		n = 1;
+		if (!w->data[i])
+			continue;
+		while (n < img->run && i + n < nblocks &&
+		       w->data[i + n] == w->data[i] + n)
+			n++;
+		len = node->stored - (i << vol->blocksize) <
+		      n << vol->blocksize ?
+		      node->stored - (i << vol->blocksize) :
+		      n << vol->blocksize;
+		if (lanyfs_fd_pread(fd, w->run, len,
+				    pos + (i << vol->blocksize)))
+			goto out;
+		memset(w->run + len, 0, (n << vol->blocksize) - len);
+		if (lanyfs_dev_pwrite(vol->dev, w->run, n << vol->blocksize,
+				      w->data[i] << vol->blocksize))
+			goto out;
+	}
+	ret = 0;
+
+out:
+	if (node->spool < 0)
+		close(fd);
+	return ret;
+}
+
+/**
+ * write_file() - Writes a file, its extenders and its data.
+ * @w:				worker
+ * @node:			file
+ *
+ * Holes are skipped, the remaining data blocks follow the extenders. The
+ * file block goes last, so a file found in the image points to its old
+ * data until the new data is written.
+ */
+static int write_file (struct mk_worker *w, struct mk_node *node)
+{
+	struct mk_image *img = w->img;
+	struct lanyfs_vol *vol = w->vol;
+	uint64_t nblocks, *ext, *grown, root, cur, i, n;
+
+	if (node->prev && !(node->dirty & MKIMAGE_DATA))
+		return load_node(w, node) || store_node(w, node) ? -1 : 0;
+	nblocks = node->span;
+	n = lanyfs_ext_count(vol, nblocks);
+	if (nblocks + n > w->cap) {
+		grown = realloc(w->data, (nblocks + n) * sizeof(*w->data));
+		if (!grown)
+			return -1;
+		w->data = grown;
+		w->cap = nblocks + n;
+	}
+	ext = w->data + nblocks;
+	for (i = 0; i < n; i++)
+		ext[i] = node_block(img, node, i);
+	cur = n;
+	for (i = 0; i < nblocks; i++)
+		w->data[i] = is_hole(node, i) ? 0 : node_block(img, node, cur++);
+	if (lanyfs_ext_build(vol, w->data, nblocks, ext, &root))
+		return -1;
+	if (nblocks && write_data(w, node))
+		return -1;
+
+	if (load_node(w, node))
+		return -1;
+	w->b->file.data = tole64(root);
+	w->b->file.size = tole64(node->size);
+	w->b->file.stored = 0;
+	w->b->file.codec = LANYFS_CODEC_NONE;
+	w->b->file.chunk = 0;
+	if (node->attr & LANYFS_ATTR_COMPRESSED) {
+		w->b->file.stored = tole64(node->stored);
+		w->b->file.codec = img->codec;
+		w->b->file.chunk = img->chunk;
+	}
+	return store_node(w, node);
+}
+
+/**
+ * write_dir() - Writes a directory block.
+ * @w:				worker
+ * @node:			directory
+ */
+static int write_dir (struct mk_worker *w, struct mk_node *node)
+{
+	if (load_node(w, node))
+		return -1;
+	if (!node->prev || node->dirty & MKIMAGE_SUB)
+		w->b->dir.subtree = tole64(node->sub);
+	return store_node(w, node);
+}
+
+/**
+ * write_batch() - Pool task writing a batch of directories and files.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			array of struct mk_worker, one per worker
+ * @first:			first node of batch
+ */
+static int write_batch (struct lanyfs_pool *pool, int worker, void *arg,
+			uint64_t first)
+{
+	struct mk_worker *w = (struct mk_worker *) arg + worker;
+	struct mk_image *img = w->img;
+	uint64_t i;
+
+	for (i = first; i < first + MKIMAGE_BATCH && i < img->n; i++) {
+		if (img->nodes[i].prev && !img->nodes[i].dirty)
+			continue;
+		if (img->nodes[i].type == LANYFS_TYPE_DIR ?
+		    write_dir(w, &img->nodes[i]) :
+		    write_file(w, &img->nodes[i]))
+			return -1;
+	}
+	return 0;
+}
+
+/**
+ * write_free() - Writes the free blocks chain.
+ * @img:			image
+ * @vol:			volume
+ *
+ * All blocks after the last block in use are free, the lowest hold the
+ * chain. Returns the number of free blocks.
+ */
+static uint64_t write_free (struct mk_image *img, struct lanyfs_vol *vol)
+{
+	struct lanyfs_chainenc *enc;
+	uint64_t nfree = vol->blocks - img->used, m, k;
+	uint64_t *chains;
+
+	m = lanyfs_chain_blocks(vol, nfree);
+	if (!m)
+		return 0;
+	chains = malloc(m * sizeof(*chains));
+	if (!chains)
+		show_error(_("out of memory"));
+	for (k = 0; k < m; k++)
+		chains[k] = img->used + k;
+	enc = lanyfs_chain_begin(vol, chains, m);
+	if (!enc)
+		show_error(_("error writing free blocks chain: %s"),
+			   strerror(errno));
+	for (k = img->used + m; k < vol->blocks; k++) {
+		if (lanyfs_chain_add(enc, k))
+			show_error(_("error writing free blocks chain: %s"),
+				   strerror(errno));
+	}
+	if (lanyfs_chain_end(enc))
+		show_error(_("error writing free blocks chain: %s"),
+			   strerror(errno));
+	free(chains);
+	return nfree;
+}
+
+/**
+ * run_pool() - Hands out all nodes in batches to a pool task.
+ * @pool:			pool
+ * @task:			task
+ * @workers:			array of struct mk_worker, one per worker
+ * @n:				number of nodes
+ */
+static int run_pool (struct lanyfs_pool *pool, lanyfs_task_t task,
+		     struct mk_worker *workers, uint64_t n)
+{
+	uint64_t first;
+
+	for (first = 0; first < n; first += MKIMAGE_BATCH)
+		if (lanyfs_pool_submit(pool, task, workers, first))
+			break;
+	return lanyfs_pool_wait(pool) || first < n ? -1 : 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct mk_image img;
+	struct mk_worker *workers;
+	struct lanyfs_vol *vol = NULL, *geo;
+	struct lanyfs_pool *pool;
+	const char *tmpdir = NULL;
+	char label[LANYFS_NAME_LENGTH];
+	uint64_t spare = 1024, nfree, files = 0, packed = 0, stored = 0;
+	uint64_t size = 0, holes = 0, fresh = 0, changed = 0, relinked = 0;
+	int threads = lanyfs_default_threads(), jset = 0, blocksize = 12;
+	int addrlen = 4, packers, i, n;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&img, 0, sizeof(img));
+	img.codec = LANYFS_CODEC_NONE;
+	img.chunk = LANYFS_CHUNK_SHIFT;
+	img.sparse = 1;
+	memset(label, 0, sizeof(label));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "a:b:c:j:k:l:s:t:uvzC")) != -1) {
+		switch (c) {
+		case 'a':
+			addrlen = atoi(optarg);
+			if (addrlen < LANYFS_MIN_ADDRLEN ||
+			    addrlen > LANYFS_MAX_ADDRLEN)
+				show_error(_("invalid address length"));
+			break;
+		case 'b':
+			blocksize = intlog2(atoi(optarg));
+			if (blocksize < LANYFS_MIN_BLOCKSIZE ||
+			    blocksize > LANYFS_MAX_BLOCKSIZE)
+				show_error(_("invalid blocksize"));
+			break;
+		case 'c':
+			img.codec = lanyfs_codec_parse(optarg);
+			if (img.codec < 0)
+				show_error(_("unknown codec %s"), optarg);
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			jset = 1;
+			break;
+		case 'k':
+			img.chunk = intlog2(atoi(optarg));
+			if (img.chunk < LANYFS_MIN_CHUNK_SHIFT ||
+			    img.chunk > LANYFS_MAX_CHUNK_SHIFT)
+				show_error(_("invalid chunk size"));
+			break;
+		case 'l':
+			strncpy(label, optarg, LANYFS_NAME_LENGTH - 1);
+			break;
+		case 's':
+			spare = strtoull(optarg, NULL, 0);
+			break;
+		case 't':
+			tmpdir = optarg;
+			break;
+		case 'u':
+			img.update = 1;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		case 'z':
+			img.sparse = 0;
+			break;
+		case 'C':
+			img.compare = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 != argc || (img.compare && !img.update))
+		show_usage();
+	if (img.update) {
+		vol = lanyfs_vol_open(argv[optind + 1], 0);
+		if (!vol)
+			show_error(_("error opening image %s: %s"),
+				   argv[optind + 1], strerror(errno));
+		blocksize = vol->blocksize;
+		if (!jset)
+			threads = lanyfs_dev_threads(vol->dev, threads);
+	}
+	img.blocksize = blocksize;
+
+	printf(_("scanning %s\n"), argv[optind]);
+	scan_source(&img, argv[optind]);
+	if (img.update) {
+		printf(_("matching %s\n"), argv[optind + 1]);
+		match_image(&img, vol);
+	}
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		show_error(_("error starting threads: %s"), strerror(errno));
+	n = lanyfs_pool_threads(pool);
+	workers = calloc(n, sizeof(*workers));
+	packers = n;
+	img.spools = malloc(n * sizeof(*img.spools));
+	if (!workers || !img.spools)
+		show_error(_("out of memory"));
+	for (i = 0; i < n; i++) {
+		img.spools[i] = -1;
+		workers[i].img = &img;
+		workers[i].vol = vol;
+		workers[i].tmpdir = tmpdir;
+	}
+	if (img.codec != LANYFS_CODEC_NONE || img.sparse || img.compare) {
+		if (img.codec != LANYFS_CODEC_NONE)
+			printf(_("packing files with %s\n"),
+			       lanyfs_codec_name(img.codec));
+		else
+			printf(_("finding zero blocks\n"));
+		for (i = 0; i < n; i++) {
+			workers[i].plain = malloc((size_t) 1 << img.chunk);
+			if (img.codec != LANYFS_CODEC_NONE || img.compare)
+				workers[i].packed =
+					malloc((size_t) 1 << img.chunk);
+			if (!workers[i].plain ||
+			    ((img.codec != LANYFS_CODEC_NONE || img.compare) &&
+			     !workers[i].packed))
+				show_error(_("out of memory"));
+		}
+		if (run_pool(pool, pack_batch, workers, img.n))
+			show_error(_("error packing files: %s"),
+				   strerror(errno));
+	}
+	lanyfs_pool_free(pool);
+
+	if (img.update) {
+		plan_update(&img, vol);
+	} else {
+		/* plan on a volume of the right geometry but no device */
+		geo = calloc(1, sizeof(*geo));
+		if (!geo)
+			show_error(_("out of memory"));
+		geo->blocksize = blocksize;
+		geo->bsize = (size_t) 1 << blocksize;
+		geo->addrlen = addrlen;
+		plan_image(&img, geo);
+		free(geo);
+	}
+	for (i = 0; (uint64_t) i < img.n; i++) {
+		fresh += !img.nodes[i].prev;
+		changed += img.nodes[i].prev &&
+			   img.nodes[i].dirty & MKIMAGE_DATA;
+		relinked += img.nodes[i].prev && img.nodes[i].dirty &&
+			    !(img.nodes[i].dirty & MKIMAGE_DATA);
+		if (img.nodes[i].type != LANYFS_TYPE_FILE)
+			continue;
+		files++;
+		size += img.nodes[i].size;
+		stored += img.nodes[i].stored;
+		packed += !!(img.nodes[i].attr & LANYFS_ATTR_COMPRESSED);
+		holes += img.nodes[i].nholes;
+	}
+	if (!img.update)
+		verbose("%"PRIu64" files of %"PRIu64" bytes, %"PRIu64" packed, "
+			"%"PRIu64" bytes stored, %"PRIu64" blocks left as "
+			"holes, %"PRIu64" blocks in use", files, size, packed,
+			stored, holes, img.used);
+
+	if (img.update) {
+		verbose("%"PRIu64" new, %"PRIu64" changed, %"PRIu64" "
+			"rewritten in place, %"PRIu64" blocks taken, %zu blocks "
+			"to be freed", fresh, changed, relinked, img.used,
+			img.freed.n);
+	} else {
+		vol = lanyfs_vol_create(argv[optind + 1], blocksize, addrlen,
+					img.used + spare);
+		if (!vol)
+			show_error(_("error creating image %s: %s"),
+				   argv[optind + 1], strerror(errno));
+	}
+	img.run = lanyfs_dev_batch(vol->dev) >> vol->blocksize;
+	if (!img.run)
+		img.run = 1;
+	if (!jset)
+		threads = lanyfs_dev_threads(vol->dev, threads);
+	printf(_("writing %"PRIu64" blocks with %d threads\n"),
+	       img.update ? img.used : vol->blocks, threads);
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		show_error(_("error starting threads: %s"), strerror(errno));
+	/* spools stay with the workers that packed them */
+	if (lanyfs_pool_threads(pool) > n) {
+		workers = realloc(workers, lanyfs_pool_threads(pool) *
+				  sizeof(*workers));
+		if (!workers)
+			show_error(_("out of memory"));
+		memset(workers + n, 0, (lanyfs_pool_threads(pool) - n) *
+		       sizeof(*workers));
+		for (i = n; i < lanyfs_pool_threads(pool); i++)
+			workers[i].img = &img;
+		n = lanyfs_pool_threads(pool);
+	}
+	for (i = 0; i < n; i++) {
+		workers[i].vol = vol;
+		workers[i].b = lanyfs_alloc_block(vol);
+		/* aligned, runs may go out bypassing the page cache */
+		if (posix_memalign((void **) &workers[i].run, 4096,
+				   img.run * vol->bsize))
+			workers[i].run = NULL;
+		if (!workers[i].b || !workers[i].run)
+			show_error(_("out of memory"));
+	}
+	if (run_pool(pool, write_batch, workers, img.n))
+		show_error(_("error writing image: %s"), strerror(errno));
+	lanyfs_pool_free(pool);
+
+	if (img.update) {
+		/* old blocks are freed once nothing points to them */
+		if (lanyfs_dev_sync(vol->dev))
+			show_error(_("error writing image: %s"),
+				   strerror(errno));
+		if (lanyfs_free_append(vol, img.freed.a, img.freed.n))
+			show_error(_("error freeing blocks: %s"),
+				   strerror(errno));
+		if (label[0])
+			strncpy(vol->sb->sb.label, label, LANYFS_NAME_LENGTH);
+		nfree = fromle64(vol->sb->sb.freeblocks) +
+			fromle64(vol->sb->sb.zoneblocks);
+		if (lanyfs_write_sb(vol) || lanyfs_dev_sync(vol->dev))
+			show_error(_("error writing superblock: %s"),
+				   strerror(errno));
+	} else {
+		nfree = write_free(&img, vol);
+		vol->sb->sb.rootdir = tole64(img.nodes[0].addr);
+		vol->sb->sb.wrcnt = tole16(1);
+		strncpy(vol->sb->sb.label, label, LANYFS_NAME_LENGTH);
+		if (lanyfs_dev_pwrite(vol->dev, vol->sb, vol->bsize, 0) ||
+		    lanyfs_dev_sync(vol->dev))
+			show_error(_("error writing superblock: %s"),
+				   strerror(errno));
+	}
+	printf(_("%"PRIu64" directories, %"PRIu64" files, %"PRIu64" free "
+		 "blocks\n"), img.n - files, files, nfree);
+	if (lanyfs_vol_close(vol))
+		show_error(_("error closing image: %s"), strerror(errno));
+
+	for (i = 0; i < packers; i++) {
+		if (img.spools[i] >= 0)
+			close(img.spools[i]);
+	}
+	for (i = 0; i < n; i++) {
+		free(workers[i].b);
+		free(workers[i].run);
+		free(workers[i].data);
+		free(workers[i].plain);
+		free(workers[i].packed);
+	}
+	for (i = 0; (uint64_t) i < img.n; i++) {
+		free(img.nodes[i].path);
+		free(img.nodes[i].holes);
+	}
+	free(img.nodes);
+	free(img.spools);
+	free(img.taken);
+	lanyfs_addrvec_free(&img.freed);
+	free(workers);
+	return EXIT_SUCCESS;
+}
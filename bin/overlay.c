@@ -0,0 +1,204 @@
+/*
+ * overlay.c - Manage Copy-on-Write Overlays of Lanyard Filesystem Images.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "overlay.lanyfs";
+const char *progdate = "December 2012";
+
+/**
+ * enum ovlanyfs_mode - Operation to perform.
+ * @MODE_INFO:			report on overlay
+ * @MODE_CREATE:		create overlay on top of base
+ * @MODE_COMMIT:		write modifications back to base
+ * @MODE_RESET:			drop modifications
+ */
+enum ovlanyfs_mode {
+	MODE_INFO,
+	MODE_CREATE,
+	MODE_COMMIT,
+	MODE_RESET,
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * intlog2() - Simple logarithm check.
+ * @n:				value to check
+ */
+static int intlog2 (unsigned int n)
+{
+	int b = 0;
+	while (n) {
+		if (n & 1) {
+			if (n > 1)
+				return -1;
+			return b;
+		}
+		n >>= 1;
+		b++;
+	}
+	return -1;
+}
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-g granule] -c base overlay\n"
+		  "       %s -m overlay\n"
+		  "       %s -r overlay\n"
+		  "       %s overlay\n"),
+		progname, progname, progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	enum ovlanyfs_mode mode = MODE_INFO;
+	char *base = NULL, *path;
+	char real[LANYFS_OVERLAY_PATHLEN];
+	uint64_t gsize, total, present;
+	int shift = LANYFS_OVERLAY_SHIFT;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "c:g:mr")) != -1) {
+		switch (c) {
+		case 'c':
+			mode = MODE_CREATE;
+			base = optarg;
+			break;
+		case 'g':
+			shift = intlog2(atoi(optarg));
+			if (shift < LANYFS_MIN_BLOCKSIZE || shift > 30)
+				show_error(_("invalid granule size"));
+			break;
+		case 'm':
+			mode = MODE_COMMIT;
+			break;
+		case 'r':
+			mode = MODE_RESET;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 1 != argc)
+		show_usage();
+	path = argv[optind];
+
+	switch (mode) {
+	case MODE_CREATE:
+		if (lanyfs_overlay_create(base, path, shift))
+			show_error(_("error creating overlay %s: %s"), path,
+				   strerror(errno));
+		printf(_("created overlay %s on top of %s\n"), path, base);
+		break;
+	case MODE_COMMIT:
+	case MODE_RESET:
+		if (lanyfs_overlay_merge(path, mode == MODE_COMMIT, &present))
+			show_error(_("error merging overlay %s: %s"), path,
+				   strerror(errno));
+		if (mode == MODE_COMMIT)
+			printf(_("committed %"PRIu64" granules\n"), present);
+		else
+			printf(_("dropped %"PRIu64" granules\n"), present);
+		break;
+	case MODE_INFO:
+	default:
+		if (lanyfs_overlay_stat(path, real, &gsize, &total, &present))
+			show_error(_("error reading overlay %s: %s"), path,
+				   strerror(errno));
+		printf(_("base: %s\n"), real);
+		printf(_("granule size: %"PRIu64" bytes\n"), gsize);
+		printf(_("granules: %"PRIu64"\n"), total);
+		printf(_("modified granules: %"PRIu64"\n"), present);
+		break;
+	}
+	return EXIT_SUCCESS;
+}
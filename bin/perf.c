@@ -0,0 +1,944 @@
+/*
+ * perf.c - Benchmark Suite for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Benchmark suite
+ *
+ * Every run formats a scratch image with mkfs.lanyfs, detects it with
+ * detectfs.lanyfs and times a handful of library primitives in process.
+ * The tools are run as child processes, so their start-up cost is part of
+ * the result just as it is for a user. Each primitive is timed over a fixed
+ * number of operations and reported per operation.
+ *
+ * Effective read throughput of compressed files is measured against the
+ * same files stored raw: a source directory of text is built into two
+ * images by mkimage.lanyfs, once with LZ4 and once without, and each run
+ * reads all files back through the library after dropping the images from
+ * the page cache, as far as the kernel lets it.
+ *
+ * Traversal speed is measured on two images formatted by mkfs.lanyfs, one
+ * of them with a metadata zone. Both are filled by mkimage.lanyfs -u one
+ * directory at a time, as a volume ages, so without a zone every update
+ * leaves its metadata between the data of the updates before and after.
+ * Each run walks all directory, file and extender blocks of both images,
+ * again after dropping them from the page cache.
+ *
+ * Every metric gets one sample per run. The samples are written as JSON
+ * for compare.lanyfs, which needs several runs per side to tell a real
+ * change from noise. Results of several invocations may be appended to the
+ * same file.
+ */
+
+#define _GNU_SOURCE		/* asprintf() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>		/* getopt(), fork(), execv() */
+#include <sys/stat.h>		/* mkdir() */
+#include <sys/wait.h>
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "perf.lanyfs";
+const char *progdate = "December 2012";
+#define RUNS_DEFAULT		10	/* samples per metric */
+#define SIZE_DEFAULT		64	/* scratch image size in MiB */
+#define SLOT_OPS		(1 << 22)	/* slot reads or writes timed */
+#define READ_OPS		(1 << 14)	/* block reads timed */
+#define CANON_BLOCKS		(1 << 10)	/* blocks converted at once */
+#define CANON_ROUNDS		64	/* conversions timed */
+#define CMAP_OPS		(1 << 20)	/* bits set timed */
+#define CODEC_LEN		(1 << 16)	/* bytes compressed at once */
+#define CODEC_ROUNDS		64	/* compressions timed */
+#define LAT_OPS			(1 << 20)	/* latencies recorded timed */
+#define FILES_N			16	/* files built into images */
+#define FILES_LEN		(1 << 20)	/* bytes per file */
+#define TREE_DIRS		32	/* directories, one update each */
+#define TREE_FILES		16	/* files per directory */
+#define TREE_LEN		(1 << 16)	/* bytes per file */
+#define TREE_SIZE		64	/* traversal image size in MiB */
+#define TREE_ZONE		"15"	/* metadata zone in percent */
+
+/* global variables */
+int v = 0;
+
+/**
+ * enum perf_metric - Metrics of the suite.
+ */
+enum perf_metric {
+	PERF_MKFS,
+	PERF_DETECTFS,
+	PERF_READ_BLOCK,
+	PERF_SLOT_GET,
+	PERF_SLOT_SET,
+	PERF_CANON,
+	PERF_CMAP_SET,
+	PERF_LZ4_COMPRESS,
+	PERF_LZ4_DECOMPRESS,
+	PERF_LAT_RECORD,
+	PERF_READ_RAW,
+	PERF_READ_LZ4,
+	PERF_WALK_PLAIN,
+	PERF_WALK_ZONE,
+	PERF_METRICS
+};
+
+/**
+ * struct perf_info - Description of a metric.
+ * @name:			name, key in the results
+ * @unit:			unit of samples
+ * @lower:			lower values are better
+ */
+struct perf_info {
+	const char		*name;
+	const char		*unit;
+	int			lower;
+};
+
+static const struct perf_info perf_info[PERF_METRICS] = {
+	[PERF_MKFS]		= { "mkfs",		"ms",		1 },
+	[PERF_DETECTFS]		= { "detectfs",		"ms",		1 },
+	[PERF_READ_BLOCK]	= { "read_block",	"ns/op",	1 },
+	[PERF_SLOT_GET]		= { "slot_get",		"ns/op",	1 },
+	[PERF_SLOT_SET]		= { "slot_set",		"ns/op",	1 },
+	[PERF_CANON]		= { "canon_blocks",	"ns/block",	1 },
+	[PERF_CMAP_SET]		= { "cmap_set",		"ns/op",	1 },
+	[PERF_LZ4_COMPRESS]	= { "lz4_compress",	"MiB/s",	0 },
+	[PERF_LZ4_DECOMPRESS]	= { "lz4_decompress",	"MiB/s",	0 },
+	[PERF_LAT_RECORD]	= { "lat_record",	"ns/op",	1 },
+	[PERF_READ_RAW]		= { "read_raw",		"MiB/s",	0 },
+	[PERF_READ_LZ4]		= { "read_lz4",		"MiB/s",	0 },
+	[PERF_WALK_PLAIN]	= { "walk_plain",	"ms",		1 },
+	[PERF_WALK_ZONE]	= { "walk_zone",	"ms",		1 },
+};
+
+/**
+ * struct perf_suite - State of the suite.
+ * @tooldir:			directory of the tools, NULL to search PATH
+ * @image:			path of scratch image
+ * @source:			directory of files built into images
+ * @raw:			path of image holding files raw
+ * @lz4:			path of image holding files compressed
+ * @tree:			directory of files built into traversal images
+ * @plain:			path of traversal image without metadata zone
+ * @zoned:			path of traversal image with metadata zone
+ * @size:			size of scratch image in bytes
+ * @runs:			number of runs
+ * @samples:			samples, runs per metric
+ * @seed:			state of random sequence
+ */
+struct perf_suite {
+	char			*tooldir;
+	char			*image;
+	char			*source;
+	char			*raw;
+	char			*lz4;
+	char			*tree;
+	char			*plain;
+	char			*zoned;
+	uint64_t		size;
+	int			runs;
+	double			*samples[PERF_METRICS];
+	uint64_t		seed;
+};
+
+/* keeps results of timed loops alive */
+volatile uint64_t perf_sink;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-r runs] [-s size] [-d directory] "
+		  "[-o file]\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ *
+ * Goes to stderr, stdout may carry the results.
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		fprintf(stderr, _("info: "));
+		va_start(arg, fmt);
+		vfprintf(stderr, fmt, arg);
+		va_end(arg);
+		fprintf(stderr, "\n");
+	}
+}
+
+/**
+ * run_tool() - Runs a tool of the package and returns its run time.
+ * @suite:			suite
+ * @tool:			name of tool
+ * @argv:			arguments, argv[0] is replaced
+ *
+ * Output of the tool is discarded. Exits program if the tool fails.
+ */
+static double run_tool (struct perf_suite *suite, const char *tool,
+			char *argv[])
+{
+	char path[4096];
+	uint64_t start;
+	pid_t pid;
+	int status, fd;
+
+	if (suite->tooldir)
+		snprintf(path, sizeof(path), "%s/%s", suite->tooldir, tool);
+	else
+		snprintf(path, sizeof(path), "%s", tool);
+	argv[0] = path;
+	start = lanyfs_lat_now();
+	pid = fork();
+	if (pid < 0)
+		show_error(_("error starting %s: %s"), tool, strerror(errno));
+	if (!pid) {
+		fd = open("/dev/null", O_RDWR);
+		if (fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+		}
+		if (suite->tooldir)
+			execv(path, argv);
+		else
+			execvp(path, argv);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0)
+		show_error(_("error waiting for %s: %s"), tool,
+			   strerror(errno));
+	if (!WIFEXITED(status) || WEXITSTATUS(status))
+		show_error(_("%s failed on %s"), path, suite->image);
+	return (lanyfs_lat_now() - start) / 1e6;
+}
+
+/**
+ * run_tools() - Times formatting and detecting the scratch image.
+ * @suite:			suite
+ * @run:			number of run
+ */
+static void run_tools (struct perf_suite *suite, int run)
+{
+	char *argv[3];
+
+	argv[1] = suite->image;
+	argv[2] = NULL;
+	suite->samples[PERF_MKFS][run] = run_tool(suite, "mkfs.lanyfs", argv);
+	suite->samples[PERF_DETECTFS][run] = run_tool(suite,
+						      "detectfs.lanyfs", argv);
+}
+
+/**
+ * run_read() - Times reading random blocks of the scratch image.
+ * @suite:			suite
+ * @vol:			volume on scratch image
+ * @buf:			block buffer
+ * @run:			number of run
+ */
+static void run_read (struct perf_suite *suite, struct lanyfs_vol *vol,
+		      void *buf, int run)
+{
+	uint64_t start, i;
+
+	start = lanyfs_lat_now();
+	for (i = 0; i < READ_OPS; i++) {
+		if (lanyfs_read_block(vol, lanyfs_rand(&suite->seed) %
+				      vol->blocks, buf))
+			show_error(_("error reading %s: %s"), suite->image,
+				   strerror(errno));
+	}
+	suite->samples[PERF_READ_BLOCK][run] =
+		(double) (lanyfs_lat_now() - start) / READ_OPS;
+}
+
+/**
+ * run_slots() - Times reading and writing addresses of chain blocks.
+ * @suite:			suite
+ * @vol:			volume on scratch image
+ * @buf:			block buffer
+ * @run:			number of run
+ */
+static void run_slots (struct perf_suite *suite, struct lanyfs_vol *vol,
+		       union lanyfs_b *buf, int run)
+{
+	unsigned char *stream = &buf->chain.stream;
+	int slots = lanyfs_chain_slots(vol);
+	uint64_t start, sum = 0, i;
+
+	start = lanyfs_lat_now();
+	for (i = 0; i < SLOT_OPS; i++)
+		lanyfs_slot_set(vol, stream, i % slots, i);
+	suite->samples[PERF_SLOT_SET][run] =
+		(double) (lanyfs_lat_now() - start) / SLOT_OPS;
+	start = lanyfs_lat_now();
+	for (i = 0; i < SLOT_OPS; i++)
+		sum += lanyfs_slot_get(vol, stream, i % slots);
+	suite->samples[PERF_SLOT_GET][run] =
+		(double) (lanyfs_lat_now() - start) / SLOT_OPS;
+	perf_sink += sum;
+}
+
+/**
+ * run_canon() - Times byte order conversion of directory blocks.
+ * @suite:			suite
+ * @vol:			volume on scratch image
+ * @blocks:			CANON_BLOCKS blocks to convert
+ * @run:			number of run
+ *
+ * Only run where LANYFS_SWAP is 1, elsewhere conversion does nothing and
+ * the metric is left out of the results.
+ */
+static void run_canon (struct perf_suite *suite, struct lanyfs_vol *vol,
+		       void *blocks, int run)
+{
+	uint64_t start;
+	int i;
+
+	start = lanyfs_lat_now();
+	for (i = 0; i < CANON_ROUNDS; i++)
+		lanyfs_canon_blocks(LANYFS_TYPE_DIR, blocks, CANON_BLOCKS,
+				    vol->bsize);
+	suite->samples[PERF_CANON][run] = (double) (lanyfs_lat_now() - start)
+					  / ((uint64_t) CANON_ROUNDS *
+					     CANON_BLOCKS);
+}
+
+/**
+ * run_cmap() - Times setting random bits of a concurrent bitmap.
+ * @suite:			suite
+ * @run:			number of run
+ */
+static void run_cmap (struct perf_suite *suite, int run)
+{
+	struct lanyfs_cmap *map;
+	uint64_t start, i;
+
+	map = lanyfs_cmap_new(CMAP_OPS * 8);
+	if (!map)
+		show_error(_("out of memory"));
+	start = lanyfs_lat_now();
+	for (i = 0; i < CMAP_OPS; i++)
+		lanyfs_cmap_set(map, lanyfs_rand(&suite->seed) % (CMAP_OPS * 8));
+	suite->samples[PERF_CMAP_SET][run] =
+		(double) (lanyfs_lat_now() - start) / CMAP_OPS;
+	lanyfs_cmap_free(map);
+}
+
+/**
+ * run_codec() - Times compressing and decompressing with LZ4.
+ * @suite:			suite
+ * @src:			CODEC_LEN bytes of input
+ * @dst:			output, large enough for compressed input
+ * @cap:			size of output
+ * @out:			CODEC_LEN bytes for decompressed input
+ * @run:			number of run
+ */
+static void run_codec (struct perf_suite *suite, const unsigned char *src,
+		       unsigned char *dst, size_t cap, unsigned char *out,
+		       int run)
+{
+	uint64_t start;
+	size_t len = 0;
+	int i;
+
+	start = lanyfs_lat_now();
+	for (i = 0; i < CODEC_ROUNDS; i++)
+		len = lanyfs_compress(LANYFS_CODEC_LZ4, src, CODEC_LEN, dst,
+				      cap);
+	suite->samples[PERF_LZ4_COMPRESS][run] = (double) CODEC_ROUNDS *
+		CODEC_LEN / (1 << 20) / ((lanyfs_lat_now() - start) / 1e9);
+	if (!len)
+		show_error(_("error compressing: %s"), strerror(errno));
+	start = lanyfs_lat_now();
+	for (i = 0; i < CODEC_ROUNDS; i++) {
+		if (lanyfs_decompress(LANYFS_CODEC_LZ4, dst, len, out,
+				      CODEC_LEN))
+			show_error(_("error decompressing: %s"),
+				   strerror(errno));
+	}
+	suite->samples[PERF_LZ4_DECOMPRESS][run] = (double) CODEC_ROUNDS *
+		CODEC_LEN / (1 << 20) / ((lanyfs_lat_now() - start) / 1e9);
+	if (memcmp(src, out, CODEC_LEN))
+		show_error(_("LZ4 round trip differs"));
+}
+
+/**
+ * run_lat() - Times recording latencies.
+ * @suite:			suite
+ * @run:			number of run
+ *
+ * The latencies recorded are dropped again.
+ */
+static void run_lat (struct perf_suite *suite, int run)
+{
+	uint64_t start, i;
+
+	start = lanyfs_lat_now();
+	for (i = 0; i < LAT_OPS; i++)
+		lanyfs_lat_record(LANYFS_LAT_READ, i);
+	suite->samples[PERF_LAT_RECORD][run] =
+		(double) (lanyfs_lat_now() - start) / LAT_OPS;
+	lanyfs_lat_reset();
+}
+
+/**
+ * fill_text() - Fills a buffer with compressible text.
+ * @buf:			buffer
+ * @len:			size of buffer
+ * @seed:			state of random sequence
+ *
+ * Words drawn from a small vocabulary compress about as well as source
+ * code or logs.
+ */
+static void fill_text (unsigned char *buf, size_t len, uint64_t *seed)
+{
+	static const char *words[] = { "lanyard ", "filesystem ", "block ",
+		"chain ", "extender ", "superblock ", "directory ", "file ",
+		"address ", "free ", "\n", "0x", "struct ", "return ", "if ",
+		"for " };
+	size_t i = 0, n;
+	const char *w;
+
+	while (i < len) {
+		w = words[lanyfs_rand(seed) % (sizeof(words) /
+					       sizeof(*words))];
+		n = strlen(w);
+		if (n > len - i)
+			n = len - i;
+		memcpy(buf + i, w, n);
+		i += n;
+	}
+}
+
+/**
+ * build_files() - Builds the images of compressed and raw files.
+ * @suite:			suite, paths set
+ * @buf:			FILES_LEN bytes of scratch
+ */
+static void build_files (struct perf_suite *suite, unsigned char *buf)
+{
+	char *argv[6], *path;
+	int fd, i;
+
+	if (!mkdtemp(suite->source))
+		show_error(_("error creating %s: %s"), suite->source,
+			   strerror(errno));
+	for (i = 0; i < FILES_N; i++) {
+		if (asprintf(&path, "%s/%02d.log", suite->source, i) < 0)
+			show_error(_("out of memory"));
+		fill_text(buf, FILES_LEN, &suite->seed);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || lanyfs_fd_pwrite(fd, buf, FILES_LEN, 0) ||
+		    close(fd))
+			show_error(_("error writing %s: %s"), path,
+				   strerror(errno));
+		free(path);
+	}
+	argv[1] = "-c";
+	argv[3] = suite->source;
+	argv[5] = NULL;
+	argv[2] = "none";
+	argv[4] = suite->raw;
+	run_tool(suite, "mkimage.lanyfs", argv);
+	argv[2] = "lz4";
+	argv[4] = suite->lz4;
+	run_tool(suite, "mkimage.lanyfs", argv);
+}
+
+/**
+ * remove_files() - Removes the source directory and its images.
+ * @suite:			suite
+ */
+static void remove_files (struct perf_suite *suite)
+{
+	char *path;
+	int i;
+
+	for (i = 0; i < FILES_N; i++) {
+		if (asprintf(&path, "%s/%02d.log", suite->source, i) < 0)
+			show_error(_("out of memory"));
+		unlink(path);
+		free(path);
+	}
+	rmdir(suite->source);
+	unlink(suite->raw);
+	unlink(suite->lz4);
+}
+
+/**
+ * run_files() - Times reading all files of an image.
+ * @suite:			suite
+ * @image:			image built by build_files()
+ * @buf:			FILES_LEN bytes of scratch
+ * @metric:			metric of the image
+ * @run:			number of run
+ *
+ * Throughput is counted in bytes of the files, not bytes stored.
+ */
+static void run_files (struct perf_suite *suite, const char *image,
+		       unsigned char *buf, int metric, int run)
+{
+	struct lanyfs_vol *vol;
+	struct lanyfs_fh *fh;
+	char name[16];
+	uint64_t start;
+	int fd, i;
+
+	/* cold reads where the kernel allows dropping cached pages */
+	fd = open(image, O_RDONLY);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	start = lanyfs_lat_now();
+	vol = lanyfs_open_volume(image, 0);
+	if (!vol)
+		show_error(_("error opening %s: %s"), image, strerror(errno));
+	for (i = 0; i < FILES_N; i++) {
+		snprintf(name, sizeof(name), "%02d.log", i);
+		fh = lanyfs_open(vol, name);
+		if (!fh || lanyfs_pread(fh, buf, FILES_LEN, 0) != FILES_LEN)
+			show_error(_("error reading %s in %s: %s"), name,
+				   image, strerror(errno));
+		lanyfs_close(fh);
+	}
+	lanyfs_close_volume(vol);
+	suite->samples[metric][run] = (double) FILES_N * FILES_LEN /
+		(1 << 20) / ((lanyfs_lat_now() - start) / 1e9);
+}
+
+/**
+ * build_tree() - Builds the traversal images, one directory per update.
+ * @suite:			suite, paths set
+ * @buf:			TREE_LEN bytes of scratch
+ */
+static void build_tree (struct perf_suite *suite, unsigned char *buf)
+{
+	char *argv[5], *path;
+	int fd, d, f;
+
+	if (!mkdtemp(suite->tree))
+		show_error(_("error creating %s: %s"), suite->tree,
+			   strerror(errno));
+	fd = open(suite->plain, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t) TREE_SIZE << 20) || close(fd))
+		show_error(_("error sizing %s: %s"), suite->plain,
+			   strerror(errno));
+	fd = open(suite->zoned, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, (off_t) TREE_SIZE << 20) || close(fd))
+		show_error(_("error sizing %s: %s"), suite->zoned,
+			   strerror(errno));
+	argv[1] = suite->plain;
+	argv[2] = NULL;
+	run_tool(suite, "mkfs.lanyfs", argv);
+	argv[1] = "-z";
+	argv[2] = TREE_ZONE;
+	argv[3] = suite->zoned;
+	argv[4] = NULL;
+	run_tool(suite, "mkfs.lanyfs", argv);
+
+	for (d = 0; d < TREE_DIRS; d++) {
+		if (asprintf(&path, "%s/%02d", suite->tree, d) < 0)
+			show_error(_("out of memory"));
+		if (mkdir(path, 0755))
+			show_error(_("error creating %s: %s"), path,
+				   strerror(errno));
+		free(path);
+		for (f = 0; f < TREE_FILES; f++) {
+			if (asprintf(&path, "%s/%02d/%02d.log", suite->tree,
+				     d, f) < 0)
+				show_error(_("out of memory"));
+			fill_text(buf, TREE_LEN, &suite->seed);
+			fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd < 0 || lanyfs_fd_pwrite(fd, buf, TREE_LEN, 0) ||
+			    close(fd))
+				show_error(_("error writing %s: %s"), path,
+					   strerror(errno));
+			free(path);
+		}
+		argv[1] = "-u";
+		argv[2] = suite->tree;
+		argv[3] = suite->plain;
+		run_tool(suite, "mkimage.lanyfs", argv);
+		argv[3] = suite->zoned;
+		run_tool(suite, "mkimage.lanyfs", argv);
+	}
+}
+
+/**
+ * remove_tree() - Removes the traversal source directory and its images.
+ * @suite:			suite
+ */
+static void remove_tree (struct perf_suite *suite)
+{
+	char *path;
+	int d, f;
+
+	for (d = 0; d < TREE_DIRS; d++) {
+		for (f = 0; f < TREE_FILES; f++) {
+			if (asprintf(&path, "%s/%02d/%02d.log", suite->tree,
+				     d, f) < 0)
+				show_error(_("out of memory"));
+			unlink(path);
+			free(path);
+		}
+		if (asprintf(&path, "%s/%02d", suite->tree, d) < 0)
+			show_error(_("out of memory"));
+		rmdir(path);
+		free(path);
+	}
+	rmdir(suite->tree);
+	unlink(suite->plain);
+	unlink(suite->zoned);
+}
+
+/**
+ * walk_ext() - Counts a block of an extender tree.
+ * @vol:			volume being walked
+ * @addr:			address of extender or data block
+ * @type:			LANYFS_TYPE_EXT or LANYFS_TYPE_DATA
+ * @iblock:			index of data block within file
+ * @arg:			number of extenders read
+ */
+static int walk_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+		     uint64_t iblock, void *arg)
+{
+	if (type == LANYFS_TYPE_EXT)
+		(*(uint64_t *) arg)++;
+	return 0;
+}
+
+/**
+ * walk_node() - Reads the extenders of a file found by the walk.
+ * @vol:			volume being walked
+ * @worker:			index of worker thread calling back
+ * @addr:			address of directory or file block
+ * @b:				visited block
+ * @arg:			number of blocks read
+ */
+static int walk_node (struct lanyfs_vol *vol, int worker, uint64_t addr,
+		      union lanyfs_b *b, void *arg)
+{
+	(*(uint64_t *) arg)++;
+	if (b->raw.type != LANYFS_TYPE_FILE)
+		return 0;
+	return lanyfs_ext_walk(vol, fromle64(b->file.data), walk_ext, arg);
+}
+
+/**
+ * run_walk() - Times walking all metadata of a traversal image.
+ * @suite:			suite
+ * @image:			image built by build_tree()
+ * @metric:			metric of the image
+ * @run:			number of run
+ *
+ * A single worker walks the tree, so the time taken follows the seeks
+ * between metadata blocks rather than the device's queue depth.
+ */
+static void run_walk (struct perf_suite *suite, const char *image,
+		      int metric, int run)
+{
+	struct lanyfs_vol *vol;
+	union lanyfs_b *b;
+	uint64_t start, n = 0;
+	int fd;
+
+	fd = open(image, O_RDONLY);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+	}
+	start = lanyfs_lat_now();
+	vol = lanyfs_vol_open(image, 1);
+	if (!vol)
+		show_error(_("error opening %s: %s"), image, strerror(errno));
+	b = lanyfs_alloc_block(vol);
+	if (!b)
+		show_error(_("out of memory"));
+	if (lanyfs_read_block(vol, fromle64(vol->sb->sb.rootdir), b) ||
+	    lanyfs_walk(vol, fromle64(b->dir.subtree), 1, walk_node, &n))
+		show_error(_("error walking %s: %s"), image, strerror(errno));
+	free(b);
+	lanyfs_vol_close(vol);
+	suite->samples[metric][run] = (lanyfs_lat_now() - start) / 1e6;
+	perf_sink += n;
+}
+
+/**
+ * write_results() - Writes all samples as JSON.
+ * @suite:			suite
+ * @fp:				output
+ */
+static void write_results (struct perf_suite *suite, FILE *fp)
+{
+	const char *sep = "";
+	int m, r;
+
+	fprintf(fp, "{\n\t\"suite\": \"%s\",\n\t\"version\": \"%d.%d\",\n"
+		"\t\"runs\": %d,\n\t\"metrics\": {", progname,
+		LANYFS_MAJOR_VERSION, LANYFS_MINOR_VERSION, suite->runs);
+	for (m = 0; m < PERF_METRICS; m++) {
+		if (m == PERF_CANON && !LANYFS_SWAP)
+			continue;
+		fprintf(fp, "%s\n\t\t\"%s\": {\"unit\": \"%s\", \"better\": "
+			"\"%s\", \"samples\": [", sep, perf_info[m].name,
+			perf_info[m].unit,
+			perf_info[m].lower ? "lower" : "higher");
+		for (r = 0; r < suite->runs; r++)
+			fprintf(fp, "%s%.6g", r ? ", " : "",
+				suite->samples[m][r]);
+		fprintf(fp, "]}");
+		sep = ",";
+	}
+	fprintf(fp, "\n\t}\n}\n");
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct perf_suite suite;
+	struct lanyfs_vol *vol;
+	union lanyfs_b *buf;
+	unsigned char *blocks, *src, *dst, *out, *files;
+	const char *dir = NULL, *outname = NULL;
+	char *slash;
+	FILE *fp = stdout;
+	size_t cap;
+	int fd, m, r;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&suite, 0, sizeof(suite));
+	suite.runs = RUNS_DEFAULT;
+	suite.size = (uint64_t) SIZE_DEFAULT << 20;
+	suite.seed = 0x4c414e5946535553ULL;
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "d:o:r:s:v")) != -1) {
+		switch (c) {
+		case 'd':
+			dir = optarg;
+			break;
+		case 'o':
+			outname = optarg;
+			break;
+		case 'r':
+			suite.runs = atoi(optarg);
+			if (suite.runs < 1)
+				show_error(_("invalid number of runs"));
+			break;
+		case 's':
+			suite.size = (uint64_t) atol(optarg) << 20;
+			if (!suite.size)
+				show_error(_("invalid image size"));
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		show_usage();
+	if (!dir)
+		dir = getenv("TMPDIR");
+	if (!dir || !*dir)
+		dir = "/tmp";
+
+	/* the tools are taken from where this one was started */
+	slash = strrchr(argv[0], '/');
+	if (slash) {
+		suite.tooldir = strndup(argv[0], slash - argv[0] + 1);
+		if (!suite.tooldir)
+			show_error(_("out of memory"));
+		suite.tooldir[slash - argv[0]] = '\0';
+	}
+	if (asprintf(&suite.image, "%s/perf.lanyfs.XXXXXX", dir) < 0)
+		show_error(_("out of memory"));
+	fd = mkstemp(suite.image);
+	if (fd < 0)
+		show_error(_("error creating scratch image in %s: %s"), dir,
+			   strerror(errno));
+	if (ftruncate(fd, suite.size)) {
+		unlink(suite.image);
+		show_error(_("error sizing %s: %s"), suite.image,
+			   strerror(errno));
+	}
+	close(fd);
+	for (m = 0; m < PERF_METRICS; m++) {
+		suite.samples[m] = calloc(suite.runs, sizeof(double));
+		if (!suite.samples[m])
+			show_error(_("out of memory"));
+	}
+	cap = lanyfs_compress_bound(LANYFS_CODEC_LZ4, CODEC_LEN);
+	src = malloc(CODEC_LEN);
+	dst = malloc(cap);
+	out = malloc(CODEC_LEN);
+	files = malloc(FILES_LEN);
+	if (!src || !dst || !out || !files)
+		show_error(_("out of memory"));
+	fill_text(src, CODEC_LEN, &suite.seed);
+	verbose("scratch image %s, %"PRIu64" MiB", suite.image,
+		suite.size >> 20);
+	if (asprintf(&suite.source, "%s.src.XXXXXX", suite.image) < 0 ||
+	    asprintf(&suite.raw, "%s.raw", suite.image) < 0 ||
+	    asprintf(&suite.lz4, "%s.lz4", suite.image) < 0 ||
+	    asprintf(&suite.tree, "%s.tree.XXXXXX", suite.image) < 0 ||
+	    asprintf(&suite.plain, "%s.plain", suite.image) < 0 ||
+	    asprintf(&suite.zoned, "%s.zone", suite.image) < 0)
+		show_error(_("out of memory"));
+	build_files(&suite, files);
+	build_tree(&suite, files);
+
+	for (r = 0; r < suite.runs; r++) {
+		run_tools(&suite, r);
+		vol = lanyfs_vol_open(suite.image, 1);
+		if (!vol)
+			show_error(_("error opening %s: %s"), suite.image,
+				   strerror(errno));
+		buf = lanyfs_alloc_block(vol);
+		blocks = calloc(CANON_BLOCKS, vol->bsize);
+		if (!buf || !blocks)
+			show_error(_("out of memory"));
+		if (lanyfs_read_block(vol, fromle64(vol->sb->sb.rootdir),
+				      buf))
+			show_error(_("error reading %s: %s"), suite.image,
+				   strerror(errno));
+		for (m = 0; m < CANON_BLOCKS; m++)
+			memcpy(blocks + m * vol->bsize, buf, vol->bsize);
+		run_read(&suite, vol, buf, r);
+		run_slots(&suite, vol, buf, r);
+		if (LANYFS_SWAP)
+			run_canon(&suite, vol, blocks, r);
+		run_cmap(&suite, r);
+		run_codec(&suite, src, dst, cap, out, r);
+		run_lat(&suite, r);
+		run_files(&suite, suite.raw, files, PERF_READ_RAW, r);
+		run_files(&suite, suite.lz4, files, PERF_READ_LZ4, r);
+		run_walk(&suite, suite.plain, PERF_WALK_PLAIN, r);
+		run_walk(&suite, suite.zoned, PERF_WALK_ZONE, r);
+		free(blocks);
+		free(buf);
+		lanyfs_vol_close(vol);
+		verbose("run %d: mkfs %.1f ms, detectfs %.1f ms", r + 1,
+			suite.samples[PERF_MKFS][r],
+			suite.samples[PERF_DETECTFS][r]);
+	}
+	unlink(suite.image);
+	remove_files(&suite);
+	remove_tree(&suite);
+
+	if (outname) {
+		fp = fopen(outname, "a");
+		if (!fp)
+			show_error(_("error opening %s: %s"), outname,
+				   strerror(errno));
+	}
+	write_results(&suite, fp);
+	if (fp != stdout && fclose(fp))
+		show_error(_("error writing %s: %s"), outname,
+			   strerror(errno));
+	for (m = 0; m < PERF_METRICS; m++)
+		free(suite.samples[m]);
+	free(src);
+	free(dst);
+	free(out);
+	free(files);
+	free(suite.source);
+	free(suite.raw);
+	free(suite.lz4);
+	free(suite.tree);
+	free(suite.plain);
+	free(suite.zoned);
+	free(suite.image);
+	free(suite.tooldir);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,893 @@
+/*
+ * recover.c - Recover Files from Damaged Lanyard Filesystem Volumes.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Recovery
+ *
+ * Recovery does not trust the superblock or the root directory. The first
+ * phase streams the whole device and keeps every block that looks like a
+ * directory or file block. Type bytes of a chunk are gathered and tested
+ * eight at a time, so chunks of data blocks cost next to nothing, and the
+ * few candidates are checked for plausible addresses, timestamps, names and
+ * zeroed reserved fields.
+ *
+ * The second phase rebuilds the directory forest. Every candidate that no
+ * other candidate points to, by binary tree or subtree pointer, is the top
+ * of a tree whose parent is lost. Each such tree is extracted into a
+ * directory of its own named after its address. Candidates still not
+ * reached afterwards, e.g. in pointer cycles, are extracted the same way.
+ *
+ * Candidates and per-block state live in out-of-core tables, and pointers
+ * between candidates are sorted externally within the memory cap, so huge
+ * devices need little memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>		/* getopt() */
+#include <sys/stat.h>
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "recover.lanyfs";
+const char *progdate = "December 2012";
+#define SCAN_CHUNK		(1 << 20)	/* bytes read at once */
+#define PROBE_BYTES		(64 << 20)	/* bytes probed for geometry */
+#define PROBE_FILES		256		/* files probed for addrlen */
+#define PATH_LENGTH		4096
+#define MEMCAP_DEFAULT		256		/* memory cap in MiB */
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct recover_node - Candidate directory or file block.
+ * @addr:			address of block
+ * @left:			left node of binary tree
+ * @right:			right node of binary tree
+ * @down:			subtree of directory, 0 for files
+ * @type:			type of block
+ */
+struct recover_node {
+	uint64_t		addr;
+	uint64_t		left;
+	uint64_t		right;
+	uint64_t		down;
+	uint64_t		type;
+};
+
+/**
+ * struct recover_ctx - State of a recovery.
+ * @vol:			volume
+ * @tmpdir:			directory for out-of-core tables
+ * @nodes:			candidates in address order
+ * @skip:			blocks not to consider, e.g. free blocks
+ * @memcap:			memory cap of sorting in bytes
+ * @seen:			blocks visited while extracting
+ * @files:			number of files extracted
+ * @dirs:			number of directories extracted
+ * @damaged:			number of files extracted incompletely
+ * @b:				block buffer
+ */
+struct recover_ctx {
+	struct lanyfs_vol	*vol;
+	const char		*tmpdir;
+	struct lanyfs_table	nodes;
+	unsigned char		*skip;
+	size_t			memcap;
+	unsigned char		*seen;
+	uint64_t		files;
+	uint64_t		dirs;
+	uint64_t		damaged;
+	union lanyfs_b		*b;
+};
+
+/**
+ * struct recover_file - File being extracted.
+ * @fd:				target file
+ * @size:			size of file
+ * @buf:			block buffer
+ */
+struct recover_file {
+	int			fd;
+	uint64_t		size;
+	unsigned char		*buf;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-n] [-s] [-b blocksize] [-a addrlen] "
+		  "[-m memory] [-T tmpdir] device [directory]\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/**
+ * intlog2() - Simple logarithm check.
+ * @n:				value to check
+ */
+static int intlog2 (unsigned int n)
+{
+	int b = 0;
+	while (n) {
+		if (n & 1) {
+			if (n > 1)
+				return -1;
+			return b;
+		}
+		n >>= 1;
+		b++;
+	}
+	return -1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* bytes of a 64-bit word, for testing eight type bytes at once */
+#define ONES			0x0101010101010101ULL
+#define HIGHS			0x8080808080808080ULL
+#define has_zero(w)		(((w) - ONES) & ~(w) & HIGHS)
+#define has_byte(w, c)		has_zero((w) ^ (ONES * (c)))
+
+/**
+ * maybe_node() - Tests eight gathered type bytes for directory or file.
+ * @w:				type bytes of eight blocks
+ *
+ * May report false positives, never false negatives.
+ */
+static inline int maybe_node (uint64_t w)
+{
+	return !!(has_byte(w, LANYFS_TYPE_DIR) | has_byte(w, LANYFS_TYPE_FILE));
+}
+
+/**
+ * zeroed() - Checks a reserved field for being all zeros.
+ * @p:				field
+ * @len:			length of field
+ */
+static int zeroed (const void *p, size_t len)
+{
+	const unsigned char *c = p;
+	while (len--) {
+		if (*c++)
+			return 0;
+	}
+	return 1;
+}
+
+/**
+ * ts_plausible() - Checks a timestamp for valid field ranges.
+ * @ts:				timestamp
+ */
+static int ts_plausible (const struct lanyfs_ts *ts)
+{
+	return fromle16(ts->year) <= 9999 && ts->mon >= 1 && ts->mon <= 12 &&
+	       ts->day >= 1 && ts->day <= 31 && ts->hour <= 23 &&
+	       ts->min <= 59 && ts->sec <= 60 &&
+	       fromle32(ts->nsec) <= 1000000000;
+}
+
+/**
+ * plausible() - Checks whether a block looks like a directory or file.
+ * @blocks:			number of blocks on the device
+ * @bsize:			blocksize in bytes
+ * @addr:			address of block
+ * @b:				block
+ *
+ * The size of a file is not checked, files with holes may be larger than
+ * the device.
+ */
+static int plausible (uint64_t blocks, size_t bsize, uint64_t addr,
+		      union lanyfs_b *b)
+{
+	uint64_t left = fromle64(b->vi_btree.left);
+	uint64_t right = fromle64(b->vi_btree.right);
+	uint64_t down;
+
+	if (b->raw.type == LANYFS_TYPE_DIR) {
+		down = fromle64(b->dir.subtree);
+		if (!zeroed(b->dir.__reserved_1, sizeof(b->dir.__reserved_1)) ||
+		    !zeroed(b->dir.__reserved_2, sizeof(b->dir.__reserved_2)))
+			return 0;
+	} else if (b->raw.type == LANYFS_TYPE_FILE) {
+		down = fromle64(b->file.data);
+		if (!zeroed(b->file.__reserved_1,
+			    sizeof(b->file.__reserved_1)) ||
+		    !zeroed(b->file.__reserved_2,
+			    sizeof(b->file.__reserved_2)) ||
+		    fromle64(b->file.stored) / bsize > blocks ||
+		    !b->vi_meta.name[0])
+			return 0;
+	} else {
+		return 0;
+	}
+	if (b->raw.__reserved_0 || left >= blocks || right >= blocks ||
+	    down >= blocks || left == addr || right == addr || down == addr ||
+	    (left && left == right))
+		return 0;
+	if (!zeroed(b->vi_meta.__reserved_0, sizeof(b->vi_meta.__reserved_0)) ||
+	    !ts_plausible(&b->vi_meta.created) ||
+	    !ts_plausible(&b->vi_meta.modified) ||
+	    !memchr(b->vi_meta.name, 0, LANYFS_NAME_LENGTH))
+		return 0;
+	return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * probe_blocksize() - Guesses the blocksize from candidates.
+ * @dev:			device
+ *
+ * Blocks are aligned to the blocksize, so candidates found at the smallest
+ * blocksize are all aligned to the true one. Larger blocksizes miss
+ * candidates. Returns -1 if nothing was found.
+ */
+static int probe_blocksize (struct lanyfs_dev *dev)
+{
+	size_t bsize = (size_t) 1 << LANYFS_MIN_BLOCKSIZE;
+	uint64_t len = dev->size < PROBE_BYTES ? dev->size : PROBE_BYTES;
+	uint64_t found[LANYFS_MAX_BLOCKSIZE + 1], blocks, off;
+	union lanyfs_b *b;
+	int bs;
+
+	memset(found, 0, sizeof(found));
+	b = malloc(bsize);
+	if (!b)
+		show_error(_("out of memory"));
+	blocks = dev->size / bsize;
+	for (off = bsize; off + bsize <= len; off += bsize) {
+		if (lanyfs_dev_pread(dev, b, bsize, off))
+			show_error(_("read error at offset %"PRIu64), off);
+		if (b->raw.type != LANYFS_TYPE_DIR &&
+		    b->raw.type != LANYFS_TYPE_FILE)
+			continue;
+		for (bs = LANYFS_MIN_BLOCKSIZE; bs <= LANYFS_MAX_BLOCKSIZE;
+		     bs++) {
+			if (off & (((uint64_t) 1 << bs) - 1))
+				break;
+			/* addresses must fit the smaller device of bs */
+			if (plausible(blocks >> (bs - LANYFS_MIN_BLOCKSIZE),
+				      (size_t) 1 << bs, off >> bs, b))
+				found[bs]++;
+		}
+	}
+	free(b);
+	for (bs = LANYFS_MAX_BLOCKSIZE; bs >= LANYFS_MIN_BLOCKSIZE; bs--) {
+		if (found[bs] && found[bs] == found[LANYFS_MIN_BLOCKSIZE])
+			return bs;
+	}
+	return -1;
+}
+
+/**
+ * probe_addrlen() - Guesses the address length from files.
+ * @dev:			device
+ * @blocksize:			blocksize (exponent to base 2)
+ *
+ * A level 0 extender of a file without holes holds one address per data
+ * block, packed at its start. Reading it with a wrong address length splits
+ * or merges addresses, which gives another count, gaps, or addresses beyond
+ * the device.
+ */
+static int probe_addrlen (struct lanyfs_dev *dev, int blocksize)
+{
+	size_t bsize = (size_t) 1 << blocksize;
+	uint64_t len = dev->size < PROBE_BYTES ? dev->size : PROBE_BYTES;
+	uint64_t blocks = dev->size >> blocksize, off, want, n, a;
+	unsigned int score[LANYFS_MAX_ADDRLEN + 1], files = 0;
+	union lanyfs_b *b, *e;
+	unsigned char *p;
+	int al, best = -1, i, k, slots;
+
+	memset(score, 0, sizeof(score));
+	b = malloc(bsize);
+	e = malloc(bsize);
+	if (!b || !e)
+		show_error(_("out of memory"));
+	for (off = bsize; off + bsize <= len && files < PROBE_FILES;
+	     off += bsize) {
+		if (lanyfs_dev_pread(dev, b, bsize, off))
+			show_error(_("read error at offset %"PRIu64), off);
+		if (b->raw.type != LANYFS_TYPE_FILE ||
+		    !plausible(blocks, bsize, off >> blocksize, b) ||
+		    !b->file.data)
+			continue;
+		if (lanyfs_dev_pread(dev, e, bsize,
+				     fromle64(b->file.data) << blocksize) ||
+		    e->raw.type != LANYFS_TYPE_EXT || e->ext.level)
+			continue;
+		files++;
+		want = (fromle64(b->file.size) + bsize - 1) / bsize;
+		for (al = LANYFS_MIN_ADDRLEN; al <= LANYFS_MAX_ADDRLEN; al++) {
+			slots = (bsize - offsetof(struct lanyfs_ext, stream)) /
+				al;
+			p = &e->ext.stream;
+			for (i = 0, n = 0; i < slots; i++, p += al) {
+				for (a = 0, k = al; k--; )
+					a = a << 8 | p[k];
+				if (a >= blocks || (a && n < i))
+					break;
+				n += !!a;
+			}
+			if (i == slots && n == want)
+				score[al]++;
+		}
+	}
+	free(b);
+	free(e);
+	for (al = LANYFS_MIN_ADDRLEN; al <= LANYFS_MAX_ADDRLEN; al++) {
+		if (score[al] && (best < 0 || score[al] > score[best]))
+			best = al;
+	}
+	return best;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * scan() - Collects candidates of the whole device.
+ * @ctx:			recovery context
+ */
+static void scan (struct recover_ctx *ctx)
+{
+	struct lanyfs_vol *vol = ctx->vol;
+	struct recover_node node;
+	union lanyfs_b *b;
+	unsigned char *buf, types[SCAN_CHUNK >> LANYFS_MIN_BLOCKSIZE];
+	uint64_t addr, first, n, i, j, w, dirs = 0, files = 0;
+	size_t per = SCAN_CHUNK >> vol->blocksize;
+
+	buf = malloc(SCAN_CHUNK);
+	if (!buf)
+		show_error(_("out of memory"));
+	if (lanyfs_table_open(&ctx->nodes, ctx->tmpdir, sizeof(node)))
+		show_error(_("error creating table: %s"), strerror(errno));
+	/* block 0 is the superblock, even a damaged one */
+	for (first = 1; first < vol->blocks; first += n) {
+		n = vol->blocks - first < per ? vol->blocks - first : per;
+		if (lanyfs_dev_pread(vol->dev, buf, n * vol->bsize,
+				     first << vol->blocksize))
+			show_error(_("read error at block %"PRIu64), first);
+		for (i = 0; i < n; i++)
+			types[i] = buf[i << vol->blocksize];
+		memset(types + n, 0, (8 - n % 8) % 8);
+		for (i = 0; i < n; i += 8) {
+			memcpy(&w, types + i, sizeof(w));
+			if (!maybe_node(w))
+				continue;
+			for (j = i; j < i + 8 && j < n; j++) {
+				addr = first + j;
+				b = (union lanyfs_b *) (buf + (j << vol->blocksize));
+				if ((ctx->skip && lanyfs_testbit(ctx->skip, addr)) ||
+				    !plausible(vol->blocks, vol->bsize, addr, b))
+					continue;
+				node.addr = addr;
+				node.left = fromle64(b->vi_btree.left);
+				node.right = fromle64(b->vi_btree.right);
+				node.type = b->raw.type;
+				if (b->raw.type == LANYFS_TYPE_DIR) {
+					node.down = fromle64(b->dir.subtree);
+					dirs++;
+				} else {
+					node.down = 0;
+					files++;
+				}
+				if (lanyfs_table_append(&ctx->nodes, &node))
+					show_error(_("error writing table: %s"),
+						   strerror(errno));
+			}
+		}
+	}
+	free(buf);
+	if (lanyfs_table_map(&ctx->nodes))
+		show_error(_("error reading table: %s"), strerror(errno));
+	printf(_("found %"PRIu64" directories and %"PRIu64" files\n"), dirs,
+	       files);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * clean_name() - Turns a block's name into a safe file name.
+ * @b:				directory or file block
+ * @addr:			address of block
+ * @out:			buffer of LANYFS_NAME_LENGTH + 32 bytes
+ */
+static void clean_name (union lanyfs_b *b, uint64_t addr, char *out)
+{
+	char *c;
+	if (!b->vi_meta.name[0] || !strcmp((char *) b->vi_meta.name, ".") ||
+	    !strcmp((char *) b->vi_meta.name, "..")) {
+		sprintf(out, "#%"PRIu64, addr);
+		return;
+	}
+	strcpy(out, (char *) b->vi_meta.name);
+	for (c = out; *c; c++) {
+		if (*c == '/')
+			*c = '_';
+	}
+}
+
+/**
+ * save_data() - Writes a data block of a file being extracted.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			file being extracted
+ */
+static int save_data (struct lanyfs_vol *vol, uint64_t addr, int type,
+		      uint64_t iblock, void *arg)
+{
+	struct recover_file *file = arg;
+	uint64_t pos = iblock << vol->blocksize;
+	size_t len = vol->bsize;
+
+	if (type != LANYFS_TYPE_DATA || pos >= file->size)
+		return 0;
+	if (file->size - pos < len)
+		len = file->size - pos;
+	if (lanyfs_read_block(vol, addr, file->buf))
+		return -1;
+	return lanyfs_fd_pwrite(file->fd, file->buf, len, pos);
+}
+
+/**
+ * save_chunks() - Writes the contents of a compressed file being extracted.
+ * @vol:			volume
+ * @addr:			address of file block
+ * @file:			file being extracted
+ *
+ * Chunks are decompressed by the library, a damaged chunk fails the file.
+ */
+static int save_chunks (struct lanyfs_vol *vol, uint64_t addr,
+			struct recover_file *file)
+{
+	size_t len = (size_t) 1 << LANYFS_MAX_CHUNK_SHIFT;
+	struct lanyfs_fh *fh;
+	unsigned char *buf;
+	uint64_t pos = 0;
+	ssize_t n;
+	int ret = -1;
+
+	fh = lanyfs_open_addr(vol, addr);
+	buf = malloc(len);
+	if (!fh || !buf)
+		goto out;
+	while ((n = lanyfs_pread(fh, buf, len, pos)) > 0) {
+		if (lanyfs_fd_pwrite(file->fd, buf, n, pos))
+			goto out;
+		pos += n;
+	}
+	ret = n ? -1 : 0;
+
+out:
+	free(buf);
+	lanyfs_close(fh);
+	return ret;
+}
+
+/**
+ * extract_file() - Extracts a file.
+ * @ctx:			recovery context
+ * @b:				file block
+ * @addr:			address of file block
+ * @path:			target path
+ */
+static void extract_file (struct recover_ctx *ctx, union lanyfs_b *b,
+			  uint64_t addr, const char *path)
+{
+	struct recover_file file;
+	int ret;
+
+	file.fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (file.fd < 0) {
+		fprintf(stderr, _("%s: cannot create %s: %s\n"), progname,
+			path, strerror(errno));
+		return;
+	}
+	file.size = fromle64(b->file.size);
+	file.buf = malloc(ctx->vol->bsize);
+	if (!file.buf)
+		show_error(_("out of memory"));
+	if (fromle16(b->file.meta.attr) & LANYFS_ATTR_COMPRESSED)
+		ret = save_chunks(ctx->vol, addr, &file);
+	else
+		ret = b->file.data && lanyfs_ext_walk(ctx->vol,
+			fromle64(b->file.data), save_data, &file);
+	if (ret) {
+		fprintf(stderr, _("%s: %s is damaged\n"), progname, path);
+		ctx->damaged++;
+	}
+	if (ftruncate(file.fd, file.size) || close(file.fd))
+		fprintf(stderr, _("%s: error writing %s: %s\n"), progname,
+			path, strerror(errno));
+	free(file.buf);
+	ctx->files++;
+}
+
+/**
+ * extract_tree() - Extracts all nodes of a binary tree into a directory.
+ * @ctx:			recovery context
+ * @top:			binary tree root
+ * @dir:			target directory, NULL to count only
+ *
+ * The binary tree is walked on an explicit stack, its depth is not bounded
+ * on a damaged volume. Recursion follows directory nesting only.
+ */
+static void extract_tree (struct recover_ctx *ctx, uint64_t top,
+			  const char *dir)
+{
+	struct lanyfs_vol *vol = ctx->vol;
+	struct lanyfs_addrvec stack = {NULL, 0, 0};
+	union lanyfs_b *b;
+	char name[LANYFS_NAME_LENGTH + 32];
+	char *path;
+	uint64_t addr, sub;
+	size_t len;
+
+	b = lanyfs_alloc_block(vol);
+	path = malloc(PATH_LENGTH);
+	if (!b || !path || lanyfs_addrvec_push(&stack, top))
+		show_error(_("out of memory"));
+	while (stack.n) {
+		addr = stack.a[--stack.n];
+		if (!addr || lanyfs_testbit(ctx->seen, addr))
+			continue;
+		lanyfs_setbit(ctx->seen, addr);
+		if (lanyfs_read_block(vol, addr, b) ||
+		    !plausible(vol->blocks, vol->bsize, addr, b)) {
+			verbose("skipping implausible block %"PRIu64, addr);
+			continue;
+		}
+		if (lanyfs_addrvec_push(&stack, fromle64(b->vi_btree.left)) ||
+		    lanyfs_addrvec_push(&stack, fromle64(b->vi_btree.right)))
+			show_error(_("out of memory"));
+		if (!dir) {
+			if (b->raw.type == LANYFS_TYPE_FILE) {
+				ctx->files++;
+			} else {
+				ctx->dirs++;
+				extract_tree(ctx, fromle64(b->dir.subtree),
+					     NULL);
+			}
+			continue;
+		}
+		clean_name(b, addr, name);
+		len = snprintf(path, PATH_LENGTH, "%s/%s", dir, name);
+		if (len < PATH_LENGTH && !access(path, F_OK))
+			len = snprintf(path, PATH_LENGTH, "%s/%s#%"PRIu64, dir,
+				       name, addr);
+		if (len >= PATH_LENGTH) {
+			fprintf(stderr, _("%s: path too long at block %"PRIu64
+				"\n"), progname, addr);
+			continue;
+		}
+		verbose("%s at addr=%"PRIu64, path, addr);
+		if (b->raw.type == LANYFS_TYPE_FILE) {
+			extract_file(ctx, b, addr, path);
+			continue;
+		}
+		if (mkdir(path, 0755)) {
+			fprintf(stderr, _("%s: cannot create %s: %s\n"),
+				progname, path, strerror(errno));
+			continue;
+		}
+		ctx->dirs++;
+		sub = fromle64(b->dir.subtree);
+		if (sub)
+			extract_tree(ctx, sub, path);
+	}
+	lanyfs_addrvec_free(&stack);
+	free(path);
+	free(b);
+}
+
+/**
+ * extract_root() - Extracts a tree whose parent is lost.
+ * @ctx:			recovery context
+ * @node:			top of tree
+ * @outdir:			directory to extract into, NULL to list only
+ */
+static void extract_root (struct recover_ctx *ctx, struct recover_node *node,
+			  const char *outdir)
+{
+	char path[PATH_LENGTH];
+
+	uint64_t dirs = ctx->dirs, files = ctx->files;
+
+	if (outdir) {
+		snprintf(path, sizeof(path), "%s/#%"PRIu64, outdir, node->addr);
+		if (mkdir(path, 0755))
+			show_error(_("cannot create %s: %s"), path,
+				   strerror(errno));
+	}
+	extract_tree(ctx, node->addr, outdir ? path : NULL);
+	printf(_("#%"PRIu64": %"PRIu64" directories, %"PRIu64" files\n"),
+	       node->addr, ctx->dirs - dirs, ctx->files - files);
+}
+
+/**
+ * addr_cmp() - Orders block addresses.
+ * @a:				address
+ * @b:				address
+ */
+static int addr_cmp (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return x < y ? -1 : x > y;
+}
+
+/**
+ * rebuild() - Finds the tops of all trees and extracts them.
+ * @ctx:			recovery context
+ * @outdir:			directory to extract into, NULL to list only
+ */
+static void rebuild (struct recover_ctx *ctx, const char *outdir)
+{
+	struct recover_node *nodes = (struct recover_node *) ctx->nodes.map;
+	struct lanyfs_sort *refs;
+	uint64_t i, ref, tops = 0, cycles = 0;
+	int ret;
+
+	/*
+	 * A candidate pointed to by another one is not a top. Targets are
+	 * sorted and merged with the candidates, which are in address order.
+	 */
+	refs = lanyfs_sort_open(ctx->tmpdir, sizeof(uint64_t), addr_cmp,
+				ctx->memcap);
+	if (!refs)
+		show_error(_("out of memory"));
+	for (i = 0; i < ctx->nodes.n; i++) {
+		/* left, right and down are adjacent, zeros match no node */
+		if (lanyfs_sort_add(refs, &nodes[i].left, 3))
+			show_error(_("error sorting references: %s"),
+				   strerror(errno));
+	}
+	if (lanyfs_sort_finish(refs, NULL))
+		show_error(_("error sorting references: %s"), strerror(errno));
+	ret = lanyfs_sort_next(refs, &ref);
+	for (i = 0; i < ctx->nodes.n; i++) {
+		while (ret == 1 && ref < nodes[i].addr)
+			ret = lanyfs_sort_next(refs, &ref);
+		if (ret < 0)
+			show_error(_("error sorting references: %s"),
+				   strerror(errno));
+		if (ret == 1 && ref == nodes[i].addr)
+			continue;
+		tops++;
+		extract_root(ctx, &nodes[i], outdir);
+	}
+	lanyfs_sort_close(refs);
+
+	/* what is left is referenced from within itself only */
+	for (i = 0; i < ctx->nodes.n; i++) {
+		if (lanyfs_testbit(ctx->seen, nodes[i].addr))
+			continue;
+		cycles++;
+		extract_root(ctx, &nodes[i], outdir);
+	}
+	printf(_("%"PRIu64" trees, %"PRIu64" of them in pointer cycles\n"),
+	       tops + cycles, cycles);
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct recover_ctx ctx;
+	struct lanyfs_dev *dev;
+	char *dev_name, *outdir = NULL;
+	int blocksize = -1, addrlen = -1, trust = 1, list = 0;
+	uint64_t nfree;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.memcap = (size_t) MEMCAP_DEFAULT << 20;
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "a:b:m:nsT:v")) != -1) {
+		switch (c) {
+		case 'a':
+			addrlen = atoi(optarg);
+			if (addrlen < LANYFS_MIN_ADDRLEN ||
+			    addrlen > LANYFS_MAX_ADDRLEN)
+				show_error(_("invalid address length"));
+			break;
+		case 'b':
+			blocksize = intlog2(atoi(optarg));
+			if (blocksize < LANYFS_MIN_BLOCKSIZE ||
+			    blocksize > LANYFS_MAX_BLOCKSIZE)
+				show_error(_("invalid blocksize"));
+			break;
+		case 'n':
+			list = 1;
+			break;
+		case 'm':
+			ctx.memcap = (size_t) atol(optarg) << 20;
+			if (!ctx.memcap)
+				show_error(_("invalid memory cap"));
+			break;
+		case 's':
+			trust = 0;
+			break;
+		case 'T':
+			ctx.tmpdir = optarg;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 - list != argc)
+		show_usage();
+	dev_name = argv[optind];
+	if (!list)
+		outdir = argv[optind + 1];
+
+	/* geometry from superblock, options, or guessed */
+	dev = lanyfs_dev_open(dev_name, 1);
+	if (!dev)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+	if (trust && blocksize < 0 && addrlen < 0) {
+		ctx.vol = lanyfs_vol_attach(dev);
+		if (!ctx.vol)
+			printf(_("superblock damaged, guessing geometry\n"));
+	}
+	if (!ctx.vol) {
+		if (blocksize < 0)
+			blocksize = probe_blocksize(dev);
+		if (blocksize < 0)
+			show_error(_("cannot guess blocksize, use -b"));
+		if (addrlen < 0)
+			addrlen = probe_addrlen(dev, blocksize);
+		if (addrlen < 0)
+			show_error(_("cannot guess address length, use -a"));
+		ctx.vol = lanyfs_vol_forge(dev, blocksize, addrlen);
+		if (!ctx.vol)
+			show_error(_("error opening device %s: %s"), dev_name,
+				   strerror(errno));
+		trust = 0;
+	}
+	printf(_("blocksize %zu, address length %d, %"PRIu64" blocks\n"),
+	       ctx.vol->bsize, ctx.vol->addrlen, ctx.vol->blocks);
+
+	ctx.seen = lanyfs_bitmap_open(ctx.tmpdir, ctx.vol->blocks);
+	if (!ctx.seen)
+		show_error(_("error creating bitmap: %s"), strerror(errno));
+
+	/* stale blocks on the free blocks chain are no candidates */
+	if (trust) {
+		ctx.skip = lanyfs_bitmap_open(ctx.tmpdir, ctx.vol->blocks);
+		if (!ctx.skip)
+			show_error(_("error creating bitmap: %s"),
+				   strerror(errno));
+		if (lanyfs_free_map(ctx.vol, ctx.skip, 1, &nfree)) {
+			printf(_("free blocks chain damaged, ignoring it\n"));
+			lanyfs_bitmap_close(ctx.skip, ctx.vol->blocks);
+			ctx.skip = NULL;
+		} else {
+			verbose("ignoring %"PRIu64" free blocks", nfree);
+		}
+	}
+
+	if (outdir && mkdir(outdir, 0755) && errno != EEXIST)
+		show_error(_("cannot create %s: %s"), outdir, strerror(errno));
+	printf(_("scanning device\n"));
+	scan(&ctx);
+	rebuild(&ctx, outdir);
+	if (outdir) {
+		printf(_("extracted %"PRIu64" directories and %"PRIu64
+			 " files, %"PRIu64" damaged\n"), ctx.dirs, ctx.files,
+		       ctx.damaged);
+	}
+
+	lanyfs_table_close(&ctx.nodes);
+	lanyfs_bitmap_close(ctx.skip, ctx.vol->blocks);
+	lanyfs_bitmap_close(ctx.seen, ctx.vol->blocks);
+	lanyfs_vol_close(ctx.vol);
+	return EXIT_SUCCESS;
+}
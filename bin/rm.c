@@ -0,0 +1,283 @@
+/*
+ * rm.c - Remove Files and Directories from Lanyard Filesystem.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Order of operations
+ *
+ * Nothing is written until all blocks of the doomed tree have been
+ * collected, so a damaged tree is detected before the volume is touched.
+ * The tree is then unlinked from its parent's binary tree, its blocks are
+ * appended to the free blocks chain, and the superblock is written last.
+ * An interruption in between leaks blocks but never frees a block that is
+ * still reachable.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "rm.lanyfs";
+const char *progdate = "December 2012";
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct rmlanyfs_ctx - Blocks collected for removal.
+ * @vecs:			one address vector per worker
+ */
+struct rmlanyfs_ctx {
+	struct lanyfs_addrvec	*vecs;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-r] [-j threads] device path\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/**
+ * collect_ext() - Collects extender and data blocks of a file.
+ * @vol:			volume
+ * @addr:			address of extender or data block
+ * @type:			type of block
+ * @iblock:			index of data block within file
+ * @arg:			address vector
+ */
+static int collect_ext (struct lanyfs_vol *vol, uint64_t addr, int type,
+			uint64_t iblock, void *arg)
+{
+	return lanyfs_addrvec_push(arg, addr);
+}
+
+/**
+ * collect_node() - Collects a directory or file block and its extenders.
+ * @vol:			volume
+ * @worker:			index of calling worker
+ * @addr:			address of block
+ * @b:				the block
+ * @arg:			removal context
+ */
+static int collect_node (struct lanyfs_vol *vol, int worker, uint64_t addr,
+			 union lanyfs_b *b, void *arg)
+{
+	struct rmlanyfs_ctx *ctx = arg;
+	struct lanyfs_addrvec *vec = &ctx->vecs[worker];
+	if (lanyfs_addrvec_push(vec, addr))
+		return -1;
+	if (b->raw.type == LANYFS_TYPE_FILE)
+		return lanyfs_ext_walk(vol, fromle64(b->file.data),
+				       collect_ext, vec);
+	return 0;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	struct lanyfs_link link;
+	struct lanyfs_addrvec all = {NULL, 0, 0};
+	struct rmlanyfs_ctx ctx;
+	union lanyfs_b *b;
+	char *dev_name, *path;
+	uint64_t addr;
+	size_t i;
+	int recursive = 0;
+	int threads = lanyfs_default_threads();
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "j:rv")) != -1) {
+		switch (c) {
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			break;
+		case 'r':
+			recursive = 1;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 2 != argc)
+		show_usage();
+	dev_name = argv[optind];
+	path = argv[optind + 1];
+
+	/* open device */
+	vol = lanyfs_vol_open(dev_name, 0);
+	if (!vol)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+
+	/* find victim */
+	if (lanyfs_lookup(vol, path, &addr, &link))
+		show_error(_("cannot remove %s: %s"), path, strerror(errno));
+	if (!link.holder)
+		show_error(_("cannot remove root directory"));
+	b = lanyfs_alloc_block(vol);
+	if (!b || lanyfs_read_block(vol, addr, b))
+		show_error(_("read error at block %"PRIu64), addr);
+	if (b->raw.type == LANYFS_TYPE_DIR && b->dir.subtree && !recursive)
+		show_error(_("cannot remove %s: directory not empty"), path);
+	verbose("removing %s at addr=%"PRIu64, path, addr);
+
+	/* collect blocks */
+	printf(_("collecting blocks\n"));
+	ctx.vecs = calloc(threads, sizeof(*ctx.vecs));
+	if (!ctx.vecs || lanyfs_addrvec_push(&all, addr))
+		show_error(_("out of memory"));
+	if (b->raw.type == LANYFS_TYPE_DIR) {
+		if (lanyfs_walk(vol, fromle64(b->dir.subtree), threads,
+				collect_node, &ctx))
+			show_error(_("error walking %s: %s"), path,
+				   strerror(errno));
+	} else if (lanyfs_ext_walk(vol, fromle64(b->file.data), collect_ext,
+				   &all)) {
+		show_error(_("error walking %s: %s"), path, strerror(errno));
+	}
+	for (i = 0; i < threads; i++) {
+		if (lanyfs_addrvec_merge(&all, &ctx.vecs[i]))
+			show_error(_("out of memory"));
+	}
+	free(ctx.vecs);
+	free(b);
+
+	/* a block claimed twice means the tree is damaged */
+	lanyfs_addrvec_sort(&all);
+	for (i = 1; i < all.n; i++) {
+		if (all.a[i] == all.a[i - 1])
+			show_error(_("block %"PRIu64" claimed twice, "
+				     "filesystem needs checking"), all.a[i]);
+	}
+	verbose("collected %zu blocks", all.n);
+
+	/* unlink and free */
+	printf(_("unlinking %s\n"), path);
+	if (lanyfs_btree_unlink(vol, &link, addr))
+		show_error(_("error unlinking %s: %s"), path, strerror(errno));
+	printf(_("freeing %zu blocks\n"), all.n);
+	if (lanyfs_free_append(vol, all.a, all.n))
+		show_error(_("error freeing blocks: %s"), strerror(errno));
+	lanyfs_addrvec_free(&all);
+
+	/* update superblock */
+	printf(_("updating superblock\n"));
+	if (lanyfs_write_sb(vol))
+		show_error(_("error writing superblock: %s"), strerror(errno));
+
+	/* close device */
+	if (lanyfs_vol_close(vol))
+		show_error(_("error closing device %s"), dev_name);
+
+	printf(_("all done\n"));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,203 @@
+/*
+ * tune.c - Calibrate Devices for Lanyard Filesystem Utilities.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Calibration
+ *
+ * The device is probed through sysfs and then timed by the library, see
+ * libtune.c. The resulting profile is printed and cached for the model of
+ * the device, all tools opening a device of that model use it from then
+ * on. Writes are only timed on request, they rewrite what was just read.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "tune.lanyfs";
+const char *progdate = "December 2012";
+
+/* global variables */
+int v = 0;
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr, _("usage: %s [-v] [-n] [-w] device\n"), progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/**
+ * show_profile() - Prints a profile.
+ * @tune:			profile
+ */
+static void show_profile (const struct lanyfs_tune *tune)
+{
+	printf(_("model: %s\n"), tune->model);
+	printf(_("rotational: %s\n"), tune->rotational ? _("yes") : _("no"));
+	printf(_("largest request: %u KiB\n"), tune->max_sectors_kb);
+	printf(_("queue: %u requests\n"), tune->nr_requests);
+	printf(_("logical block: %u bytes\n"), tune->logical);
+	if (tune->latency)
+		printf(_("read latency: %.1f us\n"), tune->latency / 1e3);
+	printf(_("batch size: %zu KiB\n"), tune->batch >> 10);
+	printf(_("queue depth: %d\n"), tune->depth);
+	printf(_("direct I/O: %s\n"), tune->direct ? _("yes") : _("no"));
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_dev *dev;
+	struct lanyfs_tune tune, cached;
+	char *dev_name;
+	int calibrate = 1, write = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "nvw")) != -1) {
+		switch (c) {
+		case 'n':
+			calibrate = 0;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		case 'w':
+			write = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 1 != argc || (write && !calibrate))
+		show_usage();
+	dev_name = argv[optind];
+
+	dev = lanyfs_dev_open(dev_name, !write);
+	if (!dev)
+		show_error(_("error opening device %s: %s"), dev_name,
+			   strerror(errno));
+	if (lanyfs_tune_probe(dev, &tune))
+		show_error(_("error probing device %s: %s"), dev_name,
+			   strerror(errno));
+	cached = tune;
+	if (!lanyfs_tune_load(&cached))
+		verbose("cached profile: batch %zu KiB, depth %d, direct %d",
+			cached.batch >> 10, cached.depth, cached.direct);
+	if (calibrate) {
+		verbose("calibrating %s%s", dev_name,
+			write ? ", rewriting data" : "");
+		if (lanyfs_tune_calibrate(dev, &tune, write))
+			show_error(_("error calibrating device %s: %s"),
+				   dev_name, strerror(errno));
+		if (lanyfs_tune_save(&tune))
+			show_error(_("error caching profile: %s"),
+				   strerror(errno));
+	}
+	show_profile(&tune);
+	if (lanyfs_dev_close(dev))
+		show_error(_("error closing device %s: %s"), dev_name,
+			   strerror(errno));
+	return EXIT_SUCCESS;
+}
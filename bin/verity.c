@@ -0,0 +1,338 @@
+/*
+ * verity.c - Build and Check Hash Trees of Lanyard Filesystem Images.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Verified reads
+ *
+ * Building hashes all blocks in use of an image into a sidecar file and
+ * prints the root hash, to be kept where the image cannot alter it. All
+ * utilities then verify what they read against the sidecar when
+ * LANYFS_VERITY is set, pinned to the root hash in LANYFS_VERITY_ROOT.
+ *
+ * Checking reads the whole image through the verifying backend, in
+ * parallel, and reports every block failing verification.
+ */
+
+#define _GNU_SOURCE		/* asprintf() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>		/* getopt() */
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "verity.lanyfs";
+const char *progdate = "December 2012";
+
+/* global variables */
+int v = 0;
+
+/**
+ * struct vrt_check - Image being checked.
+ * @dev:			verifying device
+ * @blocksize:			blocksize (exponent to base 2)
+ * @blocks:			number of blocks
+ * @run:			blocks read at once
+ * @bufs:			per worker buffer of @run blocks
+ * @bad:			number of blocks failing verification
+ */
+struct vrt_check {
+	struct lanyfs_dev	*dev;
+	int			blocksize;
+	uint64_t		blocks;
+	uint64_t		run;
+	unsigned char		**bufs;
+	uint64_t		bad;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-j threads] [-o sidecar] image\n"
+		  "       %s -c [-v] [-j threads] [-o sidecar] [-r root] "
+		  "image\n"),
+		progname, progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * check_run() - Pool task reading a run of blocks through verification.
+ * @pool:			pool
+ * @worker:			index of worker
+ * @arg:			image being checked
+ * @first:			first block of run
+ *
+ * A run failing verification is read again block by block to report the
+ * blocks at fault. Only errors other than failed verification stop the
+ * check.
+ */
+static int check_run (struct lanyfs_pool *pool, int worker, void *arg,
+		      uint64_t first)
+{
+	struct vrt_check *chk = arg;
+	unsigned char *buf = chk->bufs[worker];
+	uint64_t n, i;
+
+	n = chk->blocks - first < chk->run ? chk->blocks - first : chk->run;
+	if (!lanyfs_dev_pread(chk->dev, buf, n << chk->blocksize,
+			      first << chk->blocksize))
+		return 0;
+	if (errno != EIO)
+		return -1;
+	for (i = first; i < first + n; i++) {
+		if (!lanyfs_dev_pread(chk->dev, buf,
+				      (size_t) 1 << chk->blocksize,
+				      i << chk->blocksize))
+			continue;
+		if (errno != EIO)
+			return -1;
+		fprintf(stderr, _("%s: block %"PRIu64" failed verification\n"),
+			progname, i);
+		__atomic_fetch_add(&chk->bad, 1, __ATOMIC_RELAXED);
+	}
+	return 0;
+}
+
+/**
+ * check() - Reads a whole image through verification.
+ * @image:			path of image
+ * @sidecar:			path of sidecar
+ * @root:			expected root hash, NULL to trust the sidecar's
+ * @threads:			number of threads, 0 for the device's choice
+ *
+ * Returns the number of blocks failing verification.
+ */
+static uint64_t check (const char *image, const char *sidecar,
+		       const unsigned char *root, int threads)
+{
+	struct lanyfs_dev *dev;
+	struct lanyfs_vol *vol;
+	struct lanyfs_pool *pool;
+	struct vrt_check chk;
+	uint64_t first, verified, nodes;
+	int i;
+
+	dev = lanyfs_dev_open(image, 1);
+	if (!dev)
+		show_error(_("error opening image %s: %s"), image,
+			   strerror(errno));
+	dev = lanyfs_verity_open(dev, sidecar, root);
+	if (!dev)
+		show_error(_("error opening sidecar %s: %s"), sidecar,
+			   errno == EIO ? _("root hash mismatch") :
+			   strerror(errno));
+	/* the superblock is verified as it is read */
+	vol = lanyfs_vol_attach(dev);
+	if (!vol)
+		show_error(_("error reading superblock: %s"), strerror(errno));
+	memset(&chk, 0, sizeof(chk));
+	chk.dev = dev;
+	chk.blocksize = vol->blocksize;
+	chk.blocks = vol->blocks;
+	chk.run = lanyfs_dev_batch(dev) >> chk.blocksize;
+	if (!chk.run)
+		chk.run = 1;
+	if (!threads)
+		threads = lanyfs_dev_threads(dev, lanyfs_default_threads());
+	pool = lanyfs_pool_new(threads, 0, 0);
+	if (!pool)
+		show_error(_("error starting threads: %s"), strerror(errno));
+	chk.bufs = calloc(lanyfs_pool_threads(pool), sizeof(*chk.bufs));
+	if (!chk.bufs)
+		show_error(_("out of memory"));
+	for (i = 0; i < lanyfs_pool_threads(pool); i++) {
+		if (posix_memalign((void **) &chk.bufs[i], 4096,
+				   chk.run << chk.blocksize))
+			show_error(_("out of memory"));
+	}
+	printf(_("checking %"PRIu64" blocks with %d threads\n"), chk.blocks,
+	       lanyfs_pool_threads(pool));
+	for (first = 0; first < chk.blocks; first += chk.run)
+		if (lanyfs_pool_submit(pool, check_run, &chk, first))
+			break;
+	if (lanyfs_pool_wait(pool) || first < chk.blocks)
+		show_error(_("error reading image %s: %s"), image,
+			   strerror(errno));
+	if (!lanyfs_verity_stats(dev, &verified, &nodes))
+		verbose("%"PRIu64" blocks and %"PRIu64" hash blocks verified",
+			verified, nodes);
+	for (i = 0; i < lanyfs_pool_threads(pool); i++)
+		free(chk.bufs[i]);
+	free(chk.bufs);
+	lanyfs_pool_free(pool);
+	lanyfs_vol_close(vol);
+	return chk.bad;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct lanyfs_vol *vol;
+	unsigned char root[LANYFS_VERITY_HASH];
+	char hex[2 * LANYFS_VERITY_HASH + 1], *sidecar = NULL;
+	uint64_t count, bad;
+	int threads = lanyfs_default_threads(), jset = 0, checking = 0;
+	int pinned = 0;
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	/* images are hashed and checked as they are */
+	unsetenv("LANYFS_VERITY");
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "cj:o:r:v")) != -1) {
+		switch (c) {
+		case 'c':
+			checking = 1;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads < 1)
+				show_error(_("invalid number of threads"));
+			jset = 1;
+			break;
+		case 'o':
+			sidecar = optarg;
+			break;
+		case 'r':
+			if (lanyfs_verity_parse(optarg, root))
+				show_error(_("invalid root hash %s"), optarg);
+			pinned = 1;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind + 1 != argc || (pinned && !checking))
+		show_usage();
+	if (!sidecar && asprintf(&sidecar, "%s.verity", argv[optind]) < 0)
+		show_error(_("out of memory"));
+
+	if (checking) {
+		bad = check(argv[optind], sidecar, pinned ? root : NULL,
+			    jset ? threads : 0);
+		if (bad)
+			show_error(_("%"PRIu64" blocks failed verification"),
+				   bad);
+		printf(_("image matches %s\n"), sidecar);
+		return EXIT_SUCCESS;
+	}
+
+	vol = lanyfs_vol_open(argv[optind], 1);
+	if (!vol)
+		show_error(_("error opening image %s: %s"), argv[optind],
+			   strerror(errno));
+	if (!jset)
+		threads = lanyfs_dev_threads(vol->dev, threads);
+	printf(_("hashing %s with %d threads\n"), argv[optind], threads);
+	if (lanyfs_verity_build(vol, sidecar, threads, root, &count))
+		show_error(_("error building hash tree %s: %s"), sidecar,
+			   strerror(errno));
+	verbose("%"PRIu64" of %"PRIu64" blocks in use", count, vol->blocks);
+	lanyfs_verity_format(root, hex);
+	printf(_("wrote %s\n"), sidecar);
+	printf(_("root hash %s\n"), hex);
+	lanyfs_vol_close(vol);
+	return EXIT_SUCCESS;
+}
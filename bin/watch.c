@@ -0,0 +1,756 @@
+/*
+ * watch.c - Watch for Lanyard Filesystems Being Attached.
+ *
+ * Copyright 2012 Dan Luedtke <mail@danrl.de>
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, and the entire permission notice in its entirety,
+ *    including the disclaimer of warranties.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote
+ *    products derived from this software without specific prior
+ *    written permission.
+ *
+ * ALTERNATIVELY, this product may be distributed under the terms of
+ * the GNU General Public License Version 2 or any later version,
+ * in which case the provisions of the GPL are required INSTEAD OF the above
+ * restrictions.
+ *
+ * THIS SOFTWARE IS PROVIDED ''AS IS'' AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE, ALL OF
+ * WHICH ARE HEREBY DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT
+ * OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE
+ * USE OF THIS SOFTWARE, EVEN IF NOT ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ */
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * DOC: Watching
+ *
+ * Instead of polling devices, the daemon sleeps until the kernel reports a
+ * block device being added, changed or removed through a netlink uevent
+ * socket. Image files in a directory watched through inotify stand in for
+ * devices where there is no hardware to plug. While nothing changes no I/O
+ * is done at all.
+ *
+ * A device is probed with a single read of its superblock as soon as it
+ * shows up. Results are printed, kept in a state file replaced atomically
+ * on every change, and sent to every client of a Unix socket. A client
+ * connecting gets one line per known device first and then every change as
+ * it happens.
+ *
+ * Each line is a verb, the path and, for add, the result of the probe,
+ * separated by tabs:
+ *
+ *	add	PATH	lanyfs	VERSION	BLOCKSIZE	ADDRLEN	BLOCKS	FREE	LABEL
+ *	add	PATH	other
+ *	remove	PATH
+ *
+ * The state file holds the add lines of all devices present.
+ */
+
+#define _GNU_SOURCE		/* accept4(), SOCK_CLOEXEC */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>		/* va_*(), vprintf() */
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <unistd.h>		/* getopt() */
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <linux/netlink.h>
+#endif
+
+#include "liblanyfs.h"
+
+ /* gettext support, e.g. for i18n */
+#ifdef	HAVE_GETTEXT
+#define	_(s)	gettext(s)
+#else
+#define	_(s)	s
+#endif
+
+/* constants */
+const char *progname = "watch.lanyfs";
+const char *progdate = "December 2012";
+#define WATCH_SB_SIZE		512	/* bytes read per probe */
+#define WATCH_CLIENTS		64	/* socket clients at most */
+#define WATCH_MSG		8192	/* size of uevent and inotify buffers */
+
+/* global variables */
+int v = 0;
+volatile sig_atomic_t quit = 0;
+
+/**
+ * struct watch_dev - A device or image file seen.
+ * @path:			path
+ * @line:			result of probe, tab separated, no verb or path
+ */
+struct watch_dev {
+	char			*path;
+	char			*line;
+};
+
+/**
+ * struct watch - State of the daemon.
+ * @devs:			devices present
+ * @ndevs:			number of devices
+ * @cap:			number of devices allocated
+ * @dir:			directory watched, NULL to watch uevents
+ * @state:			path of state file, may be NULL
+ * @tmp:			path state file is written to before renaming
+ * @sock:			path of socket, may be NULL
+ * @clients:			descriptors of socket clients
+ * @nclients:			number of clients
+ */
+struct watch {
+	struct watch_dev	*devs;
+	size_t			ndevs;
+	size_t			cap;
+	const char		*dir;
+	const char		*state;
+	char			*tmp;
+	const char		*sock;
+	int			clients[WATCH_CLIENTS];
+	int			nclients;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * show_version() - Prints the program's name and version.
+ */
+static void show_version (void)
+{
+	fprintf(stderr, "%s v%d.%d (%s)\n", progname, LANYFS_MAJOR_VERSION,
+		LANYFS_MINOR_VERSION, _(progdate));
+}
+
+/**
+ * show_usage() - Prints usage hints.
+ */
+static void show_usage (void)
+{
+	fprintf(stderr,
+		_("usage: %s [-v] [-o] [-d directory] [-s state file] "
+		  "[-u socket]\n"),
+		progname);
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * show_error() - Prints error message to stderr and exits program.
+ * @fmt:			error message format string
+ * @...:			format string arguments
+ */
+static void show_error (const char *fmt, ...)
+{
+	va_list arg;
+	fprintf(stderr, "%s: ", progname);
+	va_start(arg, fmt);
+	vfprintf(stderr, fmt, arg);
+	va_end(arg);
+	fprintf(stderr, "\n");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * verbose() - Prints verbose message.
+ * @fmt:			verbose message format string
+ * @...:			format string arguments
+ */
+static void verbose (const char *fmt, ...)
+{
+	va_list arg;
+	if (v) {
+		printf(_("info: "));
+		va_start(arg, fmt);
+		vprintf(fmt, arg);
+		va_end(arg);
+		printf("\n");
+		fflush(stdout);
+	}
+}
+
+/**
+ * on_signal() - Asks the event loop to stop.
+ * @sig:			signal number
+ */
+static void on_signal (int sig)
+{
+	(void) sig;
+	quit = 1;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * probe() - Reads the superblock of a device.
+ * @path:			path of device or image file
+ * @line:			result, newly allocated
+ *
+ * One read of the first 512 bytes, through the library only for images
+ * of other backends. Fails if the device cannot be read, e.g. a card
+ * reader without card.
+ */
+static int probe (const char *path, char **line)
+{
+	struct lanyfs_dev *dev;
+	union {
+		struct lanyfs_sb	sb;
+		unsigned char		raw[WATCH_SB_SIZE];
+	} u;
+	char label[LANYFS_NAME_LENGTH + 1], *p;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = lanyfs_fd_pread(fd, u.raw, sizeof(u.raw), 0);
+	close(fd);
+	if (ret)
+		return -1;
+	if (!memcmp(u.raw, LANYFS_OVERLAY_MAGIC, LANYFS_DEV_MAGIC_LEN) ||
+	    !memcmp(u.raw, LANYFS_ARCHIVE_MAGIC, LANYFS_DEV_MAGIC_LEN)) {
+		dev = lanyfs_dev_open(path, 1);
+		if (!dev)
+			return -1;
+		ret = lanyfs_dev_pread(dev, u.raw, sizeof(u.raw), 0);
+		lanyfs_dev_close(dev);
+		if (ret)
+			return -1;
+	}
+	lanyfs_canon_sb(&u.sb);
+	if (u.sb.type != LANYFS_TYPE_SB || u.sb.magic != LANYFS_SUPER_MAGIC) {
+		*line = strdup("other");
+		return *line ? 0 : -1;
+	}
+	memcpy(label, u.sb.label, LANYFS_NAME_LENGTH);
+	label[LANYFS_NAME_LENGTH] = '\0';
+	for (p = label; *p; p++) {
+		if (*p == '\t' || *p == '\n' || *p == '\r')
+			*p = ' ';
+	}
+	if (asprintf(line, "lanyfs\t%u.%u\t%u\t%u\t%"PRIu64"\t%"PRIu64"\t%s",
+		     u.sb.major, u.sb.minor, 1U << u.sb.blocksize,
+		     u.sb.addrlen, u.sb.blocks,
+		     u.sb.freeblocks + u.sb.zoneblocks, label) < 0)
+		return -1;
+	return 0;
+}
+
+/**
+ * find_dev() - Returns the index of a device or the number of devices.
+ * @w:				daemon
+ * @path:			path of device
+ */
+static size_t find_dev (struct watch *w, const char *path)
+{
+	size_t i;
+
+	for (i = 0; i < w->ndevs; i++) {
+		if (!strcmp(w->devs[i].path, path))
+			break;
+	}
+	return i;
+}
+
+/**
+ * send_client() - Sends a line to a socket client.
+ * @w:				daemon
+ * @i:				number of client
+ * @msg:			line, newline included
+ *
+ * Clients are never waited for, one not keeping up is dropped and -1
+ * returned.
+ */
+static int send_client (struct watch *w, int i, const char *msg)
+{
+	size_t len = strlen(msg);
+
+	if (send(w->clients[i], msg, len, MSG_NOSIGNAL | MSG_DONTWAIT) ==
+	    (ssize_t) len)
+		return 0;
+	verbose("dropping client %d", w->clients[i]);
+	close(w->clients[i]);
+	w->clients[i] = w->clients[--w->nclients];
+	return -1;
+}
+
+/**
+ * write_state() - Replaces the state file.
+ * @w:				daemon
+ */
+static void write_state (struct watch *w)
+{
+	FILE *fp;
+	size_t i;
+
+	if (!w->state)
+		return;
+	fp = fopen(w->tmp, "w");
+	if (!fp)
+		show_error(_("error writing %s: %s"), w->tmp, strerror(errno));
+	for (i = 0; i < w->ndevs; i++)
+		fprintf(fp, "add\t%s\t%s\n", w->devs[i].path, w->devs[i].line);
+	if (fclose(fp) || rename(w->tmp, w->state))
+		show_error(_("error writing %s: %s"), w->state,
+			   strerror(errno));
+}
+
+/**
+ * publish() - Announces a change everywhere.
+ * @w:				daemon
+ * @verb:			add or remove
+ * @d:				device
+ */
+static void publish (struct watch *w, const char *verb, struct watch_dev *d)
+{
+	char *msg;
+	int i;
+
+	if (asprintf(&msg, "%s\t%s%s%s\n", verb, d->path, d->line ? "\t" : "",
+		     d->line ? d->line : "") < 0)
+		show_error(_("out of memory"));
+	fputs(msg, stdout);
+	fflush(stdout);
+	for (i = w->nclients - 1; i >= 0; i--)
+		send_client(w, i, msg);
+	free(msg);
+}
+
+/**
+ * dev_removed() - Forgets a device that was removed.
+ * @w:				daemon
+ * @path:			path of device
+ */
+static void dev_removed (struct watch *w, const char *path)
+{
+	struct watch_dev *d;
+	size_t i = find_dev(w, path);
+
+	if (i == w->ndevs)
+		return;
+	d = &w->devs[i];
+	free(d->line);
+	d->line = NULL;
+	publish(w, "remove", d);
+	free(d->path);
+	*d = w->devs[--w->ndevs];
+	write_state(w);
+}
+
+/**
+ * dev_added() - Probes a device that was added or changed.
+ * @w:				daemon
+ * @path:			path of device
+ *
+ * Unchanged results are not announced again. A device that cannot be
+ * read counts as removed.
+ */
+static void dev_added (struct watch *w, const char *path)
+{
+	struct watch_dev *d;
+	char *line;
+	size_t i = find_dev(w, path);
+
+	if (probe(path, &line)) {
+		verbose("cannot probe %s: %s", path, strerror(errno));
+		dev_removed(w, path);
+		return;
+	}
+	if (i < w->ndevs) {
+		d = &w->devs[i];
+		if (!strcmp(d->line, line)) {
+			free(line);
+			return;
+		}
+		free(d->line);
+	} else {
+		if (w->ndevs == w->cap) {
+			w->cap = w->cap ? w->cap * 2 : 16;
+			d = realloc(w->devs, w->cap * sizeof(*d));
+			if (!d)
+				show_error(_("out of memory"));
+			w->devs = d;
+		}
+		d = &w->devs[w->ndevs++];
+		d->path = strdup(path);
+		if (!d->path)
+			show_error(_("out of memory"));
+	}
+	d->line = line;
+	publish(w, "add", d);
+	write_state(w);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/**
+ * scan() - Probes everything present at start.
+ * @w:				daemon
+ *
+ * Block devices are listed from sysfs, image files from the directory.
+ */
+static void scan (struct watch *w)
+{
+	const char *dir = w->dir ? w->dir : "/sys/class/block";
+	struct dirent *ent;
+	struct stat st;
+	char *path;
+	DIR *d;
+
+	d = opendir(dir);
+	if (!d)
+		show_error(_("error opening %s: %s"), dir, strerror(errno));
+	while ((ent = readdir(d))) {
+		if (ent->d_name[0] == '.')
+			continue;
+		if (asprintf(&path, "%s/%s", w->dir ? w->dir : "/dev",
+			     ent->d_name) < 0)
+			show_error(_("out of memory"));
+		if ((!w->dir || (!stat(path, &st) && S_ISREG(st.st_mode))) &&
+		    (!w->state || strcmp(path, w->state)) &&
+		    (!w->tmp || strcmp(path, w->tmp)))
+			dev_added(w, path);
+		free(path);
+	}
+	closedir(d);
+}
+
+#ifdef __linux__
+/**
+ * open_uevents() - Subscribes to block device uevents of the kernel.
+ */
+static int open_uevents (void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;	/* kernel events, not those of udev */
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * read_uevent() - Handles a uevent of the kernel.
+ * @w:				daemon
+ * @fd:				netlink socket
+ *
+ * A uevent is "action@devpath" followed by KEY=VALUE strings, each NUL
+ * terminated. Only block devices are looked at. Change events cover media
+ * being inserted into or taken out of a card reader.
+ */
+static void read_uevent (struct watch *w, int fd)
+{
+	char buf[WATCH_MSG], path[PATH_MAX];
+	const char *action = NULL, *subsystem = NULL, *devname = NULL, *p;
+	struct sockaddr_nl addr;
+	struct iovec iov = { buf, sizeof(buf) - 1 };
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &addr;
+	msg.msg_namelen = sizeof(addr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	n = recvmsg(fd, &msg, MSG_DONTWAIT);
+	if (n <= 0 || addr.nl_pid != 0)
+		return;
+	buf[n] = '\0';
+	for (p = buf; p < buf + n; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+	}
+	if (!action || !subsystem || !devname || strcmp(subsystem, "block"))
+		return;
+	if (devname[0] == '/')
+		snprintf(path, sizeof(path), "%s", devname);
+	else
+		snprintf(path, sizeof(path), "/dev/%s", devname);
+	verbose("uevent %s %s", action, path);
+	if (!strcmp(action, "add") || !strcmp(action, "change"))
+		dev_added(w, path);
+	else if (!strcmp(action, "remove"))
+		dev_removed(w, path);
+}
+
+/**
+ * open_inotify() - Watches a directory of image files.
+ * @dir:			directory
+ */
+static int open_inotify (const char *dir)
+{
+	int fd = inotify_init1(IN_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+	if (inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+			      IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * read_inotify() - Handles changes of the directory watched.
+ * @w:				daemon
+ * @fd:				inotify descriptor
+ *
+ * Files are probed once written and closed or moved in, so half written
+ * images are not looked at. The state file is ignored if it lives there.
+ */
+static void read_inotify (struct watch *w, int fd)
+{
+	char buf[WATCH_MSG] __attribute__((aligned(8))), *path;
+	const struct inotify_event *ev;
+	ssize_t n;
+	char *p;
+
+	n = read(fd, buf, sizeof(buf));
+	for (p = buf; n > 0 && p < buf + n; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *) p;
+		if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+			quit = 1;
+			verbose("%s went away", w->dir);
+			return;
+		}
+		if (!ev->len || ev->name[0] == '.' || ev->mask & IN_ISDIR)
+			continue;
+		if (asprintf(&path, "%s/%s", w->dir, ev->name) < 0)
+			show_error(_("out of memory"));
+		if ((!w->state || strcmp(path, w->state)) &&
+		    strcmp(path, w->tmp ? w->tmp : "")) {
+			if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+				dev_added(w, path);
+			else
+				dev_removed(w, path);
+		}
+		free(path);
+	}
+}
+#endif
+
+/**
+ * open_socket() - Listens on a Unix socket.
+ * @path:			path of socket, replaced if it exists
+ */
+static int open_socket (const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) ||
+	    listen(fd, WATCH_CLIENTS)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * accept_client() - Takes a client and tells it what is present.
+ * @w:				daemon
+ * @fd:				listening socket
+ */
+static void accept_client (struct watch *w, int fd)
+{
+	char *msg;
+	size_t i;
+	int c;
+
+	c = accept4(fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (c < 0)
+		return;
+	if (w->nclients == WATCH_CLIENTS) {
+		verbose("too many clients");
+		close(c);
+		return;
+	}
+	w->clients[w->nclients++] = c;
+	verbose("client %d connected", c);
+	for (i = 0; i < w->ndevs; i++) {
+		if (asprintf(&msg, "add\t%s\t%s\n", w->devs[i].path,
+			     w->devs[i].line) < 0)
+			show_error(_("out of memory"));
+		c = send_client(w, w->nclients - 1, msg);
+		free(msg);
+		if (c)
+			break;
+	}
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main (int argc, char *argv[])
+{
+	struct watch w;
+	struct pollfd pfd[WATCH_CLIENTS + 2];
+	struct sigaction sa;
+	int src = -1, lsn = -1, once = 0, n, i;
+	size_t k;
+	char buf[64];
+
+	show_version();
+	if (lanyfs_lat_atexit())
+		show_error(_("LANYFS_LATENCY must be text or json"));
+	memset(&w, 0, sizeof(w));
+	/* parse command line options */
+	int c;
+	while ((c = getopt(argc, argv, "d:os:u:v")) != -1) {
+		switch (c) {
+		case 'd':
+			w.dir = optarg;
+			break;
+		case 'o':
+			once = 1;
+			break;
+		case 's':
+			w.state = optarg;
+			break;
+		case 'u':
+			w.sock = optarg;
+			break;
+		case 'v':
+			v = 1;
+			break;
+		default:
+			show_usage();
+			break;
+		}
+	}
+	if (optind != argc)
+		show_usage();
+	if (w.state && asprintf(&w.tmp, "%s.tmp", w.state) < 0)
+		show_error(_("out of memory"));
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* subscribe first, nothing added while scanning gets lost */
+	if (!once) {
+#ifdef __linux__
+		src = w.dir ? open_inotify(w.dir) : open_uevents();
+#else
+		errno = EOPNOTSUPP;
+#endif
+		if (src < 0)
+			show_error(_("error watching %s: %s"),
+				   w.dir ? w.dir : _("uevents"),
+				   strerror(errno));
+	}
+	scan(&w);
+	write_state(&w);
+	if (once)
+		goto out;
+	if (w.sock) {
+		lsn = open_socket(w.sock);
+		if (lsn < 0)
+			show_error(_("error listening on %s: %s"), w.sock,
+				   strerror(errno));
+	}
+	verbose("watching %s", w.dir ? w.dir : "uevents");
+
+	while (!quit) {
+		pfd[0].fd = src;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = lsn;
+		pfd[1].events = POLLIN;
+		for (i = 0; i < w.nclients; i++) {
+			pfd[i + 2].fd = w.clients[i];
+			pfd[i + 2].events = POLLIN;
+		}
+		n = poll(pfd, w.nclients + 2, -1);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			show_error(_("error waiting for events: %s"),
+				   strerror(errno));
+		/* clients only ever hang up, anything they send is ignored */
+		for (i = w.nclients - 1; i >= 0; i--) {
+			if (!pfd[i + 2].revents)
+				continue;
+			if (recv(w.clients[i], buf, sizeof(buf),
+				 MSG_DONTWAIT) > 0)
+				continue;
+			verbose("client %d gone", w.clients[i]);
+			close(w.clients[i]);
+			w.clients[i] = w.clients[--w.nclients];
+		}
+#ifdef __linux__
+		if (pfd[0].revents && w.dir)
+			read_inotify(&w, src);
+		else if (pfd[0].revents)
+			read_uevent(&w, src);
+#endif
+		if (lsn >= 0 && pfd[1].revents)
+			accept_client(&w, lsn);
+	}
+	verbose("stopping");
+
+out:
+	for (i = 0; i < w.nclients; i++)
+		close(w.clients[i]);
+	if (lsn >= 0) {
+		close(lsn);
+		unlink(w.sock);
+	}
+	if (src >= 0)
+		close(src);
+	for (k = 0; k < w.ndevs; k++) {
+		free(w.devs[k].path);
+		free(w.devs[k].line);
+	}
+	free(w.devs);
+	free(w.tmp);
+	return EXIT_SUCCESS;
+}